@@ -8,6 +8,9 @@ data class PdnsdTuning(
     val timeout: Int = 10,
     val minTtl: String = "15m",
     val maxTtl: String = "1w",
+    val staleTtl: String = "1d",
+    val prefetchHits: Int = 3,
+    val cacheSync: String = "5m",
     val queryMethod: String = "udp_tcp",
     val verbosity: Int = 2
 )
@@ -38,6 +41,9 @@ object Pdnsd {
                 query_method=${tuning.queryMethod};
                 min_ttl=${tuning.minTtl};
                 max_ttl=${tuning.maxTtl};
+                stale_ttl=${tuning.staleTtl};
+                prefetch_hits=${tuning.prefetchHits};
+                cache_sync=${tuning.cacheSync};
                 timeout=${tuning.timeout};
                 daemon=off;
                 verbosity=${tuning.verbosity};
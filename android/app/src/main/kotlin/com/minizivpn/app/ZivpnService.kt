@@ -402,6 +402,7 @@ class ZivpnService : VpnService() {
                     timeout = pdnsdTimeout,
                     minTtl = getPrefString(prefs, "pdnsd_min_ttl", "15m"),
                     maxTtl = getPrefString(prefs, "pdnsd_max_ttl", "1w"),
+                    staleTtl = getPrefString(prefs, "pdnsd_stale_ttl", "1d"),
                     queryMethod = getPrefString(prefs, "pdnsd_query_method", "tcp_only"),
                     verbosity = pdnsdVerbosity
                 )
@@ -432,7 +433,7 @@ class ZivpnService : VpnService() {
             val tunCmd = arrayListOf(
                 tun2socksBin, "--netif-ipaddr", "169.254.1.2", "--netif-netmask", "255.255.255.0",
                 "--socks-server-addr", "127.0.0.1:7777", "--tunmtu", mtu.toString(),
-                "--loglevel", tsLogLevel, "--dnsgw", "169.254.1.1:$pdnsdPort", "--fake-proc"
+                "--loglevel", tsLogLevel, "--log-async", "--dnsgw", "169.254.1.1:$pdnsdPort", "--fake-proc"
             )
 
             tunCmd.add("--tcp-snd-buf"); tunCmd.add(tcpSndBuf.toString())
@@ -50,8 +50,14 @@
 #define BLOG_INFO 4
 #define BLOG_DEBUG 5
 
-#define BLog(...) BLog_LogToChannel(BLOG_CURRENT_CHANNEL, __VA_ARGS__)
-#define BContextLog(context, ...) BLog_ContextLog((context), BLOG_CURRENT_CHANNEL, __VA_ARGS__)
+// Messages above this level are compiled out, so that their arguments are not
+// even evaluated. Define it on the command line to one of the levels above.
+#ifndef BLOG_COMPILE_LEVEL
+#define BLOG_COMPILE_LEVEL BLOG_DEBUG
+#endif
+
+#define BLog(level, ...) ((level) <= BLOG_COMPILE_LEVEL ? BLog_LogToChannel(BLOG_CURRENT_CHANNEL, (level), __VA_ARGS__) : (void)0)
+#define BContextLog(context, level, ...) ((level) <= BLOG_COMPILE_LEVEL ? BLog_ContextLog((context), BLOG_CURRENT_CHANNEL, (level), __VA_ARGS__) : (void)0)
 #define BLOG_CCCC(context) BLog_MakeChannelContext((context), BLOG_CURRENT_CHANNEL)
 
 typedef void (*_BLog_log_func) (int channel, int level, const char *msg);
@@ -69,6 +75,7 @@ struct _BLog_global {
     struct _BLog_channel channels[BLOG_NUM_CHANNELS];
     _BLog_log_func log_func;
     _BLog_free_func free_func;
+    int async; // messages go to the ring buffers of BLog_async.c
     BMutex mutex;
 #ifndef NDEBUG
     int logging;
@@ -80,6 +87,17 @@ struct _BLog_global {
 extern struct _BLog_channel blog_channel_list[];
 extern struct _BLog_global blog_global;
 
+#if BADVPN_THREAD_SAFE
+// implemented in BLog_async.c
+void _BLog_AsyncLog (int channel, int level, const char *prefix, size_t prefix_len, const char *fmt, va_list vl);
+void _BLog_AsyncText (int channel, int level, const char *msg, size_t len);
+#define BLOG_IS_ASYNC (blog_global.async)
+#else
+#define BLOG_IS_ASYNC 0
+#define _BLog_AsyncLog(channel, level, prefix, prefix_len, fmt, vl) ASSERT(0)
+#define _BLog_AsyncText(channel, level, msg, len) ASSERT(0)
+#endif
+
 typedef void (*BLog_logfunc) (void *);
 
 typedef struct {
@@ -143,6 +161,7 @@ void BLog_Init (_BLog_log_func log_func, _BLog_free_func free_func)
     
     blog_global.log_func = log_func;
     blog_global.free_func = free_func;
+    blog_global.async = 0;
 #ifndef NDEBUG
     blog_global.logging = 0;
 #endif
@@ -183,7 +202,7 @@ int BLog_WouldLog (int channel, int level)
     ASSERT(channel >= 0 && channel < BLOG_NUM_CHANNELS)
     ASSERT(level >= BLOG_ERROR && level <= BLOG_DEBUG)
     
-    return (level <= blog_global.channels[channel].loglevel);
+    return (level <= BLOG_COMPILE_LEVEL && level <= blog_global.channels[channel].loglevel);
 }
 
 void BLog_Begin (void)
@@ -260,7 +279,11 @@ void BLog_Finish (int channel, int level)
     ASSERT(blog_global.logbuf_pos < sizeof(blog_global.logbuf))
     ASSERT(blog_global.logbuf[blog_global.logbuf_pos] == '\0')
     
-    blog_global.log_func(channel, level, blog_global.logbuf);
+    if (BLOG_IS_ASYNC) {
+        _BLog_AsyncText(channel, level, blog_global.logbuf, blog_global.logbuf_pos);
+    } else {
+        blog_global.log_func(channel, level, blog_global.logbuf);
+    }
     
 #ifndef NDEBUG
     blog_global.logging = 0;
@@ -281,6 +304,11 @@ void BLog_LogToChannelVarArg (int channel, int level, const char *fmt, va_list v
         return;
     }
     
+    if (BLOG_IS_ASYNC) {
+        _BLog_AsyncLog(channel, level, NULL, 0, fmt, vl);
+        return;
+    }
+    
     BLog_Begin();
     BLog_AppendVarArg(fmt, vl);
     BLog_Finish(channel, level);
@@ -298,11 +326,7 @@ void BLog_LogToChannel (int channel, int level, const char *fmt, ...)
     
     va_list vl;
     va_start(vl, fmt);
-    
-    BLog_Begin();
-    BLog_AppendVarArg(fmt, vl);
-    BLog_Finish(channel, level);
-    
+    BLog_LogToChannelVarArg(channel, level, fmt, vl);
     va_end(vl);
 }
 
@@ -318,6 +342,19 @@ void BLog_LogViaFuncVarArg (BLog_logfunc func, void *arg, int channel, int level
     
     BLog_Begin();
     func(arg);
+    
+    if (BLOG_IS_ASYNC) {
+        // only the prefix is formatted here
+        _BLog_AsyncLog(channel, level, blog_global.logbuf, blog_global.logbuf_pos, fmt, vl);
+        blog_global.logbuf_pos = 0;
+        blog_global.logbuf[0] = '\0';
+#ifndef NDEBUG
+        blog_global.logging = 0;
+#endif
+        BMutex_Unlock(&blog_global.mutex);
+        return;
+    }
+    
     BLog_AppendVarArg(fmt, vl);
     BLog_Finish(channel, level);
 }
@@ -334,12 +371,7 @@ void BLog_LogViaFunc (BLog_logfunc func, void *arg, int channel, int level, cons
     
     va_list vl;
     va_start(vl, fmt);
-    
-    BLog_Begin();
-    func(arg);
-    BLog_AppendVarArg(fmt, vl);
-    BLog_Finish(channel, level);
-    
+    BLog_LogViaFuncVarArg(func, arg, channel, level, fmt, vl);
     va_end(vl);
 }
 
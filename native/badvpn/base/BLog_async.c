@@ -0,0 +1,873 @@
+/**
+ * @file BLog_async.c
+ * 
+ * @section LICENSE
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the author nor the
+ *    names of its contributors may be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+
+#include <misc/debug.h>
+#include <misc/balign.h>
+
+#include "BLog_async.h"
+
+// size of the ring buffer of each logging thread (power of two)
+#define BLOG_ASYNC_RING_SIZE 65536
+
+// maximum size of a record, which also bounds the formatted message
+#define BLOG_ASYNC_MAX_RECORD 2048
+
+// how often the background thread looks for records if it is not woken up
+#define BLOG_ASYNC_POLL_MS 20
+
+// number of call sites tracked for rate limiting (power of two)
+#define BLOG_ASYNC_SITES 256
+
+// argument classes, in the order they are stored in a record
+#define ARG_NONE 0
+#define ARG_INT 1
+#define ARG_UINT 2
+#define ARG_DOUBLE 3
+#define ARG_LDOUBLE 4
+#define ARG_PTR 5
+#define ARG_STR 6
+
+// length modifiers
+#define LEN_NONE 0
+#define LEN_HH 1
+#define LEN_H 2
+#define LEN_L 3
+#define LEN_LL 4
+#define LEN_Z 5
+#define LEN_J 6
+#define LEN_T 7
+#define LEN_BIG_L 8
+
+struct conv_spec {
+    const char *start; // the '%'
+    const char *end; // after the conversion character
+    int width_star;
+    int prec_star;
+    int prec; // -1 if not given as a number
+    int len;
+    char conv;
+    int arg; // one of ARG_*
+};
+
+struct record {
+    uint32_t size; // total size including this header, 0 marks a wrap to the start of the ring
+    uint16_t channel;
+    uint8_t level;
+    uint8_t truncated;
+    uint32_t prefix_len;
+    uint64_t seq;
+    const char *fmt; // NULL if the message is entirely in the prefix
+    // followed by the prefix, then the arguments, each starting 8-byte aligned
+};
+
+struct ring {
+    char *buf;
+    size_t head; // read position, written by the background thread
+    size_t tail; // write position, written by the owning thread
+    unsigned long dropped; // records that did not fit, written by the owning thread
+    unsigned long dropped_reported; // used by the background thread
+    struct ring *next;
+};
+
+struct site {
+    const char *fmt;
+    uint64_t last_ms;
+    long tokens; // in thousandths of a message
+    unsigned long suppressed;
+};
+
+static struct {
+    int rate_limit;
+    _BLog_log_func sink;
+    _BLog_free_func sink_free;
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    int quitting; // protected by mutex
+    struct ring *rings; // protected by mutex
+    uint64_t seq;
+    struct site sites[BLOG_ASYNC_SITES]; // used by the background thread
+    char line[BLOG_ASYNC_MAX_RECORD]; // used by the background thread
+} blog_async;
+
+static __thread struct ring *blog_async_ring;
+
+static const char * parse_spec (const char *p, struct conv_spec *s)
+{
+    ASSERT(*p == '%')
+    
+    s->start = p++;
+    s->width_star = 0;
+    s->prec_star = 0;
+    s->prec = -1;
+    s->len = LEN_NONE;
+    
+    while (*p && strchr("-+ #0'", *p)) {
+        p++;
+    }
+    if (*p == '*') {
+        s->width_star = 1;
+        p++;
+    } else {
+        while (*p >= '0' && *p <= '9') {
+            p++;
+        }
+    }
+    if (*p == '.') {
+        p++;
+        if (*p == '*') {
+            s->prec_star = 1;
+            p++;
+        } else {
+            s->prec = 0;
+            while (*p >= '0' && *p <= '9') {
+                s->prec = 10 * s->prec + (*p - '0');
+                p++;
+            }
+        }
+    }
+    switch (*p) {
+        case 'h': p++; s->len = LEN_H; if (*p == 'h') { p++; s->len = LEN_HH; } break;
+        case 'l': p++; s->len = LEN_L; if (*p == 'l') { p++; s->len = LEN_LL; } break;
+        case 'z': p++; s->len = LEN_Z; break;
+        case 'j': p++; s->len = LEN_J; break;
+        case 't': p++; s->len = LEN_T; break;
+        case 'L': p++; s->len = LEN_BIG_L; break;
+    }
+    
+    s->conv = *p;
+    switch (*p) {
+        case 'd': case 'i': case 'c':
+            s->arg = ARG_INT;
+            break;
+        case 'u': case 'o': case 'x': case 'X':
+            s->arg = ARG_UINT;
+            break;
+        case 'f': case 'F': case 'e': case 'E': case 'g': case 'G': case 'a': case 'A':
+            s->arg = (s->len == LEN_BIG_L ? ARG_LDOUBLE : ARG_DOUBLE);
+            break;
+        case 'p': case 'n':
+            s->arg = ARG_PTR;
+            break;
+        case 's':
+            s->arg = ARG_STR;
+            break;
+        case '\0':
+            s->arg = ARG_NONE;
+            s->end = p;
+            return p;
+        default: // including '%'
+            s->arg = ARG_NONE;
+            break;
+    }
+    
+    s->end = p + 1;
+    return s->end;
+}
+
+// Pieces of a record are appended to an output buffer which is exactly as long as
+// the largest record, so everything fits unless the record is too large.
+
+struct writer {
+    char *buf;
+    size_t pos;
+    int truncated;
+};
+
+static void * writer_reserve (struct writer *w, size_t len)
+{
+    size_t aligned = balign_up(len, 8);
+    if (aligned > BLOG_ASYNC_MAX_RECORD - w->pos) {
+        w->truncated = 1;
+        return NULL;
+    }
+    void *p = w->buf + w->pos;
+    w->pos += aligned;
+    return p;
+}
+
+static int writer_put (struct writer *w, const void *data, size_t len)
+{
+    void *p = writer_reserve(w, len);
+    if (!p) {
+        return 0;
+    }
+    memcpy(p, data, len);
+    return 1;
+}
+
+static int record_int (struct writer *w, int len, va_list *vl)
+{
+    intmax_t v;
+    switch (len) {
+        case LEN_L: v = va_arg(*vl, long); break;
+        case LEN_LL: v = va_arg(*vl, long long); break;
+        case LEN_Z: v = va_arg(*vl, size_t); break;
+        case LEN_J: v = va_arg(*vl, intmax_t); break;
+        case LEN_T: v = va_arg(*vl, ptrdiff_t); break;
+        default: v = va_arg(*vl, int); break;
+    }
+    return writer_put(w, &v, sizeof(v));
+}
+
+static int record_uint (struct writer *w, int len, va_list *vl)
+{
+    uintmax_t v;
+    switch (len) {
+        case LEN_L: v = va_arg(*vl, unsigned long); break;
+        case LEN_LL: v = va_arg(*vl, unsigned long long); break;
+        case LEN_Z: v = va_arg(*vl, size_t); break;
+        case LEN_J: v = va_arg(*vl, uintmax_t); break;
+        case LEN_T: v = va_arg(*vl, ptrdiff_t); break;
+        default: v = va_arg(*vl, unsigned int); break;
+    }
+    return writer_put(w, &v, sizeof(v));
+}
+
+// Stores the arguments for fmt. Returns 0 if they did not all fit.
+static int record_args (struct writer *w, const char *fmt, va_list *vl)
+{
+    const char *p = fmt;
+    struct conv_spec s;
+    int prec;
+    
+    while ((p = strchr(p, '%'))) {
+        p = parse_spec(p, &s);
+        if (s.arg == ARG_NONE) {
+            continue;
+        }
+        
+        prec = s.prec;
+        if (s.width_star && !record_int(w, LEN_NONE, vl)) {
+            return 0;
+        }
+        if (s.prec_star) {
+            intmax_t v = prec = va_arg(*vl, int);
+            if (!writer_put(w, &v, sizeof(v))) {
+                return 0;
+            }
+        }
+        
+        switch (s.arg) {
+            case ARG_INT:
+                if (!record_int(w, s.len, vl)) {
+                    return 0;
+                }
+                break;
+            case ARG_UINT:
+                if (!record_uint(w, s.len, vl)) {
+                    return 0;
+                }
+                break;
+            case ARG_DOUBLE: {
+                double v = va_arg(*vl, double);
+                if (!writer_put(w, &v, sizeof(v))) {
+                    return 0;
+                }
+            } break;
+            case ARG_LDOUBLE: {
+                long double v = va_arg(*vl, long double);
+                if (!writer_put(w, &v, sizeof(v))) {
+                    return 0;
+                }
+            } break;
+            case ARG_PTR: {
+                void *v = va_arg(*vl, void *);
+                if (!writer_put(w, &v, sizeof(v))) {
+                    return 0;
+                }
+            } break;
+            case ARG_STR: {
+                const char *str = va_arg(*vl, const char *);
+                if (s.len == LEN_L) {
+                    // wide strings are not supported
+                    str = "(wide string)";
+                }
+                else if (!str) {
+                    str = "(null)";
+                }
+                // store the length, then the string up to the precision, with a null terminator
+                size_t n = (prec >= 0 ? strnlen(str, prec) : strlen(str));
+                size_t avail = BLOG_ASYNC_MAX_RECORD - w->pos;
+                if (avail < 16) {
+                    w->truncated = 1;
+                    return 0;
+                }
+                if (n > avail - 16) {
+                    n = avail - 16;
+                    w->truncated = 1;
+                }
+                uint64_t n64 = n;
+                writer_put(w, &n64, sizeof(n64));
+                char *d = writer_reserve(w, n + 1);
+                memcpy(d, str, n);
+                d[n] = '\0';
+                if (w->truncated) {
+                    return 0;
+                }
+            } break;
+        }
+    }
+    
+    return 1;
+}
+
+static struct ring * get_ring (void)
+{
+    struct ring *r = blog_async_ring;
+    if (r) {
+        return r;
+    }
+    
+    if (!(r = malloc(sizeof(*r)))) {
+        return NULL;
+    }
+    if (!(r->buf = malloc(BLOG_ASYNC_RING_SIZE))) {
+        free(r);
+        return NULL;
+    }
+    r->head = 0;
+    r->tail = 0;
+    r->dropped = 0;
+    r->dropped_reported = 0;
+    
+    pthread_mutex_lock(&blog_async.mutex);
+    r->next = blog_async.rings;
+    blog_async.rings = r;
+    pthread_mutex_unlock(&blog_async.mutex);
+    
+    blog_async_ring = r;
+    return r;
+}
+
+// Copies a finished record into the ring of the calling thread.
+static void push_record (struct record *rec)
+{
+    struct ring *r = get_ring();
+    if (!r) {
+        return;
+    }
+    
+    size_t head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+    size_t tail = r->tail;
+    size_t off = tail % BLOG_ASYNC_RING_SIZE;
+    size_t contig = BLOG_ASYNC_RING_SIZE - off;
+    size_t need = rec->size + (contig < rec->size ? contig : 0);
+    
+    if (BLOG_ASYNC_RING_SIZE - (tail - head) < need) {
+        __atomic_store_n(&r->dropped, r->dropped + 1, __ATOMIC_RELAXED);
+        return;
+    }
+    
+    if (contig < rec->size) {
+        // not enough room before the end, continue at the start
+        ((struct record *)(r->buf + off))->size = 0;
+        tail += contig;
+        off = 0;
+    }
+    memcpy(r->buf + off, rec, rec->size);
+    __atomic_store_n(&r->tail, tail + rec->size, __ATOMIC_RELEASE);
+    
+    // wake up the background thread early if the ring is getting full
+    if (tail + rec->size - head > BLOG_ASYNC_RING_SIZE / 2) {
+        pthread_cond_signal(&blog_async.cond);
+    }
+}
+
+static void record_message (int channel, int level, const char *prefix, size_t prefix_len, const char *fmt, va_list *vl)
+{
+    uint64_t buf[BLOG_ASYNC_MAX_RECORD / 8];
+    struct record *rec = (struct record *)buf;
+    struct writer w;
+    
+    w.buf = (char *)buf;
+    w.pos = 0;
+    w.truncated = 0;
+    writer_reserve(&w, sizeof(*rec));
+    
+    if (prefix_len > BLOG_ASYNC_MAX_RECORD / 2) {
+        prefix_len = BLOG_ASYNC_MAX_RECORD / 2;
+        w.truncated = 1;
+    }
+    if (prefix_len > 0) {
+        writer_put(&w, prefix, prefix_len);
+    }
+    
+    rec->fmt = fmt;
+    if (fmt && !record_args(&w, fmt, vl)) {
+        // the formatter stops at the first missing argument
+        w.truncated = 1;
+    }
+    
+    rec->size = w.pos;
+    rec->channel = channel;
+    rec->level = level;
+    rec->truncated = w.truncated;
+    rec->prefix_len = prefix_len;
+    rec->seq = __atomic_fetch_add(&blog_async.seq, 1, __ATOMIC_RELAXED);
+    
+    push_record(rec);
+}
+
+void _BLog_AsyncLog (int channel, int level, const char *prefix, size_t prefix_len, const char *fmt, va_list vl)
+{
+    va_list vl2;
+    va_copy(vl2, vl);
+    record_message(channel, level, prefix, prefix_len, fmt, &vl2);
+    va_end(vl2);
+}
+
+void _BLog_AsyncText (int channel, int level, const char *msg, size_t len)
+{
+    record_message(channel, level, msg, len, NULL, NULL);
+}
+
+struct reader {
+    const char *p;
+    const char *end;
+};
+
+static int read_slot (struct reader *rd, void *out, size_t len)
+{
+    size_t aligned = balign_up(len, 8);
+    if (rd->end - rd->p < aligned) {
+        return 0;
+    }
+    memcpy(out, rd->p, len);
+    rd->p += aligned;
+    return 1;
+}
+
+// Formats a record into blog_async.line, returns the length.
+static size_t format_record (const struct record *rec)
+{
+    char *out = blog_async.line;
+    size_t cap = sizeof(blog_async.line) - 1;
+    size_t pos = 0;
+    struct reader rd;
+    
+    rd.p = (const char *)rec + balign_up(sizeof(*rec), 8);
+    rd.end = (const char *)rec + rec->size;
+    
+    size_t n = rec->prefix_len;
+    memcpy(out, rd.p, n);
+    pos = n;
+    rd.p += balign_up(n, 8);
+    
+    const char *p = rec->fmt;
+    while (p && *p && pos < cap) {
+        const char *pct = strchr(p, '%');
+        size_t lit = (pct ? pct : p + strlen(p)) - p;
+        if (lit > cap - pos) {
+            lit = cap - pos;
+        }
+        memcpy(out + pos, p, lit);
+        pos += lit;
+        if (!pct) {
+            break;
+        }
+        
+        struct conv_spec s;
+        p = parse_spec(pct, &s);
+        if (s.arg == ARG_NONE) {
+            if (s.conv == '%' && pos < cap) {
+                out[pos++] = '%';
+            }
+            continue;
+        }
+        if (s.conv == 'n') {
+            void *dummy;
+            if (!read_slot(&rd, &dummy, sizeof(dummy))) {
+                break;
+            }
+            continue;
+        }
+        
+        // rebuild the conversion specification with the stored width and precision
+        char spec[48];
+        size_t sp = 0;
+        const char *q = s.start;
+        intmax_t star;
+        spec[sp++] = *q++;
+        while (strchr("-+ #0'", *q) && sp < 8) {
+            spec[sp++] = *q++;
+        }
+        if (s.width_star) {
+            if (!read_slot(&rd, &star, sizeof(star))) {
+                break;
+            }
+            sp += sprintf(spec + sp, "%d", (int)star);
+            q++;
+        }
+        else {
+            while (*q >= '0' && *q <= '9' && sp < 20) {
+                spec[sp++] = *q++;
+            }
+        }
+        if (*q == '.') {
+            q++;
+            if (s.prec_star) {
+                if (!read_slot(&rd, &star, sizeof(star))) {
+                    break;
+                }
+                if (star >= 0) {
+                    sp += sprintf(spec + sp, ".%d", (int)star);
+                }
+                q++;
+            }
+            else {
+                spec[sp++] = '.';
+                while (*q >= '0' && *q <= '9' && sp < 32) {
+                    spec[sp++] = *q++;
+                }
+            }
+        }
+        while (q < s.end && sp < sizeof(spec) - 1) {
+            spec[sp++] = *q++;
+        }
+        spec[sp] = '\0';
+        
+        int w = 0;
+        switch (s.arg) {
+            case ARG_INT: {
+                intmax_t v;
+                if (!read_slot(&rd, &v, sizeof(v))) {
+                    goto out;
+                }
+                switch (s.len) {
+                    case LEN_L: w = snprintf(out + pos, cap + 1 - pos, spec, (long)v); break;
+                    case LEN_LL: w = snprintf(out + pos, cap + 1 - pos, spec, (long long)v); break;
+                    case LEN_Z: w = snprintf(out + pos, cap + 1 - pos, spec, (size_t)v); break;
+                    case LEN_J: w = snprintf(out + pos, cap + 1 - pos, spec, v); break;
+                    case LEN_T: w = snprintf(out + pos, cap + 1 - pos, spec, (ptrdiff_t)v); break;
+                    default: w = snprintf(out + pos, cap + 1 - pos, spec, (int)v); break;
+                }
+            } break;
+            case ARG_UINT: {
+                uintmax_t v;
+                if (!read_slot(&rd, &v, sizeof(v))) {
+                    goto out;
+                }
+                switch (s.len) {
+                    case LEN_L: w = snprintf(out + pos, cap + 1 - pos, spec, (unsigned long)v); break;
+                    case LEN_LL: w = snprintf(out + pos, cap + 1 - pos, spec, (unsigned long long)v); break;
+                    case LEN_Z: w = snprintf(out + pos, cap + 1 - pos, spec, (size_t)v); break;
+                    case LEN_J: w = snprintf(out + pos, cap + 1 - pos, spec, v); break;
+                    case LEN_T: w = snprintf(out + pos, cap + 1 - pos, spec, (ptrdiff_t)v); break;
+                    default: w = snprintf(out + pos, cap + 1 - pos, spec, (unsigned int)v); break;
+                }
+            } break;
+            case ARG_DOUBLE: {
+                double v;
+                if (!read_slot(&rd, &v, sizeof(v))) {
+                    goto out;
+                }
+                w = snprintf(out + pos, cap + 1 - pos, spec, v);
+            } break;
+            case ARG_LDOUBLE: {
+                long double v;
+                if (!read_slot(&rd, &v, sizeof(v))) {
+                    goto out;
+                }
+                w = snprintf(out + pos, cap + 1 - pos, spec, v);
+            } break;
+            case ARG_PTR: {
+                void *v;
+                if (!read_slot(&rd, &v, sizeof(v))) {
+                    goto out;
+                }
+                w = snprintf(out + pos, cap + 1 - pos, spec, v);
+            } break;
+            case ARG_STR: {
+                uint64_t len;
+                if (!read_slot(&rd, &len, sizeof(len)) || rd.end - rd.p < len + 1) {
+                    goto out;
+                }
+                if (s.len == LEN_L) {
+                    // the stored string is narrow
+                    spec[sp - 2] = 's';
+                    spec[sp - 1] = '\0';
+                }
+                w = snprintf(out + pos, cap + 1 - pos, spec, rd.p);
+                rd.p += balign_up(len + 1, 8);
+            } break;
+        }
+        if (w > 0) {
+            pos += ((size_t)w > cap - pos ? cap - pos : (size_t)w);
+        }
+    }
+    
+out:
+    if (rec->truncated && pos + 3 <= cap) {
+        memcpy(out + pos, "...", 3);
+        pos += 3;
+    }
+    out[pos] = '\0';
+    return pos;
+}
+
+static uint64_t now_ms (void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// Token bucket per call site. Returns whether the message is to be output.
+// Sites that do not fit into the table are not limited.
+static int rate_check (const char *fmt, uint64_t now, unsigned long *suppressed)
+{
+    *suppressed = 0;
+    if (!fmt || blog_async.rate_limit <= 0) {
+        return 1;
+    }
+    
+    long full = (long)blog_async.rate_limit * 1000;
+    size_t h = ((uintptr_t)fmt >> 3) * 2654435761u;
+    
+    for (int i = 0; i < 8; i++) {
+        struct site *st = &blog_async.sites[(h + i) % BLOG_ASYNC_SITES];
+        if (!st->fmt) {
+            st->fmt = fmt;
+            st->last_ms = now;
+            st->tokens = full;
+            st->suppressed = 0;
+        }
+        if (st->fmt != fmt) {
+            continue;
+        }
+        
+        // a full bucket refills in a second, so longer pauses need not be counted
+        uint64_t elapsed = now - st->last_ms;
+        st->tokens += (long)(elapsed > 1000 ? 1000 : elapsed) * blog_async.rate_limit;
+        if (st->tokens > full) {
+            st->tokens = full;
+        }
+        st->last_ms = now;
+        if (st->tokens < 1000) {
+            st->suppressed++;
+            return 0;
+        }
+        st->tokens -= 1000;
+        *suppressed = st->suppressed;
+        st->suppressed = 0;
+        return 1;
+    }
+    
+    return 1;
+}
+
+static void output_record (const struct record *rec, uint64_t now)
+{
+    unsigned long suppressed;
+    if (!rate_check(rec->fmt, now, &suppressed)) {
+        return;
+    }
+    
+    size_t len = format_record(rec);
+    if (suppressed > 0) {
+        snprintf(blog_async.line + len, sizeof(blog_async.line) - len, " (%lu similar messages suppressed)", suppressed);
+    }
+    
+    blog_async.sink(rec->channel, rec->level, blog_async.line);
+}
+
+// Outputs all records available now, in the order they were logged.
+// Returns the number of records processed.
+static size_t drain (void)
+{
+    uint64_t now = now_ms();
+    size_t count = 0;
+    
+    pthread_mutex_lock(&blog_async.mutex);
+    struct ring *rings = blog_async.rings;
+    pthread_mutex_unlock(&blog_async.mutex);
+    
+    // report records dropped since the last time
+    for (struct ring *r = rings; r; r = r->next) {
+        unsigned long dropped = __atomic_load_n(&r->dropped, __ATOMIC_RELAXED);
+        if (dropped != r->dropped_reported) {
+            snprintf(blog_async.line, sizeof(blog_async.line), "BLog: %lu messages dropped, logging too fast", dropped - r->dropped_reported);
+            blog_async.sink(0, BLOG_WARNING, blog_async.line);
+            r->dropped_reported = dropped;
+        }
+    }
+    
+    for (;;) {
+        struct ring *min_r = NULL;
+        struct record *min_rec = NULL;
+        
+        for (struct ring *r = rings; r; r = r->next) {
+            size_t head = r->head;
+            size_t tail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+            if (head == tail) {
+                continue;
+            }
+            struct record *rec = (struct record *)(r->buf + head % BLOG_ASYNC_RING_SIZE);
+            if (rec->size == 0) {
+                // wrap marker, skip to the start of the ring
+                head += BLOG_ASYNC_RING_SIZE - head % BLOG_ASYNC_RING_SIZE;
+                __atomic_store_n(&r->head, head, __ATOMIC_RELEASE);
+                if (head == tail) {
+                    continue;
+                }
+                rec = (struct record *)r->buf;
+            }
+            if (!min_rec || rec->seq < min_rec->seq) {
+                min_r = r;
+                min_rec = rec;
+            }
+        }
+        
+        if (!min_rec) {
+            break;
+        }
+        
+        output_record(min_rec, now);
+        __atomic_store_n(&min_r->head, min_r->head + min_rec->size, __ATOMIC_RELEASE);
+        count++;
+    }
+    
+    return count;
+}
+
+static void * thread_func (void *unused)
+{
+    pthread_mutex_lock(&blog_async.mutex);
+    
+    while (!blog_async.quitting) {
+        pthread_mutex_unlock(&blog_async.mutex);
+        if (drain() > 0) {
+            // a pipe reader should see the messages now rather than when a stdio buffer fills up
+            fflush(NULL);
+        }
+        pthread_mutex_lock(&blog_async.mutex);
+        
+        if (blog_async.quitting) {
+            break;
+        }
+        
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_nsec += BLOG_ASYNC_POLL_MS * 1000000L;
+        if (ts.tv_nsec >= 1000000000L) {
+            ts.tv_sec++;
+            ts.tv_nsec -= 1000000000L;
+        }
+        pthread_cond_timedwait(&blog_async.cond, &blog_async.mutex, &ts);
+    }
+    
+    pthread_mutex_unlock(&blog_async.mutex);
+    return NULL;
+}
+
+static void async_free (void)
+{
+    pthread_mutex_lock(&blog_async.mutex);
+    blog_async.quitting = 1;
+    pthread_cond_signal(&blog_async.cond);
+    pthread_mutex_unlock(&blog_async.mutex);
+    
+    ASSERT_FORCE(pthread_join(blog_async.thread, NULL) == 0)
+    
+    // the logging threads are done, output what is left
+    drain();
+    fflush(NULL);
+    
+    blog_global.async = 0;
+    
+    struct ring *r = blog_async.rings;
+    while (r) {
+        struct ring *next = r->next;
+        free(r->buf);
+        free(r);
+        r = next;
+    }
+    blog_async.rings = NULL;
+    blog_async_ring = NULL;
+    
+    pthread_cond_destroy(&blog_async.cond);
+    pthread_mutex_destroy(&blog_async.mutex);
+    
+    blog_async.sink_free();
+}
+
+int BLog_InitAsync (int rate_limit)
+{
+    ASSERT(blog_global.initialized)
+    ASSERT(!blog_global.async)
+    ASSERT(rate_limit >= 0)
+    
+    memset(&blog_async, 0, sizeof(blog_async));
+    blog_async.rate_limit = rate_limit;
+    blog_async.sink = blog_global.log_func;
+    blog_async.sink_free = blog_global.free_func;
+    
+    if (pthread_mutex_init(&blog_async.mutex, NULL) != 0) {
+        goto fail0;
+    }
+    if (pthread_cond_init(&blog_async.cond, NULL) != 0) {
+        goto fail1;
+    }
+    
+    // start the thread with all signals blocked, so that signals meant for
+    // the main thread (e.g. those handled via signalfd) are never delivered to it
+    sigset_t all_sigs;
+    sigset_t old_sigs;
+    sigfillset(&all_sigs);
+    if (pthread_sigmask(SIG_SETMASK, &all_sigs, &old_sigs) != 0) {
+        goto fail2;
+    }
+    int res = pthread_create(&blog_async.thread, NULL, thread_func, NULL);
+    ASSERT_FORCE(pthread_sigmask(SIG_SETMASK, &old_sigs, NULL) == 0)
+    if (res != 0) {
+        goto fail2;
+    }
+    
+    blog_global.free_func = async_free;
+    blog_global.async = 1;
+    
+    return 1;
+    
+fail2:
+    pthread_cond_destroy(&blog_async.cond);
+fail1:
+    pthread_mutex_destroy(&blog_async.mutex);
+fail0:
+    return 0;
+}
@@ -0,0 +1,64 @@
+/**
+ * @file BLog_async.h
+ * 
+ * @section LICENSE
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the author nor the
+ *    names of its contributors may be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ * 
+ * @section DESCRIPTION
+ * 
+ * Asynchronous operation of the BLog backend.
+ * 
+ * Once enabled, logging a message only records its format string, which serves
+ * as the message ID, and the raw arguments into a lock-free ring buffer owned
+ * by the calling thread. A background thread formats the records, applies a
+ * per-call-site rate limit and passes the messages to the backend that was set
+ * up with {@link BLog_Init}.
+ * 
+ * Format strings must remain valid until the message is output, which is the
+ * case for string literals. Arguments are copied, including strings for %s.
+ */
+
+#ifndef BADVPN_BLOG_ASYNC_H
+#define BADVPN_BLOG_ASYNC_H
+
+#include <misc/debug.h>
+#include <base/BLog.h>
+
+/**
+ * Makes logging asynchronous.
+ * The logger must be initialized (e.g. with {@link BLog_InitStdout}), and this
+ * must be called while only one thread is logging, and not before forking.
+ * {@link BLog_Free} outputs the pending messages and stops the background thread.
+ * If too many messages are logged for the background thread to keep up, the ring
+ * buffer of a thread fills up and further messages are dropped and counted.
+ * 
+ * @param rate_limit maximum number of messages per second (with bursts of as many)
+ *                   output from a single call site, identified by its format string.
+ *                   Suppressed messages are counted and reported with the next
+ *                   message from that call site. 0 means no limit.
+ * @return 1 on success, 0 on failure, in which case logging stays synchronous
+ */
+int BLog_InitAsync (int rate_limit) WARN_UNUSED;
+
+#endif
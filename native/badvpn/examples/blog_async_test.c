@@ -0,0 +1,179 @@
+/**
+ * @file blog_async_test.c
+ * 
+ * @section LICENSE
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the author nor the
+ *    names of its contributors may be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <time.h>
+
+#include <misc/debug.h>
+#include <base/BLog.h>
+#include <base/BLog_async.h>
+
+#define MAX_LINES 64
+#define BENCH_MESSAGES 200000
+
+static char lines[MAX_LINES][2048];
+static int num_lines;
+static FILE *null_file;
+
+static void capture_log (int channel, int level, const char *msg)
+{
+    if (num_lines < MAX_LINES) {
+        snprintf(lines[num_lines], sizeof(lines[num_lines]), "%d %s", level, msg);
+    }
+    num_lines++;
+}
+
+static void null_log (int channel, int level, const char *msg)
+{
+    fprintf(null_file, "%s\n", msg);
+}
+
+static void nop_free (void)
+{
+}
+
+static void prefix_logfunc (void *arg)
+{
+    BLog_Append("conn %d: ", *(int *)arg);
+}
+
+static void log_samples (void)
+{
+    char buf[] = "stack string";
+    int id = 7;
+    
+    BLog_LogToChannel(0, BLOG_ERROR, "plain");
+    BLog_LogToChannel(0, BLOG_WARNING, "int %d uint %u hex %#x char %c", -5, 4000000000u, 255, 'z');
+    BLog_LogToChannel(0, BLOG_NOTICE, "long %ld ull %llu size %zu u64 %"PRIu64" u16 %"PRIu16, -123456789L, 18446744073709551615ULL, (size_t)42, (uint64_t)1 << 40, (uint16_t)53);
+    BLog_LogToChannel(0, BLOG_INFO, "str [%s] [%10s] [%-6.3s] [%.*s] [%*d]", buf, "right", "truncate", 4, "abcdefg", -6, 12);
+    BLog_LogToChannel(0, BLOG_INFO, "double %.3f %e %g percent %% end", 3.14159, 1e-9, 2.5);
+    BLog_LogToChannel(0, BLOG_DEBUG, "short %hd char %hhu null %s", (short)-3, (unsigned char)250, (char *)NULL);
+    BLog_LogViaFunc(prefix_logfunc, &id, 0, BLOG_NOTICE, "closed after %d bytes", 1500);
+    BLog_Begin();
+    BLog_Append("begin/append %s", "text");
+    BLog_Finish(0, BLOG_NOTICE);
+}
+
+static double now_sec (void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double bench (int async)
+{
+    BLog_Init(null_log, nop_free);
+    if (async) {
+        ASSERT_FORCE(BLog_InitAsync(0))
+    }
+    
+    double elapsed = 0;
+    for (int i = 0; i < BENCH_MESSAGES; i += 1000) {
+        double start = now_sec();
+        for (int j = i; j < i + 1000; j++) {
+            BLog_LogToChannel(0, BLOG_INFO, "UDP: from device %d bytes", j % 1500);
+        }
+        elapsed += now_sec() - start;
+        if (async) {
+            // do not outrun the background thread, which would drop messages
+            struct timespec ts = {0, 500000};
+            nanosleep(&ts, NULL);
+        }
+    }
+    
+    BLog_Free();
+    return elapsed;
+}
+
+int main (int argc, char **argv)
+{
+    char sync_lines[MAX_LINES][2048];
+    int sync_num;
+    
+    // synchronous reference output
+    BLog_Init(capture_log, nop_free);
+    for (int i = 0; i < BLOG_NUM_CHANNELS; i++) {
+        BLog_SetChannelLoglevel(i, BLOG_DEBUG);
+    }
+    log_samples();
+    BLog_Free();
+    sync_num = num_lines;
+    memcpy(sync_lines, lines, sizeof(lines));
+    
+    // the same messages formatted by the background thread
+    num_lines = 0;
+    BLog_Init(capture_log, nop_free);
+    for (int i = 0; i < BLOG_NUM_CHANNELS; i++) {
+        BLog_SetChannelLoglevel(i, BLOG_DEBUG);
+    }
+    ASSERT_FORCE(BLog_InitAsync(0))
+    log_samples();
+    BLog_Free();
+    
+    ASSERT_FORCE(num_lines == sync_num)
+    for (int i = 0; i < num_lines; i++) {
+        if (strcmp(lines[i], sync_lines[i])) {
+            printf("mismatch:\n  sync:  %s\n  async: %s\n", sync_lines[i], lines[i]);
+            return 1;
+        }
+        printf("%s\n", lines[i]);
+    }
+    
+    // rate limiting: a burst of 10 from one call site, then one more with the count of suppressed ones
+    num_lines = 0;
+    BLog_Init(capture_log, nop_free);
+    ASSERT_FORCE(BLog_InitAsync(10))
+    for (int i = 0; i < 1000; i++) {
+        BLog_LogToChannel(0, BLOG_ERROR, "flood %d", i);
+    }
+    BLog_LogToChannel(0, BLOG_ERROR, "other site");
+    struct timespec ts = {0, 300000000};
+    nanosleep(&ts, NULL);
+    BLog_LogToChannel(0, BLOG_ERROR, "flood %d", 1000);
+    BLog_Free();
+    ASSERT_FORCE(num_lines == 12)
+    ASSERT_FORCE(!strcmp(lines[10], "1 other site"))
+    ASSERT_FORCE(strstr(lines[11], "flood 1000 (990 similar messages suppressed)"))
+    
+    // cost for the logging thread
+    null_file = fopen("/dev/null", "w");
+    ASSERT_FORCE(null_file)
+    double t_sync = bench(0);
+    double t_async = bench(1);
+    fclose(null_file);
+    
+    printf("%d messages: sync %.0f ns/message, async %.0f ns/message\n",
+           BENCH_MESSAGES, t_sync / BENCH_MESSAGES * 1e9, t_async / BENCH_MESSAGES * 1e9);
+    
+    return 0;
+}
@@ -0,0 +1,195 @@
+/**
+ * @file connect_scheduler_test.c
+ * 
+ * @section LICENSE
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the author nor the
+ *    names of its contributors may be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include <misc/debug.h>
+#include <base/BLog.h>
+#include <system/BReactor.h>
+#include <system/BTime.h>
+#include <tun2socks/ConnectScheduler.h>
+
+#define NUM_ENTRIES 10
+#define STEP_TIME 50
+
+static BReactor reactor;
+static BTimer step_timer;
+static int step;
+static ConnectScheduler sched;
+static ConnectSchedulerEntry entries[NUM_ENTRIES];
+static int started[NUM_ENTRIES];
+static btime_t start_times[NUM_ENTRIES];
+static int num_started;
+
+static void entry_handler (void *user)
+{
+    int i = (ConnectSchedulerEntry *)user - entries;
+    ASSERT_FORCE(!ConnectSchedulerEntry_IsQueued(&entries[i]))
+    
+    start_times[num_started] = btime_gettime();
+    started[num_started++] = i;
+}
+
+static void init_entry (int i, int prio)
+{
+    ConnectSchedulerEntry_Init(&entries[i], &sched, prio, entry_handler, &entries[i]);
+}
+
+// runs a test, calling step_handler every STEP_TIME until it quits the reactor
+static void run_test (BTimer_handler step_handler)
+{
+    ASSERT_FORCE(BReactor_Init(&reactor))
+    BTimer_Init(&step_timer, STEP_TIME, step_handler, NULL);
+    step = 0;
+    num_started = 0;
+    
+    step_handler(NULL);
+    BReactor_Exec(&reactor);
+    
+    BReactor_RemoveTimer(&reactor, &step_timer);
+    BReactor_Free(&reactor);
+}
+
+static void priorities_step (void *unused)
+{
+    switch (step++) {
+        case 0: {
+            ConnectScheduler_Init(&sched, &reactor, 2, 100);
+            
+            init_entry(0, CONNECTSCHEDULER_PRIO_LOW);
+            init_entry(1, CONNECTSCHEDULER_PRIO_NORMAL);
+            init_entry(2, CONNECTSCHEDULER_PRIO_HIGH);
+            init_entry(3, CONNECTSCHEDULER_PRIO_LOW);
+            init_entry(4, CONNECTSCHEDULER_PRIO_NORMAL);
+            
+            // nothing starts before the job runs
+            ASSERT_FORCE(num_started == 0)
+        } break;
+        
+        case 1: {
+            // only two slots are available
+            ASSERT_FORCE(num_started == 2)
+            ASSERT_FORCE(started[0] == 2 && started[1] == 1)
+            ASSERT_FORCE(ConnectScheduler_NumActive(&sched) == 2)
+            ASSERT_FORCE(ConnectScheduler_NumQueued(&sched) == 3)
+            
+            // raising a priority takes effect, canceling removes from the queue
+            ConnectSchedulerEntry_SetPriority(&entries[3], CONNECTSCHEDULER_PRIO_HIGH);
+            ConnectSchedulerEntry_Free(&entries[4]);
+            ASSERT_FORCE(ConnectScheduler_NumQueued(&sched) == 2)
+        } break;
+        
+        case 2: {
+            ASSERT_FORCE(num_started == 2)
+            
+            // a connection coming up releases its slot
+            ConnectSchedulerEntry_Done(&entries[2]);
+        } break;
+        
+        case 3: {
+            ASSERT_FORCE(num_started == 3 && started[2] == 3)
+            
+            // so does freeing a connection being set up
+            ConnectSchedulerEntry_Free(&entries[1]);
+        } break;
+        
+        case 4: {
+            ASSERT_FORCE(num_started == 4 && started[3] == 0)
+            ASSERT_FORCE(ConnectScheduler_NumQueued(&sched) == 0)
+            
+            ConnectSchedulerStats stats;
+            ConnectScheduler_GetStats(&sched, &stats);
+            ASSERT_FORCE(stats.started == 4)
+            ASSERT_FORCE(stats.delayed == 3)
+            ASSERT_FORCE(stats.canceled == 1)
+            ASSERT_FORCE(stats.max_queued == 5)
+            ASSERT_FORCE(stats.max_wait_time >= 3 * STEP_TIME)
+            
+            ConnectSchedulerEntry_Free(&entries[0]);
+            ConnectSchedulerEntry_Free(&entries[2]);
+            ConnectSchedulerEntry_Free(&entries[3]);
+            ConnectScheduler_Free(&sched);
+            
+            BReactor_Quit(&reactor, 0);
+        } return;
+    }
+    
+    BReactor_SetTimer(&reactor, &step_timer);
+}
+
+static void start_limit_step (void *unused)
+{
+    switch (step++) {
+        case 0: {
+            ConnectScheduler_Init(&sched, &reactor, NUM_ENTRIES, 3);
+            
+            for (int i = 0; i < NUM_ENTRIES; i++) {
+                init_entry(i, CONNECTSCHEDULER_PRIO_NORMAL);
+            }
+        } break;
+        
+        case 1: {
+            ASSERT_FORCE(num_started == NUM_ENTRIES)
+            
+            // FIFO order within a priority
+            for (int i = 0; i < NUM_ENTRIES; i++) {
+                ASSERT_FORCE(started[i] == i)
+            }
+            
+            // at most 3 in a reactor iteration; the next batch waits for the
+            // reactor to poll, so no more than 3 can share a millisecond
+            for (int i = 3; i < NUM_ENTRIES; i++) {
+                ASSERT_FORCE(start_times[i] > start_times[i - 3])
+            }
+            
+            for (int i = 0; i < NUM_ENTRIES; i++) {
+                ConnectSchedulerEntry_Free(&entries[i]);
+            }
+            ConnectScheduler_Free(&sched);
+            
+            BReactor_Quit(&reactor, 0);
+        } return;
+    }
+    
+    BReactor_SetTimer(&reactor, &step_timer);
+}
+
+int main ()
+{
+    BLog_InitStderr();
+    BTime_Init();
+    
+    run_test(priorities_step);
+    run_test(start_limit_step);
+    
+    printf("ok\n");
+    
+    BLog_Free();
+    return 0;
+}
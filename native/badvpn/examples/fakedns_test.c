@@ -0,0 +1,188 @@
+/**
+ * @file fakedns_test.c
+ * 
+ * @section LICENSE
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the author nor the
+ *    names of its contributors may be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+
+#include <misc/debug.h>
+#include <misc/byteorder.h>
+#include <base/BLog.h>
+#include <system/BTime.h>
+#include <tun2socks/FakeDns.h>
+
+#define TYPE_A 1
+#define TYPE_MX 15
+#define TYPE_AAAA 28
+
+static int make_query (uint8_t *out, uint16_t id, const char *name, uint16_t qtype)
+{
+    memset(out, 0, 12);
+    out[0] = id >> 8;
+    out[1] = id;
+    out[2] = 0x01; // RD
+    out[5] = 1; // QDCOUNT
+    out[11] = 1; // ARCOUNT (EDNS)
+    
+    int pos = 12;
+    while (*name) {
+        const char *dot = strchr(name, '.');
+        int len = (dot ? dot - name : (int)strlen(name));
+        out[pos++] = len;
+        memcpy(out + pos, name, len);
+        pos += len;
+        name += len + (dot ? 1 : 0);
+    }
+    out[pos++] = 0;
+    out[pos++] = qtype >> 8;
+    out[pos++] = qtype;
+    out[pos++] = 0;
+    out[pos++] = 1; // IN
+    
+    // OPT record
+    uint8_t opt[11] = {0, 0, 41, 0x10, 0, 0, 0, 0, 0, 0, 0};
+    memcpy(out + pos, opt, sizeof(opt));
+    return pos + sizeof(opt);
+}
+
+// returns the answered address in network byte order, 0 for an empty answer
+static uint32_t resolve (FakeDns *fd, const char *name, uint16_t qtype)
+{
+    uint8_t query[512];
+    uint8_t resp[FAKEDNS_MAX_RESPONSE];
+    int query_len = make_query(query, 0x1234, name, qtype);
+    int question_len = query_len - 11 - 12;
+    
+    int len = FakeDns_ProcessQuery(fd, query, query_len, resp);
+    ASSERT_FORCE(len > 0)
+    ASSERT_FORCE(resp[0] == 0x12 && resp[1] == 0x34)
+    ASSERT_FORCE(resp[2] == 0x81 && resp[3] == 0x80)
+    ASSERT_FORCE(resp[5] == 1 && resp[9] == 0 && resp[11] == 0)
+    ASSERT_FORCE(!memcmp(resp + 12, query + 12, question_len))
+    
+    if (resp[7] == 0) {
+        ASSERT_FORCE(len == 12 + question_len)
+        return 0;
+    }
+    
+    ASSERT_FORCE(resp[7] == 1)
+    ASSERT_FORCE(len == 12 + question_len + 16)
+    uint8_t *a = resp + 12 + question_len;
+    ASSERT_FORCE(a[0] == 0xC0 && a[1] == 12)
+    ASSERT_FORCE(a[3] == TYPE_A && a[5] == 1)
+    ASSERT_FORCE(a[9] == 60 && a[11] == 4)
+    
+    uint32_t addr;
+    memcpy(&addr, a + 12, 4);
+    return addr;
+}
+
+static uint32_t addr4 (int a, int b, int c, int d)
+{
+    return hton32(((uint32_t)a << 24) | ((uint32_t)b << 16) | ((uint32_t)c << 8) | d);
+}
+
+static void test_mapping (void)
+{
+    FakeDns fd;
+    ASSERT_FORCE(FakeDns_Init(&fd, addr4(198, 18, 0, 0), 15, 16, 60))
+    
+    // names get consecutive addresses, case-insensitively
+    uint32_t a1 = resolve(&fd, "Example.COM", TYPE_A);
+    uint32_t a2 = resolve(&fd, "www.example.org", TYPE_A);
+    ASSERT_FORCE(a1 == addr4(198, 18, 0, 1))
+    ASSERT_FORCE(a2 == addr4(198, 18, 0, 2))
+    ASSERT_FORCE(resolve(&fd, "example.com", TYPE_A) == a1)
+    
+    // AAAA gets no data, other types are not answered
+    ASSERT_FORCE(resolve(&fd, "example.com", TYPE_AAAA) == 0)
+    uint8_t query[512];
+    uint8_t resp[FAKEDNS_MAX_RESPONSE];
+    int query_len = make_query(query, 1, "example.com", TYPE_MX);
+    ASSERT_FORCE(FakeDns_ProcessQuery(&fd, query, query_len, resp) == 0)
+    
+    // truncated and malformed queries are not answered
+    query_len = make_query(query, 1, "example.com", TYPE_A);
+    for (int i = 0; i < 12 + 13 + 4; i++) {
+        ASSERT_FORCE(FakeDns_ProcessQuery(&fd, query, i, resp) == 0)
+    }
+    query[12] = 0xC0;
+    ASSERT_FORCE(FakeDns_ProcessQuery(&fd, query, query_len, resp) == 0)
+    
+    // reverse lookup
+    ASSERT_FORCE(FakeDns_IsFake(&fd, a1))
+    ASSERT_FORCE(FakeDns_IsFake(&fd, addr4(198, 19, 255, 255)))
+    ASSERT_FORCE(!FakeDns_IsFake(&fd, addr4(198, 20, 0, 1)))
+    ASSERT_FORCE(!strcmp(FakeDns_Lookup(&fd, a1), "example.com"))
+    ASSERT_FORCE(!strcmp(FakeDns_Lookup(&fd, a2), "www.example.org"))
+    ASSERT_FORCE(!FakeDns_Lookup(&fd, addr4(198, 18, 0, 0)))
+    ASSERT_FORCE(!FakeDns_Lookup(&fd, addr4(198, 18, 0, 3)))
+    ASSERT_FORCE(!FakeDns_Lookup(&fd, addr4(10, 0, 0, 1)))
+    
+    FakeDns_Free(&fd);
+}
+
+static void test_reuse (void)
+{
+    FakeDns fd;
+    ASSERT_FORCE(FakeDns_Init(&fd, addr4(10, 0, 0, 0), 29, 100, 60))
+    
+    // a /29 has 6 usable addresses
+    char name[32];
+    uint32_t addrs[6];
+    for (int i = 0; i < 6; i++) {
+        sprintf(name, "host%d.test", i);
+        addrs[i] = resolve(&fd, name, TYPE_A);
+        ASSERT_FORCE(addrs[i] == addr4(10, 0, 0, 1 + i))
+    }
+    
+    // using host0 makes host1 the least recently used
+    ASSERT_FORCE(!strcmp(FakeDns_Lookup(&fd, addrs[0]), "host0.test"))
+    ASSERT_FORCE(resolve(&fd, "new.test", TYPE_A) == addrs[1])
+    ASSERT_FORCE(!strcmp(FakeDns_Lookup(&fd, addrs[1]), "new.test"))
+    
+    // the old name gets a new address
+    ASSERT_FORCE(resolve(&fd, "host1.test", TYPE_A) == addrs[2])
+    ASSERT_FORCE(!strcmp(FakeDns_Lookup(&fd, addrs[2]), "host1.test"))
+    
+    FakeDns_Free(&fd);
+}
+
+int main ()
+{
+    BLog_InitStderr();
+    BTime_Init();
+    
+    test_mapping();
+    test_reuse();
+    
+    printf("ok\n");
+    
+    BLog_Free();
+    return 0;
+}
@@ -0,0 +1,318 @@
+/**
+ * @file flow_batch_test.c
+ * 
+ * @section LICENSE
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the author nor the
+ *    names of its contributors may be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ * 
+ * @section DESCRIPTION
+ * 
+ * Tests batched sends along the udpgw client path: flows of a
+ * PacketPassFairQueue feed a PacketPassConnector, whose output is a
+ * PacketStreamSender writing to a stream that accepts partial writes.
+ * Writes complete only once the pending jobs have run, like on a socket,
+ * so that packets from several flows get queued together. Mid-batch, the
+ * stream stops and the connector is switched to a new stream, as when the
+ * udpgw connection is replaced.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include <misc/debug.h>
+#include <base/BLog.h>
+#include <base/BPending.h>
+#include <system/BReactor.h>
+#include <system/BTime.h>
+#include <flow/PacketPassFairQueue.h>
+#include <flow/PacketPassConnector.h>
+#include <flow/PacketStreamSender.h>
+
+#define NUM_FLOWS 3
+#define NUM_PACKETS 20
+#define PACKET_LEN 16
+#define SINK_CHUNK 20
+#define SINK_STOP_AT 200
+#define TOTAL_LEN (NUM_FLOWS * NUM_PACKETS * PACKET_LEN)
+
+struct source {
+    PacketPassFairQueueFlow flow;
+    int num_sent;
+    int watched;
+    int busy_calls;
+    int freed;
+    uint8_t packet[PACKET_LEN];
+};
+
+struct sink {
+    StreamPassInterface input;
+    PacketStreamSender sender;
+    int stop_at;
+    int stopped;
+    int pending_len;
+    int num_vec_sends;
+    int len;
+    uint8_t data[TOTAL_LEN];
+};
+
+static BReactor reactor;
+static PacketPassFairQueue fq;
+static PacketPassConnector connector;
+static struct source sources[NUM_FLOWS];
+static struct sink sinks[2];
+static struct sink *cur_sink;
+static int num_freed;
+
+static void source_send (struct source *src)
+{
+    int i = src - sources;
+    
+    memset(src->packet, 0, sizeof(src->packet));
+    src->packet[0] = i;
+    src->packet[1] = src->num_sent;
+    
+    PacketPassInterface_Sender_Send(PacketPassFairQueueFlow_GetInput(&src->flow), src->packet, PACKET_LEN);
+    src->num_sent++;
+}
+
+static void source_handler_done (void *user)
+{
+    struct source *src = user;
+    ASSERT_FORCE(!src->freed)
+    
+    if (src->num_sent < NUM_PACKETS) {
+        source_send(src);
+    }
+}
+
+static void source_handler_busy (void *user)
+{
+    struct source *src = user;
+    ASSERT_FORCE(!src->freed)
+    ASSERT_FORCE(!PacketPassFairQueueFlow_IsBusy(&src->flow))
+    
+    src->watched = 0;
+    src->busy_calls++;
+    
+    // the watched flows are those of the batch just finished; free the ones that
+    // sent their last packet, including others whose handlers are yet to be called
+    for (int i = 0; i < NUM_FLOWS; i++) {
+        struct source *other = &sources[i];
+        if (other != src && !other->watched) {
+            continue;
+        }
+        ASSERT_FORCE(!other->freed)
+        ASSERT_FORCE(!PacketPassFairQueueFlow_IsBusy(&other->flow))
+        
+        if (other->num_sent == NUM_PACKETS) {
+            PacketPassFairQueueFlow_Free(&other->flow);
+            other->watched = 0;
+            other->freed = 1;
+            num_freed++;
+        }
+    }
+}
+
+// accepts up to SINK_CHUNK bytes from the buffers, or stops at stop_at;
+// the write is completed by run_pending
+static void sink_write (struct sink *s, StreamPassInterface_iovec *vec, int vec_count)
+{
+    ASSERT_FORCE(!s->stopped)
+    ASSERT_FORCE(s->pending_len == 0)
+    
+    // watch every flow the queue is currently sending
+    for (int i = 0; i < NUM_FLOWS; i++) {
+        if (!sources[i].freed && PacketPassFairQueueFlow_IsBusy(&sources[i].flow)) {
+            PacketPassFairQueueFlow_SetBusyHandler(&sources[i].flow, source_handler_busy, &sources[i]);
+            sources[i].watched = 1;
+        }
+    }
+    
+    if (s->len >= s->stop_at) {
+        s->stopped = 1;
+        return;
+    }
+    
+    int amount = 0;
+    for (int i = 0; i < vec_count && amount < SINK_CHUNK; i++) {
+        int n = vec[i].len;
+        if (n > SINK_CHUNK - amount) {
+            n = SINK_CHUNK - amount;
+        }
+        ASSERT_FORCE(s->len + n <= TOTAL_LEN)
+        memcpy(s->data + s->len, vec[i].data, n);
+        s->len += n;
+        amount += n;
+    }
+    
+    if (vec_count > 1) {
+        s->num_vec_sends++;
+    }
+    
+    s->pending_len = amount;
+}
+
+static void sink_handler_send (struct sink *s, uint8_t *data, int data_len)
+{
+    StreamPassInterface_iovec vec;
+    vec.data = data;
+    vec.len = data_len;
+    sink_write(s, &vec, 1);
+}
+
+static void sink_handler_send_vec (struct sink *s, StreamPassInterface_iovec *vec, int vec_count)
+{
+    sink_write(s, vec, vec_count);
+}
+
+static void sink_init (struct sink *s, int stop_at)
+{
+    s->stop_at = stop_at;
+    s->stopped = 0;
+    s->pending_len = 0;
+    s->num_vec_sends = 0;
+    s->len = 0;
+    
+    StreamPassInterface_Init(&s->input, (StreamPassInterface_handler_send)sink_handler_send, s, BReactor_PendingGroup(&reactor));
+    StreamPassInterface_EnableVec(&s->input, (StreamPassInterface_handler_send_vec)sink_handler_send_vec);
+    PacketStreamSender_Init(&s->sender, &s->input, PACKET_LEN, BReactor_PendingGroup(&reactor));
+}
+
+static void sink_free (struct sink *s)
+{
+    PacketStreamSender_Free(&s->sender);
+    StreamPassInterface_Free(&s->input);
+}
+
+static void reconnect (void)
+{
+    PacketPassInterface *old_input = PacketStreamSender_GetInput(&sinks[0].sender);
+    
+    // the stream stopped inside a batch, with some of its packets written
+    ASSERT_FORCE(sinks[0].len % PACKET_LEN != 0)
+    ASSERT_FORCE(PacketPassInterface_Sender_GetBatchProgress(old_input) > 0)
+    
+    // replace the stream, like the udpgw client does when reconnecting
+    PacketPassConnector_DisconnectOutput(&connector);
+    sink_free(&sinks[0]);
+    sink_init(&sinks[1], TOTAL_LEN + 1);
+    PacketPassConnector_ConnectOutput(&connector, PacketStreamSender_GetInput(&sinks[1].sender));
+    cur_sink = &sinks[1];
+}
+
+static void run_pending (BPendingGroup *pg)
+{
+    while (1) {
+        while (BPendingGroup_HasJobs(pg)) {
+            BPendingGroup_ExecuteJob(pg);
+        }
+        
+        if (num_freed == NUM_FLOWS) {
+            break;
+        }
+        
+        if (cur_sink->pending_len > 0) {
+            StreamPassInterface_Done(&cur_sink->input, cur_sink->pending_len);
+            cur_sink->pending_len = 0;
+        } else {
+            ASSERT_FORCE(cur_sink->stopped && cur_sink == &sinks[0])
+            reconnect();
+        }
+    }
+}
+
+int main ()
+{
+    BLog_InitStderr();
+    BTime_Init();
+    
+    ASSERT_FORCE(BReactor_Init(&reactor))
+    
+    sink_init(&sinks[0], SINK_STOP_AT);
+    cur_sink = &sinks[0];
+    PacketPassConnector_Init(&connector, PACKET_LEN, BReactor_PendingGroup(&reactor));
+    PacketPassConnector_ConnectOutput(&connector, PacketStreamSender_GetInput(&sinks[0].sender));
+    ASSERT_FORCE(PacketPassFairQueue_Init(&fq, PacketPassConnector_GetInput(&connector), BReactor_PendingGroup(&reactor), 0, 1))
+    
+    for (int i = 0; i < NUM_FLOWS; i++) {
+        struct source *src = &sources[i];
+        src->num_sent = 0;
+        src->watched = 0;
+        src->busy_calls = 0;
+        src->freed = 0;
+        PacketPassFairQueueFlow_Init(&src->flow, &fq);
+        PacketPassInterface_Sender_Init(PacketPassFairQueueFlow_GetInput(&src->flow), source_handler_done, src);
+        source_send(src);
+    }
+    num_freed = 0;
+    
+    run_pending(BReactor_PendingGroup(&reactor));
+    
+    // the first stream wrote its packets in batches, gathering them into single writes
+    ASSERT_FORCE(sinks[0].stopped)
+    ASSERT_FORCE(sinks[0].num_vec_sends > 0)
+    
+    // the packet the first stream got only part of is sent again whole, then the rest;
+    // nothing is lost or duplicated
+    int full_len = sinks[0].len - sinks[0].len % PACKET_LEN;
+    ASSERT_FORCE(full_len + sinks[1].len == TOTAL_LEN)
+    ASSERT_FORCE(!memcmp(sinks[0].data + full_len, sinks[1].data, sinks[0].len - full_len))
+    
+    uint8_t packets[TOTAL_LEN];
+    memcpy(packets, sinks[0].data, full_len);
+    memcpy(packets + full_len, sinks[1].data, sinks[1].len);
+    
+    // each flow's packets arrive in order, and no flow gets more than one packet
+    // ahead of another
+    int counts[NUM_FLOWS] = {0};
+    for (int j = 0; j < NUM_FLOWS * NUM_PACKETS; j++) {
+        uint8_t *p = packets + j * PACKET_LEN;
+        ASSERT_FORCE(p[0] < NUM_FLOWS)
+        ASSERT_FORCE(p[1] == counts[p[0]])
+        counts[p[0]]++;
+        
+        for (int i = 0; i < NUM_FLOWS; i++) {
+            ASSERT_FORCE(counts[i] <= counts[p[0]] + 1)
+            ASSERT_FORCE(counts[p[0]] <= counts[i] + 1)
+        }
+    }
+    
+    // busy handlers were called after the flows were finished, but not for flows
+    // freed by the handler of another flow
+    int busy_calls = 0;
+    for (int i = 0; i < NUM_FLOWS; i++) {
+        ASSERT_FORCE(sources[i].freed)
+        busy_calls += sources[i].busy_calls;
+    }
+    ASSERT_FORCE(busy_calls < NUM_FLOWS * NUM_PACKETS)
+    
+    PacketPassFairQueue_Free(&fq);
+    PacketPassConnector_Free(&connector);
+    sink_free(&sinks[1]);
+    BReactor_Free(&reactor);
+    
+    printf("ok\n");
+    
+    BLog_Free();
+    return 0;
+}
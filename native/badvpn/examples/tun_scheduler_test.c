@@ -0,0 +1,331 @@
+/**
+ * @file tun_scheduler_test.c
+ * 
+ * @section LICENSE
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the author nor the
+ *    names of its contributors may be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include <misc/debug.h>
+#include <base/BLog.h>
+#include <system/BReactor.h>
+#include <system/BTime.h>
+#include <tuntap/BTap.h>
+#include <tun2socks/TunScheduler.h>
+
+#define MTU 1500
+#define BULK_PAYLOAD 1400
+#define MAX_OUT 64
+
+struct out_packet {
+    int proto;
+    int port;
+    int id;
+};
+
+static BReactor reactor;
+static BTap device;
+static TunScheduler sched;
+static BTimer quit_timer;
+static int peer_fd;
+static struct out_packet out[MAX_OUT];
+static int num_out;
+
+static int make_packet (uint8_t *p, int proto, int sport, int dport, int id, int payload, int tcp_flags)
+{
+    int l4_len = (proto == 6 ? 20 : 8);
+    int total = 20 + l4_len + payload;
+    
+    memset(p, 0, total);
+    p[0] = 0x45;
+    p[2] = total >> 8;
+    p[3] = total;
+    p[4] = id >> 8;
+    p[5] = id;
+    p[8] = 64;
+    p[9] = proto;
+    p[12] = 10; p[15] = 1;
+    p[16] = 10; p[19] = 2;
+    
+    uint8_t *l4 = p + 20;
+    l4[0] = sport >> 8;
+    l4[1] = sport;
+    l4[2] = dport >> 8;
+    l4[3] = dport;
+    if (proto == 6) {
+        l4[12] = 5 << 4;
+        l4[13] = tcp_flags;
+    } else {
+        l4[4] = (8 + payload) >> 8;
+        l4[5] = (8 + payload);
+    }
+    
+    return total;
+}
+
+static void send_packet (int proto, int sport, int dport, int id, int payload, int tcp_flags)
+{
+    uint8_t p[MTU];
+    int len = make_packet(p, proto, sport, dport, id, payload, tcp_flags);
+    TunScheduler_Send(&sched, p, len);
+}
+
+static void quit_timer_handler (void *unused)
+{
+    BReactor_Quit(&reactor, 0);
+}
+
+static void device_error_handler (void *unused)
+{
+    ASSERT_FORCE(0)
+}
+
+static void setup (int num_packets, int max_bytes)
+{
+    // a pipe stands in for the device; packets are delimited by the IP length
+    int fds[2];
+    ASSERT_FORCE(pipe(fds) == 0)
+    ASSERT_FORCE(fcntl(fds[1], F_SETPIPE_SZ, 1 << 20) >= 0)
+    peer_fd = fds[0];
+    
+    ASSERT_FORCE(BReactor_Init(&reactor))
+    
+    struct BTap_init_data init_data;
+    init_data.dev_type = BTAP_DEV_TUN;
+    init_data.init_type = BTAP_INIT_FD;
+    init_data.init.fd.fd = fds[1];
+    init_data.init.fd.mtu = MTU;
+    init_data.offload = 0;
+    ASSERT_FORCE(BTap_Init2(&device, &reactor, init_data, device_error_handler, NULL))
+    
+    ASSERT_FORCE(TunScheduler_Init(&sched, &device, &reactor, num_packets, max_bytes, 4 * MTU))
+    
+    BTimer_Init(&quit_timer, 50, quit_timer_handler, NULL);
+}
+
+static void run (void)
+{
+    BReactor_SetTimer(&reactor, &quit_timer);
+    BReactor_Exec(&reactor);
+    
+    ASSERT_FORCE(TunScheduler_NumQueued(&sched) == 0)
+    
+    TunScheduler_Free(&sched);
+    BTap_Free(&device);
+    BReactor_Free(&reactor);
+    
+    // collect what reached the device
+    ASSERT_FORCE(fcntl(peer_fd, F_SETFL, O_NONBLOCK) == 0)
+    static uint8_t buf[MAX_OUT * MTU];
+    int buf_len = 0;
+    int len;
+    while ((len = read(peer_fd, buf + buf_len, sizeof(buf) - buf_len)) > 0) {
+        buf_len += len;
+    }
+    ASSERT_FORCE(close(peer_fd) == 0)
+    
+    num_out = 0;
+    for (int pos = 0; pos < buf_len; pos += (buf[pos + 2] << 8) | buf[pos + 3]) {
+        ASSERT_FORCE(num_out < MAX_OUT)
+        uint8_t *p = buf + pos;
+        out[num_out].proto = p[9];
+        out[num_out].port = (p[20] << 8) | p[21];
+        out[num_out].id = (p[4] << 8) | p[5];
+        num_out++;
+    }
+}
+
+static void expect (int i, int proto, int port, int id)
+{
+    ASSERT_FORCE(i < num_out)
+    if (out[i].proto != proto || out[i].port != port || out[i].id != id) {
+        fprintf(stderr, "packet %d: got proto=%d port=%d id=%d, expected proto=%d port=%d id=%d\n",
+                i, out[i].proto, out[i].port, out[i].id, proto, port, id);
+        ASSERT_FORCE(0)
+    }
+}
+
+static void test_classify (void)
+{
+    uint8_t p[MTU];
+    int flow1, flow2;
+    
+    ASSERT_FORCE(TunScheduler_Classify(p, make_packet(p, 17, 53, 4000, 0, 100, 0), NULL) == TUNSCHEDULER_CLASS_DNS)
+    ASSERT_FORCE(TunScheduler_Classify(p, make_packet(p, 17, 4000, 443, 0, 1200, 0), NULL) == TUNSCHEDULER_CLASS_REALTIME)
+    ASSERT_FORCE(TunScheduler_Classify(p, make_packet(p, 6, 443, 4000, 0, 0, 0x10), &flow1) == TUNSCHEDULER_CLASS_INTERACTIVE)
+    ASSERT_FORCE(TunScheduler_Classify(p, make_packet(p, 6, 443, 4000, 0, BULK_PAYLOAD, 0x10), &flow2) == TUNSCHEDULER_CLASS_BULK)
+    ASSERT_FORCE(TunScheduler_Classify(p, make_packet(p, 6, 443, 4000, 0, BULK_PAYLOAD, 0x11), NULL) == TUNSCHEDULER_CLASS_INTERACTIVE)
+    ASSERT_FORCE(TunScheduler_Classify(p, make_packet(p, 1, 0, 0, 0, 56, 0), NULL) == TUNSCHEDULER_CLASS_INTERACTIVE)
+    ASSERT_FORCE(TunScheduler_Classify(p, 3, NULL) == TUNSCHEDULER_CLASS_INTERACTIVE)
+    
+    // segments of one connection share a flow whatever their class
+    ASSERT_FORCE(flow1 == flow2)
+}
+
+static void test_priority (void)
+{
+    setup(64, 64 * MTU);
+    
+    for (int i = 0; i < 10; i++) {
+        send_packet(6, 1000, 80, i, BULK_PAYLOAD, 0x10);
+    }
+    send_packet(6, 2000, 80, 100, 0, 0x10);
+    send_packet(17, 3000, 5000, 200, 160, 0);
+    send_packet(17, 4000, 53, 300, 40, 0);
+    
+    run();
+    
+    ASSERT_FORCE(num_out == 13)
+    expect(0, 17, 4000, 300);
+    expect(1, 17, 3000, 200);
+    expect(2, 6, 2000, 100);
+    for (int i = 0; i < 10; i++) {
+        expect(3 + i, 6, 1000, i);
+    }
+}
+
+static void test_fairness (void)
+{
+    setup(64, 64 * MTU);
+    
+    for (int i = 0; i < 6; i++) {
+        send_packet(6, 1000, 80, i, BULK_PAYLOAD, 0x10);
+    }
+    for (int i = 0; i < 6; i++) {
+        send_packet(6, 2000, 80, i, BULK_PAYLOAD, 0x10);
+    }
+    
+    run();
+    
+    ASSERT_FORCE(num_out == 12)
+    for (int i = 0; i < 6; i++) {
+        expect(2 * i, 6, 1000, i);
+        expect(2 * i + 1, 6, 2000, i);
+    }
+}
+
+static void test_demotion (void)
+{
+    setup(64, 64 * MTU);
+    
+    send_packet(6, 1000, 80, 0, BULK_PAYLOAD, 0x10);
+    send_packet(6, 1000, 80, 1, BULK_PAYLOAD, 0x10);
+    for (int i = 0; i < 4; i++) {
+        send_packet(17, 3000, 443, 10 + i, BULK_PAYLOAD, 0);
+    }
+    send_packet(6, 2000, 80, 100, 0, 0x10);
+    
+    run();
+    
+    // the UDP flow built up a queue and competes with the bulk flow
+    ASSERT_FORCE(num_out == 7)
+    expect(0, 6, 2000, 100);
+    expect(1, 6, 1000, 0);
+    expect(2, 17, 3000, 10);
+    expect(3, 6, 1000, 1);
+    for (int i = 1; i < 4; i++) {
+        expect(3 + i, 17, 3000, 10 + i);
+    }
+}
+
+static void test_overflow (void)
+{
+    setup(4, 64 * MTU);
+    
+    for (int i = 0; i < 6; i++) {
+        send_packet(6, 1000, 80, i, BULK_PAYLOAD, 0x10);
+    }
+    send_packet(17, 4000, 53, 300, 40, 0);
+    
+    run();
+    
+    // packets were dropped from the head of the bulk flow
+    ASSERT_FORCE(num_out == 4)
+    expect(0, 17, 4000, 300);
+    for (int i = 0; i < 3; i++) {
+        expect(1 + i, 6, 1000, 3 + i);
+    }
+}
+
+static void test_byte_limit (void)
+{
+    setup(64, 3 * MTU);
+    
+    for (int i = 0; i < 6; i++) {
+        send_packet(6, 1000, 80, i, BULK_PAYLOAD, 0x10);
+    }
+    send_packet(17, 4000, 53, 300, 40, 0);
+    
+    run();
+    
+    // only as many bulk packets as fit in the byte limit were kept
+    ASSERT_FORCE(num_out == 4)
+    expect(0, 17, 4000, 300);
+    for (int i = 0; i < 3; i++) {
+        expect(1 + i, 6, 1000, 3 + i);
+    }
+}
+
+static void test_budget (void)
+{
+    setup(64, 64 * MTU);
+    
+    for (int i = 0; i < 40; i++) {
+        send_packet(6, 1000, 80, i, BULK_PAYLOAD, 0x10);
+    }
+    
+    run();
+    
+    // written over several rounds, in order
+    ASSERT_FORCE(num_out == 40)
+    for (int i = 0; i < 40; i++) {
+        expect(i, 6, 1000, i);
+    }
+}
+
+int main ()
+{
+    BLog_InitStderr();
+    BTime_Init();
+    
+    test_classify();
+    test_priority();
+    test_fairness();
+    test_demotion();
+    test_overflow();
+    test_byte_limit();
+    test_budget();
+    
+    printf("ok\n");
+    
+    BLog_Free();
+    return 0;
+}
@@ -0,0 +1,203 @@
+/**
+ * @file udpgwclient_bench.c
+ * 
+ * @section LICENSE
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the author nor the
+ *    names of its contributors may be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include <misc/debug.h>
+#include <base/BLog.h>
+#include <base/DebugObject.h>
+#include <system/BReactor.h>
+#include <system/BTime.h>
+#include <flow/StreamPassInterface.h>
+#include <flow/StreamRecvInterface.h>
+#include <udpgw_client/UdpGwClient.h>
+
+#define UDP_MTU 1500
+#define PACKET_LEN 100
+#define KEEPALIVE_TIME 10000
+
+static BReactor reactor;
+static UdpGwClient client;
+static StreamPassInterface send_if;
+static StreamRecvInterface recv_if;
+static uint64_t bytes_sent;
+static uint64_t num_writes;
+static int sink_pending_len;
+
+static void usage (char *name)
+{
+    printf(
+        "Usage: %s <max_connections> <num_flows> <num_packets> [burst]\n"
+        "    [burst] is the number of packets submitted before letting them flow (default 1).\n",
+        name
+    );
+    
+    exit(1);
+}
+
+static void client_handler_servererror (void *unused)
+{
+    DEBUG("server error");
+}
+
+static void client_handler_received (void *unused, BAddr local_addr, BAddr remote_addr, const uint8_t *data, int data_len)
+{
+}
+
+static void send_if_handler_send (void *unused, uint8_t *data, int data_len)
+{
+    ASSERT(sink_pending_len == 0)
+    
+    // discard everything the client sends to the server, but only complete
+    // the write once the pending jobs have run, like a socket would
+    bytes_sent += data_len;
+    num_writes++;
+    sink_pending_len = data_len;
+}
+
+static void send_if_handler_send_vec (void *unused, StreamPassInterface_iovec *vec, int vec_count)
+{
+    ASSERT(sink_pending_len == 0)
+    
+    // like send_if_handler_send, but for a gathered write
+    int len = 0;
+    for (int i = 0; i < vec_count; i++) {
+        len += vec[i].len;
+    }
+    bytes_sent += len;
+    num_writes++;
+    sink_pending_len = len;
+}
+
+static void run_pending (BPendingGroup *pg)
+{
+    do {
+        while (BPendingGroup_HasJobs(pg)) {
+            BPendingGroup_ExecuteJob(pg);
+        }
+        
+        if (sink_pending_len > 0) {
+            StreamPassInterface_Done(&send_if, sink_pending_len);
+            sink_pending_len = 0;
+        }
+    } while (BPendingGroup_HasJobs(pg));
+}
+
+static void recv_if_handler_recv (void *unused, uint8_t *data, int data_len)
+{
+    // never receive anything from the server
+}
+
+int main (int argc, char **argv)
+{
+    if (argc <= 0) {
+        return 1;
+    }
+    
+    if (argc != 4 && argc != 5) {
+        usage(argv[0]);
+    }
+    
+    int max_connections = atoi(argv[1]);
+    int num_flows = atoi(argv[2]);
+    int num_packets = atoi(argv[3]);
+    int burst = (argc == 5 ? atoi(argv[4]) : 1);
+    
+    if (max_connections <= 0 || num_flows <= 0 || num_flows > 65536 || num_packets < 0 || burst <= 0) {
+        usage(argv[0]);
+    }
+    
+    BLog_InitStdout();
+    
+    BTime_Init();
+    
+    if (!BReactor_Init(&reactor)) {
+        DEBUG("BReactor_Init failed");
+        goto fail0;
+    }
+    
+    BPendingGroup *pg = BReactor_PendingGroup(&reactor);
+    
+    if (!UdpGwClient_Init(&client, UDP_MTU, max_connections, burst, KEEPALIVE_TIME, &reactor, NULL,
+                          client_handler_servererror, client_handler_received)) {
+        DEBUG("UdpGwClient_Init failed");
+        goto fail1;
+    }
+    
+    StreamPassInterface_Init(&send_if, send_if_handler_send, NULL, pg);
+    StreamPassInterface_EnableVec(&send_if, send_if_handler_send_vec);
+    StreamRecvInterface_Init(&recv_if, recv_if_handler_recv, NULL, pg);
+    
+    if (!UdpGwClient_ConnectServer(&client, &send_if, &recv_if)) {
+        DEBUG("UdpGwClient_ConnectServer failed");
+        goto fail2;
+    }
+    
+    uint8_t data[PACKET_LEN];
+    memset(data, 0, sizeof(data));
+    
+    BAddr remote_addr;
+    BAddr_InitIPv4(&remote_addr, hton32(0x08080808), hton16(53));
+    
+    btime_t start = btime_gettime();
+    
+    for (int i = 0; i < num_packets; i++) {
+        // each flow is a distinct local port
+        int flow = i % num_flows;
+        BAddr local_addr;
+        BAddr_InitIPv4(&local_addr, hton32(0x0a000001 + flow / 65536), hton16(flow % 65536));
+        
+        UdpGwClient_SubmitPacket(&client, local_addr, remote_addr, 0, data, sizeof(data));
+        
+        // let the packets flow through to the sink
+        if ((i + 1) % burst == 0 || i + 1 == num_packets) {
+            run_pending(pg);
+        }
+    }
+    
+    btime_t elapsed = btime_gettime() - start;
+    
+    printf("flows %d, max connections %d, packets %d, burst %d, bytes %llu, writes %llu\n", num_flows, max_connections, num_packets, burst, (unsigned long long)bytes_sent, (unsigned long long)num_writes);
+    printf("elapsed %lld ms, %.0f packets/s\n", (long long)elapsed, (elapsed > 0 ? (double)num_packets * 1000 / elapsed : 0.0));
+    
+    UdpGwClient_DisconnectServer(&client);
+fail2:
+    StreamRecvInterface_Free(&recv_if);
+    StreamPassInterface_Free(&send_if);
+    UdpGwClient_Free(&client);
+fail1:
+    BReactor_Free(&reactor);
+fail0:
+    BLog_Free();
+    DebugObjectGlobal_Finish();
+    
+    return 0;
+}
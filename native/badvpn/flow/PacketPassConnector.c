@@ -33,6 +33,20 @@
 
 #include <flow/PacketPassConnector.h>
 
+static void send_input (PacketPassConnector *o)
+{
+    ASSERT(o->in_len >= 0)
+    ASSERT(o->output)
+    
+    if (o->in_num_packets > 0) {
+        // send what a previous output has not consumed
+        ASSERT(o->in_sent < o->in_num_packets)
+        PacketPassInterface_Sender_SendBatch(o->output, o->in_packets + o->in_sent, o->in_num_packets - o->in_sent);
+    } else {
+        PacketPassInterface_Sender_Send(o->output, o->in, o->in_len);
+    }
+}
+
 static void input_handler_send (PacketPassConnector *o, uint8_t *data, int data_len)
 {
     ASSERT(data_len >= 0)
@@ -43,10 +57,29 @@ static void input_handler_send (PacketPassConnector *o, uint8_t *data, int data_
     // remember input packet
     o->in_len = data_len;
     o->in = data;
+    o->in_num_packets = 0;
     
     if (o->output) {
         // schedule send
-        PacketPassInterface_Sender_Send(o->output, o->in, o->in_len);
+        send_input(o);
+    }
+}
+
+static void input_handler_send_batch (PacketPassConnector *o, PacketPassInterface_packet *packets, int num_packets)
+{
+    ASSERT(num_packets > 0)
+    ASSERT(o->in_len == -1)
+    DebugObject_Access(&o->d_obj);
+    
+    // remember input batch
+    o->in_len = 0;
+    o->in_packets = packets;
+    o->in_num_packets = num_packets;
+    o->in_sent = 0;
+    
+    if (o->output) {
+        // schedule send
+        send_input(o);
     }
 }
 
@@ -72,6 +105,7 @@ void PacketPassConnector_Init (PacketPassConnector *o, int mtu, BPendingGroup *p
     
     // init input
     PacketPassInterface_Init(&o->input, o->input_mtu, (PacketPassInterface_handler_send)input_handler_send, o, pg);
+    PacketPassInterface_EnableBatch(&o->input, (PacketPassInterface_handler_send_batch)input_handler_send_batch);
     
     // have no input packet
     o->in_len = -1;
@@ -111,7 +145,7 @@ void PacketPassConnector_ConnectOutput (PacketPassConnector *o, PacketPassInterf
     
     // if we have an input packet, schedule send
     if (o->in_len >= 0) {
-        PacketPassInterface_Sender_Send(o->output, o->in, o->in_len);
+        send_input(o);
     }
 }
 
@@ -120,6 +154,17 @@ void PacketPassConnector_DisconnectOutput (PacketPassConnector *o)
     ASSERT(o->output)
     DebugObject_Access(&o->d_obj);
     
+    // remember how much of the input batch the output has consumed
+    if (o->in_len >= 0 && o->in_num_packets > 0) {
+        o->in_sent += PacketPassInterface_Sender_GetBatchProgress(o->output);
+        
+        // if it consumed all of it but done did not arrive, report done ourselves
+        if (o->in_sent == o->in_num_packets) {
+            o->in_len = -1;
+            PacketPassInterface_Done(&o->input);
+        }
+    }
+    
     // set no output
     o->output = NULL;
 }
@@ -30,6 +30,8 @@
  * 
  * A {@link PacketPassInterface} layer which allows the output to be
  * connected and disconnected on the fly.
+ * The input always accepts batches; if the connected output does not
+ * support them natively, they are passed to it one packet at a time.
  */
 
 #ifndef BADVPN_FLOW_PACKETPASSCONNECTOR_H
@@ -49,6 +51,9 @@ typedef struct {
     int input_mtu;
     int in_len;
     uint8_t *in;
+    PacketPassInterface_packet *in_packets;
+    int in_num_packets;
+    int in_sent;
     PacketPassInterface *output;
     DebugObject d_obj;
 } PacketPassConnector;
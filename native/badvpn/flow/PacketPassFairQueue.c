@@ -51,8 +51,8 @@ static int compare_flows (PacketPassFairQueueFlow *f1, PacketPassFairQueueFlow *
 
 static uint64_t get_current_time (PacketPassFairQueue *m)
 {
-    if (m->sending_flow) {
-        return m->sending_flow->time;
+    if (m->num_sending > 0) {
+        return m->sending_flows[0]->time;
     }
     
     uint64_t time = 0; // to remove warning
@@ -82,7 +82,8 @@ static void increment_sent_flow (PacketPassFairQueueFlow *flow, uint64_t amount)
     
     ASSERT(amount <= FAIRQUEUE_MAX_TIME)
     ASSERT(!flow->is_queued)
-    ASSERT(!m->sending_flow)
+    ASSERT(!flow->is_sending)
+    ASSERT(m->num_sending == 0)
     
     // does time overflow?
     if (amount > FAIRQUEUE_MAX_TIME - flow->time) {
@@ -117,28 +118,41 @@ static void increment_sent_flow (PacketPassFairQueueFlow *flow, uint64_t amount)
 
 static void schedule (PacketPassFairQueue *m)
 {
-    ASSERT(!m->sending_flow)
+    ASSERT(m->num_sending == 0)
     ASSERT(!m->previous_flow)
     ASSERT(!m->freeing)
     ASSERT(!PacketPassFairQueue__Tree_IsEmpty(&m->queued_tree))
     
-    // get first queued flow
-    PacketPassFairQueueFlow *qflow = PacketPassFairQueue__Tree_GetFirst(&m->queued_tree, 0);
-    ASSERT(qflow->is_queued)
-    
-    // remove flow from queue
-    PacketPassFairQueue__Tree_Remove(&m->queued_tree, 0, qflow);
-    qflow->is_queued = 0;
+    // take queued flows in order, up to the batch size
+    do {
+        // get first queued flow
+        PacketPassFairQueueFlow *qflow = PacketPassFairQueue__Tree_GetFirst(&m->queued_tree, 0);
+        ASSERT(qflow->is_queued)
+        ASSERT(!qflow->is_sending)
+        
+        // remove flow from queue
+        PacketPassFairQueue__Tree_Remove(&m->queued_tree, 0, qflow);
+        qflow->is_queued = 0;
+        
+        // add flow to sending flows
+        qflow->is_sending = 1;
+        m->sending_flows[m->num_sending] = qflow;
+        m->sending_packets[m->num_sending].data = qflow->queued.data;
+        m->sending_packets[m->num_sending].len = qflow->queued.data_len;
+        m->num_sending++;
+    } while (m->num_sending < m->max_batch && !PacketPassFairQueue__Tree_IsEmpty(&m->queued_tree));
     
     // schedule send
-    PacketPassInterface_Sender_Send(m->output, qflow->queued.data, qflow->queued.data_len);
-    m->sending_flow = qflow;
-    m->sending_len = qflow->queued.data_len;
+    if (m->num_sending == 1) {
+        PacketPassInterface_Sender_Send(m->output, m->sending_packets[0].data, m->sending_packets[0].len);
+    } else {
+        PacketPassInterface_Sender_SendBatch(m->output, m->sending_packets, m->num_sending);
+    }
 }
 
 static void schedule_job_handler (PacketPassFairQueue *m)
 {
-    ASSERT(!m->sending_flow)
+    ASSERT(m->num_sending == 0)
     ASSERT(!m->freeing)
     DebugObject_Access(&m->d_obj);
     
@@ -154,7 +168,7 @@ static void input_handler_send (PacketPassFairQueueFlow *flow, uint8_t *data, in
 {
     PacketPassFairQueue *m = flow->m;
     
-    ASSERT(flow != m->sending_flow)
+    ASSERT(!flow->is_sending)
     ASSERT(!flow->is_queued)
     ASSERT(!m->freeing)
     DebugObject_Access(&flow->d_obj);
@@ -174,45 +188,73 @@ static void input_handler_send (PacketPassFairQueueFlow *flow, uint8_t *data, in
     ASSERT_EXECUTE(res)
     flow->is_queued = 1;
     
-    if (!m->sending_flow && !BPending_IsSet(&m->schedule_job)) {
+    if (m->num_sending == 0 && !BPending_IsSet(&m->schedule_job)) {
         schedule(m);
     }
 }
 
 static void output_handler_done (PacketPassFairQueue *m)
 {
-    ASSERT(m->sending_flow)
+    ASSERT(m->num_sending > 0)
     ASSERT(!m->previous_flow)
     ASSERT(!BPending_IsSet(&m->schedule_job))
     ASSERT(!m->freeing)
-    ASSERT(!m->sending_flow->is_queued)
     
-    PacketPassFairQueueFlow *flow = m->sending_flow;
+    int num_sent = m->num_sending;
+    PacketPassFairQueueFlow *finishing[FAIRQUEUE_MAX_BATCH];
     
     // sending finished
-    m->sending_flow = NULL;
+    m->num_sending = 0;
     
-    // remember this flow so the schedule job can remove its time if it didn's send
-    m->previous_flow = flow;
+    for (int i = 0; i < num_sent; i++) {
+        PacketPassFairQueueFlow *flow = m->sending_flows[i];
+        ASSERT(flow->is_sending)
+        ASSERT(!flow->is_queued)
+        
+        flow->is_sending = 0;
+        
+        // update flow time by packet size
+        increment_sent_flow(flow, (uint64_t)m->packet_weight + m->sending_packets[i].len);
+    }
     
-    // update flow time by packet size
-    increment_sent_flow(flow, (uint64_t)m->packet_weight + m->sending_len);
+    // remember the last flow served, which the current time follows; the schedule job
+    // removes it if it didn't send again
+    m->previous_flow = m->sending_flows[num_sent - 1];
     
     // schedule schedule
     BPending_Set(&m->schedule_job);
     
-    // finish flow packet
-    PacketPassInterface_Done(&flow->input);
+    for (int i = 0; i < num_sent; i++) {
+        PacketPassFairQueueFlow *flow = m->sending_flows[i];
+        
+        // finish flow packet
+        PacketPassInterface_Done(&flow->input);
+        
+        // remember flow for calling its busy handler
+        finishing[i] = flow;
+        flow->is_finishing = 1;
+    }
     
-    // call busy handler if set
-    if (flow->handler_busy) {
-        // handler is one-shot, unset it before calling
-        PacketPassFairQueue_handler_busy handler = flow->handler_busy;
-        flow->handler_busy = NULL;
+    // a handler may free flows whose handlers are yet to be called, which removes
+    // them from the finishing flows; the queue itself is not accessed from here on,
+    // since it may be freed once all flows are
+    m->finishing_flows = finishing;
+    m->num_finishing = num_sent;
+    
+    for (int i = 0; i < num_sent; i++) {
+        PacketPassFairQueueFlow *flow = finishing[i];
+        if (!flow) {
+            continue;
+        }
+        
+        flow->is_finishing = 0;
         
-        // call handler
-        handler(flow->user);
-        return;
+        // call busy handler if set; handler is one-shot, unset it
+        if (flow->handler_busy) {
+            PacketPassFairQueue_handler_busy handler = flow->handler_busy;
+            flow->handler_busy = NULL;
+            handler(flow->user);
+        }
     }
 }
 
@@ -239,8 +281,14 @@ int PacketPassFairQueue_Init (PacketPassFairQueue *m, PacketPassInterface *outpu
     // init output
     PacketPassInterface_Sender_Init(m->output, (PacketPassInterface_handler_done)output_handler_done, m);
     
+    // pass batches only if the output supports them natively; batches can't be cancelled
+    m->max_batch = (!m->use_cancel && PacketPassInterface_HasBatch(m->output)) ? FAIRQUEUE_MAX_BATCH : 1;
+    
     // not sending
-    m->sending_flow = NULL;
+    m->num_sending = 0;
+    
+    // no finishing flows
+    m->num_finishing = 0;
     
     // no previous flow
     m->previous_flow = NULL;
@@ -270,7 +318,11 @@ void PacketPassFairQueue_Free (PacketPassFairQueue *m)
     ASSERT(LinkedList1_IsEmpty(&m->flows_list))
     ASSERT(PacketPassFairQueue__Tree_IsEmpty(&m->queued_tree))
     ASSERT(!m->previous_flow)
-    ASSERT(!m->sending_flow)
+#ifndef NDEBUG
+    for (int i = 0; i < m->num_sending; i++) {
+        ASSERT(!m->sending_flows[i])
+    }
+#endif
     DebugCounter_Free(&m->d_ctr);
     DebugObject_Free(&m->d_obj);
     
@@ -316,6 +368,12 @@ void PacketPassFairQueueFlow_Init (PacketPassFairQueueFlow *flow, PacketPassFair
     // is not queued
     flow->is_queued = 0;
     
+    // is not sending
+    flow->is_sending = 0;
+    
+    // is not finishing
+    flow->is_finishing = 0;
+    
     DebugObject_Init(&flow->d_obj);
     DebugCounter_Increment(&m->d_ctr);
 }
@@ -324,13 +382,26 @@ void PacketPassFairQueueFlow_Free (PacketPassFairQueueFlow *flow)
 {
     PacketPassFairQueue *m = flow->m;
     
-    ASSERT(m->freeing || flow != m->sending_flow)
+    ASSERT(m->freeing || !flow->is_sending)
     DebugCounter_Decrement(&m->d_ctr);
     DebugObject_Free(&flow->d_obj);
     
-    // remove from current flow
-    if (flow == m->sending_flow) {
-        m->sending_flow = NULL;
+    // remove from sending flows
+    if (flow->is_sending) {
+        for (int i = 0; i < m->num_sending; i++) {
+            if (m->sending_flows[i] == flow) {
+                m->sending_flows[i] = NULL;
+            }
+        }
+    }
+    
+    // remove from finishing flows
+    if (flow->is_finishing) {
+        for (int i = 0; i < m->num_finishing; i++) {
+            if (m->finishing_flows[i] == flow) {
+                m->finishing_flows[i] = NULL;
+            }
+        }
     }
     
     // remove from previous flow
@@ -355,25 +426,26 @@ void PacketPassFairQueueFlow_AssertFree (PacketPassFairQueueFlow *flow)
     PacketPassFairQueue *m = flow->m;
     B_USE(m)
     
-    ASSERT(m->freeing || flow != m->sending_flow)
+    ASSERT(m->freeing || !flow->is_sending)
     DebugObject_Access(&flow->d_obj);
 }
 
 int PacketPassFairQueueFlow_IsBusy (PacketPassFairQueueFlow *flow)
 {
     PacketPassFairQueue *m = flow->m;
+    B_USE(m)
     
     ASSERT(!m->freeing)
     DebugObject_Access(&flow->d_obj);
     
-    return (flow == m->sending_flow);
+    return flow->is_sending;
 }
 
 void PacketPassFairQueueFlow_RequestCancel (PacketPassFairQueueFlow *flow)
 {
     PacketPassFairQueue *m = flow->m;
     
-    ASSERT(flow == m->sending_flow)
+    ASSERT(flow->is_sending)
     ASSERT(m->use_cancel)
     ASSERT(!m->freeing)
     ASSERT(!BPending_IsSet(&m->schedule_job))
@@ -388,7 +460,7 @@ void PacketPassFairQueueFlow_SetBusyHandler (PacketPassFairQueueFlow *flow, Pack
     PacketPassFairQueue *m = flow->m;
     B_USE(m)
     
-    ASSERT(flow == m->sending_flow)
+    ASSERT(flow->is_sending)
     ASSERT(!m->freeing)
     DebugObject_Access(&flow->d_obj);
     
@@ -47,6 +47,9 @@
 // reduce this to test time overflow handling
 #define FAIRQUEUE_MAX_TIME UINT64_MAX
 
+// maximum number of packets passed to a batch-capable output at once
+#define FAIRQUEUE_MAX_BATCH 16
+
 typedef void (*PacketPassFairQueue_handler_busy) (void *user);
 
 struct PacketPassFairQueueFlow_s;
@@ -62,6 +65,8 @@ typedef struct PacketPassFairQueueFlow_s {
     uint64_t time;
     LinkedList1Node list_node;
     int is_queued;
+    int is_sending;
+    int is_finishing;
     struct {
         PacketPassFairQueue__TreeNode tree_node;
         uint8_t *data;
@@ -78,8 +83,12 @@ typedef struct PacketPassFairQueue_s {
     BPendingGroup *pg;
     int use_cancel;
     int packet_weight;
-    struct PacketPassFairQueueFlow_s *sending_flow;
-    int sending_len;
+    int max_batch;
+    struct PacketPassFairQueueFlow_s *sending_flows[FAIRQUEUE_MAX_BATCH];
+    PacketPassInterface_packet sending_packets[FAIRQUEUE_MAX_BATCH];
+    int num_sending;
+    struct PacketPassFairQueueFlow_s **finishing_flows;
+    int num_finishing;
     struct PacketPassFairQueueFlow_s *previous_flow;
     PacketPassFairQueue__Tree queued_tree;
     LinkedList1 flows_list;
@@ -97,6 +106,9 @@ typedef struct PacketPassFairQueue_s {
  * @param pg pending group
  * @param use_cancel whether cancel functionality is required. Must be 0 or 1.
  *                   If 1, output must support cancel functionality.
+ *                   If 0 and the output supports batches, packets queued from
+ *                   different flows are passed to it in batches of up to
+ *                   FAIRQUEUE_MAX_BATCH packets.
  * @param packet_weight additional weight a packet bears. Must be >0, to keep
  *                      the queue fair for zero size packets.
  * @return 1 on success, 0 on failure (because output MTU is too large)
@@ -160,7 +172,8 @@ void PacketPassFairQueueFlow_AssertFree (PacketPassFairQueueFlow *flow);
 
 /**
  * Determines if the flow is busy. If the flow is considered busy, it must not
- * be freed. At any given time, at most one flow will be indicated as busy.
+ * be freed. All flows whose packets were passed to the output in the same
+ * batch are indicated as busy; without batches, at most one flow is.
  * Queue must not be in freeing state.
  * Must not be called from queue calls to output.
  *
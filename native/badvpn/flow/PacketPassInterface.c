@@ -37,6 +37,12 @@ void _PacketPassInterface_job_operation (PacketPassInterface *i)
     // set state
     i->state = PPI_STATE_BUSY;
     
+    // call batch handler if this is a batch and the receiver supports it
+    if (i->job_operation_num > 0 && i->handler_operation_batch) {
+        i->handler_operation_batch(i->user_provider, i->job_operation_packets, i->job_operation_num);
+        return;
+    }
+    
     // call handler
     i->handler_operation(i->user_provider, i->job_operation_data, i->job_operation_len);
     return;
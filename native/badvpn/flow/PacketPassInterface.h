@@ -29,6 +29,14 @@
  * @section DESCRIPTION
  * 
  * Interface allowing a packet sender to pass data packets to a packet receiver.
+ * 
+ * The interface optionally supports passing a batch of packets in a single
+ * operation, finished with a single done. If the receiver does not implement
+ * batches natively, the interface passes the packets to it one by one and
+ * reports done to the sender after the last one. The sender can find out how
+ * many packets of an unfinished batch have been consumed, so that it can resume
+ * with the rest if it has to give up on this receiver; receivers implementing
+ * batches natively report that with PacketPassInterface_BatchPacketDone.
  */
 
 #ifndef BADVPN_FLOW_PACKETPASSINTERFACE_H
@@ -52,11 +60,19 @@ typedef void (*PacketPassInterface_handler_requestcancel) (void *user);
 
 typedef void (*PacketPassInterface_handler_done) (void *user);
 
+typedef struct {
+    uint8_t *data;
+    int len;
+} PacketPassInterface_packet;
+
+typedef void (*PacketPassInterface_handler_send_batch) (void *user, PacketPassInterface_packet *packets, int num_packets);
+
 typedef struct {
     // provider data
     int mtu;
     PacketPassInterface_handler_send handler_operation;
     PacketPassInterface_handler_requestcancel handler_requestcancel;
+    PacketPassInterface_handler_send_batch handler_operation_batch;
     void *user_provider;
     
     // user data
@@ -67,6 +83,9 @@ typedef struct {
     BPending job_operation;
     uint8_t *job_operation_data;
     int job_operation_len;
+    PacketPassInterface_packet *job_operation_packets;
+    int job_operation_num;
+    int job_operation_pos;
     
     // requestcancel job
     BPending job_requestcancel;
@@ -87,18 +106,28 @@ static void PacketPassInterface_Free (PacketPassInterface *i);
 
 static void PacketPassInterface_EnableCancel (PacketPassInterface *i, PacketPassInterface_handler_requestcancel handler_requestcancel);
 
+static void PacketPassInterface_EnableBatch (PacketPassInterface *i, PacketPassInterface_handler_send_batch handler_operation_batch);
+
 static void PacketPassInterface_Done (PacketPassInterface *i);
 
+static void PacketPassInterface_BatchPacketDone (PacketPassInterface *i);
+
 static int PacketPassInterface_GetMTU (PacketPassInterface *i);
 
 static void PacketPassInterface_Sender_Init (PacketPassInterface *i, PacketPassInterface_handler_done handler_done, void *user);
 
 static void PacketPassInterface_Sender_Send (PacketPassInterface *i, uint8_t *data, int data_len);
 
+static void PacketPassInterface_Sender_SendBatch (PacketPassInterface *i, PacketPassInterface_packet *packets, int num_packets);
+
 static void PacketPassInterface_Sender_RequestCancel (PacketPassInterface *i);
 
+static int PacketPassInterface_Sender_GetBatchProgress (PacketPassInterface *i);
+
 static int PacketPassInterface_HasCancel (PacketPassInterface *i);
 
+static int PacketPassInterface_HasBatch (PacketPassInterface *i);
+
 void _PacketPassInterface_job_operation (PacketPassInterface *i);
 void _PacketPassInterface_job_requestcancel (PacketPassInterface *i);
 void _PacketPassInterface_job_done (PacketPassInterface *i);
@@ -111,6 +140,7 @@ void PacketPassInterface_Init (PacketPassInterface *i, int mtu, PacketPassInterf
     i->mtu = mtu;
     i->handler_operation = handler_operation;
     i->handler_requestcancel = NULL;
+    i->handler_operation_batch = NULL;
     i->user_provider = user;
     
     // set no user
@@ -146,6 +176,15 @@ void PacketPassInterface_EnableCancel (PacketPassInterface *i, PacketPassInterfa
     i->handler_requestcancel = handler_requestcancel;
 }
 
+void PacketPassInterface_EnableBatch (PacketPassInterface *i, PacketPassInterface_handler_send_batch handler_operation_batch)
+{
+    ASSERT(!i->handler_operation_batch)
+    ASSERT(!i->handler_done)
+    ASSERT(handler_operation_batch)
+    
+    i->handler_operation_batch = handler_operation_batch;
+}
+
 void PacketPassInterface_Done (PacketPassInterface *i)
 {
     ASSERT(i->state == PPI_STATE_BUSY)
@@ -154,6 +193,16 @@ void PacketPassInterface_Done (PacketPassInterface *i)
     // unset requestcancel job
     BPending_Unset(&i->job_requestcancel);
     
+    // if we're passing a batch one packet at a time, continue with the next packet
+    if (i->job_operation_num > 0 && !i->handler_operation_batch && i->job_operation_pos < i->job_operation_num - 1) {
+        i->job_operation_pos++;
+        i->job_operation_data = i->job_operation_packets[i->job_operation_pos].data;
+        i->job_operation_len = i->job_operation_packets[i->job_operation_pos].len;
+        BPending_Set(&i->job_operation);
+        i->state = PPI_STATE_OPERATION_PENDING;
+        return;
+    }
+    
     // schedule done
     BPending_Set(&i->job_done);
     
@@ -161,6 +210,17 @@ void PacketPassInterface_Done (PacketPassInterface *i)
     i->state = PPI_STATE_DONE_PENDING;
 }
 
+void PacketPassInterface_BatchPacketDone (PacketPassInterface *i)
+{
+    ASSERT(i->state == PPI_STATE_BUSY)
+    ASSERT(i->handler_operation_batch)
+    ASSERT(i->job_operation_num > 0)
+    ASSERT(i->job_operation_pos < i->job_operation_num - 1)
+    DebugObject_Access(&i->d_obj);
+    
+    i->job_operation_pos++;
+}
+
 int PacketPassInterface_GetMTU (PacketPassInterface *i)
 {
     DebugObject_Access(&i->d_obj);
@@ -190,6 +250,35 @@ void PacketPassInterface_Sender_Send (PacketPassInterface *i, uint8_t *data, int
     // schedule operation
     i->job_operation_data = data;
     i->job_operation_len = data_len;
+    i->job_operation_num = 0;
+    BPending_Set(&i->job_operation);
+    
+    // set state
+    i->state = PPI_STATE_OPERATION_PENDING;
+    i->cancel_requested = 0;
+}
+
+void PacketPassInterface_Sender_SendBatch (PacketPassInterface *i, PacketPassInterface_packet *packets, int num_packets)
+{
+    ASSERT(num_packets > 0)
+    ASSERT(packets)
+    ASSERT(i->state == PPI_STATE_NONE)
+    ASSERT(i->handler_done)
+    DebugObject_Access(&i->d_obj);
+#ifndef NDEBUG
+    for (int j = 0; j < num_packets; j++) {
+        ASSERT(packets[j].len >= 0)
+        ASSERT(packets[j].len <= i->mtu)
+        ASSERT(!(packets[j].len > 0) || packets[j].data)
+    }
+#endif
+    
+    // schedule operation
+    i->job_operation_data = packets[0].data;
+    i->job_operation_len = packets[0].len;
+    i->job_operation_packets = packets;
+    i->job_operation_num = num_packets;
+    i->job_operation_pos = 0;
     BPending_Set(&i->job_operation);
     
     // set state
@@ -201,6 +290,7 @@ void PacketPassInterface_Sender_RequestCancel (PacketPassInterface *i)
 {
     ASSERT(i->state == PPI_STATE_OPERATION_PENDING || i->state == PPI_STATE_BUSY || i->state == PPI_STATE_DONE_PENDING)
     ASSERT(i->handler_requestcancel)
+    ASSERT(i->job_operation_num == 0)
     DebugObject_Access(&i->d_obj);
     
     // ignore multiple cancel requests
@@ -226,6 +316,20 @@ void PacketPassInterface_Sender_RequestCancel (PacketPassInterface *i)
     }
 }
 
+int PacketPassInterface_Sender_GetBatchProgress (PacketPassInterface *i)
+{
+    ASSERT(i->state == PPI_STATE_OPERATION_PENDING || i->state == PPI_STATE_BUSY || i->state == PPI_STATE_DONE_PENDING)
+    ASSERT(i->job_operation_num > 0)
+    DebugObject_Access(&i->d_obj);
+    
+    // all packets are consumed once done is pending
+    if (i->state == PPI_STATE_DONE_PENDING) {
+        return i->job_operation_num;
+    }
+    
+    return i->job_operation_pos;
+}
+
 int PacketPassInterface_HasCancel (PacketPassInterface *i)
 {
     DebugObject_Access(&i->d_obj);
@@ -233,4 +337,11 @@ int PacketPassInterface_HasCancel (PacketPassInterface *i)
     return !!i->handler_requestcancel;
 }
 
+int PacketPassInterface_HasBatch (PacketPassInterface *i)
+{
+    DebugObject_Access(&i->d_obj);
+    
+    return !!i->handler_operation_batch;
+}
+
 #endif
@@ -37,9 +37,34 @@ static void send_data (PacketStreamSender *s)
 {
     ASSERT(s->in_len >= 0)
     
+    // skip over finished packets of the input batch
+    while (s->in_used == s->in_len && s->in_packet_index < s->in_num_packets - 1) {
+        PacketPassInterface_BatchPacketDone(&s->input);
+        s->in_packet_index++;
+        s->in = s->in_packets[s->in_packet_index].data;
+        s->in_len = s->in_packets[s->in_packet_index].len;
+        s->in_used = 0;
+    }
+    
     if (s->in_used < s->in_len) {
-        // send more data
-        StreamPassInterface_Sender_Send(s->output, s->in + s->in_used, s->in_len - s->in_used);
+        if (s->use_vec && s->in_packet_index < s->in_num_packets - 1) {
+            // send the rest of this packet and the following packets at once
+            int count = 0;
+            s->out_vec[count].data = s->in + s->in_used;
+            s->out_vec[count].len = s->in_len - s->in_used;
+            count++;
+            for (int i = s->in_packet_index + 1; i < s->in_num_packets && count < PACKETSTREAMSENDER_MAX_IOVEC; i++) {
+                if (s->in_packets[i].len > 0) {
+                    s->out_vec[count].data = s->in_packets[i].data;
+                    s->out_vec[count].len = s->in_packets[i].len;
+                    count++;
+                }
+            }
+            StreamPassInterface_Sender_SendVec(s->output, s->out_vec, count);
+        } else {
+            // send more data
+            StreamPassInterface_Sender_Send(s->output, s->in + s->in_used, s->in_len - s->in_used);
+        }
     } else {
         // finish input packet
         s->in_len = -1;
@@ -57,6 +82,26 @@ static void input_handler_send (PacketStreamSender *s, uint8_t *data, int data_l
     s->in_len = data_len;
     s->in = data;
     s->in_used = 0;
+    s->in_num_packets = 0;
+    s->in_packet_index = 0;
+    
+    // send
+    send_data(s);
+}
+
+static void input_handler_send_batch (PacketStreamSender *s, PacketPassInterface_packet *packets, int num_packets)
+{
+    ASSERT(s->in_len == -1)
+    ASSERT(num_packets > 0)
+    DebugObject_Access(&s->d_obj);
+    
+    // set input batch, starting with the first packet
+    s->in_packets = packets;
+    s->in_num_packets = num_packets;
+    s->in_packet_index = 0;
+    s->in_len = packets[0].len;
+    s->in = packets[0].data;
+    s->in_used = 0;
     
     // send
     send_data(s);
@@ -66,10 +111,18 @@ static void output_handler_done (PacketStreamSender *s, int data_len)
 {
     ASSERT(s->in_len >= 0)
     ASSERT(data_len > 0)
-    ASSERT(data_len <= s->in_len - s->in_used)
     DebugObject_Access(&s->d_obj);
     
-    // update number of bytes sent
+    // update number of bytes sent, which may span multiple packets of the batch
+    while (data_len > s->in_len - s->in_used) {
+        ASSERT(s->in_packet_index < s->in_num_packets - 1)
+        data_len -= s->in_len - s->in_used;
+        PacketPassInterface_BatchPacketDone(&s->input);
+        s->in_packet_index++;
+        s->in = s->in_packets[s->in_packet_index].data;
+        s->in_len = s->in_packets[s->in_packet_index].len;
+        s->in_used = 0;
+    }
     s->in_used += data_len;
     
     // send
@@ -85,10 +138,14 @@ void PacketStreamSender_Init (PacketStreamSender *s, StreamPassInterface *output
     
     // init input
     PacketPassInterface_Init(&s->input, mtu, (PacketPassInterface_handler_send)input_handler_send, s, pg);
+    PacketPassInterface_EnableBatch(&s->input, (PacketPassInterface_handler_send_batch)input_handler_send_batch);
     
     // init output
     StreamPassInterface_Sender_Init(s->output, (StreamPassInterface_handler_done)output_handler_done, s);
     
+    // send batches as vectors if the output supports it
+    s->use_vec = StreamPassInterface_HasVec(s->output);
+    
     // have no input packet
     s->in_len = -1;
     
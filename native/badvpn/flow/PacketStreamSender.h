@@ -30,6 +30,8 @@
  * 
  * Object which forwards packets obtained with {@link PacketPassInterface}
  * as a stream with {@link StreamPassInterface} (i.e. it concatenates them).
+ * The input accepts batches of packets natively. If the output accepts
+ * vectors, the remaining data of a batch is passed to it as one vector.
  */
 
 #ifndef BADVPN_FLOW_PACKETSTREAMSENDER_H
@@ -41,6 +43,8 @@
 #include <flow/PacketPassInterface.h>
 #include <flow/StreamPassInterface.h>
 
+#define PACKETSTREAMSENDER_MAX_IOVEC 16
+
 /**
  * Object which forwards packets obtained with {@link PacketPassInterface}
  * as a stream with {@link StreamPassInterface} (i.e. it concatenates them).
@@ -52,6 +56,11 @@ typedef struct {
     int in_len;
     uint8_t *in;
     int in_used;
+    PacketPassInterface_packet *in_packets;
+    int in_num_packets;
+    int in_packet_index;
+    int use_vec;
+    StreamPassInterface_iovec out_vec[PACKETSTREAMSENDER_MAX_IOVEC];
 } PacketStreamSender;
 
 /**
@@ -37,6 +37,17 @@ void _StreamPassInterface_job_operation (StreamPassInterface *i)
     // set state
     i->state = SPI_STATE_BUSY;
     
+    if (i->job_operation_vec_count > 0) {
+        // call vector handler if the receiver supports it
+        if (i->handler_operation_vec) {
+            i->handler_operation_vec(i->user_provider, i->job_operation_vec, i->job_operation_vec_count);
+            return;
+        }
+        
+        // otherwise pass just the first buffer
+        i->job_operation_len = i->job_operation_vec[0].len;
+    }
+    
     // call handler
     i->handler_operation(i->user_provider, i->job_operation_data, i->job_operation_len);
     return;
@@ -34,6 +34,11 @@
  * {@link StreamRecvInterface} if names and its external semantics are disregarded.
  * If you modify this file, you should probably modify {@link StreamRecvInterface}
  * too.
+ * 
+ * The interface optionally supports passing data as a vector of buffers, to
+ * be sent as if they were concatenated. If the receiver does not implement
+ * vectors natively, only the first buffer is passed to it, which is a valid
+ * partial send from the point of view of the sender.
  */
 
 #ifndef BADVPN_FLOW_STREAMPASSINTERFACE_H
@@ -41,6 +46,7 @@
 
 #include <stdint.h>
 #include <stddef.h>
+#include <limits.h>
 
 #include <misc/debug.h>
 #include <base/DebugObject.h>
@@ -55,9 +61,17 @@ typedef void (*StreamPassInterface_handler_send) (void *user, uint8_t *data, int
 
 typedef void (*StreamPassInterface_handler_done) (void *user, int data_len);
 
+typedef struct {
+    uint8_t *data;
+    int len;
+} StreamPassInterface_iovec;
+
+typedef void (*StreamPassInterface_handler_send_vec) (void *user, StreamPassInterface_iovec *vec, int vec_count);
+
 typedef struct {
     // provider data
     StreamPassInterface_handler_send handler_operation;
+    StreamPassInterface_handler_send_vec handler_operation_vec;
     void *user_provider;
     
     // user data
@@ -68,6 +82,8 @@ typedef struct {
     BPending job_operation;
     uint8_t *job_operation_data;
     int job_operation_len;
+    StreamPassInterface_iovec *job_operation_vec;
+    int job_operation_vec_count;
     
     // done job
     BPending job_done;
@@ -83,12 +99,18 @@ static void StreamPassInterface_Init (StreamPassInterface *i, StreamPassInterfac
 
 static void StreamPassInterface_Free (StreamPassInterface *i);
 
+static void StreamPassInterface_EnableVec (StreamPassInterface *i, StreamPassInterface_handler_send_vec handler_operation_vec);
+
+static int StreamPassInterface_HasVec (StreamPassInterface *i);
+
 static void StreamPassInterface_Done (StreamPassInterface *i, int data_len);
 
 static void StreamPassInterface_Sender_Init (StreamPassInterface *i, StreamPassInterface_handler_done handler_done, void *user);
 
 static void StreamPassInterface_Sender_Send (StreamPassInterface *i, uint8_t *data, int data_len);
 
+static void StreamPassInterface_Sender_SendVec (StreamPassInterface *i, StreamPassInterface_iovec *vec, int vec_count);
+
 void _StreamPassInterface_job_operation (StreamPassInterface *i);
 void _StreamPassInterface_job_done (StreamPassInterface *i);
 
@@ -96,6 +118,7 @@ void StreamPassInterface_Init (StreamPassInterface *i, StreamPassInterface_handl
 {
     // init arguments
     i->handler_operation = handler_operation;
+    i->handler_operation_vec = NULL;
     i->user_provider = user;
     
     // set no user
@@ -120,6 +143,22 @@ void StreamPassInterface_Free (StreamPassInterface *i)
     BPending_Free(&i->job_operation);
 }
 
+void StreamPassInterface_EnableVec (StreamPassInterface *i, StreamPassInterface_handler_send_vec handler_operation_vec)
+{
+    ASSERT(!i->handler_operation_vec)
+    ASSERT(!i->handler_done)
+    ASSERT(handler_operation_vec)
+    
+    i->handler_operation_vec = handler_operation_vec;
+}
+
+int StreamPassInterface_HasVec (StreamPassInterface *i)
+{
+    DebugObject_Access(&i->d_obj);
+    
+    return !!i->handler_operation_vec;
+}
+
 void StreamPassInterface_Done (StreamPassInterface *i, int data_len)
 {
     ASSERT(i->state == SPI_STATE_BUSY)
@@ -156,6 +195,35 @@ void StreamPassInterface_Sender_Send (StreamPassInterface *i, uint8_t *data, int
     // schedule operation
     i->job_operation_data = data;
     i->job_operation_len = data_len;
+    i->job_operation_vec_count = 0;
+    BPending_Set(&i->job_operation);
+    
+    // set state
+    i->state = SPI_STATE_OPERATION_PENDING;
+}
+
+void StreamPassInterface_Sender_SendVec (StreamPassInterface *i, StreamPassInterface_iovec *vec, int vec_count)
+{
+    ASSERT(vec_count > 0)
+    ASSERT(vec)
+    ASSERT(i->state == SPI_STATE_NONE)
+    ASSERT(i->handler_done)
+    DebugObject_Access(&i->d_obj);
+    
+    // compute total length, for checking the amount done
+    int total_len = 0;
+    for (int j = 0; j < vec_count; j++) {
+        ASSERT(vec[j].len > 0)
+        ASSERT(vec[j].data)
+        ASSERT(vec[j].len <= INT_MAX - total_len)
+        total_len += vec[j].len;
+    }
+    
+    // schedule operation
+    i->job_operation_data = vec[0].data;
+    i->job_operation_len = total_len;
+    i->job_operation_vec = vec;
+    i->job_operation_vec_count = vec_count;
     BPending_Set(&i->job_operation);
     
     // set state
@@ -40,6 +40,17 @@ static void input_handler_send (PacketPassInactivityMonitor *o, uint8_t *data, i
     BReactor_RemoveTimer(o->reactor, &o->timer);
 }
 
+static void input_handler_send_batch (PacketPassInactivityMonitor *o, PacketPassInterface_packet *packets, int num_packets)
+{
+    DebugObject_Access(&o->d_obj);
+    
+    // schedule send
+    PacketPassInterface_Sender_SendBatch(o->output, packets, num_packets);
+    
+    // stop timer
+    BReactor_RemoveTimer(o->reactor, &o->timer);
+}
+
 static void input_handler_requestcancel (PacketPassInactivityMonitor *o)
 {
     DebugObject_Access(&o->d_obj);
@@ -86,6 +97,9 @@ void PacketPassInactivityMonitor_Init (PacketPassInactivityMonitor *o, PacketPas
     if (PacketPassInterface_HasCancel(o->output)) {
         PacketPassInterface_EnableCancel(&o->input, (PacketPassInterface_handler_requestcancel)input_handler_requestcancel);
     }
+    if (PacketPassInterface_HasBatch(o->output)) {
+        PacketPassInterface_EnableBatch(&o->input, (PacketPassInterface_handler_send_batch)input_handler_send_batch);
+    }
     
     // init output
     PacketPassInterface_Sender_Init(o->output, (PacketPassInterface_handler_done)output_handler_done, o);
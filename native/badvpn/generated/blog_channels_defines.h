@@ -143,4 +143,7 @@
 #define BLOG_CHANNEL_BThreadSignal 142
 #define BLOG_CHANNEL_BLockReactor 143
 #define BLOG_CHANNEL_ncd_load_module 144
-#define BLOG_NUM_CHANNELS 145
+#define BLOG_CHANNEL_TunScheduler 145
+#define BLOG_CHANNEL_FakeDns 146
+#define BLOG_CHANNEL_ConnectScheduler 147
+#define BLOG_NUM_CHANNELS 148
@@ -143,3 +143,6 @@
 {"BThreadSignal", 4},
 {"BLockReactor", 4},
 {"ncd_load_module", 4},
+{"TunScheduler", 4},
+{"FakeDns", 4},
+{"ConnectScheduler", 4},
@@ -60,6 +60,7 @@
 
 #define MEMP_NUM_TCP_PCB_LISTEN 16
 #define MEMP_NUM_TCP_PCB 1024
+// defaults; tun2socks sets g_tcp_mss and g_tcp_snd_queuelen from the device MTU
 #define TCP_MSS 1460
 #define TCP_WND 65535
 #define TCP_SND_BUF 65535
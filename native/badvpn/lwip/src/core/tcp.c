@@ -60,6 +60,11 @@
 
 u16_t g_tcp_wnd = TCP_WND;
 u16_t g_tcp_snd_buf = TCP_SND_BUF;
+u16_t g_tcp_mss = TCP_MSS;
+u16_t g_tcp_snd_queuelen = TCP_SND_QUEUELEN;
+/* Set if the netif segments large TCP packets itself (GSO). Then the MSS
+   option from the peer is ignored and segments of up to g_tcp_mss are sent. */
+u8_t g_tcp_gso = 0;
 
 #ifndef TCP_LOCAL_PORT_RANGE_START
 /* From http://www.iana.org/assignments/port-numbers:
@@ -818,7 +823,7 @@ tcp_connect(struct tcp_pcb *pcb, ip_addr_t *ipaddr, u16_t port,
   pcb->snd_wnd = TCP_WND;
   /* As initial send MSS, we use TCP_MSS but limit it to 536.
      The send MSS is updated when an MSS option is received. */
-  pcb->mss = (TCP_MSS > 536) ? 536 : TCP_MSS;
+  pcb->mss = (g_tcp_mss > 536) ? 536 : g_tcp_mss;
 #if TCP_CALCULATE_EFF_SEND_MSS
   pcb->mss = tcp_eff_send_mss(pcb->mss, &pcb->local_ip, &pcb->remote_ip, PCB_ISIPV6(pcb));
 #endif /* TCP_CALCULATE_EFF_SEND_MSS */
@@ -1384,7 +1389,7 @@ tcp_alloc(u8_t prio)
     pcb->ttl = TCP_TTL;
     /* As initial send MSS, we use TCP_MSS but limit it to 536.
        The send MSS is updated when an MSS option is received. */
-    pcb->mss = (TCP_MSS > 536) ? 536 : TCP_MSS;
+    pcb->mss = (g_tcp_mss > 536) ? 536 : g_tcp_mss;
     pcb->rto = 3000 / TCP_SLOW_INTERVAL;
     pcb->sa = 0;
     pcb->sv = 3000 / TCP_SLOW_INTERVAL;
@@ -1703,7 +1708,9 @@ tcp_eff_send_mss_impl(u16_t sendmss, ipX_addr_t *dest
     mss_s = mtu - IP_HLEN - TCP_HLEN;
 #if LWIP_IPV6
     /* for IPv6, substract the difference in header size */
-    mss_s -= (IP6_HLEN - IP_HLEN);
+    if (isipv6) {
+      mss_s -= (IP6_HLEN - IP_HLEN);
+    }
 #endif /* LWIP_IPV6 */
     /* RFC 1122, chap 4.2.2.6:
      * Eff.snd.MSS = min(SendMSS+20, MMS_S) - TCPhdrsize - IPoptionsize
@@ -63,6 +63,8 @@
 #endif /* LWIP_ND6_TCP_REACHABILITY_HINTS */
 
 extern u16_t g_tcp_wnd;
+extern u16_t g_tcp_mss;
+extern u8_t g_tcp_gso;
 
 /* These variables are global to all functions involved in the input
    processing of TCP segments. They are set by the tcp_input()
@@ -137,8 +139,9 @@ tcp_input(struct pbuf *p, struct netif *inp)
   }
 
 #if CHECKSUM_CHECK_TCP
-  /* Verify TCP checksum. */
-  chksum = ipX_chksum_pseudo(ip_current_is_v6(), p, IP_PROTO_TCP, p->tot_len,
+  /* Verify TCP checksum, unless the netif has done so. */
+  chksum = (p->flags & PBUF_FLAG_CSUM_OK) ? 0 :
+           ipX_chksum_pseudo(ip_current_is_v6(), p, IP_PROTO_TCP, p->tot_len,
                              ipX_current_src_addr(), ipX_current_dest_addr());
   if (chksum != 0) {
       LWIP_DEBUGF(TCP_INPUT_DEBUG, ("tcp_input: packet discarded due to failing checksum 0x%04"X16_F"\n",
@@ -1623,8 +1626,8 @@ tcp_parseopt(struct tcp_pcb *pcb)
         }
         /* An MSS option with the right option length. */
         mss = (opts[c + 2] << 8) | opts[c + 3];
-        /* Limit the mss to the configured TCP_MSS and prevent division by zero */
-        pcb->mss = ((mss > TCP_MSS) || (mss == 0)) ? TCP_MSS : mss;
+        /* Limit the mss to the configured g_tcp_mss and prevent division by zero */
+        pcb->mss = ((mss > g_tcp_mss) || (mss == 0) || g_tcp_gso) ? g_tcp_mss : mss;
         /* Advance to next option */
         c += 0x04;
         break;
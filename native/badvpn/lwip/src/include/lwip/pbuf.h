@@ -82,6 +82,9 @@ typedef enum {
 #define PBUF_FLAG_LLMCAST   0x10U
 /** indicates this pbuf includes a TCP FIN flag */
 #define PBUF_FLAG_TCP_FIN   0x20U
+/** indicates the transport checksum of this received packet was verified by the
+    netif (or must not be verified because it was offloaded) */
+#define PBUF_FLAG_CSUM_OK   0x40U
 
 struct pbuf {
   /** next pbuf in singly linked pbuf chain */
@@ -45,7 +45,8 @@
 #define STATE_SENDING_REQUEST 4
 #define STATE_SENT_REQUEST 5
 #define STATE_RECEIVED_REPLY_HEADER 6
-#define STATE_UP 7
+#define STATE_RECEIVED_REPLY_NAME_LEN 7
+#define STATE_UP 8
 
 static void report_error (BSocksClient *o, int error);
 static void init_control_io (BSocksClient *o);
@@ -60,6 +61,9 @@ static void connection_handler (BSocksClient* o, int event);
 static void recv_handler_done (BSocksClient *o, int data_len);
 static void send_handler_done (BSocksClient *o);
 static void auth_finished (BSocksClient *p);
+static int init_common (BSocksClient *o,
+                        BAddr server_addr, const struct BSocksClient_auth_info *auth_info, size_t num_auth_info,
+                        BSocksClient_handler handler, void *user, BReactor *reactor);
 
 void report_error (BSocksClient *o, int error)
 {
@@ -334,6 +338,11 @@ void recv_handler_done (BSocksClient *o, int data_len)
                 case SOCKS_ATYP_IPV6:
                     addr_len = sizeof(struct socks_addr_ipv6);
                     break;
+                case SOCKS_ATYP_DOMAINNAME:
+                    // receive the name length first
+                    start_receive(o, (uint8_t *)o->buffer + sizeof(imsg), 1);
+                    o->state = STATE_RECEIVED_REPLY_NAME_LEN;
+                    return;
                 default:
                     BLog(BLOG_NOTICE, "reply has unknown address type");
                     goto fail;
@@ -346,6 +355,17 @@ void recv_handler_done (BSocksClient *o, int data_len)
             o->state = STATE_RECEIVED_REPLY_HEADER;
         } break;
         
+        case STATE_RECEIVED_REPLY_NAME_LEN: {
+            BLog(BLOG_DEBUG, "received reply name length");
+            
+            // receive name and port
+            uint8_t *name_len = (uint8_t *)o->buffer + sizeof(struct socks_reply_header);
+            start_receive(o, name_len + 1, *name_len + sizeof(uint16_t));
+            
+            // set state
+            o->state = STATE_RECEIVED_REPLY_HEADER;
+        } break;
+        
         case STATE_SENT_PASSWORD: {
             BLog(BLOG_DEBUG, "received password reply");
             
@@ -421,7 +441,10 @@ void send_handler_done (BSocksClient *o)
             // allocate buffer for receiving reply
             bsize_t size = bsize_add(
                 bsize_fromsize(sizeof(struct socks_reply_header)),
-                bsize_max(bsize_fromsize(sizeof(struct socks_addr_ipv4)), bsize_fromsize(sizeof(struct socks_addr_ipv6)))
+                bsize_max(
+                    bsize_max(bsize_fromsize(sizeof(struct socks_addr_ipv4)), bsize_fromsize(sizeof(struct socks_addr_ipv6))),
+                    bsize_fromsize(1 + UINT8_MAX + sizeof(uint16_t))
+                )
             );
             if (!reserve_buffer(o, size)) {
                 goto fail;
@@ -464,7 +487,11 @@ void auth_finished (BSocksClient *o)
 {
     // allocate request buffer
     bsize_t size = bsize_fromsize(sizeof(struct socks_request_header));
-    switch (o->dest_addr.type) {
+    size_t name_len = 0;
+    if (o->dest_name) {
+        name_len = strlen(o->dest_name);
+        size = bsize_add(size, bsize_fromsize(1 + name_len + sizeof(o->dest_port)));
+    } else switch (o->dest_addr.type) {
         case BADDR_TYPE_IPV4: size = bsize_add(size, bsize_fromsize(sizeof(struct socks_addr_ipv4))); break;
         case BADDR_TYPE_IPV6: size = bsize_add(size, bsize_fromsize(sizeof(struct socks_addr_ipv6))); break;
     }
@@ -478,7 +505,14 @@ void auth_finished (BSocksClient *o)
     header.ver = hton8(SOCKS_VERSION);
     header.cmd = hton8(SOCKS_CMD_CONNECT);
     header.rsv = hton8(0);
-    switch (o->dest_addr.type) {
+    if (o->dest_name) {
+        header.atyp = hton8(SOCKS_ATYP_DOMAINNAME);
+        char *ptr = o->buffer + sizeof(header);
+        *ptr++ = name_len;
+        memcpy(ptr, o->dest_name, name_len);
+        ptr += name_len;
+        memcpy(ptr, &o->dest_port, sizeof(o->dest_port));
+    } else switch (o->dest_addr.type) {
         case BADDR_TYPE_IPV4: {
             header.atyp = hton8(SOCKS_ATYP_IPV4);
             struct socks_addr_ipv4 addr;
@@ -523,12 +557,11 @@ struct BSocksClient_auth_info BSocksClient_auth_password (const char *username,
     return info;
 }
 
-int BSocksClient_Init (BSocksClient *o,
-                       BAddr server_addr, const struct BSocksClient_auth_info *auth_info, size_t num_auth_info,
-                       BAddr dest_addr, BSocksClient_handler handler, void *user, BReactor *reactor)
+int init_common (BSocksClient *o,
+                 BAddr server_addr, const struct BSocksClient_auth_info *auth_info, size_t num_auth_info,
+                 BSocksClient_handler handler, void *user, BReactor *reactor)
 {
     ASSERT(!BAddr_IsInvalid(&server_addr))
-    ASSERT(dest_addr.type == BADDR_TYPE_IPV4 || dest_addr.type == BADDR_TYPE_IPV6)
 #ifndef NDEBUG
     for (size_t i = 0; i < num_auth_info; i++) {
         ASSERT(auth_info[i].auth_type == SOCKS_METHOD_NO_AUTHENTICATION_REQUIRED ||
@@ -539,7 +572,6 @@ int BSocksClient_Init (BSocksClient *o,
     // init arguments
     o->auth_info = auth_info;
     o->num_auth_info = num_auth_info;
-    o->dest_addr = dest_addr;
     o->handler = handler;
     o->user = user;
     o->reactor = reactor;
@@ -564,6 +596,43 @@ fail0:
     return 0;
 }
 
+int BSocksClient_Init (BSocksClient *o,
+                       BAddr server_addr, const struct BSocksClient_auth_info *auth_info, size_t num_auth_info,
+                       BAddr dest_addr, BSocksClient_handler handler, void *user, BReactor *reactor)
+{
+    ASSERT(dest_addr.type == BADDR_TYPE_IPV4 || dest_addr.type == BADDR_TYPE_IPV6)
+    
+    o->dest_addr = dest_addr;
+    o->dest_name = NULL;
+    
+    return init_common(o, server_addr, auth_info, num_auth_info, handler, user, reactor);
+}
+
+int BSocksClient_InitName (BSocksClient *o,
+                           BAddr server_addr, const struct BSocksClient_auth_info *auth_info, size_t num_auth_info,
+                           const char *dest_name, uint16_t dest_port, BSocksClient_handler handler, void *user, BReactor *reactor)
+{
+    ASSERT(strlen(dest_name) > 0)
+    ASSERT(strlen(dest_name) <= UINT8_MAX)
+    
+    // copy name
+    size_t name_len = strlen(dest_name);
+    if (!(o->dest_name = (char *)BAlloc(name_len + 1))) {
+        BLog(BLOG_ERROR, "BAlloc failed");
+        return 0;
+    }
+    memcpy(o->dest_name, dest_name, name_len + 1);
+    o->dest_port = dest_port;
+    BAddr_InitNone(&o->dest_addr);
+    
+    if (!init_common(o, server_addr, auth_info, num_auth_info, handler, user, reactor)) {
+        BFree(o->dest_name);
+        return 0;
+    }
+    
+    return 1;
+}
+
 void BSocksClient_Free (BSocksClient *o)
 {
     DebugObject_Free(&o->d_obj);
@@ -589,6 +658,11 @@ void BSocksClient_Free (BSocksClient *o)
     if (o->buffer) {
         BFree(o->buffer);
     }
+    
+    // free name
+    if (o->dest_name) {
+        BFree(o->dest_name);
+    }
 }
 
 StreamPassInterface * BSocksClient_GetSendInterface (BSocksClient *o)
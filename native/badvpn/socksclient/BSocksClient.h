@@ -78,6 +78,8 @@ typedef struct {
     const struct BSocksClient_auth_info *auth_info;
     size_t num_auth_info;
     BAddr dest_addr;
+    char *dest_name;
+    uint16_t dest_port;
     BSocksClient_handler handler;
     void *user;
     BReactor *reactor;
@@ -119,6 +121,20 @@ int BSocksClient_Init (BSocksClient *o,
                        BAddr server_addr, const struct BSocksClient_auth_info *auth_info, size_t num_auth_info,
                        BAddr dest_addr, BSocksClient_handler handler, void *user, BReactor *reactor) WARN_UNUSED;
 
+/**
+ * Initializes the object, connecting to a host name instead of an address.
+ * The name is resolved by the SOCKS server.
+ * 
+ * Like {@link BSocksClient_Init}, except:
+ * @param dest_name remote host name. Must be null-terminated, non-empty and no longer
+ *                  than 255 characters. It is copied and need not remain valid.
+ * @param dest_port remote port, in network byte order
+ * @return 1 on success, 0 on failure
+ */
+int BSocksClient_InitName (BSocksClient *o,
+                           BAddr server_addr, const struct BSocksClient_auth_info *auth_info, size_t num_auth_info,
+                           const char *dest_name, uint16_t dest_port, BSocksClient_handler handler, void *user, BReactor *reactor) WARN_UNUSED;
+
 /**
  * Frees the object.
  * 
@@ -307,6 +307,8 @@ int BConnection_SetSendBuffer (BConnection *o, int buf_size);
 /**
  * Initializes the send interface for the connection.
  * The send interface must not be initialized.
+ * On Unix, the interface accepts vectors of buffers natively and sends
+ * them with a single writev() call.
  * 
  * @param o the object
  */
@@ -33,6 +33,7 @@
 #include <errno.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <sys/un.h>
 
 #include <misc/nonblocking.h>
@@ -86,6 +87,7 @@ static void connection_fd_handler (BConnection *o, int events);
 static void connection_send_job_handler (BConnection *o);
 static void connection_recv_job_handler (BConnection *o);
 static void connection_send_if_handler_send (BConnection *o, uint8_t *data, int data_len);
+static void connection_send_if_handler_send_vec (BConnection *o, StreamPassInterface_iovec *vec, int vec_count);
 static void connection_recv_if_handler_recv (BConnection *o, uint8_t *data, int data_len);
 
 static int build_unix_address (struct unix_addr *out, const char *socket_path)
@@ -252,7 +254,18 @@ static void connection_send (BConnection *o)
     }
     
     // send
-    int bytes = write(o->fd, o->send.busy_data, o->send.busy_data_len);
+    int bytes;
+    if (o->send.busy_vec_count > 0) {
+        struct iovec iov[BCONNECTION_SEND_MAX_IOVEC];
+        int iovcnt = (o->send.busy_vec_count < BCONNECTION_SEND_MAX_IOVEC ? o->send.busy_vec_count : BCONNECTION_SEND_MAX_IOVEC);
+        for (int i = 0; i < iovcnt; i++) {
+            iov[i].iov_base = o->send.busy_vec[i].data;
+            iov[i].iov_len = o->send.busy_vec[i].len;
+        }
+        bytes = writev(o->fd, iov, iovcnt);
+    } else {
+        bytes = write(o->fd, o->send.busy_data, o->send.busy_data_len);
+    }
     if (bytes < 0) {
         if (!o->is_hupd && (errno == EAGAIN || errno == EWOULDBLOCK)) {
             // wait for fd
@@ -405,6 +418,29 @@ static void connection_send_if_handler_send (BConnection *o, uint8_t *data, int
     // remember data
     o->send.busy_data = data;
     o->send.busy_data_len = data_len;
+    o->send.busy_vec_count = 0;
+    
+    // set busy
+    o->send.state = SEND_STATE_BUSY;
+    
+    connection_send(o);
+    return;
+}
+
+static void connection_send_if_handler_send_vec (BConnection *o, StreamPassInterface_iovec *vec, int vec_count)
+{
+    DebugObject_Access(&o->d_obj);
+    DebugError_AssertNoError(&o->d_err);
+    ASSERT(o->send.state == SEND_STATE_READY)
+    ASSERT(vec_count > 0)
+    
+    // remember data
+    o->send.busy_vec = vec;
+    o->send.busy_vec_count = vec_count;
+    o->send.busy_data_len = 0;
+    for (int i = 0; i < vec_count; i++) {
+        o->send.busy_data_len += vec[i].len;
+    }
     
     // set busy
     o->send.state = SEND_STATE_BUSY;
@@ -974,6 +1010,7 @@ void BConnection_SendAsync_Init (BConnection *o)
     
     // init interface
     StreamPassInterface_Init(&o->send.iface, (StreamPassInterface_handler_send)connection_send_if_handler_send, o, BReactor_PendingGroup(o->reactor));
+    StreamPassInterface_EnableVec(&o->send.iface, (StreamPassInterface_handler_send_vec)connection_send_if_handler_send_vec);
     
     // init job
     BPending_Init(&o->send.job, BReactor_PendingGroup(o->reactor), (BPending_handler)connection_send_job_handler, o);
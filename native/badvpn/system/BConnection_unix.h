@@ -31,6 +31,7 @@
 #include <base/DebugObject.h>
 
 #define BCONNECTION_SEND_LIMIT 2
+#define BCONNECTION_SEND_MAX_IOVEC 64
 #define BCONNECTION_RECV_LIMIT 2
 #define BCONNECTION_LISTEN_BACKLOG 128
 
@@ -72,6 +73,8 @@ struct BConnection_s {
         BPending job;
         const uint8_t *busy_data;
         int busy_data_len;
+        StreamPassInterface_iovec *busy_vec;
+        int busy_vec_count;
         int state;
     } send;
     struct {
@@ -184,6 +184,88 @@ static void set_epoll_fd_pointers (BReactor *bsys)
     }
 }
 
+static uint64_t epoll_get_time_us (void)
+{
+    struct timespec ts;
+    ASSERT_FORCE(clock_gettime(CLOCK_MONOTONIC, &ts) == 0)
+    return ((uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000);
+}
+
+static void epoll_flush_dirty (BReactor *bsys)
+{
+    // push accumulated event changes, skipping ones which were reverted
+    LinkedList1Node *list_node;
+    while ((list_node = LinkedList1_GetFirst(&bsys->epoll_dirty_list))) {
+        BFileDescriptor *bs = UPPER_OBJECT(list_node, BFileDescriptor, epoll_dirty_list_node);
+        ASSERT(bs->active)
+        ASSERT(bs->epoll_dirty)
+        
+        // remove from dirty list
+        LinkedList1_Remove(&bsys->epoll_dirty_list, &bs->epoll_dirty_list_node);
+        bs->epoll_dirty = 0;
+        
+        if (bs->waitEvents == bs->epoll_events) {
+            continue;
+        }
+        
+        // calculate epoll events
+        int eevents = 0;
+        if ((bs->waitEvents & BREACTOR_READ)) {
+            eevents |= EPOLLIN;
+        }
+        if ((bs->waitEvents & BREACTOR_WRITE)) {
+            eevents |= EPOLLOUT;
+        }
+        
+        // update epoll entry
+        struct epoll_event event;
+        memset(&event, 0, sizeof(event));
+        event.events = eevents;
+        event.data.ptr = bs;
+        ASSERT_FORCE(epoll_ctl(bsys->efd, EPOLL_CTL_MOD, bs->fd, &event) == 0)
+        
+        bs->epoll_events = bs->waitEvents;
+        bsys->stats.epoll_ctl_mods++;
+    }
+}
+
+static int epoll_busy_poll (BReactor *bsys, int have_timeout, btime_t timeout_rel)
+{
+    ASSERT(bsys->busy_poll_cur_us > 0)
+    
+    // don't poll past the first timer
+    uint64_t window = bsys->busy_poll_cur_us;
+    if (have_timeout && (btime_t)(window / 1000) >= timeout_rel) {
+        return 0;
+    }
+    
+    uint64_t start = epoll_get_time_us();
+    do {
+        bsys->stats.busy_polls++;
+        int waitres = epoll_wait(bsys->efd, bsys->epoll_results, BSYSTEM_MAX_RESULTS, 0);
+        if (waitres > 0) {
+            bsys->stats.busy_poll_hits++;
+            return waitres;
+        }
+    } while (epoll_get_time_us() - start < window);
+    
+    return 0;
+}
+
+static void epoll_adapt_busy_poll (BReactor *bsys, uint64_t idle_us)
+{
+    ASSERT(bsys->busy_poll_max_us > 0)
+    
+    // nothing arrived within the window; widen it if the idle gap was still
+    // short enough to be worth spinning over, otherwise back off
+    if (idle_us <= (uint64_t)bsys->busy_poll_max_us) {
+        int cur = 2 * bsys->busy_poll_cur_us + 1;
+        bsys->busy_poll_cur_us = (cur < bsys->busy_poll_max_us ? cur : bsys->busy_poll_max_us);
+    } else {
+        bsys->busy_poll_cur_us /= 2;
+    }
+}
+
 #endif
 
 #ifdef BADVPN_USE_KEVENT
@@ -287,10 +369,11 @@ static void wait_for_events (BReactor *bsys)
     ASSERT(bsys->poll_results_pos == bsys->poll_results_num)
     #endif
 
-    // clean up epoll results
+    // clean up epoll results, account time spent handling the previous ones
     #ifdef BADVPN_USE_EPOLL
     bsys->epoll_results_num = 0;
     bsys->epoll_results_pos = 0;
+    bsys->stats.handler_time_us += epoll_get_time_us() - bsys->last_wake_us;
     #endif
     
     // clean up kevent results
@@ -307,7 +390,7 @@ static void wait_for_events (BReactor *bsys)
     
     // timeout vars
     int have_timeout = 0;
-    btime_t timeout_abs;
+    btime_t timeout_abs = 0; // to remove warning
     btime_t now = 0; // to remove warning
     
     // compute timeout
@@ -382,9 +465,29 @@ static void wait_for_events (BReactor *bsys)
             }
         }
         
-        BLog(BLOG_DEBUG, "Calling epoll_wait");
+        // push event changes made since the last wait
+        epoll_flush_dirty(bsys);
+        
+        // try busy-polling first
+        int waitres = 0;
+        uint64_t wait_start = 0;
+        if (bsys->busy_poll_max_us > 0) {
+            wait_start = epoll_get_time_us();
+            if (bsys->busy_poll_cur_us > 0 && (!have_timeout || timeout_rel_trunc > 0)) {
+                waitres = epoll_busy_poll(bsys, have_timeout, timeout_rel_trunc);
+            }
+        }
+        
+        if (waitres == 0) {
+            BLog(BLOG_DEBUG, "Calling epoll_wait");
+            
+            waitres = epoll_wait(bsys->efd, bsys->epoll_results, BSYSTEM_MAX_RESULTS, (have_timeout ? timeout_rel_trunc : -1));
+            
+            if (bsys->busy_poll_max_us > 0 && waitres >= 0) {
+                epoll_adapt_busy_poll(bsys, epoll_get_time_us() - wait_start);
+            }
+        }
         
-        int waitres = epoll_wait(bsys->efd, bsys->epoll_results, BSYSTEM_MAX_RESULTS, (have_timeout ? timeout_rel_trunc : -1));
         if (waitres < 0) {
             int error = errno;
             if (error == EINTR) {
@@ -403,6 +506,8 @@ static void wait_for_events (BReactor *bsys)
                 BLog(BLOG_DEBUG, "epoll_wait returned %d file descriptors", waitres);
                 bsys->epoll_results_num = waitres;
                 set_epoll_fd_pointers(bsys);
+                bsys->stats.wakeups++;
+                bsys->stats.events += waitres;
             } else {
                 BLog(BLOG_DEBUG, "epoll_wait timed out");
                 move_first_timers(bsys);
@@ -546,6 +651,10 @@ static void wait_for_events (BReactor *bsys)
         limit->count = 0;
         LinkedList1_Remove(&bsys->active_limits_list, &limit->active_limits_list_node);
     }
+    
+    #ifdef BADVPN_USE_EPOLL
+    bsys->last_wake_us = epoll_get_time_us();
+    #endif
 }
 
 #ifndef BADVPN_USE_WINAPI
@@ -605,6 +714,9 @@ int BReactor_Init (BReactor *bsys)
     // init limits
     LinkedList1_Init(&bsys->active_limits_list);
     
+    // init stats
+    memset(&bsys->stats, 0, sizeof(bsys->stats));
+    
     #ifdef BADVPN_USE_WINAPI
     
     // init IOCP list
@@ -633,6 +745,15 @@ int BReactor_Init (BReactor *bsys)
     bsys->epoll_results_num = 0;
     bsys->epoll_results_pos = 0;
     
+    // init dirty list
+    LinkedList1_Init(&bsys->epoll_dirty_list);
+    
+    // busy-polling disabled
+    bsys->busy_poll_max_us = 0;
+    bsys->busy_poll_cur_us = 0;
+    
+    bsys->last_wake_us = epoll_get_time_us();
+    
     #endif
     
     #ifdef BADVPN_USE_KEVENT
@@ -723,6 +844,9 @@ void BReactor_Free (BReactor *bsys)
     DebugCounter_Free(&bsys->d_kevent_ctr);
     #endif
     DebugCounter_Free(&bsys->d_limits_ctr);
+    #ifdef BADVPN_USE_EPOLL
+    ASSERT(LinkedList1_IsEmpty(&bsys->epoll_dirty_list))
+    #endif
     #ifdef BADVPN_USE_POLL
     ASSERT(bsys->poll_num_enabled_fds == 0)
     ASSERT(LinkedList1_IsEmpty(&bsys->poll_enabled_fds_list))
@@ -986,6 +1110,24 @@ int BReactor_Exec (BReactor *bsys)
     return bsys->exit_code;
 }
 
+void BReactor_SetBusyPoll (BReactor *bsys, int max_us)
+{
+    DebugObject_Access(&bsys->d_obj);
+    ASSERT(max_us >= 0)
+    
+    #ifdef BADVPN_USE_EPOLL
+    bsys->busy_poll_max_us = max_us;
+    bsys->busy_poll_cur_us = max_us;
+    #endif
+}
+
+void BReactor_GetStats (BReactor *bsys, BReactorStats *out_stats)
+{
+    DebugObject_Access(&bsys->d_obj);
+    
+    *out_stats = bsys->stats;
+}
+
 void BReactor_Quit (BReactor *bsys, int code)
 {
     bsys->exiting = 1;
@@ -1102,6 +1244,10 @@ int BReactor_AddFileDescriptor (BReactor *bsys, BFileDescriptor *bs)
     // set epoll returned pointer
     bs->epoll_returned_ptr = NULL;
     
+    // registered with no events, not dirty
+    bs->epoll_events = 0;
+    bs->epoll_dirty = 0;
+    
     #endif
     
     #ifdef BADVPN_USE_KEVENT
@@ -1156,6 +1302,11 @@ void BReactor_RemoveFileDescriptor (BReactor *bsys, BFileDescriptor *bs)
         *bs->epoll_returned_ptr = NULL;
     }
     
+    // forget pending event change
+    if (bs->epoll_dirty) {
+        LinkedList1_Remove(&bsys->epoll_dirty_list, &bs->epoll_dirty_list_node);
+    }
+    
     #endif
     
     #ifdef BADVPN_USE_KEVENT
@@ -1197,24 +1348,16 @@ void BReactor_SetFileDescriptorEvents (BReactor *bsys, BFileDescriptor *bs, int
         return;
     }
     
+    bsys->stats.fd_event_changes++;
+    
     #ifdef BADVPN_USE_EPOLL
     
-    // calculate epoll events
-    int eevents = 0;
-    if ((events & BREACTOR_READ)) {
-        eevents |= EPOLLIN;
-    }
-    if ((events & BREACTOR_WRITE)) {
-        eevents |= EPOLLOUT;
+    // defer the epoll update until the next wait
+    if (!bs->epoll_dirty) {
+        LinkedList1_Append(&bsys->epoll_dirty_list, &bs->epoll_dirty_list_node);
+        bs->epoll_dirty = 1;
     }
     
-    // update epoll entry
-    struct epoll_event event;
-    memset(&event, 0, sizeof(event));
-    event.events = eevents;
-    event.data.ptr = bs;
-    ASSERT_FORCE(epoll_ctl(bsys->efd, EPOLL_CTL_MOD, bs->fd, &event) == 0)
-    
     #endif
     
     #ifdef BADVPN_USE_KEVENT
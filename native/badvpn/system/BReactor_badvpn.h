@@ -199,6 +199,9 @@ typedef struct BFileDescriptor_t {
     
     #ifdef BADVPN_USE_EPOLL
     struct BFileDescriptor_t **epoll_returned_ptr;
+    int epoll_events; // events currently registered with epoll
+    int epoll_dirty; // whether in the reactor's epoll_dirty_list
+    LinkedList1Node epoll_dirty_list_node;
     #endif
     
     #ifdef BADVPN_USE_KEVENT
@@ -231,6 +234,20 @@ void BFileDescriptor_Init (BFileDescriptor *bs, int fd, BFileDescriptor_handler
 #define BSYSTEM_MAX_HANDLES 64
 #define BSYSTEM_MAX_POLL_FDS 4096
 
+/**
+ * Event loop statistics, see {@link BReactor_GetStats}.
+ * Only the epoll backend maintains these; with other backends they stay zero.
+ */
+typedef struct {
+    uint64_t wakeups; // waits which returned file descriptor events
+    uint64_t events; // file descriptor events returned
+    uint64_t handler_time_us; // time spent outside of waiting, in microseconds
+    uint64_t fd_event_changes; // effective BReactor_SetFileDescriptorEvents calls
+    uint64_t epoll_ctl_mods; // EPOLL_CTL_MOD calls resulting from them
+    uint64_t busy_polls; // non-blocking polls done while busy-polling
+    uint64_t busy_poll_hits; // busy-poll windows which found events
+} BReactorStats;
+
 /**
  * Event loop that supports file desciptor (Linux) or HANDLE (Windows) events
  * and timers.
@@ -260,8 +277,14 @@ typedef struct {
     struct epoll_event epoll_results[BSYSTEM_MAX_RESULTS]; // epoll returned events buffer
     int epoll_results_num; // number of events in the array
     int epoll_results_pos; // number of events processed so far
+    LinkedList1 epoll_dirty_list; // fds whose events need to be pushed to epoll
+    int busy_poll_max_us; // maximum busy-poll window, 0 if disabled
+    int busy_poll_cur_us; // current adaptive busy-poll window
+    uint64_t last_wake_us; // when the last wait returned, for handler_time_us
     #endif
     
+    BReactorStats stats;
+    
     #ifdef BADVPN_USE_KEVENT
     int kqueue_fd;
     struct kevent kevent_results[BSYSTEM_MAX_RESULTS];
@@ -321,6 +344,29 @@ void BReactor_Free (BReactor *bsys);
  */
 int BReactor_Exec (BReactor *bsys);
 
+/**
+ * Enables or disables adaptive busy-polling.
+ * When enabled, before blocking for events the reactor first polls for them
+ * without blocking, for up to a window of time. The window adapts to the observed
+ * idle gaps: it grows while events keep arriving within the maximum window and
+ * shrinks (down to not busy-polling at all) while they do not.
+ * This trades CPU time for latency and is only implemented by the epoll backend;
+ * elsewhere this has no effect.
+ *
+ * @param bsys the object
+ * @param max_us maximum busy-poll window in microseconds. Must be >=0.
+ *               Zero disables busy-polling (the default).
+ */
+void BReactor_SetBusyPoll (BReactor *bsys, int max_us);
+
+/**
+ * Returns event loop statistics accumulated since {@link BReactor_Init}.
+ *
+ * @param bsys the object
+ * @param out_stats returns the statistics
+ */
+void BReactor_GetStats (BReactor *bsys, BReactorStats *out_stats);
+
 /**
  * Causes the event loop ({@link BReactor_Exec}) to cease
  * dispatching events and return.
@@ -461,6 +507,9 @@ void BReactor_RemoveFileDescriptor (BReactor *bsys, BFileDescriptor *bs);
 
 /**
  * Sets monitored file descriptor events.
+ * With the epoll backend, the change is only pushed to the kernel right before
+ * the reactor next waits for events, so toggling events back and forth while
+ * handling events costs no system calls.
  *
  * @param bsys the object
  * @param bs {@link BFileDescriptor} object. Must be in active state,
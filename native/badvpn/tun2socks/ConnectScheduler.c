@@ -0,0 +1,270 @@
+/**
+ * @file ConnectScheduler.c
+ * 
+ * @section LICENSE
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the author nor the
+ *    names of its contributors may be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdint.h>
+
+#include <misc/debug.h>
+#include <misc/offset.h>
+#include <base/BLog.h>
+
+#include <tun2socks/ConnectScheduler.h>
+
+#include <generated/blog_channel_ConnectScheduler.h>
+
+// when the per-iteration limit is reached, continue after this long, having
+// processed any I/O in the meantime
+#define YIELD_TIME 1
+
+#define STATE_QUEUED 1
+#define STATE_ACTIVE 2
+#define STATE_DONE 3
+
+static void schedule (ConnectScheduler *o)
+{
+    if (o->num_queued > 0 && o->num_active < o->max_active && !BPending_IsSet(&o->start_job) && !BTimer_IsRunning(&o->yield_timer)) {
+        BPending_Set(&o->start_job);
+    }
+}
+
+static void release_slot (ConnectScheduler *o)
+{
+    ASSERT(o->num_active > 0)
+    
+    o->num_active--;
+    schedule(o);
+}
+
+static ConnectSchedulerEntry * first_queued (ConnectScheduler *o)
+{
+    for (int i = 0; i < CONNECTSCHEDULER_NUM_PRIOS; i++) {
+        LinkedList1Node *node = LinkedList1_GetFirst(&o->queues[i]);
+        if (node) {
+            return UPPER_OBJECT(node, ConnectSchedulerEntry, list_node);
+        }
+    }
+    
+    return NULL;
+}
+
+static void start_job_handler (ConnectScheduler *o)
+{
+    DebugObject_Access(&o->d_obj);
+    ASSERT(o->num_active < o->max_active)
+    
+    ConnectSchedulerEntry *e = first_queued(o);
+    if (!e) {
+        return;
+    }
+    
+    // leave the rest for a later iteration if we have started enough in this one
+    if (!BReactorLimit_Increment(&o->start_limit)) {
+        BLog(BLOG_DEBUG, "start limit reached, %d queued", o->num_queued);
+        BReactor_SetTimer(o->reactor, &o->yield_timer);
+        return;
+    }
+    
+    // take a slot
+    LinkedList1_Remove(&o->queues[e->prio], &e->list_node);
+    o->num_queued--;
+    o->num_active++;
+    e->state = STATE_ACTIVE;
+    
+    // account waiting time
+    btime_t waited = btime_gettime() - e->queue_time;
+    o->stats.started++;
+    o->stats.wait_time += waited;
+    if (waited > o->stats.max_wait_time) {
+        o->stats.max_wait_time = waited;
+    }
+    
+    // continue with the next entry from the job
+    schedule(o);
+    
+    // start connection
+    e->handler(e->user);
+    return;
+}
+
+static void yield_timer_handler (ConnectScheduler *o)
+{
+    DebugObject_Access(&o->d_obj);
+    
+    schedule(o);
+}
+
+void ConnectScheduler_Init (ConnectScheduler *o, BReactor *reactor, int max_active, int max_starts)
+{
+    ASSERT(max_active > 0)
+    ASSERT(max_starts > 0)
+    
+    // init arguments
+    o->reactor = reactor;
+    o->max_active = max_active;
+    
+    // init queues
+    for (int i = 0; i < CONNECTSCHEDULER_NUM_PRIOS; i++) {
+        LinkedList1_Init(&o->queues[i]);
+    }
+    o->num_active = 0;
+    o->num_queued = 0;
+    
+    // init start limit, job and timer
+    BReactorLimit_Init(&o->start_limit, reactor, max_starts);
+    BPending_Init(&o->start_job, BReactor_PendingGroup(reactor), (BPending_handler)start_job_handler, o);
+    BTimer_Init(&o->yield_timer, YIELD_TIME, (BTimer_handler)yield_timer_handler, o);
+    
+    // init stats
+    o->stats.started = 0;
+    o->stats.delayed = 0;
+    o->stats.canceled = 0;
+    o->stats.wait_time = 0;
+    o->stats.max_wait_time = 0;
+    o->stats.max_queued = 0;
+    
+    DebugCounter_Init(&o->d_entries_ctr);
+    DebugObject_Init(&o->d_obj);
+}
+
+void ConnectScheduler_Free (ConnectScheduler *o)
+{
+    DebugObject_Free(&o->d_obj);
+    DebugCounter_Free(&o->d_entries_ctr);
+    ASSERT(o->num_active == 0)
+    ASSERT(o->num_queued == 0)
+    
+    BLog(BLOG_INFO, "started %llu, delayed %llu, canceled %llu, wait %llu ms total, %lld ms max, %d queued max",
+         (unsigned long long)o->stats.started, (unsigned long long)o->stats.delayed, (unsigned long long)o->stats.canceled,
+         (unsigned long long)o->stats.wait_time, (long long)o->stats.max_wait_time, o->stats.max_queued);
+    
+    BReactor_RemoveTimer(o->reactor, &o->yield_timer);
+    BPending_Free(&o->start_job);
+    BReactorLimit_Free(&o->start_limit);
+}
+
+int ConnectScheduler_NumActive (ConnectScheduler *o)
+{
+    DebugObject_Access(&o->d_obj);
+    
+    return o->num_active;
+}
+
+int ConnectScheduler_NumQueued (ConnectScheduler *o)
+{
+    DebugObject_Access(&o->d_obj);
+    
+    return o->num_queued;
+}
+
+void ConnectScheduler_GetStats (ConnectScheduler *o, ConnectSchedulerStats *out)
+{
+    DebugObject_Access(&o->d_obj);
+    
+    *out = o->stats;
+}
+
+void ConnectSchedulerEntry_Init (ConnectSchedulerEntry *o, ConnectScheduler *sched, int prio, ConnectScheduler_handler handler, void *user)
+{
+    DebugObject_Access(&sched->d_obj);
+    ASSERT(prio >= 0 && prio < CONNECTSCHEDULER_NUM_PRIOS)
+    ASSERT(handler)
+    
+    // init arguments
+    o->sched = sched;
+    o->handler = handler;
+    o->user = user;
+    o->prio = prio;
+    
+    // queue
+    o->state = STATE_QUEUED;
+    o->queue_time = btime_gettime();
+    LinkedList1_Append(&sched->queues[prio], &o->list_node);
+    sched->num_queued++;
+    if (sched->num_queued > sched->stats.max_queued) {
+        sched->stats.max_queued = sched->num_queued;
+    }
+    
+    // count requests which have to wait for a slot
+    if (sched->num_active + sched->num_queued > sched->max_active) {
+        sched->stats.delayed++;
+    }
+    
+    // start from a job
+    schedule(sched);
+    
+    DebugCounter_Increment(&sched->d_entries_ctr);
+    DebugObject_Init(&o->d_obj);
+}
+
+void ConnectSchedulerEntry_Free (ConnectSchedulerEntry *o)
+{
+    ConnectScheduler *sched = o->sched;
+    DebugObject_Free(&o->d_obj);
+    DebugCounter_Decrement(&sched->d_entries_ctr);
+    
+    switch (o->state) {
+        case STATE_QUEUED: {
+            LinkedList1_Remove(&sched->queues[o->prio], &o->list_node);
+            sched->num_queued--;
+            sched->stats.canceled++;
+        } break;
+        
+        case STATE_ACTIVE: {
+            release_slot(sched);
+        } break;
+    }
+}
+
+void ConnectSchedulerEntry_SetPriority (ConnectSchedulerEntry *o, int prio)
+{
+    DebugObject_Access(&o->d_obj);
+    ASSERT(prio >= 0 && prio < CONNECTSCHEDULER_NUM_PRIOS)
+    
+    if (o->state != STATE_QUEUED || o->prio == prio) {
+        return;
+    }
+    
+    LinkedList1_Remove(&o->sched->queues[o->prio], &o->list_node);
+    o->prio = prio;
+    LinkedList1_Append(&o->sched->queues[o->prio], &o->list_node);
+}
+
+void ConnectSchedulerEntry_Done (ConnectSchedulerEntry *o)
+{
+    DebugObject_Access(&o->d_obj);
+    ASSERT(o->state == STATE_ACTIVE)
+    
+    o->state = STATE_DONE;
+    release_slot(o->sched);
+}
+
+int ConnectSchedulerEntry_IsQueued (ConnectSchedulerEntry *o)
+{
+    DebugObject_Access(&o->d_obj);
+    
+    return (o->state == STATE_QUEUED);
+}
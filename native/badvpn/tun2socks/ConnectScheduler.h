@@ -0,0 +1,191 @@
+/**
+ * @file ConnectScheduler.h
+ * 
+ * @section LICENSE
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the author nor the
+ *    names of its contributors may be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ * 
+ * @section DESCRIPTION
+ * 
+ * Limits the number of outgoing connections being set up at the same time.
+ * 
+ * Each connection asks for a slot with a priority and is started by calling
+ * its handler once one of max_active slots is free. The slot is held until
+ * the connection is up ({@link ConnectSchedulerEntry_Done}) or is freed.
+ * Requests are served in priority order and in FIFO order within a priority;
+ * a queued request may change its priority. Only a limited number of
+ * connections is started per reactor iteration (using {@link BReactorLimit});
+ * if more could be started, the scheduler lets the reactor process other I/O
+ * first.
+ */
+
+#ifndef BADVPN_TUN2SOCKS_CONNECTSCHEDULER_H
+#define BADVPN_TUN2SOCKS_CONNECTSCHEDULER_H
+
+#include <stdint.h>
+
+#include <misc/debug.h>
+#include <misc/debugcounter.h>
+#include <structure/LinkedList1.h>
+#include <base/DebugObject.h>
+#include <base/BPending.h>
+#include <system/BReactor.h>
+#include <system/BTime.h>
+
+#define CONNECTSCHEDULER_PRIO_HIGH 0
+#define CONNECTSCHEDULER_PRIO_NORMAL 1
+#define CONNECTSCHEDULER_PRIO_LOW 2
+#define CONNECTSCHEDULER_NUM_PRIOS 3
+
+typedef void (*ConnectScheduler_handler) (void *user);
+
+typedef struct {
+    uint64_t started;
+    uint64_t delayed;
+    uint64_t canceled;
+    uint64_t wait_time;
+    btime_t max_wait_time;
+    int max_queued;
+} ConnectSchedulerStats;
+
+typedef struct {
+    BReactor *reactor;
+    int max_active;
+    int num_active;
+    int num_queued;
+    LinkedList1 queues[CONNECTSCHEDULER_NUM_PRIOS];
+    BReactorLimit start_limit;
+    BPending start_job;
+    BTimer yield_timer;
+    ConnectSchedulerStats stats;
+    DebugCounter d_entries_ctr;
+    DebugObject d_obj;
+} ConnectScheduler;
+
+typedef struct {
+    ConnectScheduler *sched;
+    ConnectScheduler_handler handler;
+    void *user;
+    int state;
+    int prio;
+    btime_t queue_time;
+    LinkedList1Node list_node;
+    DebugObject d_obj;
+} ConnectSchedulerEntry;
+
+/**
+ * Initializes the scheduler.
+ * 
+ * @param o the object
+ * @param reactor reactor we live in
+ * @param max_active maximum number of connections being set up at the same time. Must be >0.
+ * @param max_starts maximum number of connections started per reactor iteration. Must be >0.
+ */
+void ConnectScheduler_Init (ConnectScheduler *o, BReactor *reactor, int max_active, int max_starts);
+
+/**
+ * Frees the scheduler. There must be no entries.
+ * 
+ * @param o the object
+ */
+void ConnectScheduler_Free (ConnectScheduler *o);
+
+/**
+ * Returns the number of connections being set up.
+ * 
+ * @param o the object
+ * @return number of entries holding a slot
+ */
+int ConnectScheduler_NumActive (ConnectScheduler *o);
+
+/**
+ * Returns the number of connections waiting for a slot.
+ * 
+ * @param o the object
+ * @return number of queued entries
+ */
+int ConnectScheduler_NumQueued (ConnectScheduler *o);
+
+/**
+ * Returns counters of the scheduler:
+ * started: connections started,
+ * delayed: how many of those were queued because no slot was free,
+ * canceled: entries freed while queued,
+ * wait_time: total time started connections spent queued (ms),
+ * max_wait_time: longest time a started connection spent queued (ms),
+ * max_queued: largest number of entries queued at the same time.
+ * 
+ * @param o the object
+ * @param out receives the counters
+ */
+void ConnectScheduler_GetStats (ConnectScheduler *o, ConnectSchedulerStats *out);
+
+/**
+ * Initializes an entry and queues it for a slot.
+ * The handler is called from a job once the entry has a slot; the entry then
+ * holds it until {@link ConnectSchedulerEntry_Done} or {@link ConnectSchedulerEntry_Free}.
+ * The handler may free the entry.
+ * 
+ * @param o the object
+ * @param sched scheduler to queue at
+ * @param prio priority, one of the CONNECTSCHEDULER_PRIO_* values
+ * @param handler handler called when the connection is to be started
+ * @param user value passed to handler
+ */
+void ConnectSchedulerEntry_Init (ConnectSchedulerEntry *o, ConnectScheduler *sched, int prio, ConnectScheduler_handler handler, void *user);
+
+/**
+ * Frees the entry. If it was queued, the request is canceled; if it was
+ * holding a slot, the slot is released.
+ * 
+ * @param o the object
+ */
+void ConnectSchedulerEntry_Free (ConnectSchedulerEntry *o);
+
+/**
+ * Changes the priority of a queued entry. The entry goes to the end of the
+ * queue of the new priority. Does nothing if the entry is no longer queued
+ * or the priority is unchanged.
+ * 
+ * @param o the object
+ * @param prio priority, one of the CONNECTSCHEDULER_PRIO_* values
+ */
+void ConnectSchedulerEntry_SetPriority (ConnectSchedulerEntry *o, int prio);
+
+/**
+ * Reports that the connection is up and releases its slot.
+ * The entry must have been started and not done yet.
+ * 
+ * @param o the object
+ */
+void ConnectSchedulerEntry_Done (ConnectSchedulerEntry *o);
+
+/**
+ * Returns whether the entry is still waiting for a slot.
+ * 
+ * @param o the object
+ * @return 1 if queued, 0 if started
+ */
+int ConnectSchedulerEntry_IsQueued (ConnectSchedulerEntry *o);
+
+#endif
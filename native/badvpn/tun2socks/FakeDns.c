@@ -0,0 +1,300 @@
+/**
+ * @file FakeDns.c
+ * 
+ * @section LICENSE
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the author nor the
+ *    names of its contributors may be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#include <misc/debug.h>
+#include <misc/offset.h>
+#include <misc/balloc.h>
+#include <misc/compare.h>
+#include <misc/byteorder.h>
+#include <misc/ipaddr.h>
+#include <base/BLog.h>
+
+#include <tun2socks/FakeDns.h>
+
+#include <generated/blog_channel_FakeDns.h>
+
+#define DNS_HEADER_LEN 12
+
+#define DNS_FLAG_QR 0x8000
+#define DNS_FLAG_RD 0x0100
+#define DNS_FLAG_RA 0x0080
+
+#define DNS_TYPE_A 1
+#define DNS_TYPE_AAAA 28
+#define DNS_CLASS_IN 1
+
+static uint16_t get16 (const uint8_t *p)
+{
+    return ((uint16_t)p[0] << 8) | p[1];
+}
+
+static void put16 (uint8_t *p, uint16_t v)
+{
+    p[0] = v >> 8;
+    p[1] = v;
+}
+
+static void put32 (uint8_t *p, uint32_t v)
+{
+    put16(p, v >> 16);
+    put16(p + 2, v);
+}
+
+static int name_comparator (void *unused, char **name1, char **name2)
+{
+    int c = strcmp(*name1, *name2);
+    return B_COMPARE(c, 0);
+}
+
+static uint32_t entry_addr (FakeDns *o, struct FakeDns_entry *e)
+{
+    // skip the network address
+    return hton32(o->net + 1 + (uint32_t)(e - o->entries));
+}
+
+static void touch_entry (FakeDns *o, struct FakeDns_entry *e)
+{
+    e->last_used = btime_gettime();
+    
+    // move to the end of the LRU list
+    LinkedList1_Remove(&o->lru_list, &e->lru_list_node);
+    LinkedList1_Append(&o->lru_list, &e->lru_list_node);
+}
+
+static struct FakeDns_entry * get_entry (FakeDns *o, char *name, int name_len)
+{
+    // look for an existing entry
+    BAVLNode *tree_node = BAVL_LookupExact(&o->names_tree, &name);
+    if (tree_node) {
+        struct FakeDns_entry *e = UPPER_OBJECT(tree_node, struct FakeDns_entry, names_tree_node);
+        touch_entry(o, e);
+        return e;
+    }
+    
+    // copy name
+    char *name_copy = (char *)BAlloc(name_len + 1);
+    if (!name_copy) {
+        BLog(BLOG_ERROR, "BAlloc failed");
+        return NULL;
+    }
+    memcpy(name_copy, name, name_len + 1);
+    
+    struct FakeDns_entry *e;
+    
+    if (o->num_used < o->num_entries) {
+        // take an unused address
+        e = &o->entries[o->num_used++];
+    } else {
+        // reuse the least recently used entry
+        e = UPPER_OBJECT(LinkedList1_GetFirst(&o->lru_list), struct FakeDns_entry, lru_list_node);
+        
+        if (btime_gettime() - e->last_used < o->ttl) {
+            BLog(BLOG_WARNING, "pool exhausted, reusing address of %s for %s", e->name, name_copy);
+        }
+        o->num_recycled++;
+        
+        BAVL_Remove(&o->names_tree, &e->names_tree_node);
+        LinkedList1_Remove(&o->lru_list, &e->lru_list_node);
+        BFree(e->name);
+    }
+    
+    e->name = name_copy;
+    e->last_used = btime_gettime();
+    ASSERT_EXECUTE(BAVL_Insert(&o->names_tree, &e->names_tree_node, NULL))
+    LinkedList1_Append(&o->lru_list, &e->lru_list_node);
+    
+    return e;
+}
+
+int FakeDns_Init (FakeDns *o, uint32_t net, int prefix, int max_entries, int ttl_sec)
+{
+    ASSERT(prefix >= 0)
+    ASSERT(prefix <= 30)
+    ASSERT(max_entries > 0)
+    ASSERT(ttl_sec > 0)
+    
+    o->mask = ntoh32(ipaddr_ipv4_mask_from_prefix(prefix));
+    o->net = ntoh32(net) & o->mask;
+    o->ttl = (btime_t)ttl_sec * 1000;
+    
+    // all addresses except network and broadcast
+    uint32_t num_addrs = (~o->mask) - 1;
+    o->num_entries = (num_addrs < (uint32_t)max_entries ? (int)num_addrs : max_entries);
+    o->num_used = 0;
+    
+    // allocate entries
+    if (!(o->entries = (struct FakeDns_entry *)BAllocArray(o->num_entries, sizeof(o->entries[0])))) {
+        BLog(BLOG_ERROR, "BAllocArray failed");
+        goto fail0;
+    }
+    
+    BAVL_Init(&o->names_tree, OFFSET_DIFF(struct FakeDns_entry, name, names_tree_node), (BAVL_comparator)name_comparator, NULL);
+    LinkedList1_Init(&o->lru_list);
+    
+    o->num_answered = 0;
+    o->num_recycled = 0;
+    
+    DebugObject_Init(&o->d_obj);
+    return 1;
+    
+fail0:
+    return 0;
+}
+
+void FakeDns_Free (FakeDns *o)
+{
+    DebugObject_Free(&o->d_obj);
+    
+    BLog(BLOG_INFO, "answered %llu queries, %d names mapped, %llu addresses reused",
+         (unsigned long long)o->num_answered, o->num_used, (unsigned long long)o->num_recycled);
+    
+    for (int i = 0; i < o->num_used; i++) {
+        BFree(o->entries[i].name);
+    }
+    
+    BFree(o->entries);
+}
+
+int FakeDns_ProcessQuery (FakeDns *o, const uint8_t *query, int query_len, uint8_t *out)
+{
+    DebugObject_Access(&o->d_obj);
+    ASSERT(query_len >= 0)
+    
+    // check header; accept a single question and no answers,
+    // but ignore additional records (e.g. EDNS)
+    if (query_len < DNS_HEADER_LEN) {
+        return 0;
+    }
+    uint16_t flags = get16(query + 2);
+    if ((flags & DNS_FLAG_QR) || ((flags >> 11) & 0xF) != 0) {
+        return 0;
+    }
+    if (get16(query + 4) != 1 || get16(query + 6) != 0 || get16(query + 8) != 0) {
+        return 0;
+    }
+    
+    // parse name into dotted lowercase form
+    char name[FAKEDNS_MAX_NAME + 1];
+    int name_len = 0;
+    int pos = DNS_HEADER_LEN;
+    while (1) {
+        if (pos >= query_len) {
+            return 0;
+        }
+        int label_len = query[pos++];
+        if (label_len == 0) {
+            break;
+        }
+        // compression is not used in questions
+        if ((label_len & 0xC0) || label_len > query_len - pos) {
+            return 0;
+        }
+        if (name_len + (name_len > 0) + label_len > FAKEDNS_MAX_NAME) {
+            return 0;
+        }
+        if (name_len > 0) {
+            name[name_len++] = '.';
+        }
+        for (int i = 0; i < label_len; i++) {
+            uint8_t c = query[pos++];
+            if (c == '\0' || c == '.') {
+                return 0;
+            }
+            name[name_len++] = (c >= 'A' && c <= 'Z') ? c - 'A' + 'a' : c;
+        }
+    }
+    name[name_len] = '\0';
+    
+    // parse type and class
+    if (name_len == 0 || query_len - pos < 4) {
+        return 0;
+    }
+    uint16_t qtype = get16(query + pos);
+    uint16_t qclass = get16(query + pos + 2);
+    pos += 4;
+    if (qclass != DNS_CLASS_IN || (qtype != DNS_TYPE_A && qtype != DNS_TYPE_AAAA)) {
+        return 0;
+    }
+    
+    // assign address
+    struct FakeDns_entry *e = NULL;
+    if (qtype == DNS_TYPE_A) {
+        if (!(e = get_entry(o, name, name_len))) {
+            return 0;
+        }
+    }
+    
+    // write header and question
+    ASSERT(pos <= FAKEDNS_MAX_RESPONSE - 16)
+    memcpy(out, query, pos);
+    put16(out + 2, DNS_FLAG_QR | (flags & DNS_FLAG_RD) | DNS_FLAG_RA);
+    put16(out + 6, (e ? 1 : 0));
+    put16(out + 10, 0);
+    
+    // write answer; AAAA queries get no data so that IPv4 is used
+    if (e) {
+        uint8_t *a = out + pos;
+        put16(a, 0xC000 | DNS_HEADER_LEN);
+        put16(a + 2, DNS_TYPE_A);
+        put16(a + 4, DNS_CLASS_IN);
+        put32(a + 6, o->ttl / 1000);
+        put16(a + 10, 4);
+        uint32_t addr = entry_addr(o, e);
+        memcpy(a + 12, &addr, 4);
+        pos += 16;
+    }
+    
+    o->num_answered++;
+    
+    return pos;
+}
+
+int FakeDns_IsFake (FakeDns *o, uint32_t addr)
+{
+    DebugObject_Access(&o->d_obj);
+    
+    return ((ntoh32(addr) & o->mask) == o->net);
+}
+
+const char * FakeDns_Lookup (FakeDns *o, uint32_t addr)
+{
+    DebugObject_Access(&o->d_obj);
+    
+    uint32_t offset = ntoh32(addr) - o->net;
+    if (!FakeDns_IsFake(o, addr) || offset == 0 || offset > (uint32_t)o->num_used) {
+        return NULL;
+    }
+    
+    struct FakeDns_entry *e = &o->entries[offset - 1];
+    touch_entry(o, e);
+    
+    return e->name;
+}
@@ -0,0 +1,137 @@
+/**
+ * @file FakeDns.h
+ * 
+ * @section LICENSE
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the author nor the
+ *    names of its contributors may be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ * 
+ * @section DESCRIPTION
+ * 
+ * Fake-IP DNS responder.
+ * 
+ * A and AAAA queries are answered locally. Every queried name is assigned an
+ * address from a reserved IPv4 network; AAAA queries get an empty answer so
+ * that clients use the IPv4 address. When a connection later targets such an
+ * address, the name can be looked up and passed to the SOCKS server, which
+ * then does the resolution.
+ * 
+ * The mapping is kept in both directions: names are found through a tree, and
+ * addresses map directly to entries by their offset in the network. Entries
+ * expire when they have not been used (queried or connected to) for the TTL.
+ * New names take unused addresses first, then the least recently used entry;
+ * if that one has not expired yet, the pool is too small and a warning is
+ * logged.
+ */
+
+#ifndef BADVPN_TUN2SOCKS_FAKEDNS_H
+#define BADVPN_TUN2SOCKS_FAKEDNS_H
+
+#include <stdint.h>
+
+#include <misc/debug.h>
+#include <structure/BAVL.h>
+#include <structure/LinkedList1.h>
+#include <base/DebugObject.h>
+#include <system/BTime.h>
+
+// maximum length of a name, without the final dot
+#define FAKEDNS_MAX_NAME 253
+
+// maximum size of a response generated by FakeDns_ProcessQuery
+#define FAKEDNS_MAX_RESPONSE 512
+
+struct FakeDns_entry {
+    char *name;
+    btime_t last_used;
+    BAVLNode names_tree_node;
+    LinkedList1Node lru_list_node;
+};
+
+typedef struct {
+    uint32_t net;
+    uint32_t mask;
+    int num_entries;
+    int num_used;
+    btime_t ttl;
+    struct FakeDns_entry *entries;
+    BAVL names_tree;
+    LinkedList1 lru_list;
+    uint64_t num_answered;
+    uint64_t num_recycled;
+    DebugObject d_obj;
+} FakeDns;
+
+/**
+ * Initializes the responder.
+ * 
+ * @param o the object
+ * @param net network to assign addresses from, in network byte order
+ * @param prefix prefix length of the network. Must be >=0 and <=30.
+ * @param max_entries maximum number of names mapped at the same time. Must be >0.
+ *                    The number of entries is also limited by the size of the network.
+ * @param ttl_sec TTL of answers, in seconds. Entries are not reused before they
+ *                have been unused for this long, unless the pool is exhausted. Must be >0.
+ * @return 1 on success, 0 on failure
+ */
+int FakeDns_Init (FakeDns *o, uint32_t net, int prefix, int max_entries, int ttl_sec) WARN_UNUSED;
+
+/**
+ * Frees the responder.
+ * 
+ * @param o the object
+ */
+void FakeDns_Free (FakeDns *o);
+
+/**
+ * Answers a DNS query.
+ * Only queries with a single A or AAAA question of class IN are answered.
+ * 
+ * @param o the object
+ * @param query DNS message (UDP payload)
+ * @param query_len length of the message. Must be >=0.
+ * @param out buffer for the response, at least FAKEDNS_MAX_RESPONSE bytes
+ * @return length of the response, or 0 if the query was not answered and should
+ *         be handled normally
+ */
+int FakeDns_ProcessQuery (FakeDns *o, const uint8_t *query, int query_len, uint8_t *out);
+
+/**
+ * Checks whether an address belongs to the fake network.
+ * 
+ * @param o the object
+ * @param addr address in network byte order
+ * @return 1 if it does, 0 if not
+ */
+int FakeDns_IsFake (FakeDns *o, uint32_t addr);
+
+/**
+ * Returns the name an address was assigned to, and marks the entry as used.
+ * The returned string is only valid until the next call to {@link FakeDns_ProcessQuery}.
+ * 
+ * @param o the object
+ * @param addr address in network byte order
+ * @return null-terminated name, or NULL if the address is not assigned
+ */
+const char * FakeDns_Lookup (FakeDns *o, uint32_t addr);
+
+#endif
@@ -1,13 +1,22 @@
 #include "MemoryPool.h"
 #include <stdlib.h>
+#include <stdint.h>
 
 void pool_init(MemoryPool *pool, size_t block_size) {
     pool->head = NULL;
     pool->block_size = block_size;
+    pool->num_free = 0;
+    pool->max_free = SIZE_MAX;
     pthread_mutex_init(&pool->lock, NULL);
     pool->initialized = 1;
 }
 
+void pool_set_max_free(MemoryPool *pool, size_t max_free) {
+    pthread_mutex_lock(&pool->lock);
+    pool->max_free = max_free;
+    pthread_mutex_unlock(&pool->lock);
+}
+
 void pool_free_all(MemoryPool *pool) {
     if (!pool->initialized) return;
 
@@ -19,6 +28,7 @@ void pool_free_all(MemoryPool *pool) {
         current = next;
     }
     pool->head = NULL;
+    pool->num_free = 0;
     pthread_mutex_unlock(&pool->lock);
 
     pthread_mutex_destroy(&pool->lock);
@@ -32,6 +42,7 @@ void *pool_alloc(MemoryPool *pool) {
     if (pool->head) {
         void *ptr = pool->head;
         pool->head = pool->head->next;
+        pool->num_free--;
         pthread_mutex_unlock(&pool->lock);
         return ptr;
     }
@@ -46,8 +57,14 @@ void pool_free(MemoryPool *pool, void *ptr) {
     if (!ptr || !pool->initialized) return;
 
     pthread_mutex_lock(&pool->lock);
+    if (pool->num_free >= pool->max_free) {
+        pthread_mutex_unlock(&pool->lock);
+        free(ptr);
+        return;
+    }
     PoolNode *node = (PoolNode *)ptr;
     node->next = pool->head;
     pool->head = node;
+    pool->num_free++;
     pthread_mutex_unlock(&pool->lock);
 }
@@ -11,11 +11,15 @@ typedef struct PoolNode {
 typedef struct {
     PoolNode *head;
     size_t block_size;
+    size_t num_free;
+    size_t max_free;
     pthread_mutex_t lock;
     int initialized;
 } MemoryPool;
 
 void pool_init(MemoryPool *pool, size_t block_size);
+// blocks freed beyond max_free cached ones go back to malloc (default: no limit)
+void pool_set_max_free(MemoryPool *pool, size_t max_free);
 void pool_free_all(MemoryPool *pool);
 void *pool_alloc(MemoryPool *pool);
 void pool_free(MemoryPool *pool, void *ptr);
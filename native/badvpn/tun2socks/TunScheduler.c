@@ -0,0 +1,415 @@
+/**
+ * @file TunScheduler.c
+ * 
+ * @section LICENSE
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the author nor the
+ *    names of its contributors may be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <limits.h>
+
+#include <misc/debug.h>
+#include <misc/offset.h>
+#include <misc/balloc.h>
+#include <base/BLog.h>
+
+#include <tun2socks/TunScheduler.h>
+
+#include <generated/blog_channel_TunScheduler.h>
+
+// TCP segments with at most this much payload are interactive
+#define SMALL_PAYLOAD 256
+
+// a priority flow with a larger backlog (in MTUs) is served as bulk
+#define SPARSE_BACKLOG_MTUS 2
+
+#define TCP_FLAG_FIN 0x01
+#define TCP_FLAG_SYN 0x02
+#define TCP_FLAG_RST 0x04
+
+static uint32_t hash_bytes (uint32_t h, const uint8_t *data, int len)
+{
+    for (int i = 0; i < len; i++) {
+        h = (h ^ data[i]) * UINT32_C(0x01000193);
+    }
+    return h;
+}
+
+static int classify_l4 (int proto, const uint8_t *l4, int l4_len, int have_ports, uint32_t *h)
+{
+    uint8_t proto8 = proto;
+    *h = hash_bytes(*h, &proto8, 1);
+    
+    switch (proto) {
+        case 17: {
+            if (!have_ports || l4_len < 8) {
+                return TUNSCHEDULER_CLASS_REALTIME;
+            }
+            
+            *h = hash_bytes(*h, l4, 4);
+            
+            uint16_t sport = ((uint16_t)l4[0] << 8) | l4[1];
+            uint16_t dport = ((uint16_t)l4[2] << 8) | l4[3];
+            if (sport == 53 || dport == 53) {
+                return TUNSCHEDULER_CLASS_DNS;
+            }
+            return TUNSCHEDULER_CLASS_REALTIME;
+        } break;
+        
+        case 6: {
+            if (!have_ports || l4_len < 20) {
+                return TUNSCHEDULER_CLASS_BULK;
+            }
+            
+            *h = hash_bytes(*h, l4, 4);
+            
+            int doff = (l4[12] >> 4) * 4;
+            uint8_t flags = l4[13];
+            if ((flags & (TCP_FLAG_FIN|TCP_FLAG_SYN|TCP_FLAG_RST)) || l4_len - doff <= SMALL_PAYLOAD) {
+                return TUNSCHEDULER_CLASS_INTERACTIVE;
+            }
+            return TUNSCHEDULER_CLASS_BULK;
+        } break;
+        
+        default:
+            return TUNSCHEDULER_CLASS_INTERACTIVE;
+    }
+}
+
+static struct TunScheduler_flow * flow_of_node (LinkedList1Node *ln)
+{
+    return UPPER_OBJECT(ln, struct TunScheduler_flow, active_node);
+}
+
+static void dequeue_packet (TunScheduler *o, struct TunScheduler_flow *f)
+{
+    ASSERT(f->first >= 0)
+    ASSERT(f->class >= 0)
+    
+    int index = f->first;
+    struct TunScheduler_packet *p = &o->packets[index];
+    
+    // unlink from flow
+    f->first = p->next;
+    if (f->first < 0) {
+        f->last = -1;
+    }
+    f->backlog -= p->len;
+    
+    // free data
+    BFree(p->data);
+    
+    // return to free list
+    p->next = o->free_first;
+    o->free_first = index;
+    o->num_queued--;
+    o->queued_bytes -= p->len;
+    
+    // deactivate flow if it's empty
+    if (f->first < 0) {
+        ASSERT(f->backlog == 0)
+        LinkedList1_Remove(&o->active[f->class], &f->active_node);
+        f->class = -1;
+        f->deficit = 0;
+    }
+}
+
+static void drop_fattest (TunScheduler *o)
+{
+    ASSERT(o->num_queued > 0)
+    
+    struct TunScheduler_flow *fattest = NULL;
+    for (int i = 0; i < TUNSCHEDULER_NUM_FLOWS; i++) {
+        struct TunScheduler_flow *f = &o->flows[i];
+        if (f->first >= 0 && (!fattest || f->backlog > fattest->backlog)) {
+            fattest = f;
+        }
+    }
+    ASSERT(fattest)
+    
+    BLog(BLOG_DEBUG, "queue full, dropping from flow %d (%d bytes queued)", (int)(fattest - o->flows), fattest->backlog);
+    
+    dequeue_packet(o, fattest);
+    o->dropped++;
+}
+
+static void serve_class (TunScheduler *o, int class, int budget)
+{
+    LinkedList1 *list = &o->active[class];
+    LinkedList1Node *ln;
+    
+    while (budget > 0 && (ln = LinkedList1_GetFirst(list))) {
+        struct TunScheduler_flow *f = flow_of_node(ln);
+        ASSERT(f->class == class)
+        ASSERT(f->first >= 0)
+        
+        int len = o->packets[f->first].len;
+        
+        // not enough credit, give the flow a quantum and move on
+        if (f->deficit < len) {
+            f->deficit += o->mtu;
+            LinkedList1_Remove(list, ln);
+            LinkedList1_Append(list, ln);
+            continue;
+        }
+        
+        f->deficit -= len;
+        budget -= len;
+        o->sent[class]++;
+        
+        // writing never calls back into us, so the packet can be freed afterwards
+        BTap_Send(o->device, o->packets[f->first].data, len);
+        dequeue_packet(o, f);
+    }
+}
+
+static void writable_handler (TunScheduler *o);
+
+static void drain (TunScheduler *o)
+{
+    // priority classes are written completely
+    for (int class = 0; class < TUNSCHEDULER_CLASS_BULK; class++) {
+        serve_class(o, class, INT_MAX);
+    }
+    
+    // bulk is written up to the budget
+    serve_class(o, TUNSCHEDULER_CLASS_BULK, o->bulk_budget);
+    
+    // continue after the reactor has handled other I/O
+    if (o->num_queued > 0 && !o->waiting_writable) {
+        o->waiting_writable = 1;
+        BTap_RequestWritable(o->device, (BTap_handler_writable)writable_handler, o);
+    }
+}
+
+static void drain_job_handler (TunScheduler *o)
+{
+    DebugObject_Access(&o->d_obj);
+    
+    drain(o);
+    return;
+}
+
+static void writable_handler (TunScheduler *o)
+{
+    DebugObject_Access(&o->d_obj);
+    ASSERT(o->waiting_writable)
+    
+    o->waiting_writable = 0;
+    
+    drain(o);
+    return;
+}
+
+int TunScheduler_Init (TunScheduler *o, BTap *device, BReactor *reactor, int num_packets, int max_bytes, int bulk_budget)
+{
+    ASSERT(num_packets > 0)
+    ASSERT(max_bytes >= BTap_GetMTU(device))
+    ASSERT(bulk_budget > 0)
+    
+    // init arguments
+    o->device = device;
+    o->mtu = BTap_GetMTU(device);
+    o->num_packets = num_packets;
+    o->max_bytes = max_bytes;
+    o->bulk_budget = bulk_budget;
+    
+    // allocate packet entries
+    if (!(o->packets = (struct TunScheduler_packet *)BAllocArray(num_packets, sizeof(o->packets[0])))) {
+        BLog(BLOG_ERROR, "BAllocArray failed");
+        goto fail0;
+    }
+    
+    // build free list
+    for (int i = 0; i < num_packets; i++) {
+        o->packets[i].next = (i + 1 < num_packets ? i + 1 : -1);
+    }
+    o->free_first = 0;
+    o->num_queued = 0;
+    o->queued_bytes = 0;
+    
+    // init flows
+    for (int i = 0; i < TUNSCHEDULER_NUM_FLOWS; i++) {
+        struct TunScheduler_flow *f = &o->flows[i];
+        f->first = -1;
+        f->last = -1;
+        f->backlog = 0;
+        f->deficit = 0;
+        f->class = -1;
+    }
+    
+    // init active lists
+    for (int i = 0; i < TUNSCHEDULER_NUM_CLASSES; i++) {
+        LinkedList1_Init(&o->active[i]);
+        o->sent[i] = 0;
+    }
+    o->dropped = 0;
+    
+    // init drain job
+    BPending_Init(&o->drain_job, BReactor_PendingGroup(reactor), (BPending_handler)drain_job_handler, o);
+    
+    // not waiting for device
+    o->waiting_writable = 0;
+    
+    DebugObject_Init(&o->d_obj);
+    return 1;
+    
+fail0:
+    return 0;
+}
+
+void TunScheduler_Free (TunScheduler *o)
+{
+    DebugObject_Free(&o->d_obj);
+    
+    BLog(BLOG_INFO, "sent dns=%llu realtime=%llu interactive=%llu bulk=%llu, dropped %llu",
+         (unsigned long long)o->sent[TUNSCHEDULER_CLASS_DNS], (unsigned long long)o->sent[TUNSCHEDULER_CLASS_REALTIME],
+         (unsigned long long)o->sent[TUNSCHEDULER_CLASS_INTERACTIVE], (unsigned long long)o->sent[TUNSCHEDULER_CLASS_BULK],
+         (unsigned long long)o->dropped);
+    
+    // stop waiting for device
+    if (o->waiting_writable) {
+        BTap_CancelWritable(o->device);
+    }
+    
+    // free drain job
+    BPending_Free(&o->drain_job);
+    
+    // free queued packets
+    for (int i = 0; i < TUNSCHEDULER_NUM_FLOWS; i++) {
+        struct TunScheduler_flow *f = &o->flows[i];
+        for (int index = f->first; index >= 0; index = o->packets[index].next) {
+            BFree(o->packets[index].data);
+        }
+    }
+    
+    // free packet entries
+    BFree(o->packets);
+}
+
+void TunScheduler_Send (TunScheduler *o, const uint8_t *data, int data_len)
+{
+    DebugObject_Access(&o->d_obj);
+    ASSERT(data_len >= 0)
+    ASSERT(data_len <= o->mtu)
+    
+    int flow_index;
+    int class = TunScheduler_Classify(data, data_len, &flow_index);
+    struct TunScheduler_flow *f = &o->flows[flow_index];
+    
+    // make space
+    while (o->free_first < 0 || o->queued_bytes > o->max_bytes - data_len) {
+        drop_fattest(o);
+    }
+    
+    // allocate data
+    uint8_t *packet_data = (uint8_t *)BAlloc(data_len);
+    if (!packet_data) {
+        BLog(BLOG_ERROR, "BAlloc failed, dropping packet");
+        o->dropped++;
+        return;
+    }
+    
+    // take a free packet
+    int index = o->free_first;
+    struct TunScheduler_packet *p = &o->packets[index];
+    o->free_first = p->next;
+    o->num_queued++;
+    o->queued_bytes += data_len;
+    
+    // copy data
+    memcpy(packet_data, data, data_len);
+    p->data = packet_data;
+    p->len = data_len;
+    p->next = -1;
+    
+    // append to flow
+    if (f->first < 0) {
+        f->first = index;
+        
+        // activate flow in the class of its first packet
+        f->class = class;
+        f->deficit = 0;
+        LinkedList1_Append(&o->active[class], &f->active_node);
+    } else {
+        o->packets[f->last].next = index;
+    }
+    f->last = index;
+    f->backlog += data_len;
+    
+    // demote a priority flow which is building up a queue
+    if (f->class != TUNSCHEDULER_CLASS_BULK && f->backlog > SPARSE_BACKLOG_MTUS * o->mtu) {
+        LinkedList1_Remove(&o->active[f->class], &f->active_node);
+        f->class = TUNSCHEDULER_CLASS_BULK;
+        LinkedList1_Append(&o->active[f->class], &f->active_node);
+    }
+    
+    // write out from a job
+    if (!BPending_IsSet(&o->drain_job)) {
+        BPending_Set(&o->drain_job);
+    }
+}
+
+int TunScheduler_Classify (const uint8_t *data, int data_len, int *out_flow)
+{
+    ASSERT(data_len >= 0)
+    
+    uint32_t h = UINT32_C(0x811c9dc5);
+    int class = TUNSCHEDULER_CLASS_INTERACTIVE;
+    
+    if (data_len >= 20 && (data[0] >> 4) == 4) {
+        int ihl = (data[0] & 0x0F) * 4;
+        int total = ((int)data[2] << 8) | data[3];
+        if (ihl >= 20 && ihl <= total && total <= data_len) {
+            // all fragments of a datagram go to the same flow
+            int fragmented = (((int)data[6] << 8) | data[7]) & 0x3FFF;
+            h = hash_bytes(h, data + 12, 8);
+            class = classify_l4(data[9], data + ihl, total - ihl, !fragmented, &h);
+        }
+    }
+    else if (data_len >= 40 && (data[0] >> 4) == 6) {
+        int payload = ((int)data[4] << 8) | data[5];
+        if (payload <= data_len - 40) {
+            h = hash_bytes(h, data + 8, 32);
+            class = classify_l4(data[6], data + 40, payload, 1, &h);
+        }
+    }
+    
+    if (out_flow) {
+        h ^= h >> 16;
+        h *= UINT32_C(0x7feb352d);
+        h ^= h >> 15;
+        *out_flow = h % TUNSCHEDULER_NUM_FLOWS;
+    }
+    
+    return class;
+}
+
+int TunScheduler_NumQueued (TunScheduler *o)
+{
+    DebugObject_Access(&o->d_obj);
+    
+    return o->num_queued;
+}
@@ -0,0 +1,158 @@
+/**
+ * @file TunScheduler.h
+ * 
+ * @section LICENSE
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the author nor the
+ *    names of its contributors may be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ * 
+ * @section DESCRIPTION
+ * 
+ * Output scheduler in front of a TUN device.
+ * 
+ * Packets are classified into DNS, other UDP, small TCP segments (pure ACKs,
+ * handshakes and segments carrying little payload) and bulk TCP. The classes
+ * are served in this order with strict priority. Within a class, packets are
+ * queued per flow (a hash of addresses, ports and protocol) and flows are
+ * served by deficit round robin.
+ * 
+ * A flow keeps its class while it has packets queued, so packets of one flow
+ * are never reordered. A flow from a priority class whose backlog grows
+ * beyond a few packets is moved to the bulk class until it drains; this keeps
+ * e.g. QUIC downloads from starving TCP ACKs.
+ * 
+ * Packets are queued when submitted and written out from a job. Priority
+ * classes are always written completely, while only a limited number of bulk
+ * bytes are written per round; if bulk packets remain, the scheduler waits
+ * for the device to become writable, which lets the reactor process other
+ * I/O first. The queue is bounded both in packets and in bytes; packet
+ * buffers are allocated with the length of the packet, so large device MTUs
+ * (e.g. with offloading) don't reduce the number of small packets that can be
+ * queued. When the queue is full, packets are dropped from the head of the
+ * flow with the largest backlog.
+ */
+
+#ifndef BADVPN_TUN2SOCKS_TUNSCHEDULER_H
+#define BADVPN_TUN2SOCKS_TUNSCHEDULER_H
+
+#include <stdint.h>
+
+#include <misc/debug.h>
+#include <structure/LinkedList1.h>
+#include <base/DebugObject.h>
+#include <base/BPending.h>
+#include <system/BReactor.h>
+#include <tuntap/BTap.h>
+
+#define TUNSCHEDULER_CLASS_DNS 0
+#define TUNSCHEDULER_CLASS_REALTIME 1
+#define TUNSCHEDULER_CLASS_INTERACTIVE 2
+#define TUNSCHEDULER_CLASS_BULK 3
+#define TUNSCHEDULER_NUM_CLASSES 4
+
+#define TUNSCHEDULER_NUM_FLOWS 256
+
+struct TunScheduler_packet {
+    int next;
+    int len;
+    uint8_t *data;
+};
+
+struct TunScheduler_flow {
+    int first;
+    int last;
+    int backlog;
+    int deficit;
+    int class;
+    LinkedList1Node active_node;
+};
+
+typedef struct {
+    BTap *device;
+    int mtu;
+    int num_packets;
+    int max_bytes;
+    int bulk_budget;
+    struct TunScheduler_packet *packets;
+    int free_first;
+    int num_queued;
+    int queued_bytes;
+    struct TunScheduler_flow flows[TUNSCHEDULER_NUM_FLOWS];
+    LinkedList1 active[TUNSCHEDULER_NUM_CLASSES];
+    BPending drain_job;
+    int waiting_writable;
+    uint64_t sent[TUNSCHEDULER_NUM_CLASSES];
+    uint64_t dropped;
+    DebugObject d_obj;
+} TunScheduler;
+
+/**
+ * Initializes the scheduler.
+ * 
+ * @param o the object
+ * @param device device to write packets to. Must not be freed before the scheduler.
+ * @param reactor reactor we live in
+ * @param num_packets maximum number of packets queued. Must be >0.
+ * @param max_bytes maximum number of bytes queued. Must be >= the MTU of the device.
+ * @param bulk_budget number of bulk bytes written per round before waiting for the
+ *                    device to become writable. Must be >0.
+ * @return 1 on success, 0 on failure
+ */
+int TunScheduler_Init (TunScheduler *o, BTap *device, BReactor *reactor, int num_packets, int max_bytes, int bulk_budget) WARN_UNUSED;
+
+/**
+ * Frees the scheduler. Queued packets are discarded.
+ * 
+ * @param o the object
+ */
+void TunScheduler_Free (TunScheduler *o);
+
+/**
+ * Queues a packet for the device.
+ * The data is copied and can be reused after the call.
+ * 
+ * @param o the object
+ * @param data IP packet
+ * @param data_len length of packet. Must be >=0 and <= the MTU of the device.
+ */
+void TunScheduler_Send (TunScheduler *o, const uint8_t *data, int data_len);
+
+/**
+ * Returns the class a packet would be queued in, one of the
+ * TUNSCHEDULER_CLASS_* values.
+ * 
+ * @param data IP packet
+ * @param data_len length of packet. Must be >=0.
+ * @param out_flow if not NULL, receives the flow index (<TUNSCHEDULER_NUM_FLOWS)
+ * @return packet class
+ */
+int TunScheduler_Classify (const uint8_t *data, int data_len, int *out_flow);
+
+/**
+ * Returns the number of packets currently queued.
+ * 
+ * @param o the object
+ * @return number of queued packets
+ */
+int TunScheduler_NumQueued (TunScheduler *o);
+
+#endif
@@ -27,6 +27,7 @@
  */
 
 #include <stdint.h>
+#include <inttypes.h>
 #include <stdio.h>
 #include <stddef.h>
 #include <string.h>
@@ -47,6 +48,7 @@
 #include <misc/read_file.h>
 #include <misc/ipaddr6.h>
 #include <misc/concat_strings.h>
+#include <misc/ipaddr.h>
 #include <structure/LinkedList1.h>
 #include <base/BLog.h>
 #include <system/BReactor.h>
@@ -61,9 +63,14 @@
 #include <lwip/netif.h>
 #include <lwip/tcp.h>
 #include <tun2socks/SocksUdpGwClient.h>
+#include <tun2socks/TunScheduler.h>
+#include <tun2socks/FakeDns.h>
+#include <tun2socks/ConnectScheduler.h>
 
 #ifndef BADVPN_USE_WINAPI
 #include <base/BLog_syslog.h>
+#include <base/BLog_async.h>
+#include <system/BUnixSignal.h>
 #endif
 
 #include <tun2socks/tun2socks.h>
@@ -72,6 +79,9 @@
 
 extern u16_t g_tcp_wnd;
 extern u16_t g_tcp_snd_buf;
+extern u16_t g_tcp_mss;
+extern u16_t g_tcp_snd_queuelen;
+extern u8_t g_tcp_gso;
 int g_socks_buf_size = CLIENT_SOCKS_RECV_BUF_SIZE;
 
 #ifdef ANDROID
@@ -194,6 +204,8 @@ struct {
     #endif
     int loglevel;
     int loglevels[BLOG_NUM_CHANNELS];
+    int log_async;
+    int log_rate_limit;
     char *netif_ipaddr;
     char *netif_netmask;
     char *netif_ip6addr;
@@ -209,6 +221,15 @@ struct {
     int tcp_snd_buf;
     int tcp_wnd;
     int socks_buf;
+    int busy_poll;
+    int tun_queue_packets;
+    int fake_dns;
+    char *fake_dns_net;
+    int fake_dns_ttl;
+    int socks_max_connecting;
+    int tcp_connect_timeout;
+    int tcp_idle_timeout;
+    int tcp_half_closed_timeout;
 #ifdef ANDROID
     int tun_fd;
     int tun_mtu;
@@ -218,31 +239,60 @@ struct {
     int num_dnsgw;
 #else
     char *tundev;
+    int tun_offload;
 #endif
 } options;
 
+// UDP packet received from the device, parsed by parse_device_udp_packet
+struct device_udp_packet {
+    int ip_version;
+    union {
+        struct ipv4_header ipv4;
+        struct ipv6_header ipv6;
+    };
+    struct udp_header udp;
+    uint8_t *payload;
+    int payload_len;
+};
+
+// states of TCP clients for idle timeouts
+#define CLIENT_STATE_QUEUED 0
+#define CLIENT_STATE_CONNECTING 1
+#define CLIENT_STATE_ESTABLISHED 2
+#define CLIENT_STATE_HALF_CLOSED 3
+#define CLIENT_NUM_STATES 4
+
 // TCP client
 struct tcp_client {
     dead_t dead;
     dead_t dead_client;
     LinkedList1Node list_node;
+    int idle_state;
+    btime_t idle_since;
+    LinkedList1Node idle_list_node;
     BAddr local_addr;
     BAddr remote_addr;
     struct tcp_pcb *pcb;
     int client_closed;
-    uint8_t *buf;
+    uint8_t *buf; // from buf_pool while buf_used > 0, else NULL
     int buf_used;
     char *socks_username;
+    ConnectSchedulerEntry socks_connect;
+    int socks_started;
     BSocksClient socks_client;
     int socks_up;
     int socks_closed;
     StreamPassInterface *socks_send_if;
     StreamRecvInterface *socks_recv_if;
-    uint8_t *socks_recv_buf;
+    uint8_t *socks_recv_buf; // socks_recv_idle_buf or from socks_buf_pool
+    int socks_recv_buf_size;
     int socks_recv_buf_used;
     int socks_recv_buf_sent;
+    int socks_recv_last_len;
+    int socks_recv_full_reads;
     int socks_recv_waiting;
     int socks_recv_tcp_pending;
+    uint8_t socks_recv_idle_buf[CLIENT_SOCKS_RECV_IDLE_BUF_SIZE];
 };
 
 // IP address of netif
@@ -267,6 +317,9 @@ size_t socks_num_auth_info;
 // remote udpgw server addr, if provided
 BAddr udpgw_remote_server_addr;
 
+// network for fake DNS addresses
+struct ipv4_ifaddr fake_dns_net;
+
 // reactor
 BReactor ss;
 
@@ -279,6 +332,15 @@ BTap device;
 // device write buffer
 uint8_t *device_write_buf;
 
+// device output scheduler, if options.tun_queue_packets > 0
+TunScheduler device_scheduler;
+
+// fake DNS responder, if options.fake_dns
+FakeDns fake_dns;
+
+// limits SOCKS connections being set up at the same time
+ConnectScheduler connect_scheduler;
+
 // device reading
 SinglePacketBuffer device_read_buffer;
 PacketPassInterface device_read_interface;
@@ -309,6 +371,25 @@ LinkedList1 tcp_clients;
 // number of clients
 int num_clients;
 
+// TCP clients by state, least recently active first
+LinkedList1 idle_lists[CLIENT_NUM_STATES];
+int idle_list_counts[CLIENT_NUM_STATES];
+
+// time of the last TCP timer tick; activity is recorded with this resolution
+btime_t idle_now;
+
+// idle timeouts by state in milliseconds, 0 for none
+btime_t idle_timeouts[CLIENT_NUM_STATES];
+
+// number of clients reaped by state, and after network changes
+uint64_t idle_reaped[CLIENT_NUM_STATES];
+uint64_t network_change_reaped;
+
+#ifndef BADVPN_USE_WINAPI
+// SIGUSR1 notifies of network changes
+BUnixSignal network_change_signal;
+#endif
+
 #ifdef ANDROID
 // Addresses of dnsgws
 BAddr dnsgws[8];
@@ -326,12 +407,21 @@ static void signal_handler (void *unused);
 static BAddr baddr_from_lwip (int is_ipv6, const ipX_addr_t *ipx_addr, uint16_t port_hostorder);
 static void lwip_init_job_hadler (void *unused);
 static void tcp_timer_handler (void *unused);
+static void reap_idle_clients (void);
+static int reap_clients_idle_for (btime_t idle_time);
+static void log_client_stats (void);
+#ifndef BADVPN_USE_WINAPI
+static void network_change_signal_handler (void *unused, int signo);
+#endif
 static void device_error_handler (void *unused);
 static void device_read_handler_send (void *unused, uint8_t *data, int data_len);
+static void device_send (uint8_t *data, int data_len);
+static int parse_device_udp_packet (uint8_t *data, int data_len, int csum_trusted, struct device_udp_packet *out);
 #ifdef ANDROID
-static int process_device_dns_packet (uint8_t *data, int data_len);
+static int process_device_dns_packet (struct device_udp_packet *pkt);
 #endif
-static int process_device_udp_packet (uint8_t *data, int data_len);
+static int process_device_fake_dns_packet (struct device_udp_packet *pkt);
+static int process_device_udp_packet (struct device_udp_packet *pkt);
 static err_t netif_init_func (struct netif *netif);
 static err_t netif_output_func (struct netif *netif, struct pbuf *p, ip_addr_t *ipaddr);
 static err_t netif_output_ip6_func (struct netif *netif, struct pbuf *p, ip6_addr_t *ipaddr);
@@ -346,8 +436,12 @@ static void client_abort_client (struct tcp_client *client);
 static void client_free_socks (struct tcp_client *client);
 static void client_murder (struct tcp_client *client);
 static void client_dealloc (struct tcp_client *client);
+static void client_set_state (struct tcp_client *client, int state);
+static void client_touch (struct tcp_client *client);
 static void client_err_func (void *arg, err_t err);
 static err_t client_recv_func (void *arg, struct tcp_pcb *tpcb, struct pbuf *p, err_t err);
+static int client_connect_priority (struct tcp_client *client);
+static void client_socks_start (struct tcp_client *client);
 static void client_socks_handler (struct tcp_client *client, int event);
 static void client_send_to_socks (struct tcp_client *client);
 static void client_socks_send_handler_done (struct tcp_client *client, int data_len);
@@ -478,6 +572,13 @@ int main (int argc, char **argv)
     }
 #endif
 
+    #ifndef BADVPN_USE_WINAPI
+    // after daemonizing, the logging thread would not survive the fork
+    if (options.log_async && !BLog_InitAsync(options.log_rate_limit)) {
+        BLog(BLOG_WARNING, "failed to start asynchronous logging, logging synchronously");
+    }
+    #endif
+
     // clear password contents pointer
     password_file_contents = NULL;
 
@@ -496,7 +597,9 @@ int main (int argc, char **argv)
     // init memory pools
     pool_init(&client_pool, sizeof(struct tcp_client));
     pool_init(&buf_pool, g_tcp_wnd);
+    pool_set_max_free(&buf_pool, CLIENT_BUF_POOL_MAX_FREE);
     pool_init(&socks_buf_pool, g_socks_buf_size);
+    pool_set_max_free(&socks_buf_pool, CLIENT_BUF_POOL_MAX_FREE);
 
     // init time
     BTime_Init();
@@ -507,6 +610,9 @@ int main (int argc, char **argv)
         goto fail1;
     }
 
+    // busy-poll if requested
+    BReactor_SetBusyPoll(&ss, options.busy_poll);
+
     // set not quitting
     quitting = 0;
 
@@ -568,6 +674,7 @@ int main (int argc, char **argv)
     init_data.init_type = BTAP_INIT_FD;
     init_data.init.fd.fd = fd;
     init_data.init.fd.mtu = options.tun_mtu;
+    init_data.offload = 0;
 
     if (!BTap_Init2(&device, &ss, init_data, device_error_handler, NULL)) {
         BLog(BLOG_ERROR, "BTap_Init2 failed");
@@ -575,8 +682,14 @@ int main (int argc, char **argv)
     }
 #else
     // init TUN device
-    if (!BTap_Init(&device, &ss, options.tundev, device_error_handler, NULL, 1)) {
-        BLog(BLOG_ERROR, "BTap_Init failed");
+    struct BTap_init_data init_data;
+    init_data.dev_type = BTAP_DEV_TUN;
+    init_data.init_type = BTAP_INIT_STRING;
+    init_data.init.string = options.tundev;
+    init_data.offload = options.tun_offload;
+
+    if (!BTap_Init2(&device, &ss, init_data, device_error_handler, NULL)) {
+        BLog(BLOG_ERROR, "BTap_Init2 failed");
         goto fail3;
     }
 #endif
@@ -595,9 +708,9 @@ int main (int argc, char **argv)
 
     if (options.udpgw_remote_server_addr) {
         // compute maximum UDP payload size we need to pass through udpgw
-        udp_mtu = BTap_GetMTU(&device) - (int)(sizeof(struct ipv4_header) + sizeof(struct udp_header));
+        udp_mtu = BTap_GetLinkMTU(&device) - (int)(sizeof(struct ipv4_header) + sizeof(struct udp_header));
         if (options.netif_ip6addr) {
-            int udp_ip6_mtu = BTap_GetMTU(&device) - (int)(sizeof(struct ipv6_header) + sizeof(struct udp_header));
+            int udp_ip6_mtu = BTap_GetLinkMTU(&device) - (int)(sizeof(struct ipv6_header) + sizeof(struct udp_header));
             if (udp_mtu < udp_ip6_mtu) {
                 udp_mtu = udp_ip6_mtu;
             }
@@ -633,6 +746,45 @@ int main (int argc, char **argv)
         goto fail5;
     }
 
+    // init device output scheduler
+    if (options.tun_queue_packets > 0 && !TunScheduler_Init(&device_scheduler, &device, &ss, options.tun_queue_packets, TUN_QUEUE_MAX_BYTES, TUN_QUEUE_BULK_BUDGET)) {
+        BLog(BLOG_ERROR, "TunScheduler_Init failed");
+        goto fail6;
+    }
+
+    // init fake DNS
+    if (options.fake_dns && !FakeDns_Init(&fake_dns, fake_dns_net.addr, fake_dns_net.prefix, FAKE_DNS_MAX_ENTRIES, options.fake_dns_ttl)) {
+        BLog(BLOG_ERROR, "FakeDns_Init failed");
+        goto fail7;
+    }
+
+    // init SOCKS connect scheduler
+    ConnectScheduler_Init(&connect_scheduler, &ss, options.socks_max_connecting, SOCKS_CONNECT_STARTS_PER_ITERATION);
+
+    // init idle tracking
+    for (int i = 0; i < CLIENT_NUM_STATES; i++) {
+        LinkedList1_Init(&idle_lists[i]);
+        idle_list_counts[i] = 0;
+        idle_reaped[i] = 0;
+    }
+    network_change_reaped = 0;
+    idle_now = btime_gettime();
+    idle_timeouts[CLIENT_STATE_QUEUED] = 0; // bounded by the connect timeouts of the clients ahead
+    idle_timeouts[CLIENT_STATE_CONNECTING] = (btime_t)options.tcp_connect_timeout * 1000;
+    idle_timeouts[CLIENT_STATE_ESTABLISHED] = (btime_t)options.tcp_idle_timeout * 1000;
+    idle_timeouts[CLIENT_STATE_HALF_CLOSED] = (btime_t)options.tcp_half_closed_timeout * 1000;
+
+#ifndef BADVPN_USE_WINAPI
+    // reap idle connections when notified of a network change
+    sigset_t sset;
+    ASSERT_FORCE(sigemptyset(&sset) == 0)
+    ASSERT_FORCE(sigaddset(&sset, SIGUSR1) == 0)
+    if (!BUnixSignal_Init(&network_change_signal, &ss, sset, network_change_signal_handler, NULL)) {
+        BLog(BLOG_ERROR, "BUnixSignal_Init failed");
+        goto fail8;
+    }
+#endif
+
     // init TCP timer
     // it won't trigger before lwip is initialized, becuase the lwip init is a job
     BTimer_Init(&tcp_timer, TCP_TMR_INTERVAL, tcp_timer_handler, NULL);
@@ -655,6 +807,13 @@ int main (int argc, char **argv)
     BLog(BLOG_NOTICE, "entering event loop");
     BReactor_Exec(&ss);
 
+    // report event loop statistics
+    BReactorStats stats;
+    BReactor_GetStats(&ss, &stats);
+    BLog(BLOG_INFO, "reactor: %"PRIu64" wakeups, %"PRIu64" events, %"PRIu64" us in handlers, %"PRIu64" event changes, %"PRIu64" epoll_ctl, %"PRIu64" busy-poll hits in %"PRIu64" polls",
+         stats.wakeups, stats.events, stats.handler_time_us, stats.fd_event_changes, stats.epoll_ctl_mods, stats.busy_poll_hits, stats.busy_polls);
+    log_client_stats();
+
     // free clients
     LinkedList1Node *node;
     while ((node = LinkedList1_GetFirst(&tcp_clients))) {
@@ -684,8 +843,20 @@ int main (int argc, char **argv)
 #endif
 
     BReactor_RemoveTimer(&ss, &tcp_timer);
+#ifndef BADVPN_USE_WINAPI
+    BUnixSignal_Free(&network_change_signal, 0);
+fail8:
+#endif
+    ConnectScheduler_Free(&connect_scheduler);
+    if (options.fake_dns) {
+        FakeDns_Free(&fake_dns);
+    }
+fail7:
+    if (options.tun_queue_packets > 0) {
+        TunScheduler_Free(&device_scheduler);
+    }
+fail6:
     BFree(device_write_buf);
-
 fail5:
     BPending_Free(&lwip_init_job);
     if (options.udpgw_remote_server_addr) {
@@ -743,6 +914,10 @@ void print_help (const char *name)
         #endif
         "        [--loglevel <0-5/none/error/warning/notice/info/debug>]\n"
         "        [--channel-loglevel <channel-name> <0-5/none/error/warning/notice/info/debug>] ...\n"
+        #ifndef BADVPN_USE_WINAPI
+        "        [--log-async]\n"
+        "        [--log-rate-limit <messages per second per call site>]\n"
+        #endif
 #ifdef ANDROID
         "        [--fake-proc]\n"
         "        [--tunfd <fd>]\n"
@@ -751,6 +926,7 @@ void print_help (const char *name)
         "        [--pid <pid_file>]\n"
 #else
         "        [--tundev <name>]\n"
+        "        [--tun-offload]\n"
 #endif
         "        --netif-ipaddr <ipaddr>\n"
         "        --netif-netmask <ipnetmask>\n"
@@ -764,6 +940,15 @@ void print_help (const char *name)
         "        [--udpgw-max-connections <number>]\n"
         "        [--udpgw-connection-buffer-size <number>]\n"
         "        [--udpgw-transparent-dns]\n"
+        "        [--busy-poll <microseconds>]\n"
+        "        [--tun-queue-packets <number>]\n"
+        "        [--fake-dns]\n"
+        "        [--fake-dns-net <ipaddr/prefix>]\n"
+        "        [--fake-dns-ttl <seconds>]\n"
+        "        [--socks-max-connecting <number>]\n"
+        "        [--tcp-connect-timeout <seconds>]\n"
+        "        [--tcp-idle-timeout <seconds>]\n"
+        "        [--tcp-half-closed-timeout <seconds>]\n"
         "Address format is a.b.c.d:port (IPv4) or [addr]:port (IPv6).\n",
         name
     );
@@ -791,6 +976,8 @@ int parse_arguments (int argc, char *argv[])
     for (int i = 0; i < BLOG_NUM_CHANNELS; i++) {
         options.loglevels[i] = -1;
     }
+    options.log_async = 0;
+    options.log_rate_limit = DEFAULT_LOG_RATE_LIMIT;
 #ifdef ANDROID
     options.tun_fd = -1;
     options.tun_mtu = 1500;
@@ -799,6 +986,7 @@ int parse_arguments (int argc, char *argv[])
     options.num_dnsgw = 0;
 #else
     options.tundev = NULL;
+    options.tun_offload = 0;
 #endif
     options.netif_ipaddr = NULL;
     options.netif_netmask = NULL;
@@ -815,6 +1003,15 @@ int parse_arguments (int argc, char *argv[])
     options.tcp_snd_buf = 0;
     options.tcp_wnd = 0;
     options.socks_buf = 0;
+    options.busy_poll = 0;
+    options.tun_queue_packets = DEFAULT_TUN_QUEUE_PACKETS;
+    options.fake_dns = 0;
+    options.fake_dns_net = DEFAULT_FAKE_DNS_NET;
+    options.fake_dns_ttl = DEFAULT_FAKE_DNS_TTL;
+    options.socks_max_connecting = DEFAULT_SOCKS_MAX_CONNECTING;
+    options.tcp_connect_timeout = DEFAULT_TCP_CONNECT_TIMEOUT;
+    options.tcp_idle_timeout = DEFAULT_TCP_IDLE_TIMEOUT;
+    options.tcp_half_closed_timeout = DEFAULT_TCP_HALF_CLOSED_TIMEOUT;
 
     int i;
     for (i = 1; i < argc; i++) {
@@ -947,6 +1144,9 @@ int parse_arguments (int argc, char *argv[])
             options.tundev = argv[i + 1];
             i++;
         }
+        else if (!strcmp(arg, "--tun-offload")) {
+            options.tun_offload = 1;
+        }
 #endif
         else if (!strcmp(arg, "--netif-ipaddr")) {
             if (1 >= argc - i) {
@@ -1073,6 +1273,110 @@ int parse_arguments (int argc, char *argv[])
             }
             i++;
         }
+        #ifndef BADVPN_USE_WINAPI
+        else if (!strcmp(arg, "--log-async")) {
+            options.log_async = 1;
+        }
+        else if (!strcmp(arg, "--log-rate-limit")) {
+            if (1 >= argc - i) {
+                fprintf(stderr, "%s: requires an argument\n", arg);
+                return 0;
+            }
+            if ((options.log_rate_limit = atoi(argv[i + 1])) < 0) {
+                fprintf(stderr, "%s: wrong argument\n", arg);
+                return 0;
+            }
+            i++;
+        }
+        #endif
+        else if (!strcmp(arg, "--busy-poll")) {
+            if (1 >= argc - i) {
+                fprintf(stderr, "%s: requires an argument\n", arg);
+                return 0;
+            }
+            if ((options.busy_poll = atoi(argv[i + 1])) < 0) {
+                fprintf(stderr, "%s: wrong argument\n", arg);
+                return 0;
+            }
+            i++;
+        }
+        else if (!strcmp(arg, "--tun-queue-packets")) {
+            if (1 >= argc - i) {
+                fprintf(stderr, "%s: requires an argument\n", arg);
+                return 0;
+            }
+            if ((options.tun_queue_packets = atoi(argv[i + 1])) < 0) {
+                fprintf(stderr, "%s: wrong argument\n", arg);
+                return 0;
+            }
+            i++;
+        }
+        else if (!strcmp(arg, "--fake-dns")) {
+            options.fake_dns = 1;
+        }
+        else if (!strcmp(arg, "--fake-dns-net")) {
+            if (1 >= argc - i) {
+                fprintf(stderr, "%s: requires an argument\n", arg);
+                return 0;
+            }
+            options.fake_dns_net = argv[i + 1];
+            i++;
+        }
+        else if (!strcmp(arg, "--fake-dns-ttl")) {
+            if (1 >= argc - i) {
+                fprintf(stderr, "%s: requires an argument\n", arg);
+                return 0;
+            }
+            if ((options.fake_dns_ttl = atoi(argv[i + 1])) <= 0) {
+                fprintf(stderr, "%s: wrong argument\n", arg);
+                return 0;
+            }
+            i++;
+        }
+        else if (!strcmp(arg, "--socks-max-connecting")) {
+            if (1 >= argc - i) {
+                fprintf(stderr, "%s: requires an argument\n", arg);
+                return 0;
+            }
+            if ((options.socks_max_connecting = atoi(argv[i + 1])) <= 0) {
+                fprintf(stderr, "%s: wrong argument\n", arg);
+                return 0;
+            }
+            i++;
+        }
+        else if (!strcmp(arg, "--tcp-connect-timeout")) {
+            if (1 >= argc - i) {
+                fprintf(stderr, "%s: requires an argument\n", arg);
+                return 0;
+            }
+            if ((options.tcp_connect_timeout = atoi(argv[i + 1])) < 0) {
+                fprintf(stderr, "%s: wrong argument\n", arg);
+                return 0;
+            }
+            i++;
+        }
+        else if (!strcmp(arg, "--tcp-idle-timeout")) {
+            if (1 >= argc - i) {
+                fprintf(stderr, "%s: requires an argument\n", arg);
+                return 0;
+            }
+            if ((options.tcp_idle_timeout = atoi(argv[i + 1])) < 0) {
+                fprintf(stderr, "%s: wrong argument\n", arg);
+                return 0;
+            }
+            i++;
+        }
+        else if (!strcmp(arg, "--tcp-half-closed-timeout")) {
+            if (1 >= argc - i) {
+                fprintf(stderr, "%s: requires an argument\n", arg);
+                return 0;
+            }
+            if ((options.tcp_half_closed_timeout = atoi(argv[i + 1])) < 0) {
+                fprintf(stderr, "%s: wrong argument\n", arg);
+                return 0;
+            }
+            i++;
+        }
         else {
             fprintf(stderr, "unknown option: %s\n", arg);
             return 0;
@@ -1137,6 +1441,18 @@ int process_arguments (void)
         return 0;
     }
 
+    // parse fake DNS network
+    if (options.fake_dns) {
+        if (!ipaddr_parse_ipv4_ifaddr(options.fake_dns_net, &fake_dns_net)) {
+            BLog(BLOG_ERROR, "fake DNS net: incorrect");
+            return 0;
+        }
+        if (fake_dns_net.prefix > 30) {
+            BLog(BLOG_ERROR, "fake DNS net: prefix must be at most 30");
+            return 0;
+        }
+    }
+
     // parse IP6 address
     if (options.netif_ip6addr) {
         if (!ipaddr6_parse_ipv6_addr(options.netif_ip6addr, &netif_ip6addr)) {
@@ -1256,6 +1572,22 @@ void lwip_init_job_hadler (void *unused)
     // init lwip
     lwip_init();
 
+    // derive the MSS from the device MTU, leaving at least two segments per window;
+    // with the netif MTU set, lwip lowers it further for the IPv6 header per connection
+    int mss = BTap_GetMTU(&device) - IP_HLEN - TCP_HLEN;
+    int mss_max = LWIP_MIN(g_tcp_snd_buf, g_tcp_wnd) / 2;
+    if (mss > mss_max) {
+        mss = mss_max;
+    }
+    if (mss < MIN_TCP_MSS) {
+        mss = MIN_TCP_MSS;
+    }
+    g_tcp_mss = mss;
+    // with offload, the kernel cuts our segments down to the peer's size
+    g_tcp_gso = (BTap_GetMTU(&device) > BTap_GetLinkMTU(&device));
+    g_tcp_snd_queuelen = LWIP_MIN(4 * g_tcp_snd_buf / mss, TCP_SNDQUEUELEN_OVERFLOW);
+    BLog(BLOG_INFO, "TCP MSS %d (IPv4), %d (IPv6), send queue %d segments", mss, LWIP_MIN(mss, BTap_GetMTU(&device) - IP6_HLEN - TCP_HLEN), (int)g_tcp_snd_queuelen);
+
     // make addresses for netif
     ip_addr_t addr;
     addr.addr = netif_ipaddr.ipv4;
@@ -1346,14 +1678,101 @@ void tcp_timer_handler (void *unused)
 
     BLog(BLOG_DEBUG, "TCP timer");
 
-    // schedule next timer
-    // TODO: calculate timeout so we don't drift
-    BReactor_SetTimerAbsolute(&ss, &tcp_timer, btime_add(tcp_timer.base.absTime, TCP_TMR_INTERVAL));
+    // schedule next timer relative to when this one was due, so we don't drift;
+    // if we have fallen behind (e.g. the device was asleep), skip the missed ticks
+    // instead of running them back to back
+    idle_now = btime_gettime();
+    btime_t next_time = btime_add(tcp_timer.base.absTime, TCP_TMR_INTERVAL);
+    if (next_time <= idle_now) {
+        next_time = btime_add(idle_now, TCP_TMR_INTERVAL);
+    }
+    BReactor_SetTimerAbsolute(&ss, &tcp_timer, next_time);
 
     tcp_tmr();
+
+    reap_idle_clients();
     return;
 }
 
+void reap_idle_clients (void)
+{
+    // the lists are ordered by last activity, so only clients that are reaped are looked at
+    for (int i = 0; i < CLIENT_NUM_STATES; i++) {
+        if (idle_timeouts[i] == 0) {
+            continue;
+        }
+
+        LinkedList1Node *node;
+        while ((node = LinkedList1_GetFirst(&idle_lists[i]))) {
+            struct tcp_client *client = UPPER_OBJECT(node, struct tcp_client, idle_list_node);
+            if (idle_now - client->idle_since < idle_timeouts[i]) {
+                break;
+            }
+
+            client_log(client, BLOG_INFO, "idle timeout");
+            idle_reaped[i]++;
+            client_murder(client);
+        }
+    }
+}
+
+int reap_clients_idle_for (btime_t idle_time)
+{
+    int count = 0;
+
+    for (int i = 0; i < CLIENT_NUM_STATES; i++) {
+        LinkedList1Node *node;
+        while ((node = LinkedList1_GetFirst(&idle_lists[i]))) {
+            struct tcp_client *client = UPPER_OBJECT(node, struct tcp_client, idle_list_node);
+            if (idle_now - client->idle_since < idle_time) {
+                break;
+            }
+
+            client_log(client, BLOG_INFO, "reaping after network change");
+            client_murder(client);
+            count++;
+        }
+    }
+
+    return count;
+}
+
+void log_client_stats (void)
+{
+    // count established clients that have been idle for a while
+    int num_idle = 0;
+    for (LinkedList1Node *node = LinkedList1_GetFirst(&idle_lists[CLIENT_STATE_ESTABLISHED]); node; node = LinkedList1Node_Next(node)) {
+        struct tcp_client *client = UPPER_OBJECT(node, struct tcp_client, idle_list_node);
+        if (idle_now - client->idle_since < IDLE_REPORT_TIME) {
+            break;
+        }
+        num_idle++;
+    }
+
+    BLog(BLOG_INFO, "TCP: %d queued, %d connecting, %d established (%d idle), %d half-closed; reaped %"PRIu64" connecting, %"PRIu64" idle, %"PRIu64" half-closed, %"PRIu64" after network changes",
+         idle_list_counts[CLIENT_STATE_QUEUED], idle_list_counts[CLIENT_STATE_CONNECTING], idle_list_counts[CLIENT_STATE_ESTABLISHED], num_idle, idle_list_counts[CLIENT_STATE_HALF_CLOSED],
+         idle_reaped[CLIENT_STATE_CONNECTING], idle_reaped[CLIENT_STATE_ESTABLISHED], idle_reaped[CLIENT_STATE_HALF_CLOSED], network_change_reaped);
+}
+
+#ifndef BADVPN_USE_WINAPI
+
+void network_change_signal_handler (void *unused, int signo)
+{
+    ASSERT(signo == SIGUSR1)
+    ASSERT(!quitting)
+
+    // connections that were not moving data are likely dead on the new network;
+    // drop them now rather than letting applications wait for them to time out
+    idle_now = btime_gettime();
+    int count = reap_clients_idle_for(NETWORK_CHANGE_IDLE_TIME);
+    network_change_reaped += count;
+
+    BLog(BLOG_NOTICE, "network changed, reaped %d idle connections", count);
+    log_client_stats();
+}
+
+#endif
+
 void device_error_handler (void *unused)
 {
     ASSERT(!quitting)
@@ -1374,16 +1793,28 @@ void device_read_handler_send (void *unused, uint8_t *data, int data_len)
     // accept packet
     PacketPassInterface_Done(&device_read_interface);
 
+    // with offload, the kernel tells us when checksums need not be verified
+    int csum_trusted = BTap_OutputChecksumTrusted(&device);
+
+    // parse UDP once and try the handlers in order; anything else goes to lwip
+    struct device_udp_packet pkt;
+    if (parse_device_udp_packet(data, data_len, csum_trusted, &pkt)) {
+        // answer DNS queries with fake addresses
+        if (process_device_fake_dns_packet(&pkt)) {
+            return;
+        }
+
 #ifdef ANDROID
-    // process DNS directly
-    if (process_device_dns_packet(data, data_len)) {
-        return;
-    }
+        // process DNS directly
+        if (process_device_dns_packet(&pkt)) {
+            return;
+        }
 #endif
 
-    // process UDP directly
-    if (process_device_udp_packet(data, data_len)) {
-        return;
+        // process UDP directly
+        if (process_device_udp_packet(&pkt)) {
+            return;
+        }
     }
 
     // obtain pbuf
@@ -1391,7 +1822,8 @@ void device_read_handler_send (void *unused, uint8_t *data, int data_len)
         BLog(BLOG_WARNING, "device read: packet too large");
         return;
     }
-    struct pbuf *p = pbuf_alloc(PBUF_RAW, data_len, PBUF_POOL);
+    // packets larger than a pool buffer go into a single pbuf rather than a chain
+    struct pbuf *p = pbuf_alloc(PBUF_RAW, data_len, (data_len > PBUF_POOL_BUFSIZE ? PBUF_RAM : PBUF_POOL));
     if (!p) {
         BLog(BLOG_WARNING, "device read: pbuf_alloc failed");
         return;
@@ -1399,6 +1831,9 @@ void device_read_handler_send (void *unused, uint8_t *data, int data_len)
 
     // write packet to pbuf
     ASSERT_FORCE(pbuf_take(p, data, data_len) == ERR_OK)
+    if (csum_trusted) {
+        p->flags |= PBUF_FLAG_CSUM_OK;
+    }
 
     // pass pbuf to input
     if (netif.input(p, &netif) != ERR_OK) {
@@ -1407,55 +1842,110 @@ void device_read_handler_send (void *unused, uint8_t *data, int data_len)
     }
 }
 
-#ifdef ANDROID
-int process_device_dns_packet (uint8_t *data, int data_len)
+int parse_device_udp_packet (uint8_t *data, int data_len, int csum_trusted, struct device_udp_packet *out)
 {
     ASSERT(data_len >= 0)
 
-    // do nothing if we don't have dnsgw
-    if (num_dnsgws == 0) {
-        goto fail;
+    // nobody to hand UDP packets to
+#ifdef ANDROID
+    if (!options.fake_dns && num_dnsgws == 0 && !options.udpgw_remote_server_addr) {
+        return 0;
     }
+#else
+    if (!options.fake_dns && !options.udpgw_remote_server_addr) {
+        return 0;
+    }
+#endif
 
-    static int init = 0;
-    static int dnsgw_idx = 0;
-
-    int to_dns;
-    int from_dns;
-    int packet_length = 0;
-
-    uint8_t ip_version = 0;
-    if (data_len > 0) {
-        ip_version = (data[0] >> 4);
+    if (data_len == 0) {
+        return 0;
     }
 
-    switch (ip_version) {
+    switch (data[0] >> 4) {
         case 4: {
-            // ignore non-UDP packets
+            // everything except UDP goes to lwip unparsed
             if (data_len < sizeof(struct ipv4_header) || data[offsetof(struct ipv4_header, protocol)] != IPV4_PROTOCOL_UDP) {
-                goto fail;
+                return 0;
             }
 
             // parse IPv4 header
-            struct ipv4_header ipv4_header;
-            if (!ipv4_check(data, data_len, &ipv4_header, &data, &data_len)) {
-                goto fail;
+            if (!ipv4_check(data, data_len, &out->ipv4, &data, &data_len)) {
+                return 0;
             }
 
             // parse UDP
-            struct udp_header udp_header;
-            if (!udp_check(data, data_len, &udp_header, &data, &data_len)) {
-                goto fail;
+            if (!udp_check(data, data_len, &out->udp, &out->payload, &out->payload_len)) {
+                return 0;
+            }
+
+            // verify UDP checksum, unless the sender did not compute one;
+            // the checksum over a correct packet including its checksum field is zero
+            if (!csum_trusted && out->udp.checksum != 0 && udp_checksum(&out->udp, out->payload, out->payload_len, out->ipv4.source_address, out->ipv4.destination_address) != 0) {
+                return 0;
+            }
+
+            out->ip_version = 4;
+        } break;
+
+        case 6: {
+            // ignore if IPv6 support is disabled
+            if (!options.netif_ip6addr) {
+                return 0;
+            }
+
+            // everything except UDP goes to lwip unparsed
+            if (data_len < sizeof(struct ipv6_header) || data[offsetof(struct ipv6_header, next_header)] != IPV6_NEXT_UDP) {
+                return 0;
+            }
+
+            // parse IPv6 header
+            if (!ipv6_check(data, data_len, &out->ipv6, &data, &data_len)) {
+                return 0;
+            }
+
+            // parse UDP
+            if (!udp_check(data, data_len, &out->udp, &out->payload, &out->payload_len)) {
+                return 0;
             }
 
             // verify UDP checksum
-            uint16_t checksum_in_packet = udp_header.checksum;
-            udp_header.checksum = 0;
-            uint16_t checksum_computed = udp_checksum(&udp_header, data, data_len, ipv4_header.source_address, ipv4_header.destination_address);
-            if (checksum_in_packet != checksum_computed) {
-                goto fail;
+            if (!csum_trusted && udp_ip6_checksum(&out->udp, out->payload, out->payload_len, out->ipv6.source_address, out->ipv6.destination_address) != 0) {
+                return 0;
             }
 
+            out->ip_version = 6;
+        } break;
+
+        default:
+            return 0;
+    }
+
+    return 1;
+}
+
+#ifdef ANDROID
+int process_device_dns_packet (struct device_udp_packet *pkt)
+{
+    // do nothing if we don't have dnsgw
+    if (num_dnsgws == 0) {
+        goto fail;
+    }
+
+    static int init = 0;
+    static int dnsgw_idx = 0;
+
+    int to_dns;
+    int from_dns;
+    int packet_length = 0;
+
+    uint8_t *data = pkt->payload;
+    int data_len = pkt->payload_len;
+
+    switch (pkt->ip_version) {
+        case 4: {
+            struct ipv4_header ipv4_header = pkt->ipv4;
+            struct udp_header udp_header = pkt->udp;
+
             // to port 53 is considered a DNS packet
             to_dns = udp_header.dest_port == hton16(53);
 
@@ -1604,35 +2094,8 @@ int process_device_dns_packet (uint8_t *data, int data_len)
             // Force IPv4 priority.
             goto fail;
 
-            // ignore if IPv6 support is disabled
-            if (!options.netif_ip6addr) {
-                goto fail;
-            }
-
-            // ignore non-UDP packets
-            if (data_len < sizeof(struct ipv6_header) || data[offsetof(struct ipv6_header, next_header)] != IPV6_NEXT_UDP) {
-                goto fail;
-            }
-
-            // parse IPv6 header
-            struct ipv6_header ipv6_header;
-            if (!ipv6_check(data, data_len, &ipv6_header, &data, &data_len)) {
-                goto fail;
-            }
-
-            // parse UDP
-            struct udp_header udp_header;
-            if (!udp_check(data, data_len, &udp_header, &data, &data_len)) {
-                goto fail;
-            }
-
-            // verify UDP checksum
-            uint16_t checksum_in_packet = udp_header.checksum;
-            udp_header.checksum = 0;
-            uint16_t checksum_computed = udp_ip6_checksum(&udp_header, data, data_len, ipv6_header.source_address, ipv6_header.destination_address);
-            if (checksum_in_packet != checksum_computed) {
-                goto fail;
-            }
+            struct ipv6_header ipv6_header = pkt->ipv6;
+            struct udp_header udp_header = pkt->udp;
 
             // to port 53 is considered a DNS packet
             to_dns = udp_header.dest_port == hton16(53);
@@ -1696,7 +2159,7 @@ int process_device_dns_packet (uint8_t *data, int data_len)
     }
 
     // submit packet
-    BTap_Send(&device, device_write_buf, packet_length);
+    device_send(device_write_buf, packet_length);
 
     return 1;
 
@@ -1705,53 +2168,164 @@ fail:
 }
 #endif
 
-int process_device_udp_packet (uint8_t *data, int data_len)
+int process_device_fake_dns_packet (struct device_udp_packet *pkt)
 {
-    ASSERT(data_len >= 0)
-
-    // do nothing if we don't have udpgw
-    if (!options.udpgw_remote_server_addr) {
+    // do nothing if fake DNS is disabled
+    if (!options.fake_dns) {
         goto fail;
     }
 
-    BAddr local_addr;
-    BAddr remote_addr;
-    int is_dns;
+    int packet_length = 0;
 
-    uint8_t ip_version = 0;
-    if (data_len > 0) {
-        ip_version = (data[0] >> 4);
-    }
+    uint8_t *data = pkt->payload;
+    int data_len = pkt->payload_len;
 
-    switch (ip_version) {
+    switch (pkt->ip_version) {
         case 4: {
-            // ignore non-UDP packets
-            if (data_len < sizeof(struct ipv4_header) || data[offsetof(struct ipv4_header, protocol)] != IPV4_PROTOCOL_UDP) {
+            struct ipv4_header ipv4_header = pkt->ipv4;
+            struct udp_header udp_header = pkt->udp;
+
+            // only queries to port 53 are answered
+            if (udp_header.dest_port != hton16(53)) {
                 goto fail;
             }
 
-            // parse IPv4 header
-            struct ipv4_header ipv4_header;
-            if (!ipv4_check(data, data_len, &ipv4_header, &data, &data_len)) {
+#ifdef ANDROID
+            // leave queries of the DNS gateway itself alone
+            for (int i = 0; i < num_dnsgws; i++) {
+                if (ipv4_header.source_address == dnsgws[i].ipv4.ip) {
+                    goto fail;
+                }
+            }
+#endif
+
+            // write answer after the headers
+            if (BTap_GetMTU(&device) < (int)(sizeof(struct ipv4_header) + sizeof(struct udp_header) + FAKEDNS_MAX_RESPONSE)) {
+                goto fail;
+            }
+            uint8_t *answer = device_write_buf + sizeof(struct ipv4_header) + sizeof(struct udp_header);
+            int answer_len = FakeDns_ProcessQuery(&fake_dns, data, data_len, answer);
+            if (answer_len == 0) {
                 goto fail;
             }
 
-            // parse UDP
-            struct udp_header udp_header;
-            if (!udp_check(data, data_len, &udp_header, &data, &data_len)) {
+            BLog(BLOG_DEBUG, "UDP: answered DNS query from fake DNS");
+
+            // build IPv4 header
+            struct ipv4_header ipv4_h;
+            ipv4_h.version4_ihl4 = IPV4_MAKE_VERSION_IHL(sizeof(ipv4_h));
+            ipv4_h.ds = hton8(0);
+            ipv4_h.total_length = hton16(sizeof(ipv4_h) + sizeof(struct udp_header) + answer_len);
+            ipv4_h.identification = hton16(0);
+            ipv4_h.flags3_fragmentoffset13 = hton16(0);
+            ipv4_h.ttl = hton8(64);
+            ipv4_h.protocol = hton8(IPV4_PROTOCOL_UDP);
+            ipv4_h.checksum = hton16(0);
+            ipv4_h.source_address = ipv4_header.destination_address;
+            ipv4_h.destination_address = ipv4_header.source_address;
+            ipv4_h.checksum = ipv4_checksum(&ipv4_h, NULL, 0);
+
+            // build UDP header
+            struct udp_header udp_h;
+            udp_h.source_port = udp_header.dest_port;
+            udp_h.dest_port = udp_header.source_port;
+            udp_h.length = hton16(sizeof(udp_h) + answer_len);
+            udp_h.checksum = hton16(0);
+            udp_h.checksum = udp_checksum(&udp_h, answer, answer_len, ipv4_h.source_address, ipv4_h.destination_address);
+
+            // write headers
+            memcpy(device_write_buf, &ipv4_h, sizeof(ipv4_h));
+            memcpy(device_write_buf + sizeof(ipv4_h), &udp_h, sizeof(udp_h));
+            packet_length = sizeof(ipv4_h) + sizeof(udp_h) + answer_len;
+        } break;
+
+        case 6: {
+            struct ipv6_header ipv6_header = pkt->ipv6;
+            struct udp_header udp_header = pkt->udp;
+
+            // only queries to port 53 are answered
+            if (udp_header.dest_port != hton16(53)) {
                 goto fail;
             }
 
-            // verify UDP checksum
-            uint16_t checksum_in_packet = udp_header.checksum;
-            udp_header.checksum = 0;
-            uint16_t checksum_computed = udp_checksum(&udp_header, data, data_len, ipv4_header.source_address, ipv4_header.destination_address);
-            if (checksum_in_packet != checksum_computed) {
+            // write answer after the headers
+            if (BTap_GetMTU(&device) < (int)(sizeof(struct ipv6_header) + sizeof(struct udp_header) + FAKEDNS_MAX_RESPONSE)) {
+                goto fail;
+            }
+            uint8_t *answer = device_write_buf + sizeof(struct ipv6_header) + sizeof(struct udp_header);
+            int answer_len = FakeDns_ProcessQuery(&fake_dns, data, data_len, answer);
+            if (answer_len == 0) {
                 goto fail;
             }
 
+            BLog(BLOG_DEBUG, "UDP/IPv6: answered DNS query from fake DNS");
+
+            // build IPv6 header
+            struct ipv6_header ipv6_h;
+            ipv6_h.version4_tc4 = hton8(0x60);
+            ipv6_h.tc4_fl4 = hton8(0);
+            ipv6_h.fl = hton16(0);
+            ipv6_h.payload_length = hton16(sizeof(struct udp_header) + answer_len);
+            ipv6_h.next_header = hton8(IPV6_NEXT_UDP);
+            ipv6_h.hop_limit = hton8(64);
+            memcpy(ipv6_h.source_address, ipv6_header.destination_address, 16);
+            memcpy(ipv6_h.destination_address, ipv6_header.source_address, 16);
+
+            // build UDP header
+            struct udp_header udp_h;
+            udp_h.source_port = udp_header.dest_port;
+            udp_h.dest_port = udp_header.source_port;
+            udp_h.length = hton16(sizeof(udp_h) + answer_len);
+            udp_h.checksum = hton16(0);
+            udp_h.checksum = udp_ip6_checksum(&udp_h, answer, answer_len, ipv6_h.source_address, ipv6_h.destination_address);
+
+            // write headers
+            memcpy(device_write_buf, &ipv6_h, sizeof(ipv6_h));
+            memcpy(device_write_buf + sizeof(ipv6_h), &udp_h, sizeof(udp_h));
+            packet_length = sizeof(ipv6_h) + sizeof(udp_h) + answer_len;
+        } break;
+
+        default: {
+            goto fail;
+        } break;
+    }
+
+    // submit packet
+    device_send(device_write_buf, packet_length);
+
+    return 1;
+
+fail:
+    return 0;
+}
+
+int process_device_udp_packet (struct device_udp_packet *pkt)
+{
+    // do nothing if we don't have udpgw
+    if (!options.udpgw_remote_server_addr) {
+        goto fail;
+    }
+
+    BAddr local_addr;
+    BAddr remote_addr;
+    int is_dns;
+
+    uint8_t *data = pkt->payload;
+    int data_len = pkt->payload_len;
+
+    switch (pkt->ip_version) {
+        case 4: {
+            struct ipv4_header ipv4_header = pkt->ipv4;
+            struct udp_header udp_header = pkt->udp;
+
             BLog(BLOG_INFO, "UDP: from device %d bytes", data_len);
 
+            // names of fake DNS addresses cannot be passed to udpgw
+            if (options.fake_dns && FakeDns_IsFake(&fake_dns, ipv4_header.destination_address)) {
+                BLog(BLOG_INFO, "UDP: dropping packet to fake DNS address");
+                return 1;
+            }
+
             // construct addresses
             BAddr_InitIPv4(&local_addr, ipv4_header.source_address, udp_header.source_port);
             BAddr_InitIPv4(&remote_addr, ipv4_header.destination_address, udp_header.dest_port);
@@ -1767,35 +2341,8 @@ int process_device_udp_packet (uint8_t *data, int data_len)
             // Force IPv4 priority.
             goto fail;
 
-            // ignore if IPv6 support is disabled
-            if (!options.netif_ip6addr) {
-                goto fail;
-            }
-
-            // ignore non-UDP packets
-            if (data_len < sizeof(struct ipv6_header) || data[offsetof(struct ipv6_header, next_header)] != IPV6_NEXT_UDP) {
-                goto fail;
-            }
-
-            // parse IPv6 header
-            struct ipv6_header ipv6_header;
-            if (!ipv6_check(data, data_len, &ipv6_header, &data, &data_len)) {
-                goto fail;
-            }
-
-            // parse UDP
-            struct udp_header udp_header;
-            if (!udp_check(data, data_len, &udp_header, &data, &data_len)) {
-                goto fail;
-            }
-
-            // verify UDP checksum
-            uint16_t checksum_in_packet = udp_header.checksum;
-            udp_header.checksum = 0;
-            uint16_t checksum_computed = udp_ip6_checksum(&udp_header, data, data_len, ipv6_header.source_address, ipv6_header.destination_address);
-            if (checksum_in_packet != checksum_computed) {
-                goto fail;
-            }
+            struct ipv6_header ipv6_header = pkt->ipv6;
+            struct udp_header udp_header = pkt->udp;
 
             BLog(BLOG_INFO, "UDP/IPv6: from device %d bytes", data_len);
 
@@ -1833,6 +2380,7 @@ err_t netif_init_func (struct netif *netif)
 
     netif->name[0] = 'h';
     netif->name[1] = 'o';
+    netif->mtu = BTap_GetMTU(&device);
     netif->output = netif_output_func;
     netif->output_ip6 = netif_output_ip6_func;
 
@@ -1849,6 +2397,18 @@ err_t netif_output_ip6_func (struct netif *netif, struct pbuf *p, ip6_addr_t *ip
     return common_netif_output(netif, p);
 }
 
+void device_send (uint8_t *data, int data_len)
+{
+    ASSERT(data_len >= 0)
+    ASSERT(data_len <= BTap_GetMTU(&device))
+
+    if (options.tun_queue_packets > 0) {
+        TunScheduler_Send(&device_scheduler, data, data_len);
+    } else {
+        BTap_Send(&device, data, data_len);
+    }
+}
+
 err_t common_netif_output (struct netif *netif, struct pbuf *p)
 {
     SYNC_DECL
@@ -1867,7 +2427,7 @@ err_t common_netif_output (struct netif *netif, struct pbuf *p)
         }
 
         SYNC_FROMHERE
-        BTap_Send(&device, (uint8_t *)p->payload, p->len);
+        device_send((uint8_t *)p->payload, p->len);
         SYNC_COMMIT
     } else {
         int len = 0;
@@ -1881,7 +2441,7 @@ err_t common_netif_output (struct netif *netif, struct pbuf *p)
         } while ((p = p->next));
 
         SYNC_FROMHERE
-        BTap_Send(&device, device_write_buf, len);
+        device_send(device_write_buf, len);
         SYNC_COMMIT
     }
 
@@ -1943,19 +2503,6 @@ err_t listener_accept_func (void *arg, struct tcp_pcb *newpcb, err_t err)
         BLog(BLOG_ERROR, "listener accept: pool_alloc failed");
         goto fail0;
     }
-    client->buf = (uint8_t *)pool_alloc(&buf_pool);
-    if (!client->buf) {
-        BLog(BLOG_ERROR, "listener accept: pool_alloc failed (buf)");
-        pool_free(&client_pool, client);
-        goto fail0;
-    }
-    client->socks_recv_buf = (uint8_t *)pool_alloc(&socks_buf_pool);
-    if (!client->socks_recv_buf) {
-        BLog(BLOG_ERROR, "listener accept: pool_alloc failed (socks_recv_buf)");
-        pool_free(&buf_pool, client->buf);
-        pool_free(&client_pool, client);
-        goto fail0;
-    }
     client->socks_username = NULL;
 
     SYNC_DECL
@@ -1965,11 +2512,12 @@ err_t listener_accept_func (void *arg, struct tcp_pcb *newpcb, err_t err)
     client->local_addr = baddr_from_lwip(PCB_ISIPV6(newpcb), &newpcb->local_ip, newpcb->local_port);
     client->remote_addr = baddr_from_lwip(PCB_ISIPV6(newpcb), &newpcb->remote_ip, newpcb->remote_port);
 
-    // get destination address
+    // refuse fake DNS addresses that are not assigned; the name is looked up again when connecting
     BAddr addr = client->local_addr;
-#ifdef OVERRIDE_DEST_ADDR
-    ASSERT_FORCE(BAddr_Parse2(&addr, OVERRIDE_DEST_ADDR, NULL, 0, 1))
-#endif
+    if (options.fake_dns && addr.type == BADDR_TYPE_IPV4 && FakeDns_IsFake(&fake_dns, addr.ipv4.ip) && !FakeDns_Lookup(&fake_dns, addr.ipv4.ip)) {
+        BLog(BLOG_ERROR, "listener accept: fake DNS address is not assigned");
+        goto fail1;
+    }
 
     // add source address to username if requested
     if (options.username && options.append_source_to_username) {
@@ -1979,15 +2527,6 @@ err_t listener_accept_func (void *arg, struct tcp_pcb *newpcb, err_t err)
         if (!client->socks_username) {
             goto fail1;
         }
-        socks_auth_info[1].password.username = client->socks_username;
-        socks_auth_info[1].password.username_len = strlen(client->socks_username);
-    }
-
-    // init SOCKS
-    if (!BSocksClient_Init(&client->socks_client, socks_server_addr, socks_auth_info, socks_num_auth_info,
-                           addr, (BSocksClient_handler)client_socks_handler, client, &ss)) {
-        BLog(BLOG_ERROR, "listener accept: BSocksClient_Init failed");
-        goto fail1;
     }
 
     // init dead vars
@@ -1997,6 +2536,12 @@ err_t listener_accept_func (void *arg, struct tcp_pcb *newpcb, err_t err)
     // add to linked list
     LinkedList1_Append(&tcp_clients, &client->list_node);
 
+    // add to idle list
+    client->idle_state = CLIENT_STATE_QUEUED;
+    client->idle_since = idle_now;
+    LinkedList1_Append(&idle_lists[client->idle_state], &client->idle_list_node);
+    idle_list_counts[client->idle_state]++;
+
     // increment counter
     ASSERT(num_clients >= 0)
     num_clients++;
@@ -2017,13 +2562,18 @@ err_t listener_accept_func (void *arg, struct tcp_pcb *newpcb, err_t err)
     tcp_err(client->pcb, client_err_func);
     tcp_recv(client->pcb, client_recv_func);
 
-    // setup buffer
+    // setup buffer, allocated when data arrives
+    client->buf = NULL;
     client->buf_used = 0;
 
-    // set SOCKS not up, not closed
+    // set SOCKS not started, not up, not closed
+    client->socks_started = 0;
     client->socks_up = 0;
     client->socks_closed = 0;
 
+    // wait for a slot to connect to the SOCKS server; data from the client is buffered meanwhile
+    ConnectSchedulerEntry_Init(&client->socks_connect, &connect_scheduler, client_connect_priority(client), (ConnectScheduler_handler)client_socks_start, client);
+
     client_log(client, BLOG_INFO, "accepted");
 
     DEAD_ENTER(client->dead_client)
@@ -2038,8 +2588,6 @@ err_t listener_accept_func (void *arg, struct tcp_pcb *newpcb, err_t err)
 fail1:
     SYNC_BREAK
     free(client->socks_username);
-    pool_free(&buf_pool, client->buf);
-    pool_free(&socks_buf_pool, client->socks_recv_buf);
     pool_free(&client_pool, client);
 fail0:
     return ERR_MEM;
@@ -2060,6 +2608,7 @@ void client_handle_freed_client (struct tcp_client *client)
     // if we have data to be sent to SOCKS and can send it, keep sending
     if (client->buf_used > 0 && !client->socks_closed) {
         client_log(client, BLOG_INFO, "waiting untill buffered data is sent to SOCKS");
+        client_set_state(client, CLIENT_STATE_HALF_CLOSED);
     } else {
         if (!client->socks_closed) {
             client_free_socks(client);
@@ -2115,8 +2664,10 @@ void client_free_socks (struct tcp_client *client)
         }
     }
 
-    // free SOCKS
-    BSocksClient_Free(&client->socks_client);
+    // free SOCKS, or stop waiting to connect
+    if (client->socks_started) {
+        BSocksClient_Free(&client->socks_client);
+    }
 
     // set SOCKS closed
     client->socks_closed = 1;
@@ -2124,6 +2675,7 @@ void client_free_socks (struct tcp_client *client)
     // if we have data to be sent to the client and we can send it, keep sending
     if (client->socks_up && (client->socks_recv_buf_used >= 0 || client->socks_recv_tcp_pending > 0) && !client->client_closed) {
         client_log(client, BLOG_INFO, "waiting until buffered data is sent to client");
+        client_set_state(client, CLIENT_STATE_HALF_CLOSED);
     } else {
         if (!client->client_closed) {
             client_free_client(client);
@@ -2155,7 +2707,9 @@ void client_murder (struct tcp_client *client)
     // free SOCKS
     if (!client->socks_closed) {
         // free SOCKS
-        BSocksClient_Free(&client->socks_client);
+        if (client->socks_started) {
+            BSocksClient_Free(&client->socks_client);
+        }
 
         // set SOCKS closed
         client->socks_closed = 1;
@@ -2177,16 +2731,54 @@ void client_dealloc (struct tcp_client *client)
     // remove client entry
     LinkedList1_Remove(&tcp_clients, &client->list_node);
 
+    // remove from idle list
+    LinkedList1_Remove(&idle_lists[client->idle_state], &client->idle_list_node);
+    idle_list_counts[client->idle_state]--;
+
     // kill dead var
     DEAD_KILL(client->dead);
 
+    // release connect slot or queue position
+    ConnectSchedulerEntry_Free(&client->socks_connect);
+
     // free memory
     free(client->socks_username);
     pool_free(&buf_pool, client->buf);
-    pool_free(&socks_buf_pool, client->socks_recv_buf);
+    if (client->socks_up && client->socks_recv_buf != client->socks_recv_idle_buf) {
+        pool_free(&socks_buf_pool, client->socks_recv_buf);
+    }
     pool_free(&client_pool, client);
 }
 
+void client_set_state (struct tcp_client *client, int state)
+{
+    if (client->idle_state == state) {
+        return;
+    }
+
+    // move to the end of the list of the new state; the time in the new state counts from now
+    LinkedList1_Remove(&idle_lists[client->idle_state], &client->idle_list_node);
+    idle_list_counts[client->idle_state]--;
+    client->idle_state = state;
+    client->idle_since = idle_now;
+    LinkedList1_Append(&idle_lists[client->idle_state], &client->idle_list_node);
+    idle_list_counts[client->idle_state]++;
+}
+
+void client_touch (struct tcp_client *client)
+{
+    // the connect timeout counts from when the SOCKS connect was started;
+    // otherwise record activity at most once per timer tick
+    if (client->idle_state == CLIENT_STATE_CONNECTING || client->idle_since == idle_now) {
+        return;
+    }
+
+    // move to the end of the list
+    client->idle_since = idle_now;
+    LinkedList1_Remove(&idle_lists[client->idle_state], &client->idle_list_node);
+    LinkedList1_Append(&idle_lists[client->idle_state], &client->idle_list_node);
+}
+
 void client_err_func (void *arg, err_t err)
 {
     struct tcp_client *client = (struct tcp_client *)arg;
@@ -2219,9 +2811,24 @@ err_t client_recv_func (void *arg, struct tcp_pcb *tpcb, struct pbuf *p, err_t e
         return ERR_MEM;
     }
 
+    // get a buffer; if there is no memory, lwIP holds on to the data and retries
+    if (!client->buf) {
+        ASSERT(client->buf_used == 0)
+        if (!(client->buf = (uint8_t *)pool_alloc(&buf_pool))) {
+            client_log(client, BLOG_ERROR, "pool_alloc failed (buf)");
+            return ERR_MEM;
+        }
+    }
+
     // copy data to buffer
     ASSERT_EXECUTE(pbuf_copy_partial(p, client->buf + client->buf_used, p->tot_len, 0) == p->tot_len)
     client->buf_used += p->tot_len;
+    client_touch(client);
+
+    // the application is waiting for the connection now
+    if (!client->socks_started) {
+        ConnectSchedulerEntry_SetPriority(&client->socks_connect, client_connect_priority(client));
+    }
 
     // if there was nothing in the buffer before, and SOCKS is up, start send data
     if (client->buf_used == p->tot_len && client->socks_up) {
@@ -2244,6 +2851,68 @@ err_t client_recv_func (void *arg, struct tcp_pcb *tpcb, struct pbuf *p, err_t e
     return ERR_OK;
 }
 
+int client_connect_priority (struct tcp_client *client)
+{
+    // DNS first, then connections the application has sent data on; ones it has
+    // not (such as connections opened speculatively by browsers) can wait
+    if (BAddr_GetPort(&client->local_addr) == hton16(53)) {
+        return CONNECTSCHEDULER_PRIO_HIGH;
+    }
+
+    return (client->buf_used > 0 ? CONNECTSCHEDULER_PRIO_NORMAL : CONNECTSCHEDULER_PRIO_LOW);
+}
+
+void client_socks_start (struct tcp_client *client)
+{
+    ASSERT(!client->socks_started)
+    ASSERT(!client->socks_closed)
+
+    // time spent waiting in the connect scheduler doesn't count towards the connect timeout
+    if (client->idle_state == CLIENT_STATE_QUEUED) {
+        client_set_state(client, CLIENT_STATE_CONNECTING);
+    }
+
+    // get destination address
+    BAddr addr = client->local_addr;
+#ifdef OVERRIDE_DEST_ADDR
+    ASSERT_FORCE(BAddr_Parse2(&addr, OVERRIDE_DEST_ADDR, NULL, 0, 1))
+#endif
+
+    // use username with source address if requested
+    if (client->socks_username) {
+        socks_auth_info[1].password.username = client->socks_username;
+        socks_auth_info[1].password.username_len = strlen(client->socks_username);
+    }
+
+    // init SOCKS, connecting by name if the address came from fake DNS
+    if (options.fake_dns && addr.type == BADDR_TYPE_IPV4 && FakeDns_IsFake(&fake_dns, addr.ipv4.ip)) {
+        const char *name = FakeDns_Lookup(&fake_dns, addr.ipv4.ip);
+        if (!name) {
+            client_log(client, BLOG_ERROR, "fake DNS address is no longer assigned");
+            goto fail;
+        }
+        client_log(client, BLOG_INFO, "connecting to %s", name);
+        if (!BSocksClient_InitName(&client->socks_client, socks_server_addr, socks_auth_info, socks_num_auth_info,
+                                   name, addr.ipv4.port, (BSocksClient_handler)client_socks_handler, client, &ss)) {
+            client_log(client, BLOG_ERROR, "BSocksClient_InitName failed");
+            goto fail;
+        }
+    } else {
+        if (!BSocksClient_Init(&client->socks_client, socks_server_addr, socks_auth_info, socks_num_auth_info,
+                               addr, (BSocksClient_handler)client_socks_handler, client, &ss)) {
+            client_log(client, BLOG_ERROR, "BSocksClient_Init failed");
+            goto fail;
+        }
+    }
+
+    // set SOCKS started
+    client->socks_started = 1;
+    return;
+
+fail:
+    client_free_socks(client);
+}
+
 void client_socks_handler (struct tcp_client *client, int event)
 {
     ASSERT(!client->socks_closed)
@@ -2260,6 +2929,9 @@ void client_socks_handler (struct tcp_client *client, int event)
 
             client_log(client, BLOG_INFO, "SOCKS up");
 
+            // let the next connection start
+            ConnectSchedulerEntry_Done(&client->socks_connect);
+
             // init sending
             client->socks_send_if = BSocksClient_GetSendInterface(&client->socks_client);
             StreamPassInterface_Sender_Init(client->socks_send_if, (StreamPassInterface_handler_done)client_socks_send_handler_done, client);
@@ -2267,7 +2939,11 @@ void client_socks_handler (struct tcp_client *client, int event)
             // init receiving
             client->socks_recv_if = BSocksClient_GetRecvInterface(&client->socks_client);
             StreamRecvInterface_Receiver_Init(client->socks_recv_if, (StreamRecvInterface_handler_done)client_socks_recv_handler_done, client);
+            client->socks_recv_buf = client->socks_recv_idle_buf;
+            client->socks_recv_buf_size = bmin_int(CLIENT_SOCKS_RECV_IDLE_BUF_SIZE, g_socks_buf_size);
             client->socks_recv_buf_used = -1;
+            client->socks_recv_last_len = 0;
+            client->socks_recv_full_reads = 0;
             client->socks_recv_tcp_pending = 0;
             if (!client->client_closed) {
                 tcp_sent(client->pcb, client_sent_func);
@@ -2275,6 +2951,9 @@ void client_socks_handler (struct tcp_client *client, int event)
 
             // set up
             client->socks_up = 1;
+            if (!client->client_closed) {
+                client_set_state(client, CLIENT_STATE_ESTABLISHED);
+            }
 
             // start sending data if there is any
             if (client->buf_used > 0) {
@@ -2318,6 +2997,8 @@ void client_socks_send_handler_done (struct tcp_client *client, int data_len)
     ASSERT(data_len > 0)
     ASSERT(data_len <= client->buf_used)
 
+    client_touch(client);
+
     // remove sent data from buffer
     memmove(client->buf, client->buf + data_len, client->buf_used - data_len);
     client->buf_used -= data_len;
@@ -2330,8 +3011,14 @@ void client_socks_send_handler_done (struct tcp_client *client, int data_len)
     if (client->buf_used > 0) {
         // send any further data
         StreamPassInterface_Sender_Send(client->socks_send_if, client->buf, client->buf_used);
+        return;
     }
-    else if (client->client_closed) {
+
+    // release the buffer until more data arrives
+    pool_free(&buf_pool, client->buf);
+    client->buf = NULL;
+
+    if (client->client_closed) {
         // client was closed we've sent everything we had buffered; we're done with it
         client_log(client, BLOG_INFO, "removing after client went down");
 
@@ -2346,17 +3033,40 @@ void client_socks_recv_initiate (struct tcp_client *client)
     ASSERT(client->socks_up)
     ASSERT(client->socks_recv_buf_used == -1)
 
-    StreamRecvInterface_Receiver_Recv(client->socks_recv_if, client->socks_recv_buf, g_socks_buf_size);
+    // Read into the idle buffer until several reads in a row fill it, then into one of
+    // g_socks_buf_size bytes. Once a read leaves the socket drained, the large buffer is
+    // released so that connections waiting for data do not hold on to it.
+    if (client->socks_recv_buf == client->socks_recv_idle_buf) {
+        if (client->socks_recv_last_len < client->socks_recv_buf_size) {
+            client->socks_recv_full_reads = 0;
+        } else if (++client->socks_recv_full_reads >= CLIENT_SOCKS_RECV_FULL_READS && g_socks_buf_size > client->socks_recv_buf_size) {
+            uint8_t *buf = (uint8_t *)pool_alloc(&socks_buf_pool);
+            if (buf) {
+                client->socks_recv_buf = buf;
+                client->socks_recv_buf_size = g_socks_buf_size;
+            }
+        }
+    } else if (client->socks_recv_last_len < client->socks_recv_buf_size) {
+        pool_free(&socks_buf_pool, client->socks_recv_buf);
+        client->socks_recv_buf = client->socks_recv_idle_buf;
+        client->socks_recv_buf_size = CLIENT_SOCKS_RECV_IDLE_BUF_SIZE;
+        client->socks_recv_full_reads = 0;
+    }
+
+    StreamRecvInterface_Receiver_Recv(client->socks_recv_if, client->socks_recv_buf, client->socks_recv_buf_size);
 }
 
 void client_socks_recv_handler_done (struct tcp_client *client, int data_len)
 {
     ASSERT(data_len > 0)
-    ASSERT(data_len <= g_socks_buf_size)
+    ASSERT(data_len <= client->socks_recv_buf_size)
     ASSERT(!client->socks_closed)
     ASSERT(client->socks_up)
     ASSERT(client->socks_recv_buf_used == -1)
 
+    client->socks_recv_last_len = data_len;
+    client_touch(client);
+
     // if client was closed, stop receiving
     if (client->client_closed) {
         return;
@@ -2449,6 +3159,8 @@ err_t client_sent_func (void *arg, struct tcp_pcb *tpcb, u16_t len)
     ASSERT(len > 0)
     ASSERT(len <= client->socks_recv_tcp_pending)
 
+    client_touch(client);
+
     // decrement pending
     client->socks_recv_tcp_pending -= len;
 
@@ -2598,5 +3310,5 @@ void udpgw_client_handler_received (void *unused, BAddr local_addr, BAddr remote
     }
 
     // submit packet
-    BTap_Send(&device, device_write_buf, packet_length);
+    device_send(device_write_buf, packet_length);
 }
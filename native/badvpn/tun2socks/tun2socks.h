@@ -30,12 +30,65 @@
 // size of temporary buffer for passing data from the SOCKS server to TCP for sending
 #define CLIENT_SOCKS_RECV_BUF_SIZE 65536
 
+// size of the buffer embedded in each connection that SOCKS reads go to while little
+// data is flowing; a buffer of the above size is taken from a pool when a read fills it
+#define CLIENT_SOCKS_RECV_IDLE_BUF_SIZE 2048
+
+// number of consecutive reads filling the idle buffer after which the above-sized
+// buffer is taken; keeps short bursts from switching between the buffers
+#define CLIENT_SOCKS_RECV_FULL_READS 4
+
+// number of released per-connection data buffers kept for reuse by each pool
+#define CLIENT_BUF_POOL_MAX_FREE 16
+
+// lower bound for the TCP MSS derived from the device MTU
+#define MIN_TCP_MSS 64
+
 // maximum number of udpgw connections
 #define DEFAULT_UDPGW_MAX_CONNECTIONS 256
 
 // udpgw per-connection send buffer size, in number of packets
 #define DEFAULT_UDPGW_CONNECTION_BUFFER_SIZE 32
 
+// maximum number of packets queued for the TUN device by the output scheduler
+#define DEFAULT_TUN_QUEUE_PACKETS 256
+
+// maximum number of bytes queued for the TUN device by the output scheduler;
+// must be at least the device MTU
+#define TUN_QUEUE_MAX_BYTES (1024 * 1024)
+
+// bulk bytes written to the TUN device before other I/O is handled
+#define TUN_QUEUE_BULK_BUDGET 16384
+
+// fake DNS defaults: network addresses are taken from, and TTL of answers in seconds
+#define DEFAULT_FAKE_DNS_NET "198.18.0.0/15"
+#define DEFAULT_FAKE_DNS_TTL 60
+
+// maximum number of names mapped to fake addresses at the same time
+#define FAKE_DNS_MAX_ENTRIES 4096
+
+// maximum number of SOCKS connections being set up at the same time; connections
+// accepted beyond this wait for a slot with their data buffered
+#define DEFAULT_SOCKS_MAX_CONNECTING 32
+
+// SOCKS connections started per event loop iteration
+#define SOCKS_CONNECT_STARTS_PER_ITERATION 8
+
+// default idle timeouts of TCP connections in seconds, by state: connecting to the
+// SOCKS server, established, and one side closed with data left to send; 0 disables
+#define DEFAULT_TCP_CONNECT_TIMEOUT 30
+#define DEFAULT_TCP_IDLE_TIMEOUT 7200
+#define DEFAULT_TCP_HALF_CLOSED_TIMEOUT 60
+
+// on a network change (SIGUSR1), connections idle for this long are reaped
+#define NETWORK_CHANGE_IDLE_TIME 1000
+
+// established connections idle for this long are reported as idle in statistics
+#define IDLE_REPORT_TIME 60000
+
+// with --log-async, maximum number of messages per second from one call site
+#define DEFAULT_LOG_RATE_LIMIT 100
+
 // udpgw reconnect time after connection fails
 #define UDPGW_RECONNECT_TIME 5000
 
@@ -47,8 +47,11 @@
     #include <sys/socket.h>
     #include <net/if.h>
     #include <net/if_arp.h>
+    #include <sys/uio.h>
+    #include <arpa/inet.h>
     #ifdef BADVPN_LINUX
         #include <linux/if_tun.h>
+        #include <linux/virtio_net.h>
     #endif
     #ifdef BADVPN_FREEBSD
         #include <net/if_tun.h>
@@ -89,8 +92,172 @@ static void recv_olap_handler (BTap *o, int event, DWORD bytes)
     PacketRecvInterface_Done(&o->output, bytes);
 }
 
+static void writable_job_handler (BTap *o)
+{
+    DebugObject_Access(&o->d_obj);
+    ASSERT(o->handler_writable)
+    
+    BTap_handler_writable handler = o->handler_writable;
+    o->handler_writable = NULL;
+    
+    handler(o->handler_writable_user);
+    return;
+}
+
 #else
 
+#ifdef BADVPN_LINUX
+
+static uint32_t csum_add (uint32_t sum, const uint8_t *data, int len)
+{
+    // sum big-endian 32-bit words, which folds to the same 16-bit sum
+    uint64_t acc = sum;
+    int i = 0;
+    for (; i + 4 <= len; i += 4) {
+        uint32_t w;
+        memcpy(&w, data + i, 4);
+        acc += ntohl(w);
+    }
+    for (; i + 1 < len; i += 2) {
+        acc += ((uint32_t)data[i] << 8) | data[i + 1];
+    }
+    if (i < len) {
+        acc += (uint32_t)data[i] << 8;
+    }
+    
+    while (acc >> 16) {
+        acc = (acc & 0xFFFF) + (acc >> 16);
+    }
+    return acc;
+}
+
+static int parse_tcp_packet (const uint8_t *data, int len, int *out_l3_len, int *out_l4_len, int *out_ipv6, uint16_t *out_pseudo)
+{
+    int l3_len;
+    uint32_t sum;
+    
+    if (len >= 20 && (data[0] >> 4) == 4) {
+        l3_len = (data[0] & 0x0F) * 4;
+        if (l3_len < 20 || data[9] != 6 || (((data[6] << 8) | data[7]) & 0x3FFF) || ((data[2] << 8) | data[3]) != len) {
+            return 0;
+        }
+        sum = csum_add(6 + (len - l3_len), data + 12, 8);
+        *out_ipv6 = 0;
+    }
+    else if (len >= 40 && (data[0] >> 4) == 6) {
+        l3_len = 40;
+        if (data[6] != 6 || 40 + ((data[4] << 8) | data[5]) != len) {
+            return 0;
+        }
+        sum = csum_add(6 + (len - l3_len), data + 8, 32);
+        *out_ipv6 = 1;
+    }
+    else {
+        return 0;
+    }
+    
+    if (len - l3_len < 20) {
+        return 0;
+    }
+    int l4_len = (data[l3_len + 12] >> 4) * 4;
+    if (l4_len < 20 || l4_len > len - l3_len) {
+        return 0;
+    }
+    
+    *out_l3_len = l3_len;
+    *out_l4_len = l4_len;
+    *out_pseudo = sum;
+    return 1;
+}
+
+#endif
+
+static int read_packet (BTap *o, uint8_t *data)
+{
+#ifdef BADVPN_LINUX
+    if (o->vnet_hdr) {
+        struct virtio_net_hdr vh;
+        struct iovec iov[2];
+        iov[0].iov_base = &vh;
+        iov[0].iov_len = sizeof(vh);
+        iov[1].iov_base = data;
+        iov[1].iov_len = o->frame_mtu;
+        
+        int bytes = readv(o->fd, iov, 2);
+        if (bytes < 0) {
+            return bytes;
+        }
+        if (bytes < (int)sizeof(vh)) {
+            return 0;
+        }
+        bytes -= sizeof(vh);
+        
+        // the packet never left the host, so a checksum the kernel left to us is not
+        // computed at all; receivers are told to skip verification instead
+        o->output_csum_trusted = !!(vh.flags & (VIRTIO_NET_HDR_F_NEEDS_CSUM|VIRTIO_NET_HDR_F_DATA_VALID));
+        
+        return bytes;
+    }
+#endif
+    
+    return read(o->fd, data, o->frame_mtu);
+}
+
+static int write_packet (BTap *o, uint8_t *data, int data_len)
+{
+#ifdef BADVPN_LINUX
+    if (o->vnet_hdr) {
+        struct virtio_net_hdr vh;
+        memset(&vh, 0, sizeof(vh));
+        
+        struct iovec iov[4];
+        int iovcnt = 0;
+        iov[iovcnt].iov_base = &vh;
+        iov[iovcnt++].iov_len = sizeof(vh);
+        
+        int l3_len;
+        int l4_len;
+        int ipv6;
+        uint16_t pseudo_sum;
+        uint8_t pseudo[2];
+        
+        if (data_len > o->link_mtu && parse_tcp_packet(data, data_len, &l3_len, &l4_len, &ipv6, &pseudo_sum) &&
+            o->link_mtu > l3_len + l4_len
+        ) {
+            // have the kernel cut the segment to the link MTU
+            vh.flags = VIRTIO_NET_HDR_F_NEEDS_CSUM;
+            vh.gso_type = (ipv6 ? VIRTIO_NET_HDR_GSO_TCPV6 : VIRTIO_NET_HDR_GSO_TCPV4);
+            vh.hdr_len = l3_len + l4_len;
+            vh.gso_size = o->link_mtu - (l3_len + l4_len);
+            vh.csum_start = l3_len;
+            vh.csum_offset = 16;
+            
+            // the checksum field must carry the pseudo-header sum; substitute it
+            // in the I/O vector so that the caller's packet is left intact
+            pseudo[0] = pseudo_sum >> 8;
+            pseudo[1] = pseudo_sum;
+            iov[iovcnt].iov_base = data;
+            iov[iovcnt++].iov_len = l3_len + 16;
+            iov[iovcnt].iov_base = pseudo;
+            iov[iovcnt++].iov_len = 2;
+            iov[iovcnt].iov_base = data + l3_len + 18;
+            iov[iovcnt++].iov_len = data_len - (l3_len + 18);
+        } else {
+            iov[iovcnt].iov_base = data;
+            iov[iovcnt++].iov_len = data_len;
+        }
+        
+        int bytes = writev(o->fd, iov, iovcnt);
+        if (bytes < 0) {
+            return bytes;
+        }
+        return bytes - (int)sizeof(vh);
+    }
+#endif
+    
+    return write(o->fd, data, data_len);
+}
+
 static void fd_handler (BTap *o, int events)
 {
     DebugObject_Access(&o->d_obj);
@@ -104,7 +271,7 @@ static void fd_handler (BTap *o, int events)
         ASSERT(o->output_packet)
         
         // try reading into the buffer
-        int bytes = read(o->fd, o->output_packet, o->frame_mtu);
+        int bytes = read_packet(o, o->output_packet);
         if (bytes < 0) {
             if (errno == EAGAIN || errno == EWOULDBLOCK) {
                 // retry later
@@ -127,6 +294,18 @@ static void fd_handler (BTap *o, int events)
         // inform receiver we finished the packet
         PacketRecvInterface_Done(&o->output, bytes);
     } while (0);
+    
+    if ((events&BREACTOR_WRITE) && o->handler_writable) {
+        BTap_handler_writable handler = o->handler_writable;
+        o->handler_writable = NULL;
+        
+        // update events
+        o->poll_events &= ~BREACTOR_WRITE;
+        BReactor_SetFileDescriptorEvents(o->reactor, &o->bfd, o->poll_events);
+        
+        handler(o->handler_writable_user);
+        return;
+    }
 }
 
 #endif
@@ -160,7 +339,7 @@ void output_handler_recv (BTap *o, uint8_t *data)
 #else
     
     // attempt read
-    int bytes = read(o->fd, data, o->frame_mtu);
+    int bytes = read_packet(o, data);
     if (bytes < 0) {
         if (errno == EAGAIN || errno == EWOULDBLOCK) {
             // retry later in fd_handler
@@ -191,6 +370,7 @@ int BTap_Init (BTap *o, BReactor *reactor, char *devname, BTap_handler_error han
     init_data.dev_type = tun ? BTAP_DEV_TUN : BTAP_DEV_TAP;
     init_data.init_type = BTAP_INIT_STRING;
     init_data.init.string = devname;
+    init_data.offload = 0;
     
     return BTap_Init2(o, reactor, init_data, handler_error, handler_error_user);
 }
@@ -277,6 +457,11 @@ int BTap_Init2 (BTap *o, BReactor *reactor, struct BTap_init_data init_data, BTa
     } else {
         o->frame_mtu = umtu + BTAP_ETHERNET_HEADER_LENGTH;
     }
+    o->link_mtu = o->frame_mtu;
+    
+    if (init_data.offload) {
+        BLog(BLOG_WARNING, "offload not supported");
+    }
     
     // set connected
     
@@ -319,6 +504,8 @@ fail0:
     #if defined(BADVPN_LINUX) || defined(BADVPN_FREEBSD)
     
     o->close_fd = (init_data.init_type != BTAP_INIT_FD);
+    o->vnet_hdr = 0;
+    int offload = 0;
     
     switch (init_data.init_type) {
         case BTAP_INIT_FD: {
@@ -328,6 +515,10 @@ fail0:
             
             o->fd = init_data.init.fd.fd;
             o->frame_mtu = init_data.init.fd.mtu;
+            
+            if (init_data.offload) {
+                BLog(BLOG_WARNING, "offload not supported with a file descriptor");
+            }
         } break;
         
         case BTAP_INIT_STRING: {
@@ -352,6 +543,10 @@ fail0:
             } else {
                 ifr.ifr_flags |= IFF_TAP;
             }
+            if (init_data.offload && init_data.dev_type == BTAP_DEV_TUN) {
+                // packets will be preceded by a virtio-net header
+                ifr.ifr_flags |= IFF_VNET_HDR;
+            }
             if (init_data.init.string) {
                 snprintf(ifr.ifr_name, IFNAMSIZ, "%s", init_data.init.string);
             }
@@ -363,10 +558,28 @@ fail0:
             
             strcpy(devname_real, ifr.ifr_name);
             
+            if ((ifr.ifr_flags & IFF_VNET_HDR)) {
+                o->vnet_hdr = 1;
+                
+                // let the kernel pass TCP super-packets and partial checksums
+                if (ioctl(o->fd, TUNSETOFFLOAD, (unsigned long)(TUN_F_CSUM|TUN_F_TSO4|TUN_F_TSO6)) < 0) {
+                    BLog(BLOG_WARNING, "error enabling offload, continuing without");
+                } else {
+                    offload = 1;
+                }
+            }
+            else if (init_data.offload) {
+                BLog(BLOG_WARNING, "offload is only supported for TUN devices");
+            }
+            
             #endif
             
             #ifdef BADVPN_FREEBSD
             
+            if (init_data.offload) {
+                BLog(BLOG_WARNING, "offload not supported");
+            }
+            
             if (init_data.dev_type == BTAP_DEV_TUN) {
                 BLog(BLOG_ERROR, "TUN not supported on FreeBSD");
                 goto fail0;
@@ -429,6 +642,12 @@ fail0:
         
         default: ASSERT(0);
     }
+    
+    // with offload, packets may exceed the interface MTU
+    o->link_mtu = o->frame_mtu;
+    if (offload && o->frame_mtu < BTAP_OFFLOAD_MAX_PACKET) {
+        o->frame_mtu = BTAP_OFFLOAD_MAX_PACKET;
+    }
         
     // set non-blocking
     if (fcntl(o->fd, F_SETFL, O_NONBLOCK) < 0) {
@@ -461,6 +680,15 @@ success:
     
     // set no output packet
     o->output_packet = NULL;
+    o->output_csum_trusted = 0;
+    
+    // set no writable request
+    o->handler_writable = NULL;
+    
+#ifdef BADVPN_USE_WINAPI
+    // init writable job
+    BPending_Init(&o->writable_job, BReactor_PendingGroup(o->reactor), (BPending_handler)writable_job_handler, o);
+#endif
     
     DebugError_Init(&o->d_err, BReactor_PendingGroup(o->reactor));
     DebugObject_Init(&o->d_obj);
@@ -477,6 +705,9 @@ void BTap_Free (BTap *o)
     
 #ifdef BADVPN_USE_WINAPI
     
+    // free writable job
+    BPending_Free(&o->writable_job);
+    
     // cancel I/O
     ASSERT_FORCE(CancelIo(o->device))
     
@@ -515,6 +746,20 @@ int BTap_GetMTU (BTap *o)
     return o->frame_mtu;
 }
 
+int BTap_GetLinkMTU (BTap *o)
+{
+    DebugObject_Access(&o->d_obj);
+    
+    return o->link_mtu;
+}
+
+int BTap_OutputChecksumTrusted (BTap *o)
+{
+    DebugObject_Access(&o->d_obj);
+    
+    return o->output_csum_trusted;
+}
+
 void BTap_Send (BTap *o, uint8_t *data, int data_len)
 {
     DebugObject_Access(&o->d_obj);
@@ -556,7 +801,7 @@ void BTap_Send (BTap *o, uint8_t *data, int data_len)
     
 #else
     
-    int bytes = write(o->fd, data, data_len);
+    int bytes = write_packet(o, data, data_len);
     if (bytes < 0) {
         // malformed packets will cause errors, ignore them and act like
         // the packet was accepeted
@@ -569,6 +814,44 @@ void BTap_Send (BTap *o, uint8_t *data, int data_len)
 #endif
 }
 
+void BTap_RequestWritable (BTap *o, BTap_handler_writable handler, void *user)
+{
+    DebugObject_Access(&o->d_obj);
+    DebugError_AssertNoError(&o->d_err);
+    ASSERT(handler)
+    ASSERT(!o->handler_writable)
+    
+    o->handler_writable = handler;
+    o->handler_writable_user = user;
+    
+#ifdef BADVPN_USE_WINAPI
+    // writes complete synchronously, so the device is always writable
+    BPending_Set(&o->writable_job);
+#else
+    // wait for the device to become writable
+    o->poll_events |= BREACTOR_WRITE;
+    BReactor_SetFileDescriptorEvents(o->reactor, &o->bfd, o->poll_events);
+#endif
+}
+
+void BTap_CancelWritable (BTap *o)
+{
+    DebugObject_Access(&o->d_obj);
+    
+    if (!o->handler_writable) {
+        return;
+    }
+    
+    o->handler_writable = NULL;
+    
+#ifdef BADVPN_USE_WINAPI
+    BPending_Unset(&o->writable_job);
+#else
+    o->poll_events &= ~BREACTOR_WRITE;
+    BReactor_SetFileDescriptorEvents(o->reactor, &o->bfd, o->poll_events);
+#endif
+}
+
 PacketRecvInterface * BTap_GetOutput (BTap *o)
 {
     DebugObject_Access(&o->d_obj);
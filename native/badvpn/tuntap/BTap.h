@@ -62,23 +62,39 @@
  */
 typedef void (*BTap_handler_error) (void *used);
 
+/**
+ * Handler called when the device is ready to accept more packets,
+ * as requested by {@link BTap_RequestWritable}.
+ * It is called from the job context, after pending I/O has had a
+ * chance to be processed.
+ * 
+ * @param user as in {@link BTap_RequestWritable}
+ */
+typedef void (*BTap_handler_writable) (void *user);
+
 typedef struct {
     BReactor *reactor;
     BTap_handler_error handler_error;
     void *handler_error_user;
     int frame_mtu;
+    int link_mtu;
     PacketRecvInterface output;
     uint8_t *output_packet;
+    int output_csum_trusted;
+    BTap_handler_writable handler_writable;
+    void *handler_writable_user;
     
 #ifdef BADVPN_USE_WINAPI
     HANDLE device;
     BReactorIOCPOverlapped send_olap;
     BReactorIOCPOverlapped recv_olap;
+    BPending writable_job;
 #else
     int close_fd;
     int fd;
     BFileDescriptor bfd;
     int poll_events;
+    int vnet_hdr;
 #endif
     
     DebugError d_err;
@@ -116,9 +132,13 @@ enum BTap_init_type {
 #endif
 };
 
+// largest packet passed with offload enabled, i.e. a TCP/IP super-packet
+#define BTAP_OFFLOAD_MAX_PACKET 65535
+
 struct BTap_init_data {
     enum BTap_dev_type dev_type;
     enum BTap_init_type init_type;
+    int offload;
     union {
         char *string;
         struct {
@@ -153,6 +173,14 @@ struct BTap_init_data {
  *                  and init_data.init.fd.mtu must be set to the largest IP packet or
  *                  Ethernet frame supported, for a TUN or TAP device, respectively.
  *                  File descriptor initialization is not supported on Windows.
+ *                  init_data.offload requests TCP segmentation and checksum offload; it is
+ *                  only supported for a TUN device opened by name on Linux, and ignored
+ *                  with a warning otherwise. With offload, the device exchanges TCP
+ *                  super-packets up to {@link BTAP_OFFLOAD_MAX_PACKET} bytes with the
+ *                  kernel: received ones are passed on whole, with checksums left as the
+ *                  kernel delivered them (see {@link BTap_OutputChecksumTrusted}), and TCP
+ *                  packets sent larger than the link MTU are segmented by the kernel. {@link BTap_GetMTU} then returns BTAP_OFFLOAD_MAX_PACKET and
+ *                  {@link BTap_GetLinkMTU} the MTU of the interface.
  * @param handler_error error handler function
  * @param handler_error_user value passed to error handler
  * @return 1 on success, 0 on failure
@@ -174,6 +202,16 @@ void BTap_Free (BTap *o);
  */
 int BTap_GetMTU (BTap *o);
 
+/**
+ * Returns the MTU of the network interface (including any protocol headers).
+ * This is the same as {@link BTap_GetMTU} unless offload is enabled, in which
+ * case only TCP packets may be larger than this.
+ *
+ * @param o the object
+ * @return interface MTU
+ */
+int BTap_GetLinkMTU (BTap *o);
+
 /**
  * Sends a packet to the device.
  * Any errors will be reported via a job.
@@ -184,6 +222,39 @@ int BTap_GetMTU (BTap *o);
  */
 void BTap_Send (BTap *o, uint8_t *data, int data_len);
 
+/**
+ * Requests a one-shot notification when the device can accept more packets.
+ * On Linux this waits for the device file descriptor to become writable, so
+ * the handler runs only after the reactor has polled for I/O again; senders
+ * can use this to spread a long backlog over several reactor iterations.
+ * There must be no request pending already.
+ * 
+ * @param o the object
+ * @param handler handler to call. Must not be NULL.
+ * @param user value passed to the handler
+ */
+void BTap_RequestWritable (BTap *o, BTap_handler_writable handler, void *user);
+
+/**
+ * Cancels a notification requested with {@link BTap_RequestWritable}.
+ * Does nothing if there is no request pending.
+ * 
+ * @param o the object
+ */
+void BTap_CancelWritable (BTap *o);
+
+/**
+ * Returns whether the transport checksum of the packet last received from the device
+ * can be trusted without verifying it. This is the case with offload for packets the
+ * kernel marked as checksummed or as having their checksum left to us; in the latter
+ * case the checksum field only holds the pseudo-header sum and must not be verified.
+ * Must be called before the next packet is requested from the output interface.
+ * 
+ * @param o the object
+ * @return 1 if the checksum is to be trusted, 0 if not
+ */
+int BTap_OutputChecksumTrusted (BTap *o);
+
 /**
  * Returns a {@link PacketRecvInterface} for reading packets from the device.
  * The MTU of the interface will be {@link BTap_GetMTU}.
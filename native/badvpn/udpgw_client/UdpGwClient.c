@@ -26,20 +26,32 @@
  * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 
 #include <misc/offset.h>
 #include <misc/byteorder.h>
-#include <misc/compare.h>
+#include <misc/balloc.h>
 #include <base/BLog.h>
 
 #include <udpgw_client/UdpGwClient.h>
 
 #include <generated/blog_channel_UdpGwClient.h>
 
-static int uint16_comparator (void *unused, uint16_t *v1, uint16_t *v2);
-static int conaddr_comparator (void *unused, struct UdpGwClient_conaddr *v1, struct UdpGwClient_conaddr *v2);
+// FNV-1a parameters for the width of size_t
+#if SIZE_MAX <= UINT32_MAX
+#define FNV_OFFSET_BASIS ((size_t)2166136261UL)
+#define FNV_PRIME ((size_t)16777619UL)
+#else
+#define FNV_OFFSET_BASIS ((size_t)14695981039346656037ULL)
+#define FNV_PRIME ((size_t)1099511628211ULL)
+#endif
+
+static size_t hash_bytes (size_t h, const void *data, size_t len);
+static size_t baddr_hash (size_t h, BAddr *addr);
+static size_t conaddr_hash (struct UdpGwClient_conaddr *conaddr);
+static int conaddr_equal (struct UdpGwClient_conaddr *v1, struct UdpGwClient_conaddr *v2);
 static void free_server (UdpGwClient *o);
 static void decoder_handler_error (UdpGwClient *o);
 static void recv_interface_handler_send (UdpGwClient *o, uint8_t *data, int data_len);
@@ -47,6 +59,7 @@ static void send_monitor_handler (UdpGwClient *o);
 static void keepalive_if_handler_done (UdpGwClient *o);
 static struct UdpGwClient_connection * find_connection_by_conaddr (UdpGwClient *o, struct UdpGwClient_conaddr conaddr);
 static struct UdpGwClient_connection * find_connection_by_conid (UdpGwClient *o, uint16_t conid);
+static int bitmap_num_words (int num_bits);
 static uint16_t find_unused_conid (UdpGwClient *o);
 static void connection_init (UdpGwClient *o, struct UdpGwClient_conaddr conaddr, uint8_t flags, const uint8_t *data, int data_len);
 static void connection_free (struct UdpGwClient_connection *con);
@@ -54,20 +67,52 @@ static void connection_first_job_handler (struct UdpGwClient_connection *con);
 static void connection_send (struct UdpGwClient_connection *con, uint8_t flags, const uint8_t *data, int data_len);
 static struct UdpGwClient_connection * reuse_connection (UdpGwClient *o, struct UdpGwClient_conaddr conaddr);
 
-static int uint16_comparator (void *unused, uint16_t *v1, uint16_t *v2)
+static size_t hash_bytes (size_t h, const void *data, size_t len)
 {
-    return B_COMPARE(*v1, *v2);
+    const uint8_t *p = (const uint8_t *)data;
+    
+    // FNV-1a
+    while (len-- > 0) {
+        h ^= *p++;
+        h *= FNV_PRIME;
+    }
+    
+    return h;
 }
 
-static int conaddr_comparator (void *unused, struct UdpGwClient_conaddr *v1, struct UdpGwClient_conaddr *v2)
+static size_t baddr_hash (size_t h, BAddr *addr)
 {
-    int r = BAddr_CompareOrder(&v1->remote_addr, &v2->remote_addr);
-    if (r) {
-        return r;
+    switch (addr->type) {
+        case BADDR_TYPE_IPV4:
+            h = hash_bytes(h, &addr->ipv4.ip, sizeof(addr->ipv4.ip));
+            h = hash_bytes(h, &addr->ipv4.port, sizeof(addr->ipv4.port));
+            break;
+        case BADDR_TYPE_IPV6:
+            h = hash_bytes(h, addr->ipv6.ip, sizeof(addr->ipv6.ip));
+            h = hash_bytes(h, &addr->ipv6.port, sizeof(addr->ipv6.port));
+            break;
     }
-    return BAddr_CompareOrder(&v1->local_addr, &v2->local_addr);
+    
+    return hash_bytes(h, &addr->type, sizeof(addr->type));
+}
+
+static size_t conaddr_hash (struct UdpGwClient_conaddr *conaddr)
+{
+    size_t h = FNV_OFFSET_BASIS;
+    h = baddr_hash(h, &conaddr->remote_addr);
+    h = baddr_hash(h, &conaddr->local_addr);
+    return h;
+}
+
+static int conaddr_equal (struct UdpGwClient_conaddr *v1, struct UdpGwClient_conaddr *v2)
+{
+    return (BAddr_CompareOrder(&v1->remote_addr, &v2->remote_addr) == 0 &&
+            BAddr_CompareOrder(&v1->local_addr, &v2->local_addr) == 0);
 }
 
+#include "UdpGwClient_hash.h"
+#include <structure/CHash_impl.h>
+
 static void free_server (UdpGwClient *o)
 {
     // disconnect send connector
@@ -197,39 +242,45 @@ static void keepalive_if_handler_done (UdpGwClient *o)
 
 static struct UdpGwClient_connection * find_connection_by_conaddr (UdpGwClient *o, struct UdpGwClient_conaddr conaddr)
 {
-    BAVLNode *tree_node = BAVL_LookupExact(&o->connections_tree_by_conaddr, &conaddr);
-    if (!tree_node) {
-        return NULL;
-    }
+    UdpGwClient__ConaddrHashRef ref = UdpGwClient__ConaddrHash_Lookup(&o->connections_hash, 0, &conaddr);
     
-    return UPPER_OBJECT(tree_node, struct UdpGwClient_connection, connections_tree_by_conaddr_node);
+    return ref.ptr;
 }
 
 static struct UdpGwClient_connection * find_connection_by_conid (UdpGwClient *o, uint16_t conid)
 {
-    BAVLNode *tree_node = BAVL_LookupExact(&o->connections_tree_by_conid, &conid);
-    if (!tree_node) {
+    if (conid >= o->max_connections) {
         return NULL;
     }
     
-    return UPPER_OBJECT(tree_node, struct UdpGwClient_connection, connections_tree_by_conid_node);
+    return o->connections_by_conid[conid];
+}
+
+static int bitmap_num_words (int num_bits)
+{
+    return (num_bits + 31) / 32;
 }
 
 static uint16_t find_unused_conid (UdpGwClient *o)
 {
     ASSERT(o->num_connections < o->max_connections)
     
-    while (1) {
-        if (!find_connection_by_conid(o, o->next_conid)) {
-            return o->next_conid;
-        }
-        
-        if (o->next_conid == o->max_connections - 1) {
-            o->next_conid = 0;
-        } else {
-            o->next_conid++;
-        }
+    int num_words = bitmap_num_words(o->max_connections);
+    int word = o->next_conid / 32;
+    
+    // find a word with a clear bit, starting at the word of next_conid;
+    // bits past max_connections are permanently set
+    while (o->conid_bitmap[word] == UINT32_MAX) {
+        word = (word + 1 == num_words) ? 0 : word + 1;
     }
+    
+    int conid = word * 32 + __builtin_ctz(~o->conid_bitmap[word]);
+    ASSERT(conid < o->max_connections)
+    ASSERT(!o->connections_by_conid[conid])
+    
+    o->next_conid = (conid + 1 == o->max_connections) ? 0 : conid + 1;
+    
+    return conid;
 }
 
 static void connection_init (UdpGwClient *o, struct UdpGwClient_conaddr conaddr, uint8_t flags, const uint8_t *data, int data_len)
@@ -270,11 +321,14 @@ static void connection_init (UdpGwClient *o, struct UdpGwClient_conaddr conaddr,
     }
     con->send_if = PacketProtoFlow_GetInput(&con->send_ppflow);
     
-    // insert to connections tree by conaddr
-    ASSERT_EXECUTE(BAVL_Insert(&o->connections_tree_by_conaddr, &con->connections_tree_by_conaddr_node, NULL))
+    // insert to connections hash by conaddr
+    con->conaddr_hash = conaddr_hash(&con->conaddr);
+    UdpGwClient__ConaddrHashRef ref = {con, con};
+    ASSERT_EXECUTE(UdpGwClient__ConaddrHash_Insert(&o->connections_hash, 0, ref, NULL))
     
-    // insert to connections tree by conid
-    ASSERT_EXECUTE(BAVL_Insert(&o->connections_tree_by_conid, &con->connections_tree_by_conid_node, NULL))
+    // insert to connections array by conid
+    o->connections_by_conid[con->conid] = con;
+    o->conid_bitmap[con->conid / 32] |= (uint32_t)1 << (con->conid % 32);
     
     // insert to connections list
     LinkedList1_Append(&o->connections_list, &con->connections_list_node);
@@ -303,11 +357,13 @@ static void connection_free (struct UdpGwClient_connection *con)
     // remove from connections list
     LinkedList1_Remove(&o->connections_list, &con->connections_list_node);
     
-    // remove from connections tree by conid
-    BAVL_Remove(&o->connections_tree_by_conid, &con->connections_tree_by_conid_node);
+    // remove from connections array by conid
+    o->connections_by_conid[con->conid] = NULL;
+    o->conid_bitmap[con->conid / 32] &= ~((uint32_t)1 << (con->conid % 32));
     
-    // remove from connections tree by conaddr
-    BAVL_Remove(&o->connections_tree_by_conaddr, &con->connections_tree_by_conaddr_node);
+    // remove from connections hash by conaddr
+    UdpGwClient__ConaddrHashRef ref = {con, con};
+    UdpGwClient__ConaddrHash_Remove(&o->connections_hash, 0, ref);
     
     // free PacketProtoFlow
     PacketProtoFlow_Free(&con->send_ppflow);
@@ -387,14 +443,16 @@ static struct UdpGwClient_connection * reuse_connection (UdpGwClient *o, struct
     // get least recently used connection
     struct UdpGwClient_connection *con = UPPER_OBJECT(LinkedList1_GetFirst(&o->connections_list), struct UdpGwClient_connection, connections_list_node);
     
-    // remove from connections tree by conaddr
-    BAVL_Remove(&o->connections_tree_by_conaddr, &con->connections_tree_by_conaddr_node);
+    // remove from connections hash by conaddr
+    UdpGwClient__ConaddrHashRef ref = {con, con};
+    UdpGwClient__ConaddrHash_Remove(&o->connections_hash, 0, ref);
     
     // set new conaddr
     con->conaddr = conaddr;
+    con->conaddr_hash = conaddr_hash(&con->conaddr);
     
-    // insert to connections tree by conaddr
-    ASSERT_EXECUTE(BAVL_Insert(&o->connections_tree_by_conaddr, &con->connections_tree_by_conaddr_node, NULL))
+    // insert to connections hash by conaddr
+    ASSERT_EXECUTE(UdpGwClient__ConaddrHash_Insert(&o->connections_hash, 0, ref, NULL))
     
     return con;
 }
@@ -428,11 +486,31 @@ int UdpGwClient_Init (UdpGwClient *o, int udp_mtu, int max_connections, int send
     o->udpgw_mtu = udpgw_compute_mtu(o->udp_mtu);
     o->pp_mtu = o->udpgw_mtu + sizeof(struct packetproto_header);
     
-    // init connections tree by conaddr
-    BAVL_Init(&o->connections_tree_by_conaddr, OFFSET_DIFF(struct UdpGwClient_connection, conaddr, connections_tree_by_conaddr_node), (BAVL_comparator)conaddr_comparator, NULL);
+    // init connections hash by conaddr
+    if (!UdpGwClient__ConaddrHash_Init(&o->connections_hash, o->max_connections)) {
+        BLog(BLOG_ERROR, "UdpGwClient__ConaddrHash_Init failed");
+        goto fail0;
+    }
     
-    // init connections tree by conid
-    BAVL_Init(&o->connections_tree_by_conid, OFFSET_DIFF(struct UdpGwClient_connection, conid, connections_tree_by_conid_node), (BAVL_comparator)uint16_comparator, NULL);
+    // allocate connections array by conid
+    if (!(o->connections_by_conid = (struct UdpGwClient_connection **)BAllocArray(o->max_connections, sizeof(o->connections_by_conid[0])))) {
+        BLog(BLOG_ERROR, "BAllocArray failed");
+        goto fail1;
+    }
+    for (int i = 0; i < o->max_connections; i++) {
+        o->connections_by_conid[i] = NULL;
+    }
+    
+    // allocate conid bitmap, marking bits past max_connections as used
+    int num_words = bitmap_num_words(o->max_connections);
+    if (!(o->conid_bitmap = (uint32_t *)BAllocArray(num_words, sizeof(o->conid_bitmap[0])))) {
+        BLog(BLOG_ERROR, "BAllocArray failed");
+        goto fail2;
+    }
+    memset(o->conid_bitmap, 0, num_words * sizeof(o->conid_bitmap[0]));
+    if (o->max_connections % 32) {
+        o->conid_bitmap[num_words - 1] = UINT32_MAX << (o->max_connections % 32);
+    }
     
     // init connections list
     LinkedList1_Init(&o->connections_list);
@@ -451,7 +529,7 @@ int UdpGwClient_Init (UdpGwClient *o, int udp_mtu, int max_connections, int send
     
     // init send queue
     if (!PacketPassFairQueue_Init(&o->send_queue, PacketPassInactivityMonitor_GetInput(&o->send_monitor), BReactor_PendingGroup(o->reactor), 0, 1)) {
-        goto fail0;
+        goto fail3;
     }
     
     // construct keepalive packet
@@ -475,9 +553,15 @@ int UdpGwClient_Init (UdpGwClient *o, int udp_mtu, int max_connections, int send
     DebugObject_Init(&o->d_obj);
     return 1;
     
-fail0:
+fail3:
     PacketPassInactivityMonitor_Free(&o->send_monitor);
     PacketPassConnector_Free(&o->send_connector);
+    BFree(o->conid_bitmap);
+fail2:
+    BFree(o->connections_by_conid);
+fail1:
+    UdpGwClient__ConaddrHash_Free(&o->connections_hash);
+fail0:
     return 0;
 }
 
@@ -510,6 +594,15 @@ void UdpGwClient_Free (UdpGwClient *o)
     
     // free send connector
     PacketPassConnector_Free(&o->send_connector);
+    
+    // free conid bitmap
+    BFree(o->conid_bitmap);
+    
+    // free connections array by conid
+    BFree(o->connections_by_conid);
+    
+    // free connections hash by conaddr
+    UdpGwClient__ConaddrHash_Free(&o->connections_hash);
 }
 
 void UdpGwClient_SubmitPacket (UdpGwClient *o, BAddr local_addr, BAddr remote_addr, int is_dns, const uint8_t *data, int data_len)
@@ -34,7 +34,7 @@
 #include <protocol/udpgw_proto.h>
 #include <misc/debug.h>
 #include <misc/packed.h>
-#include <structure/BAVL.h>
+#include <structure/CHash.h>
 #include <structure/LinkedList1.h>
 #include <base/DebugObject.h>
 #include <system/BAddr.h>
@@ -49,6 +49,15 @@
 typedef void (*UdpGwClient_handler_servererror) (void *user);
 typedef void (*UdpGwClient_handler_received) (void *user, BAddr local_addr, BAddr remote_addr, const uint8_t *data, int data_len);
 
+struct UdpGwClient_connection;
+struct UdpGwClient_conaddr;
+
+typedef struct UdpGwClient_connection *UdpGwClient__conaddr_hash_link;
+typedef struct UdpGwClient_conaddr *UdpGwClient__conaddr_hash_key;
+
+#include "UdpGwClient_hash.h"
+#include <structure/CHash_decl.h>
+
 B_START_PACKED
 struct UdpGwClient__keepalive_packet {
     struct packetproto_header pp;
@@ -67,8 +76,9 @@ typedef struct {
     UdpGwClient_handler_received handler_received;
     int udpgw_mtu;
     int pp_mtu;
-    BAVL connections_tree_by_conaddr;
-    BAVL connections_tree_by_conid;
+    UdpGwClient__ConaddrHash connections_hash;
+    struct UdpGwClient_connection **connections_by_conid;
+    uint32_t *conid_bitmap;
     LinkedList1 connections_list;
     int num_connections;
     int next_conid;
@@ -102,8 +112,8 @@ struct UdpGwClient_connection {
     BufferWriter *send_if;
     PacketProtoFlow send_ppflow;
     PacketPassFairQueueFlow send_qflow;
-    BAVLNode connections_tree_by_conaddr_node;
-    BAVLNode connections_tree_by_conid_node;
+    size_t conaddr_hash;
+    struct UdpGwClient_connection *conaddr_hash_next;
     LinkedList1Node connections_list_node;
 };
 
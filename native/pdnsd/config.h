@@ -129,11 +129,9 @@
    Unlike the debug messages, these messages will also be written to the syslog.*/
 #define VERBOSITY 0
 
-/* Redefine this if you want another hash size.
- * The number of hash buckets is computed as power of two (1<<HASH_SZ);
- * so e.g. HASH_SZ set to 10 yields 1024 hash rows.
- * HASH_SZ may not be bigger than 32 (if you set it even close to that value,
- * you are nuts.) */
+/* Redefine this if you want another initial hash size.
+ * The hash table starts out with (1<<HASH_SZ) slots and grows as needed;
+ * so e.g. HASH_SZ set to 10 yields 1024 slots initially. */
 #define HASH_SZ 10
 
 /* Set this to debug the hash tables. Turn this off normally, or you will get
@@ -31,6 +31,11 @@
 #include <unistd.h>
 #include <ctype.h>
 #include <sys/time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <stdint.h>
 #include "cache.h"
 #include "hash.h"
 #include "conff.h"
@@ -43,7 +48,7 @@
 
 
 /* A version identifier to prevent reading incompatible cache files */
-static const char cachverid[] = {'p','d','1','3'};
+static const char cachverid[] = {'p','d','1','4'};
 
 /* CACHE STRUCTURE CHANGES IN PDNSD 1.0.0
  * Prior to version 1.0.0, the cache was managed at domain granularity (all records of a domain were handled as a unit),
@@ -64,22 +69,10 @@ static const char cachverid[] = {'p','d','1','3'};
  * to have stored its oname any more. There are more pointers however, and in some cases (CNAMES) the memory require-
  * ments for some records may increase. The total should be lower, however.
  *
- * RRSET_L LIST STRUCTURE:
- * The rrset_l rrset list is a simple double-linked list. The oldest entries are at the first positions, the list is sorted
- * by age in descending order. Search is done only on insert.
- * The rationale for this form is:
- * - the purging operation needs to be fast (this way, the first records are the oldest and can easily be purged)
- * - the append operation is common and needs to be fast (in normal operation, an appended record was just retrieved
- *   and therefore is the newest, so it can be appended at the end of the list without search. Only in the case of
- *   reading a disk cache file, searches are necessary)
- * The rrset list is excusively used for purging purposes.
- *
- * THE DISK CACHE FILES:
- * The disk cache file consists of cent's, i.e. structures for every known hostnames with a header and rrs attached to it.
- * Therefore, the rr's are not ordered by their age and a search must be performed to insert the into the rr_l in the
- * right positions. This operations has some costs (although not all too much), but the other way (rrs stored in order
- * of their age and the cent headers separated from them), the rrs would need to be attached to the cent headers, which
- * would be even more costly, also in means of disk space.
+ * EVICTION:
+ * Older versions kept all cached rrsets in the rrset_l list, sorted by age, which was walked from the oldest entries
+ * under the write lock to purge the cache. That list is gone; entries are now evicted by sampling the hash table for
+ * the least recently used ones, in small steps done by the cache thread (see evict_one()).
  *
  * CHANGES AFTER 1.0.0p1
  * In 1.0.0p5, the cache granularity was changed from rr level to rr set level. This was done because rfc2181 demands
@@ -92,6 +85,10 @@ static const char cachverid[] = {'p','d','1','3'};
  * - new caching flag CF_NEGATIVE
  * - all functions must accept and deal correctly with empty cents with DF_NEGATIVE set.
  * - all functions must accept and deal correctly with empty rrsets with CF_NEGATIVE set.
+ *
+ * CHANGES FOR THE pd14 CACHE FILE FORMAT
+ * The records are unchanged, but they are now preceded by a header and a hash index, so that the
+ * file can be mapped and its entries loaded lazily (see read_disk_cache()). Older files are ignored.
  */
 
 
@@ -138,22 +135,6 @@ typedef struct {
 }  __attribute__((packed))
 dom_fttlts_t;
 
-/*
- * This has two modes: Normally, we have rrset, cent and idx filled in;
- * for negatively cached cents, we have rrset set to NULL and idx set to -1.
- */
-typedef struct rr_lent_s {
-	struct rr_lent_s *next;
-	struct rr_lent_s *prev;
-	rr_set_t         *rrset;
-	dns_cent_t       *cent;
-	int              idx;    /* This is the array index, not the type of the RR-set. */
-} rr_lent_t;
-
-
-static rr_lent_t *rrset_l=NULL;
-static rr_lent_t *rrset_l_tail=NULL;
-
 /*
  * We do not count the hash table sizes here. Those are very small compared
  * to the cache entries.
@@ -192,12 +173,6 @@ static volatile int r_susp=0;
  */
 volatile short int use_cache_lock=0;
 
-/*
-  This is set to 0 while cache is read from disk.
-  This must be set to 1 before we start adding new entries.
-*/
-static short int insert_sort=1;
-
 
 #ifdef ALLOC_DEBUG
 #define cache_free(ptr)		{ if (dbg) pdnsd_free(ptr); else free(ptr); }
@@ -212,12 +187,154 @@ static short int insert_sort=1;
 #endif
 
 
+/*
+ * Small-object arena for cache internals.
+ * Domain names, RR buckets, RR sets and rrext arrays are
+ * small (mostly well below 100 bytes) and very numerous, so allocating each of
+ * them with malloc() wastes a sizeable fraction of the cache memory on
+ * allocator headers and rounding, and scatters the parts of one cache entry
+ * over the heap. Instead, they are carved out of ARENA_SLABSZ sized slabs
+ * in size classes of ARENA_GRAN bytes. Freed objects are kept on per-class
+ * free lists for reuse; slabs are never returned to the system, which is fine
+ * because the cache size is bounded by perm_cache anyway.
+ * Objects larger than ARENA_MAXSZ are passed through to malloc().
+ * Copies of cache entries made outside the cache lock use the arena as well,
+ * so it has a lock of its own.
+ */
+#define ARENA_GRAN     8
+#define ARENA_MAXSZ    256
+#define ARENA_NCLASSES (ARENA_MAXSZ/ARENA_GRAN)
+#define ARENA_SLABSZ   16384
+
+typedef struct arena_blk_s {
+	struct arena_blk_s *next;
+} arena_blk_t;
+
+static arena_blk_t *arena_freel[ARENA_NCLASSES];
+static char *arena_cur=NULL;
+static size_t arena_left=0;
+static unsigned long arena_slabs=0;
+static size_t arena_used=0;
+static pthread_mutex_t arena_lock = PTHREAD_MUTEX_INITIALIZER;
+
+#define arena_class(sz) ((sz)<=ARENA_GRAN?0:((sz)-1)/ARENA_GRAN)
+
+static void *arena_alloc(size_t sz)
+{
+	unsigned cl;
+	size_t bsz;
+	void *p;
+
+	if(sz>ARENA_MAXSZ)
+		return malloc(sz);
+	cl=arena_class(sz);
+	bsz=(cl+1)*ARENA_GRAN;
+
+	pthread_mutex_lock(&arena_lock);
+	if((p=arena_freel[cl]))
+		arena_freel[cl]=arena_freel[cl]->next;
+	else {
+		if(arena_left<bsz) {
+			char *slab=malloc(ARENA_SLABSZ);
+			if(!slab) {
+				pthread_mutex_unlock(&arena_lock);
+				return NULL;
+			}
+			/* Put the tail of the old slab on the free list of its size class. */
+			if(arena_left>=ARENA_GRAN) {
+				arena_blk_t *b=(arena_blk_t *)arena_cur;
+				unsigned tcl=arena_left/ARENA_GRAN-1;
+				b->next=arena_freel[tcl];
+				arena_freel[tcl]=b;
+			}
+			arena_cur=slab;
+			arena_left=ARENA_SLABSZ;
+			++arena_slabs;
+		}
+		p=arena_cur;
+		arena_cur+=bsz;
+		arena_left-=bsz;
+	}
+	arena_used+=bsz;
+	pthread_mutex_unlock(&arena_lock);
+	return p;
+}
+
+/* sz must be the same size as passed to arena_alloc(). */
+static void arena_free(void *ptr, size_t sz)
+{
+	unsigned cl;
+	arena_blk_t *b=ptr;
+
+	if(!ptr)
+		return;
+	if(sz>ARENA_MAXSZ) {
+		free(ptr);
+		return;
+	}
+	cl=arena_class(sz);
+
+	pthread_mutex_lock(&arena_lock);
+	b->next=arena_freel[cl];
+	arena_freel[cl]=b;
+	arena_used-=(cl+1)*ARENA_GRAN;
+	pthread_mutex_unlock(&arena_lock);
+}
+
+
+#define FNV_INIT 2166136261U
+
+/* Case insensitive hash of a domain name of length len (not counting the terminating null byte). */
+static uint32_t snap_hash(const unsigned char *name, unsigned len)
+{
+	uint32_t h=FNV_INIT;
+	unsigned i;
+	for(i=0; i<len; ++i) {
+		h ^= tolower(name[i]);
+		h *= 16777619U;
+	}
+	return h;
+}
+
+/*
+ * Modification counters used by the answer cache (see dns_answer.c) to find out whether a
+ * response it has stored is still current. Every change to the cache entry of a name
+ * increments cache_gens[cache_gen_slot(name)].
+ */
+volatile unsigned long cache_gens[CACHE_GEN_SLOTS];
+
+unsigned cache_gen_slot(const unsigned char *name)
+{
+	return snap_hash(name,rhnlen(name)-1)%CACHE_GEN_SLOTS;
+}
+
+#define cache_touch(name) (++cache_gens[cache_gen_slot(name)])
+
+/* The use clock ticks once for every lookup or addition; the atime of a cache entry is
+   the value of the clock when it was last used. Seconds would be too coarse to tell
+   apart the entries used during a burst of queries. */
+static unsigned long use_clock=0;
+
+inline static unsigned long use_tick()
+{
+	return __sync_add_and_fetch(&use_clock,1);
+}
+
+/* Use clock values of answers given from the answer cache, which does not look at the
+   cache entries themselves, by cache_gen_slot(). See evict_one(). */
+static volatile unsigned long cache_uses[CACHE_GEN_SLOTS];
+
+void cache_note_use(unsigned slot)
+{
+	cache_uses[slot]=use_tick();
+}
+
+
 /*
  * Prototypes for internal use
  */
-static void purge_cache(long sz, int lazy);
+static void check_cache_size(void);
 static void del_cache_ent(dns_cent_t *cent,dns_hash_loc_t *loc);
-static void remove_rrl(rr_lent_t *le  DBGPARAM);
 
 /*
  * Locking functions.
@@ -486,21 +603,38 @@ void init_cache_lock()
 int empty_cache(slist_array sla)
 {
 	int i;
+	unsigned long size,used;
 
 	/* Wait at most 60 seconds to obtain a lock. */
 	if(!timedlock_cache_rw(60))
 		return 0;
 
+	for(i=0; i<CACHE_GEN_SLOTS; ++i)
+		++cache_gens[i];
+	/* Keep the table from being resized by other threads while the lock is yielded. */
+	dns_hash_hold(1);
+	/* The parts are taken from the table size at the start. */
+	dns_hash_stat(&size,&used);
 	for(i=0; ; ) {
+		unsigned long nsize;
+
 		if(sla)
-			free_dns_hash_selected(i,sla);
+			free_dns_hash_selected(i,size,sla);
 		else
-			free_dns_hash_bucket(i);
-		if(++i>=HASH_NUM_BUCKETS)
+			free_dns_hash_part(i,size);
+		if(++i>=HASH_NUM_PARTS)
 			break;
 		/* Give another thread a chance */
 		yield_lock_cache_rw();
+		/* If the table was resized anyway because it filled up, the entries have moved, so
+		   start over with the new size. */
+		dns_hash_stat(&nsize,&used);
+		if(nsize!=size) {
+			size=nsize;
+			i=0;
+		}
 	}
+	dns_hash_hold(0);
 
 	unlock_cache_rw();
 	return 1;
@@ -560,15 +694,16 @@ int init_cent(dns_cent_t *cent, const unsigned char *qname, time_t ttl, time_t t
 	int i;
 	size_t namesz=rhnlen(qname);
 
-	cent->qname=cache_malloc(namesz);
+	cent->qname=arena_alloc(namesz);
 	if (cent->qname == NULL)
 		return 0;
 	memcpy(cent->qname,qname,namesz);
 	cent->cs=sizeof(dns_cent_t)+namesz;
 	cent->num_rrs=0;
 	cent->flags=flags;
+	cent->hits=0;
+	cent->atime=0;
 	if(flags&DF_NEGATIVE) {
-		cent->neg.lent=NULL;
 		cent->neg.ttl=ttl;
 		cent->neg.ts=ts;
 	}
@@ -588,7 +723,7 @@ int init_cent(dns_cent_t *cent, const unsigned char *qname, time_t ttl, time_t t
 static rr_bucket_t *create_rr(unsigned dlen, void *data  DBGPARAM)
 {
 	rr_bucket_t *rrb;
-	rrb=(rr_bucket_t *)cache_malloc(sizeof(rr_bucket_t)+dlen);
+	rrb=(rr_bucket_t *)arena_alloc(sizeof(rr_bucket_t)+dlen);
 	if (rrb == NULL)
 		return NULL;
 	rrb->next=NULL;
@@ -609,9 +744,6 @@ static int add_cent_rrset_by_index(dns_cent_t *cent, unsigned int idx, time_t tt
 	/* If we add a rrset, even a negative one, the domain is not negative any more. */
 	if (cent->flags&DF_NEGATIVE) {
 		int i;
-		/* need to remove the cent from the lent list. */
-		if (cent->neg.lent)
-			remove_rrl(cent->neg.lent  DBGARG);
 		cent->flags &= ~DF_NEGATIVE;
 		for(i=0; i<NRRMU; ++i)
 			cent->rr.rrmu[i]=NULL;
@@ -626,7 +758,7 @@ static int add_cent_rrset_by_index(dns_cent_t *cent, unsigned int idx, time_t tt
 		rrext = cent->rr.rrext;
 		if(!rrext) {
 			int i;
-			cent->rr.rrext = rrext = cache_malloc(sizeof(rr_set_t*)*NRREXT);
+			cent->rr.rrext = rrext = arena_alloc(sizeof(rr_set_t*)*NRREXT);
 			if(!rrext)
 				return 0;
 			for(i=0; i<NRREXT; ++i)
@@ -639,10 +771,9 @@ static int add_cent_rrset_by_index(dns_cent_t *cent, unsigned int idx, time_t tt
 #if 0
 	if(*rrsetpa) del_rrset(*rrsetpa);
 #endif
-	*rrsetpa = rrset = cache_malloc(sizeof(rr_set_t));
+	*rrsetpa = rrset = arena_alloc(sizeof(rr_set_t));
 	if (!rrset)
 		return 0;
-	rrset->lent=NULL;
 	rrset->ttl=ttl;
 	rrset->ts=ts;
 	rrset->flags=flags;
@@ -704,7 +835,7 @@ static int add_cent_rr_int(dns_cent_t *cent, unsigned int idx, time_t ttl, time_
 
  cleanup_return:
 	free_rr(*rr);
-	free(rr);
+	arena_free(rr,sizeof(rr_bucket_t)+rr->rdlen);
 	return 0;
 }
 
@@ -757,16 +888,15 @@ int del_rrset(rr_set_t *rrs  DBGPARAM)
 	int rv=sizeof(rr_set_t);
 	rr_bucket_t *rrb,*rrn;
 
-	if(rrs->lent) remove_rrl(rrs->lent  DBGARG);
 	rrb=rrs->rrs;
 	while (rrb) {
 		rv+=sizeof(rr_bucket_t)+rrb->rdlen;
 		rrn=rrb->next;
 		free_rr(*rrb);
-		cache_free(rrb);
+		arena_free(rrb,sizeof(rr_bucket_t)+rrb->rdlen);
 		rrb=rrn;
 	}
-	cache_free(rrs);
+	arena_free(rrs,sizeof(rr_set_t));
 	return rv;
 }
 
@@ -781,6 +911,7 @@ static int del_cent_rrset_by_index(dns_cent_t *cent, int i  DBGPARAM)
 	if(rrspa) {
 		rr_set_t *rrs = *rrspa;
 		if(rrs) {
+			cache_touch(cent->qname);
 			rv= del_rrset(rrs  DBGARG);
 			*rrspa=NULL;
 			--cent->num_rrs;
@@ -812,12 +943,9 @@ void free_rr(rr_bucket_t rr)
 /* Free all data referred by a cache entry. */
 void free_cent(dns_cent_t *cent  DBGPARAM)
 {
-	cache_free(cent->qname);
-	if(cent->flags&DF_NEGATIVE) {
-		if(cent->neg.lent)
-			remove_rrl(cent->neg.lent  DBGARG);
-	}
-	else {
+	if(cent->qname)
+		arena_free(cent->qname,rhnlen(cent->qname));
+	if(!(cent->flags&DF_NEGATIVE)) {
 		int i;
 		for (i=0; i<NRRMU; ++i) {
 			rr_set_t *rrs=cent->rr.rrmu[i];
@@ -830,7 +958,7 @@ void free_cent(dns_cent_t *cent  DBGPARAM)
 					rr_set_t *rrs=rrext[i];
 					if (rrs) del_rrset(rrs  DBG0);
 				}
-				cache_free(rrext);
+				arena_free(rrext,sizeof(rr_set_t*)*NRREXT);
 			}
 		}
 	}
@@ -863,203 +991,24 @@ void negate_cent(dns_cent_t *cent, time_t ttl, time_t ts)
 					if (rrs)
 						cent->cs -= del_rrset(rrs  DBG0);
 				}
-				cache_free(rrext);
+				arena_free(rrext,sizeof(rr_set_t*)*NRREXT);
 				/* cent->rr.rrext=NULL; */
 				cent->cs -= sizeof(rr_set_t*)*NRREXT;
 			}
 		}
 		cent->num_rrs=0;
 		cent->flags |= DF_NEGATIVE;
-		cent->neg.lent=NULL;
 	}
 
 	cent->neg.ttl=ttl;
 	cent->neg.ts=ts;
 }
 
-inline static time_t get_rrlent_ts(rr_lent_t *le)
-{
-	return (le->rrset)?(le->rrset->ts):(le->cent->neg.ts);
-}
-
-/* insert a rrset into the rr_l list. This modifies the rr_set_t if rrs is not NULL!
- * The rrset address needs to be constant afterwards.
- * idx is the internally used RR-set index, not the RR type!
- * Call with locks applied. */
-static int insert_rrl(rr_set_t *rrs, dns_cent_t *cent, int idx)
-{
-	time_t ts;
-	rr_lent_t *le,*ne;
-
-	/* No need to add local records to the rr_l list, because purge_cache() ignores them anyway. */
-	if((rrs && (rrs->flags&CF_LOCAL)) || (cent->flags&DF_LOCAL))
-		return 1;
-
-	if (!(ne=malloc(sizeof(rr_lent_t))))
-		return 0;
-	ne->rrset=rrs;
-	ne->cent=cent;
-	ne->idx=idx;
-	ne->next=NULL;
-	ne->prev=NULL;
-
-	if(insert_sort) {
-		/* Since the append at the and is a very common case (and we want this case to be fast), we search back-to-forth.
-		 * Since rr_l is a list and we don't really have fast access to all elements, we do not perform an advanced algorithm
-		 * like binary search.*/
-		ts=get_rrlent_ts(ne);
-		le=rrset_l_tail;
-		while (le) {
-			if (ts>=get_rrlent_ts(le)) goto found;
-			le=le->prev;
-		}
-		/* not found, so it needs to be inserted at the start of the list. */
-		ne->next=rrset_l;
-		if (rrset_l)
-			rrset_l->prev=ne;
-		else
-			rrset_l_tail=ne;
-		rrset_l=ne;
-		goto finish;
-	found:
-		ne->next=le->next;
-		ne->prev=le;
-		if (le->next)
-			le->next->prev=ne;
-		else
-			rrset_l_tail=ne;
-		le->next=ne;
-	finish:;
-	}
-	else {
-		/* simply append at the end, sorting will be done later with a more efficient algorithm. */
-		ne->prev=rrset_l_tail;
-		if(rrset_l_tail)
-			rrset_l_tail->next=ne;
-		else
-			rrset_l=ne;
-		rrset_l_tail=ne;
-	}
-
-	if (rrs)
-		rrs->lent=ne;
-	else
-		cent->neg.lent=ne;
-
-	return 1;
-}
-
-/* Remove a rr from the rr_l list. Call with locks applied. */
-static void remove_rrl(rr_lent_t *le  DBGPARAM)
-{
-	rr_lent_t *next=le->next,*prev=le->prev;
-	if (next)
-		next->prev=prev;
-	else
-		rrset_l_tail=prev;
-	if (prev)
-		prev->next=next;
-	else
-		rrset_l=next;
-	cache_free(le);
-}
-
-
-/* Merge two sorted rr_l lists to make a larger sorted list.
-   The lists are sorted according to increasing time-stamp.
-   The back links are ignored, these must be fixed using a separate pass.
-*/
-static rr_lent_t *listmerge(rr_lent_t *p, rr_lent_t *q)
-{
-
-	if(!p)
-		return q;
-	else if(!q)
-		return p;
-	else {
-		rr_lent_t *l=NULL, **s= &l;
-
-		for(;;) {
-			if(get_rrlent_ts(p) <= get_rrlent_ts(q)) {
-				*s= p;
-				s= &p->next;
-				p= *s;
-				if(!p) {
-					*s= q;
-					break;
-				}
-			}
-			else { /* get_rrlent_ts(p) > get_rrlent_ts(q) */
-				*s= q;
-				s= &q->next;
-				q= *s;
-				if(!q) {
-					*s= p;
-					break;
-				}
-			}
-		}
-
-		return l;
-	}
-}
-
-/* Sort the rr_l list using merge sort, which can be more efficient than insertion sort used by rr_insert().
-   This algorithm is adapted from the GNU C++ STL implementation for list containers.
-   Call with locks applied.
-   Written by Paul Rombouts.
-*/
-static void sort_rrl()
-{
-	/* Do nothing unless the list has length >= 2. */
-	if(rrset_l && rrset_l->next) {
-		/* First sort the list ignoring the back links, these will be fixed later. */
-#               define NTMPSORT 32
-		/* Because we use an array of fixed length, the length of the list we can sort
-		   is bounded by pow(2,NTMPSORT)-1. */
-		rr_lent_t *tmp[NTMPSORT];  /* tmp[i] will either be NULL or point to a sorted list of length pow(2,i). */
-		rr_lent_t **fill= tmp, **end=tmp+NTMPSORT, **counter;
-		rr_lent_t *rem= rrset_l, *carry;
-
-		do {
-			carry=rem; rem=rem->next;
-			carry->next=NULL;
-			for(counter = tmp; counter!=fill && *counter!=NULL; ++counter) {
-				carry=listmerge(*counter,carry);
-				*counter=NULL;
-			}
-
-			PDNSD_ASSERT(counter!=end, "sort_rrl: tmp array overflowed");
-
-			*counter=carry;
-
-			if(counter==fill) ++fill;
-		}
-		while(rem);
-
-		/* Merge together all the remaining list fragments contained in array tmp. */
-		carry= tmp[0];
-		counter= tmp;
-		while(++counter!=fill)
-			carry=listmerge(*counter,carry);
-
-		rrset_l= carry;
-
-		{
-			/* Restore the backward links. */
-			rr_lent_t *p,*q=NULL;
-			for(p=rrset_l; p; p=p->next) {p->prev=q; q=p;}
-			rrset_l_tail=q;
-		}
-	}
-}
-
-
 /* Copy a rr_bucket_t into newly allocated memory */
 inline static rr_bucket_t *copy_rr(rr_bucket_t *rr  DBGPARAM)
 {
 	rr_bucket_t *rrn;
-	rrn=cache_malloc(sizeof(rr_bucket_t)+rr->rdlen);
+	rrn=arena_alloc(sizeof(rr_bucket_t)+rr->rdlen);
 	if (rrn == NULL)
 		return NULL;
 	memcpy(rrn,rr,sizeof(rr_bucket_t)+rr->rdlen);
@@ -1071,11 +1020,10 @@ inline static rr_bucket_t *copy_rr(rr_bucket_t *rr  DBGPARAM)
 /* Copy an RR set into newly allocated memory */
 static rr_set_t *copy_rrset(rr_set_t *rrset  DBGPARAM)
 {
-	rr_set_t *rrsc=cache_malloc(sizeof(rr_set_t));
+	rr_set_t *rrsc=arena_alloc(sizeof(rr_set_t));
 	rr_bucket_t *rr,**rrp;
 	if (rrsc) {
 		*rrsc=*rrset;
-		rrsc->lent=NULL;
 		rrp=&rrsc->rrs;
 		rr=rrset->rrs;
 		while(rr) {
@@ -1109,7 +1057,7 @@ dns_cent_t *copy_cent(dns_cent_t *cent  DBGPARAM)
 	{
 		/* copy the name */
 		size_t namesz=rhnlen(cent->qname);
-		if (!(copy->qname=cache_malloc(namesz)))
+		if (!(copy->qname=arena_alloc(namesz)))
 			goto free_return_null;
 
 		memcpy(copy->qname,cent->qname,namesz);
@@ -1117,10 +1065,11 @@ dns_cent_t *copy_cent(dns_cent_t *cent  DBGPARAM)
 	copy->cs= cent->cs;
 	copy->num_rrs= cent->num_rrs;
 	copy->flags= cent->flags;
+	copy->hits= cent->hits;
+	copy->atime= cent->atime;
 	copy->c_ns = cent->c_ns;
 	copy->c_soa= cent->c_soa;
 	if(cent->flags&DF_NEGATIVE) {
-		copy->neg.lent=NULL;
 		copy->neg.ttl= cent->neg.ttl;
 		copy->neg.ts = cent->neg.ts;
 	}
@@ -1134,7 +1083,7 @@ dns_cent_t *copy_cent(dns_cent_t *cent  DBGPARAM)
 		if(cent->rr.rrext) {
 			rr_set_t **rrextc;
 			ilim = NRRTOT;
-			copy->rr.rrext = rrextc = cache_malloc(sizeof(rr_set_t*)*NRREXT);
+			copy->rr.rrext = rrextc = arena_alloc(sizeof(rr_set_t*)*NRREXT);
 			if(!rrextc) goto free_cent_return_null;
 
 			for (i=0; i<NRREXT; ++i)
@@ -1144,13 +1093,12 @@ dns_cent_t *copy_cent(dns_cent_t *cent  DBGPARAM)
 		for (i=0; i<ilim; ++i) {
 			rr_set_t *rrset= RRARR_INDEX(cent,i);
 			if (rrset) {
-				rr_set_t *rrsc=cache_malloc(sizeof(rr_set_t));
+				rr_set_t *rrsc=arena_alloc(sizeof(rr_set_t));
 				rr_bucket_t *rr,**rrp;
 				*RRARR_INDEX_PA(copy,i)=rrsc;
 				if (!rrsc)
 					goto free_cent_return_null;
 				*rrsc=*rrset;
-				rrsc->lent=NULL;
 				rrp=&rrsc->rrs;
 				rr=rrset->rrs;
 				while(rr) {
@@ -1172,35 +1120,13 @@ dns_cent_t *copy_cent(dns_cent_t *cent  DBGPARAM)
 	return NULL;
 }
 
-/*
- * Remove all timed out entries of the RR set with the given index.
- * idx is the internally used RR-set index, not the RR type!
- * Follow some rules based on flags etc.
- * This will either delete the whole rrset, or will leave it as a whole (RFC2181 seems to
- * go in that direction)
- * This was pretty large once upon a time ;-), but now, since we operate in rrsets, was
- * shrunk drastically.
- * If test is zero and the record is in the cache, we need rw-locks applied.
- * If test is nonzero, nothing will actually be deleted.
- * Substracts the size of the freed memory from cache_size (if test is zero).
- * Returns 1 if the rrset has been (or would have been) deleted.
- */
-static int purge_rrset(dns_cent_t *cent, int idx, int test)
-{
-	rr_set_t *rrs= RRARR_INDEX_TESTEXT(cent,idx);
-	if (rrs && !(rrs->flags&CF_NOPURGE || rrs->flags&CF_LOCAL) && timedout(rrs)) {
-		/* well, it must go. */
-		if(!test)
-			cache_size -= del_cent_rrset_by_index(cent,idx  DBG0);
-		return 1;
-	}
-	return 0;
-}
-
 /*
   Remove all timed out entries of alls RR sets of a cache entry.
-  The test flag works the same as in purge_rrset().
-  Substracts the size of the freed memory from cache_size, just as purge_rrset().
+  Each RR set is either deleted as a whole or left as a whole (RFC2181 seems to go in that
+  direction); RR sets flagged CF_NOPURGE or CF_LOCAL are never deleted.
+  If test is zero and the record is in the cache, we need rw-locks applied.
+  If test is nonzero, nothing will actually be deleted.
+  Substracts the size of the freed memory from cache_size (if test is zero).
   *numrrsrem is set to the number of remaining RR sets (or the number that would have remained).
   Returns the number of items (RR sets or RR set arrays) that have been (or would have been) deleted.
 */
@@ -1213,7 +1139,7 @@ static int purge_all_rrsets(dns_cent_t *cent, int test, int *numrrsrem)
 		for(i=0; i<ilim; ++i) {
 			rr_set_t *rrs= RRARR_INDEX(cent,i);
 			if (rrs) {
-				if(!(rrs->flags&CF_NOPURGE || rrs->flags&CF_LOCAL) && timedout(rrs)) {
+				if(!(rrs->flags&CF_NOPURGE || rrs->flags&CF_LOCAL) && expired(rrs)) {
 					/* well, it must go. */
 					if(!test)
 						cache_size -= del_cent_rrset_by_index(cent, i  DBG0);
@@ -1229,7 +1155,7 @@ static int purge_all_rrsets(dns_cent_t *cent, int test, int *numrrsrem)
 		/* If the array of less frequently used RRs has become empty, free it. */
 		if(cent->rr.rrext && numrrext==0) {
 			if(!test) {
-				cache_free(cent->rr.rrext);
+				arena_free(cent->rr.rrext,sizeof(rr_set_t*)*NRREXT);
 				cent->rr.rrext=NULL;
 				cent->cs -= sizeof(rr_set_t*)*NRREXT;
 				cache_size -= sizeof(rr_set_t*)*NRREXT;
@@ -1244,7 +1170,7 @@ static int purge_all_rrsets(dns_cent_t *cent, int test, int *numrrsrem)
 
 
 /*
- * Purge a cent, deleting timed-out rrs (following the constraints noted in "purge_rrset").
+ * Purge a cent, deleting timed-out rrs (following the constraints noted in purge_all_rrsets()).
  * Since the cent may actually become empty and be deleted, you may not use it after this call until
  * you refetch its address from the hash (if it is still there).
  * If test is zero and the record is in the cache, we need rw-locks applied.
@@ -1263,7 +1189,7 @@ static int purge_cent(dns_cent_t *cent, int delete, int test)
 	/* If the cache entry was purged empty, delete it from the cache. */
 	if (delete && numrrs==0
 	    && (!(cent->flags&DF_NEGATIVE) ||
-		(!(cent->flags&DF_LOCAL) && timedout_nxdom(cent))))
+		(!(cent->flags&DF_LOCAL) && expired_nxdom(cent))))
 	{
 		if(!test)
 			del_cache_ent(cent,NULL); /* this will subtract the cent's left size from cache_size */
@@ -1307,251 +1233,493 @@ static int purge_cent(dns_cent_t *cent, int delete, int test)
 }
 
 /*
- * Bring cache to a size below or equal the cache size limit (sz). There are two strategies:
- * - for cached sets with CF_NOPURGE not set: delete if timed out
- * - additional: delete oldest sets.
+ * Eviction by sampled LRU.
+ * To make room, EVICT_SAMPLES entries are picked at random from the hash table, timed-out
+ * records are purged from them on the way, and of the remaining ones the entry that has been
+ * looked up least recently is removed (answers from the answer cache count as lookups too,
+ * see cache_note_use()). No list of all records ordered by age has to be
+ * maintained for this, so adding and looking up entries costs nothing extra, and entries
+ * are evicted in steps of at most EVICT_STEP, so the write lock is never held for long.
+ * Normally the cache thread (see cache_thread()) does this: add_cache_int() only wakes it
+ * when the cache has grown beyond its limit, and evicts by itself only if the cache keeps
+ * growing because the thread cannot keep up (or could not be started).
+ * Local records are never evicted.
+ */
+#define EVICT_SAMPLES 8
+#define EVICT_STEP    16
+
+/* The eviction counters are only changed with the rw lock applied. */
+static unsigned long evict_num=0, evict_timedout=0, evict_steps=0;
+static unsigned long evict_pause_max=0, evict_pause_tot=0;   /* in microseconds */
+
+static pthread_mutex_t evict_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  evict_cond = PTHREAD_COND_INITIALIZER;
+static int evict_pending=0;       /* Protected by evict_lock. */
+static int cache_thread_running=0;
+
+/*
+ * Sample some cache entries, purge timed-out records from them and, if the cache is
+ * still larger than sz, remove the least recently used one.
+ * Call with rw lock applied.
+ * Returns 1 if anything was removed, 0 if no entry could be found to remove.
  */
-static void purge_cache(long sz, int lazy)
-{
-	rr_lent_t *le;
-
-	/* Walk the cache list from the oldest entries to the newest, deleting timed-out
-	 * records.
-	 * XXX: We walk the list a second time if this did not free up enough space - this
-	 * should be done better. */
-	le=rrset_l;
-	while (le && (!lazy || cache_size>sz)) {
-		/* Note by Paul Rombouts:
-		 * If data integrity is ensured, at most one node is removed from the rrset_l
-		 * per iteration, and this node is the one referenced by le. */
-		rr_lent_t *next=le->next;
-		if (!((le->rrset && (le->rrset->flags&CF_LOCAL)) ||
-		      (le->cent->flags&DF_LOCAL))) {
-			dns_cent_t *ce = le->cent;
-			if (le->rrset)
-				purge_rrset(ce, le->idx,0);
-			/* Side effect: if purge_rrset called del_cent_rrset then le has been freed.
-			 * ce, however, is still guaranteed to be valid. */
-			if (ce->num_rrs==0 && (!(ce->flags&DF_NEGATIVE) ||
-					       (!(ce->flags&DF_LOCAL) && timedout_nxdom(ce))))
-				del_cache_ent(ce,NULL);
+static int evict_one(long sz)
+{
+	dns_cent_t *victim=NULL;
+	unsigned long victim_atime=0;
+	unsigned long slots,used,tries;
+	int i,n,rv=0;
+
+	dns_hash_stat(&slots,&used);
+	if(!used)
+		return 0;
+	/* In a sparse table, many samples find nothing; keep drawing from new random starts until
+	   enough entries have been seen, but don't scan much more than the whole table. */
+	tries=slots/HASH_SAMPLE_SCAN+EVICT_SAMPLES;
+	for(n=0;n<EVICT_SAMPLES && tries>0;--tries) {
+		unsigned long atime;
+		dns_cent_t *ce=dns_hash_sample(random());
+		if(!ce)
+			continue;
+		++n;
+		if(ce==victim || (ce->flags&DF_LOCAL))
+			continue;
+		if(purge_cent(ce,1,0)<0) {
+			/* The entry has timed out completely and is gone. */
+			++evict_timedout;
+			rv=1;
+			continue;
+		}
+		atime=ce->atime;
+		if(cache_uses[cache_gen_slot(ce->qname)]>atime)
+			atime=cache_uses[cache_gen_slot(ce->qname)];
+		if(!victim || atime<victim_atime) {
+			victim=ce;
+			victim_atime=atime;
 		}
-		le=next;
 	}
-	if (cache_size<=sz)
-		return;
-
-	/* we are still above the desired cache size. Well, delete records from the oldest to
-	 * the newest. This is the case where nopurge records are deleted anyway. Only local
-	 * records are kept in any case.*/
-	if(!insert_sort) {
-		sort_rrl();
-		insert_sort=1; /* use insertion sort from now on */
-	}
-
-	le=rrset_l;
-	while (le && cache_size>sz) {
-		rr_lent_t *next=le->next;
-		if (!((le->rrset && (le->rrset->flags&CF_LOCAL)) ||
-		      (le->cent->flags&DF_LOCAL))) {
-			dns_cent_t *ce = le->cent;
-			if (le->rrset)
-				cache_size -= del_cent_rrset_by_index(ce, le->idx  DBG0);
-			/* this will also delete negative cache entries */
-			if (ce->num_rrs==0)
-				del_cache_ent(ce,NULL);
+	if(victim && cache_size>sz) {
+		int ilim= RRARR_LEN(victim);
+		for(i=0;i<ilim;++i) {
+			rr_set_t *rrs= RRARR_INDEX(victim,i);
+			if(rrs && !(rrs->flags&CF_LOCAL))
+				cache_size -= del_cent_rrset_by_index(victim,i  DBG0);
 		}
-		le=next;
+		/* this will also delete negative cache entries */
+		if(victim->num_rrs==0)
+			del_cache_ent(victim,NULL);
+		++evict_num;
+		rv=1;
 	}
+	return rv;
 }
 
-#define log_warn_read_error(f,item) \
-        log_warn("%s encountered while reading %s from disk cache file.", \
-        ferror(f)?"Error":feof(f)?"EOF":"Incomplete item",item)
-
 /*
- * Load cache from disk and rebuild the hash tables.
+ * Evict up to EVICT_STEP entries to bring the cache to a size below or equal sz.
+ * Call with rw lock applied.
+ * Returns nonzero if the cache is still too large and further steps might help.
  */
-void read_disk_cache()
+static int evict_step(long sz)
 {
-	/* The locks are done when we add items. */
-	dns_cent_t ce;
-	int dtsz=512;
-	unsigned char *data;
-	unsigned long cnt;
-	FILE *f;
+	struct timespec t0,t1;
+	unsigned long us;
+	int i;
 
-	char path[strlen(global.cache_dir)+sizeof("/pdnsd.cache")];
+	if(cache_size<=sz)
+		return 0;
+	clock_gettime(CLOCK_MONOTONIC,&t0);
+	for(i=0;i<EVICT_STEP && cache_size>sz;++i) {
+		if(!evict_one(sz))
+			break;
+	}
+	clock_gettime(CLOCK_MONOTONIC,&t1);
+	us=(t1.tv_sec-t0.tv_sec)*1000000+(t1.tv_nsec-t0.tv_nsec)/1000;
+	++evict_steps;
+	evict_pause_tot += us;
+	if(us>evict_pause_max)
+		evict_pause_max=us;
+	return cache_size>sz && i==EVICT_STEP;
+}
 
-	stpcpy(stpcpy(path,global.cache_dir),"/pdnsd.cache");
+/* Evict entries until the cache size is at most sz, releasing the lock between the steps. */
+static void evict_run(long sz)
+{
+	int more;
 
-	if (!(f=fopen(path,"r"))) {
-		log_warn("Could not open disk cache file %s: %s",path,strerror(errno));
-		return;
-	}
+	do {
+		lock_cache_rw();
+		more=evict_step(sz);
+		unlock_cache_rw();
+	} while(more);
+}
 
-	if (!(data = malloc(dtsz))) {
-		goto fclose_exit;
-	}
+/* Remove all timed-out records from the cache. Call with rw lock applied. */
+static void purge_timedout()
+{
+	dns_hash_pos_t pos;
+	dns_cent_t *ce;
 
-	/* Don't use insertion sort while reading caches entries from disk, because this can be
-	   noticeably inefficient with large cache files.
-	   Entries are simply appended at the end of the rr_l list.
-	   The rr_l list is sorted using a more efficient merge sort after we are done reading.
-	*/
-	insert_sort=0;
+	for(ce=fetch_first(&pos); ce; ce=fetch_next(&pos)) {
+		if(!(ce->flags&DF_LOCAL) && purge_cent(ce,1,0)<0)
+			++evict_timedout;
+	}
+}
 
-	{
-		unsigned nb;
-		char buf[sizeof(cachverid)];
-
-		/* check cache version identifier */
-		nb=fread(buf,1,sizeof(cachverid),f);
-		if (nb!=sizeof(cachverid)) {
-			/* Don't complain about empty files */
-			if(nb!=0 || !feof(f)) {
-				log_warn_read_error(f,"cache version identifier");
+/* Called after the cache has grown. Call with rw lock applied. */
+static void check_cache_size()
+{
+	long sz=(long)global.perm_cache*1024+MCSZ;
+
+	if(cache_size>sz) {
+		if(!cache_thread_running || cache_size>sz+sz/4)
+			evict_step(sz);
+		if(cache_thread_running) {
+			pthread_mutex_lock(&evict_lock);
+			if(!evict_pending) {
+				evict_pending=1;
+				pthread_cond_signal(&evict_cond);
 			}
-			goto free_data_fclose;
-		}
-		if(memcmp(buf,cachverid,sizeof(cachverid))) {
-			log_warn("Cache file %s ignored because of incompatible version identifier",path);
-			goto free_data_fclose;
+			pthread_mutex_unlock(&evict_lock);
 		}
 	}
+}
 
-	if (fread(&cnt,sizeof(cnt),1,f)!=1) {
-		log_warn_read_error(f,"entry count");
-		goto free_data_fclose;
+/*
+ * The disk cache file is a snapshot of the cache, laid out so that it can be mapped into memory
+ * and used without parsing it first:
+ *
+ *   snap_hdr_t                 version identifier, sizes and a checksum
+ *   uint32_t index[nidx]       open-addressing hash table keyed by domain name. Each slot holds
+ *                              the offset+1 of an entry in the entry area, or 0 if unused.
+ *   entry area (dlen bytes)    one record per cent: dns_file_t, dom_fttlts_t (only for negatively
+ *                              cached domains), the domain name, and the RR sets as rr_fset_t
+ *                              headers followed by rr_fbucket_t's and their data.
+ *
+ * read_disk_cache() only maps and validates the file. The entries are moved into the cache by
+ * a background thread (see start_cache_thread()), and lookup_cache() pulls in the entry for
+ * a name that has not been loaded yet on demand, so that the first queries after startup are
+ * answered from the disk cache immediately. Entries loaded from the snapshot never replace RR
+ * sets that have been cached in the meantime.
+ * The snapshot is written to a temporary file which is then renamed, so the cache file is
+ * always complete. Besides on exit, this is done every cache_sync seconds if that option is set.
+ */
+typedef struct {
+	char             id[sizeof(cachverid)];   /* cachverid */
+	unsigned char    tsz;                     /* sizeof(time_t) of the writer; the file is not portable. */
+	unsigned char    pad[3];
+	uint32_t         nent;                    /* Number of entries. */
+	uint32_t         nidx;                    /* Number of index slots, a power of two (or 0). */
+	uint32_t         dlen;                    /* Length of the entry area. */
+	uint32_t         cksum;                   /* FNV-1a hash of the index and the entry area. */
+} snap_hdr_t;
+
+/* Growable buffer for building a snapshot. */
+typedef struct {
+	unsigned char    *p;
+	size_t           len,sz;
+} snap_buf_t;
+
+static unsigned char *snap_map=NULL;      /* The mapped cache file, NULL if there is nothing (left) to load. */
+static size_t snap_maplen;
+static const uint32_t *snap_idx;
+static const unsigned char *snap_data;
+static uint32_t snap_nidx, snap_dlen;
+static unsigned char *snap_claimed;       /* Per index slot: entry has been taken out of the snapshot. */
+static pthread_mutex_t snap_lock = PTHREAD_MUTEX_INITIALIZER;   /* Protects the variables above. */
+static pthread_mutex_t snap_wlock = PTHREAD_MUTEX_INITIALIZER;  /* Serializes writing the cache file. */
+static volatile unsigned long cache_gen=0; /* Incremented on every add_cache(), to skip unneeded writes. */
+static unsigned long cache_gen_written=0;
+
+static uint32_t snap_cksum(uint32_t h, const unsigned char *p, size_t len)
+{
+	while(len--) {
+		h ^= *p++;
+		h *= 16777619U;
 	}
+	return h;
+}
 
-	for(;cnt>0;--cnt) {
-		dns_file_t fe;
-		dom_fttlts_t fttlts = {0,0};
-		unsigned char nb[256];
-		unsigned num_rrs;
-		unsigned char prevtp;
-		if (fread(&fe,sizeof(fe),1,f)!=1) {
-			log_warn_read_error(f,"cache entry header");
-			goto free_data_fclose;
-		}
-		if(fe.flags&DF_NEGATIVE) {
-			if (fread(&fttlts,sizeof(fttlts),1,f)!=1) {
-				log_warn_read_error(f,"cache TTL and timestamp");
-				goto free_data_fclose;
-			}
-		}
-		if (fe.qlen) {
-			int i;
-			/* Because of its type qlen should be <=255. */
-			if (fread(nb,fe.qlen,1,f)!=1) {
-				log_warn_read_error(f,"domain name");
-				goto free_data_fclose;
-			}
-			for(i=0;i<fe.qlen;) {
-				unsigned lb=nb[i];
-				if(!lb || lb>63 || (i += lb+1)>fe.qlen) {
-					log_warn("Invalid domain name encountered while reading disk cache file.");
-					goto free_data_fclose;
-				}
-			}
-		}
-		nb[fe.qlen]='\0';
-		if (!init_cent(&ce, nb, fttlts.ttl, fttlts.ts, fe.flags  DBG0)) {
-			goto free_data_fclose_exit;
-		}
-		ce.c_ns=fe.c_ns; ce.c_soa=fe.c_soa;
-
-		/* now, read the rr's */
-		prevtp=0;
-		for (num_rrs=fe.num_rrs;num_rrs;--num_rrs) {
-			rr_fset_t sh;
-			unsigned num_rr;
-			if (fread(&sh,sizeof(sh),1,f)!=1) {
-				log_warn_read_error(f,"rr header");
-				goto free_cent_data_fclose;
-			}
-			if(PDNSD_NOT_CACHED_TYPE(sh.tp)) {
-				log_warn("Invalid rr type encountered while reading disk cache file.");
-				goto free_data_fclose;
-			}
-			if(sh.tp<=prevtp) {
-				log_warn("Unexpected rr type encountered (not in strict ascending order) while reading disk cache file.");
-				goto free_data_fclose;
-			}
-			prevtp=sh.tp;
-			/* Add the rrset header in any case (needed for negative caching) */
-			if(!add_cent_rrset_by_type(&ce, sh.tp, sh.ttl, sh.ts, sh.flags  DBG0)) {
-				goto free_cent_data_fclose_exit;
-			}
-			for (num_rr=sh.num_rr;num_rr;--num_rr) {
-				rr_fbucket_t rr;
-				if (fread(&rr,sizeof(rr),1,f)!=1) {
-					log_warn_read_error(f,"rr data length");
-					goto free_cent_data_fclose;
-				}
-				if (rr.rdlen>dtsz) {
-					unsigned char *tmp;
-					dtsz=rr.rdlen;
-					tmp=realloc(data,dtsz);
-					if (!tmp) {
-						goto free_cent_data_fclose_exit;
-					}
-					data=tmp;
-				}
-				if (rr.rdlen && fread(data,rr.rdlen,1,f)!=1) {
-					log_warn_read_error(f,"rr data");
-					goto free_cent_data_fclose;
-				}
-				if (!add_cent_rr(&ce,sh.tp,sh.ttl,sh.ts,sh.flags,rr.rdlen,data  DBG0)) {
-					goto free_cent_data_fclose_exit;
-				}
-			}
+/* Copy len bytes at *pp to buf and advance *pp, unless that would read beyond end. */
+inline static int snap_read(const unsigned char **pp, const unsigned char *end, void *buf, size_t len)
+{
+	if((size_t)(end-*pp)<len)
+		return 0;
+	memcpy(buf,*pp,len);
+	*pp += len;
+	return 1;
+}
+
+/* Decode the snapshot entry at offset off into ce.
+   Returns 1 on success, 0 if the entry is invalid or -1 if we ran out of memory. */
+static int snap_decode_ent(uint32_t off, dns_cent_t *ce)
+{
+	const unsigned char *p=snap_data+off, *end=snap_data+snap_dlen;
+	dns_file_t fe;
+	dom_fttlts_t fttlts = {0,0};
+	unsigned char nb[256];
+	unsigned num_rrs;
+	unsigned char prevtp;
+	int i;
+
+	if (!snap_read(&p,end,&fe,sizeof(fe)))
+		return 0;
+	if ((fe.flags&DF_NEGATIVE) && !snap_read(&p,end,&fttlts,sizeof(fttlts)))
+		return 0;
+	/* Because of its type qlen should be <=255. */
+	if (!snap_read(&p,end,nb,fe.qlen))
+		return 0;
+	for(i=0;i<fe.qlen;) {
+		unsigned lb=nb[i];
+		if(!lb || lb>63 || (i += lb+1)>fe.qlen)
+			return 0;
+	}
+	nb[fe.qlen]='\0';
+	if (!init_cent(ce, nb, fttlts.ttl, fttlts.ts, fe.flags  DBG0))
+		return -1;
+	ce->c_ns=fe.c_ns; ce->c_soa=fe.c_soa;
+
+	prevtp=0;
+	for (num_rrs=fe.num_rrs;num_rrs;--num_rrs) {
+		rr_fset_t sh;
+		unsigned num_rr;
+		if (!snap_read(&p,end,&sh,sizeof(sh)))
+			goto free_cent_invalid;
+		/* rr types must be cacheable and in strict ascending order. */
+		if (PDNSD_NOT_CACHED_TYPE(sh.tp) || sh.tp<=prevtp)
+			goto free_cent_invalid;
+		prevtp=sh.tp;
+		/* Add the rrset header in any case (needed for negative caching) */
+		if(!add_cent_rrset_by_type(ce, sh.tp, sh.ttl, sh.ts, sh.flags  DBG0))
+			goto free_cent_nomem;
+		for (num_rr=sh.num_rr;num_rr;--num_rr) {
+			rr_fbucket_t rr;
+			if (!snap_read(&p,end,&rr,sizeof(rr)) || (size_t)(end-p)<rr.rdlen)
+				goto free_cent_invalid;
+			if (!add_cent_rr(ce,sh.tp,sh.ttl,sh.ts,sh.flags,rr.rdlen,(void *)p  DBG0))
+				goto free_cent_nomem;
+			p += rr.rdlen;
 		}
-		add_cache(&ce);
+	}
+	return 1;
+
+ free_cent_invalid:
+	free_cent(ce  DBG0);
+	return 0;
+ free_cent_nomem:
+	free_cent(ce  DBG0);
+	return -1;
+}
+
+/* Return the domain name of the snapshot entry at offset off in the entry area p,
+   and its length (without terminating null byte) in *lenp. */
+static const unsigned char *snap_ent_name(const unsigned char *p, uint32_t off, unsigned *lenp)
+{
+	dns_file_t fe;
+	memcpy(&fe,p+off,sizeof(fe));
+	*lenp=fe.qlen;
+	return p+off+sizeof(fe)+((fe.flags&DF_NEGATIVE)?sizeof(dom_fttlts_t):0);
+}
+
+/* Find the index slot of the snapshot entry for name. Returns -1 if there is none.
+   Call with snap_lock held and snap_map!=NULL. */
+static long snap_find(const unsigned char *name)
+{
+	unsigned len=rhnlen(name)-1;
+	uint32_t mask=snap_nidx-1, i, n;
+
+	if(!snap_nidx)
+		return -1;
+	i=snap_hash(name,len)&mask;
+	for(n=0; n<snap_nidx; ++n, i=(i+1)&mask) {
+		uint32_t off=snap_idx[i];
+		const unsigned char *nm;
+		unsigned nlen,j;
+		if(!off)
+			break;
+		nm=snap_ent_name(snap_data,off-1,&nlen);
+		if(nlen!=len || nm+nlen>snap_data+snap_dlen)
+			continue;
+		for(j=0; j<len && tolower(nm[j])==tolower(name[j]); ++j) ;
+		if(j==len)
+			return i;
+	}
+	return -1;
+}
+
+/* Decode the entry in index slot i into ce, unless that has been done before.
+   Call with snap_lock held. Returns 1 if ce has been initialized. */
+static int snap_take(uint32_t i, dns_cent_t *ce)
+{
+	int rc;
+
+	if(snap_claimed[i])
+		return 0;
+	snap_claimed[i]=1;
+	rc=snap_decode_ent(snap_idx[i]-1,ce);
+	if(rc<0)
+		log_warn("Out of memory in reading cache file.");
+	else if(rc==0)
+		log_warn("Invalid entry encountered while reading disk cache file.");
+	return rc>0;
+}
+
+static void add_cache_int(dns_cent_t *cent, int fill);
+
+/* Move the snapshot entry for name into the cache, if it has not been loaded yet. */
+static void snap_load_name(const unsigned char *name)
+{
+	dns_cent_t ce;
+	int got=0;
+
+	pthread_mutex_lock(&snap_lock);
+	if(snap_map) {
+		long i=snap_find(name);
+		if(i>=0)
+			got=snap_take(i,&ce);
+	}
+	pthread_mutex_unlock(&snap_lock);
+	if(got) {
+		add_cache_int(&ce,1);
 		free_cent(&ce  DBG0);
 	}
+}
+
+/* Move all remaining snapshot entries into the cache and release the snapshot. */
+static void snap_load_all()
+{
+	uint32_t i;
+
+	for(i=0;;++i) {
+		dns_cent_t ce;
+		int got=0,done;
+
+		pthread_mutex_lock(&snap_lock);
+		done= (!snap_map || i>=snap_nidx);
+		if(!done && snap_idx[i])
+			got=snap_take(i,&ce);
+		pthread_mutex_unlock(&snap_lock);
+		if(done)
+			break;
+		if(got) {
+			add_cache_int(&ce,1);
+			free_cent(&ce  DBG0);
+		}
+	}
+
+	pthread_mutex_lock(&snap_lock);
+	if(snap_map) {
+		munmap(snap_map,snap_maplen);
+		snap_map=NULL;
+		free(snap_claimed);
+		snap_claimed=NULL;
+	}
+	pthread_mutex_unlock(&snap_lock);
 #ifdef DEBUG_HASH
-	free(data);
-	fclose(f);
 	dumphash();
-	goto sort_return;
-#else
-	goto free_data_fclose;
 #endif
+}
 
- free_cent_data_fclose:
-	free_cent(&ce  DBG0);
- free_data_fclose:
-	free(data);
-	fclose(f);
-#ifdef DEBUG_HASH
- sort_return:
-#endif
-	/* Do we need read/write locks to sort the rr_l list?
-	   As long as at most one thread is sorting, it is OK for the other threads
-	   to read the cache, providing they do not add or delete anything.
-	*/
-	lock_cache_r();
-	if(!insert_sort) {
-		sort_rrl();
-		insert_sort=1;
+/*
+ * Map the disk cache file and check its integrity. Its entries are loaded into the cache later,
+ * by the thread started with start_cache_thread() and on demand by lookup_cache().
+ * Call before any other thread is started.
+ */
+void read_disk_cache()
+{
+	int fd;
+	struct stat st;
+	unsigned char *map;
+	snap_hdr_t hdr;
+	const uint32_t *idx;
+	uint32_t i;
+
+	char path[strlen(global.cache_dir)+sizeof("/pdnsd.cache")];
+
+	stpcpy(stpcpy(path,global.cache_dir),"/pdnsd.cache");
+
+	if ((fd=open(path,O_RDONLY))==-1) {
+		log_warn("Could not open disk cache file %s: %s",path,strerror(errno));
+		return;
 	}
-	unlock_cache_r();
+	if (fstat(fd,&st)) {
+		log_warn("Could not stat disk cache file %s: %s",path,strerror(errno));
+		goto close_return;
+	}
+	/* Don't complain about empty files */
+	if (st.st_size==0)
+		goto close_return;
+	if ((size_t)st.st_size<sizeof(hdr)) {
+		log_warn("Cache file %s ignored because it is truncated.",path);
+		goto close_return;
+	}
+	map=mmap(NULL,st.st_size,PROT_READ,MAP_PRIVATE,fd,0);
+	if (map==MAP_FAILED) {
+		log_warn("Could not map disk cache file %s: %s",path,strerror(errno));
+		goto close_return;
+	}
+	close(fd);
+
+	memcpy(&hdr,map,sizeof(hdr));
+	if (memcmp(hdr.id,cachverid,sizeof(cachverid)) || hdr.tsz!=sizeof(time_t)) {
+		log_warn("Cache file %s ignored because of incompatible version identifier",path);
+		goto unmap_return;
+	}
+	if ((hdr.nidx&(hdr.nidx-1)) || hdr.nent>hdr.nidx ||
+	    (size_t)st.st_size!=sizeof(hdr)+(size_t)hdr.nidx*sizeof(uint32_t)+hdr.dlen ||
+	    snap_cksum(FNV_INIT,map+sizeof(hdr),st.st_size-sizeof(hdr))!=hdr.cksum)
+	{
+		log_warn("Cache file %s ignored because it is corrupt or truncated.",path);
+		goto unmap_return;
+	}
+	idx=(const uint32_t *)(map+sizeof(hdr));
+	for(i=0; i<hdr.nidx; ++i) {
+		if (idx[i] && (idx[i]>hdr.dlen || hdr.dlen-(idx[i]-1)<sizeof(dns_file_t))) {
+			log_warn("Cache file %s ignored because its index is invalid.",path);
+			goto unmap_return;
+		}
+	}
+	if (!hdr.nent)
+		goto unmap_return;
+	if (!(snap_claimed=calloc(hdr.nidx,1))) {
+		log_error("Out of memory in reading cache file.");
+		goto unmap_return;
+	}
+
+	snap_map=map;
+	snap_maplen=st.st_size;
+	snap_idx=idx;
+	snap_nidx=hdr.nidx;
+	snap_data=map+sizeof(hdr)+(size_t)hdr.nidx*sizeof(uint32_t);
+	snap_dlen=hdr.dlen;
+
+	dns_hash_reserve(ent_num+hdr.nent);
+	log_info(2,"Mapped disk cache file %s with %lu entries.",path,(unsigned long)hdr.nent);
 	return;
 
- free_cent_data_fclose_exit:
-	free_cent(&ce  DBG0);
- free_data_fclose_exit:
-	free(data);
- fclose_exit:
-	fclose(f);
-	log_error("Out of memory in reading cache file. Exiting.");
-	pdnsd_exit();
+ unmap_return:
+	munmap(map,st.st_size);
+	return;
+ close_return:
+	close(fd);
 }
 
-/* write an rr to the file f */
-static int write_rrset(int tp, rr_set_t *rrs, FILE *f)
+static int snap_put(snap_buf_t *b, const void *data, size_t len)
+{
+	if (b->sz-b->len<len) {
+		size_t nsz= b->sz?b->sz:16384;
+		unsigned char *np;
+		while (nsz-b->len<len) nsz*=2;
+		if (!(np=realloc(b->p,nsz)))
+			return 0;
+		b->p=np;
+		b->sz=nsz;
+	}
+	memcpy(b->p+b->len,data,len);
+	b->len+=len;
+	return 1;
+}
+
+static int snap_put_rrset(snap_buf_t *b, int tp, rr_set_t *rrs)
 {
 	rr_bucket_t *rr;
 	rr_fset_t sh;
@@ -1567,97 +1735,102 @@ static int write_rrset(int tp, rr_set_t *rrs, FILE *f)
 	sh.ttl=rrs->ttl;
 	sh.ts=rrs->ts;
 
-	if (fwrite(&sh,sizeof(sh),1,f)!=1) {
-		log_error("Error while writing rr header to disk cache: %s", strerror(errno));
+	if (!snap_put(b,&sh,sizeof(sh)))
 		return 0;
-	}
 
 	rr=rrs->rrs;
 	for(; num_rr; --num_rr) {
 		rf.rdlen=rr->rdlen;
-		if (fwrite(&rf,sizeof(rf),1,f)!=1 || (rf.rdlen && fwrite((rr->data),rf.rdlen,1,f)!=1)) {
-			log_error("Error while writing rr data to disk cache: %s", strerror(errno));
+		if (!snap_put(b,&rf,sizeof(rf)) || !snap_put(b,rr->data,rf.rdlen))
 			return 0;
-		}
 		rr=rr->next;
 	}
 
 	return 1;
 }
 
+/* Append the record for cent le to b. Returns 0 if out of memory. */
+static int snap_put_cent(snap_buf_t *b, dns_cent_t *le, unsigned long *num_rrs_errs)
+{
+#	define MAX_NUM_RRS_ERRS 10
+	dns_file_t df;
+	int j, jlim, num_rrs;
+	const unsigned short *iterlist;
+
+	df.qlen=rhnlen(le->qname)-1; /* Don't include the null byte at the end */
+	df.num_rrs=0;
+	df.flags=le->flags;
+	df.c_ns=le->c_ns; df.c_soa=le->c_soa;
+	num_rrs=0;
+	jlim=RRARR_LEN(le);
+	for (j=0; j<jlim; ++j) {
+		rr_set_t *rrset= RRARR_INDEX(le,j);
+		if(rrset) {
+			++num_rrs;
+			if(!(rrset->flags&CF_LOCAL))
+				++df.num_rrs;
+		}
+	}
+	if(num_rrs!=le->num_rrs && ++*num_rrs_errs<=MAX_NUM_RRS_ERRS) {
+		unsigned char buf[DNSNAMEBUFSIZE];
+		log_warn("Counted %d rr record types for %s but cached counter=%d",
+			 num_rrs,rhn2str(le->qname,buf,sizeof(buf)),le->num_rrs);
+	}
+	if (!snap_put(b,&df,sizeof(df)))
+		return 0;
+	if(le->flags&DF_NEGATIVE) {
+		dom_fttlts_t fttlts= {le->neg.ttl,le->neg.ts};
+		if (!snap_put(b,&fttlts,sizeof(fttlts)))
+			return 0;
+	}
+	if (!snap_put(b,le->qname,df.qlen))
+		return 0;
+
+	jlim= NRRITERLIST(le);
+	iterlist= RRITERLIST(le);
+	for (j=0; j<jlim; ++j) {
+		int tp= iterlist[j];
+		rr_set_t *rrset= getrrset_eff(le,tp);
+		if(rrset && !(rrset->flags&CF_LOCAL)) {
+			if(!snap_put_rrset(b,tp,rrset))
+				return 0;
+		}
+	}
+	return 1;
+#	undef MAX_NUM_RRS_ERRS
+}
 
 /*
- * Write cache to disk on termination. The hash table is lost and needs to be regenerated
- * on reload.
- *
- * The locks are not very fine grained here, but I don't think this needs fixing as this routine
- * is only called on exit.
- *
+ * Write a snapshot of the cache to the cache file.
+ * If final is nonzero, we are about to exit and only the soft locks are used.
+ * Returns 1 on success, 0 on failure and -1 if the cache could not be locked.
+ * Call with snap_wlock held.
  */
-void write_disk_cache()
+static int snap_write(int final)
 {
-	int j, jlim;
+	int j, jlim, fd, rv=0;
 	dns_cent_t *le;
-	unsigned long en=0;
 	dns_hash_pos_t pos;
-	FILE *f;
 	unsigned long num_rrs_errs=0;
-#	define MAX_NUM_RRS_ERRS 10
-
-	char path[strlen(global.cache_dir)+sizeof("/pdnsd.cache")];
+	snap_buf_t data={NULL,0,0}, offs={NULL,0,0};
+	uint32_t *idx=NULL, nent, nidx, mask, i;
+	snap_hdr_t hdr;
 
-	stpcpy(stpcpy(path,global.cache_dir),"/pdnsd.cache");
+	char path[strlen(global.cache_dir)+sizeof("/pdnsd.cache.tmp")];
+	char *ext=stpcpy(stpcpy(path,global.cache_dir),"/pdnsd.cache");
 
 	DEBUG_MSG("Writing cache to %s\n",path);
 
-	if (!softlock_cache_rw()) {
-		goto lock_failed;
-	}
-	/* purge cache down to allowed size*/
-	purge_cache((long)global.perm_cache*1024, 0);
-	if (!softunlock_cache_rw()) {
-		goto lock_failed;
-	}
-
-	if (!softlock_cache_r()) {
-		goto lock_failed;
-	}
-
-	if (!(f=fopen(path,"w"))) {
-		log_warn("Could not open disk cache file %s: %s",path,strerror(errno));
-		goto softunlock_return;
-	}
-
-	/* Write the cache version identifier */
-	if (fwrite(cachverid,sizeof(cachverid),1,f)!=1) {
-		log_error("Error while writing cache version identifier to disk cache: %s", strerror(errno));
-		goto fclose_unlock;
-	}
-
-	for (le=fetch_first(&pos); le; le=fetch_next(&pos)) {
-		/* count the rr's */
-		if(le->flags&DF_NEGATIVE) {
-			if(!(le->flags&DF_LOCAL))
-				++en;
-		}
-		else {
-			jlim= RRARR_LEN(le);
-			for (j=0; j<jlim; ++j) {
-				rr_set_t *rrset= RRARR_INDEX(le,j);
-				if (rrset && !(rrset->flags&CF_LOCAL)) {
-					++en;
-					break;
-				}
-			}
-		}
-	}
-	if (fwrite(&en,sizeof(en),1,f)!=1) {
-		log_error("Error while writing entry count to disk cache: %s", strerror(errno));
-		goto fclose_unlock;
+	if (final) {
+		if (!softlock_cache_r())
+			return -1;
 	}
+	else
+		lock_cache_r();
 
 	for (le=fetch_first(&pos); le; le=fetch_next(&pos)) {
-		/* now, write the rr's */
+		uint32_t off;
+		/* Only entries with non-local data are written */
 		if(le->flags&DF_NEGATIVE) {
 			if(!(le->flags&DF_LOCAL))
 				goto write_rrs;
@@ -1673,74 +1846,187 @@ void write_disk_cache()
 		}
 		continue;
 	       write_rrs:
+		off=data.len;
+		if (data.len>=0xffffffffUL || !snap_put(&offs,&off,sizeof(off)) ||
+		    !snap_put_cent(&data,le,&num_rrs_errs))
 		{
-			dns_file_t df;
-			int num_rrs;
-			const unsigned short *iterlist;
-			df.qlen=rhnlen(le->qname)-1; /* Don't include the null byte at the end */
-			df.num_rrs=0;
-			df.flags=le->flags;
-			df.c_ns=le->c_ns; df.c_soa=le->c_soa;
-			num_rrs=0;
-			jlim=RRARR_LEN(le);
-			for (j=0; j<jlim; ++j) {
-				rr_set_t *rrset= RRARR_INDEX(le,j);
-				if(rrset) {
-					++num_rrs;
-					if(!(rrset->flags&CF_LOCAL))
-						++df.num_rrs;
-				}
-			}
-			if(num_rrs!=le->num_rrs && ++num_rrs_errs<=MAX_NUM_RRS_ERRS) {
-				unsigned char buf[DNSNAMEBUFSIZE];
-				log_warn("Counted %d rr record types for %s but cached counter=%d",
-					 num_rrs,rhn2str(le->qname,buf,sizeof(buf)),le->num_rrs);
-			}
-			if (fwrite(&df,sizeof(df),1,f)!=1) {
-				log_error("Error while writing cache entry header to disk cache: %s", strerror(errno));
-				goto fclose_unlock;
-			}
-			if(le->flags&DF_NEGATIVE) {
-				dom_fttlts_t fttlts= {le->neg.ttl,le->neg.ts};
-				if (fwrite(&fttlts,sizeof(fttlts),1,f)!=1) {
-					log_error("Error while writing cache TTL and timestamp to disk cache: %s", strerror(errno));
-					goto fclose_unlock;
-				}
-			}
-			if (df.qlen && fwrite(le->qname,df.qlen,1,f)!=1) {
-				log_error("Error while writing domain name to disk cache: %s", strerror(errno));
-				goto fclose_unlock;
-			}
-
-			jlim= NRRITERLIST(le);
-			iterlist= RRITERLIST(le);
-			for (j=0; j<jlim; ++j) {
-				int tp= iterlist[j];
-				rr_set_t *rrset= getrrset_eff(le,tp);
-				if(rrset && !(rrset->flags&CF_LOCAL)) {
-					if(!write_rrset(tp,rrset,f))
-						goto fclose_unlock;
-				}
-			}
+			log_error("Out of memory while writing disk cache.");
+			if (final)
+				softunlock_cache_r();
+			else
+				unlock_cache_r();
+			goto free_return;
 		}
 	}
-	if(fclose(f)) {
+	cache_gen_written=cache_gen;
+	if (final)
+		softunlock_cache_r();
+	else
+		unlock_cache_r();
+
+	/* Build the index. It is kept at most half full so that probe sequences stay short. */
+	nent=offs.len/sizeof(uint32_t);
+	for(nidx=nent?2:0; nidx && nidx<2*nent; nidx*=2) ;
+	if (nidx && !(idx=calloc(nidx,sizeof(uint32_t)))) {
+		log_error("Out of memory while writing disk cache.");
+		goto free_return;
+	}
+	mask=nidx-1;
+	for(i=0; i<nent; ++i) {
+		uint32_t off=((uint32_t *)offs.p)[i];
+		unsigned len;
+		const unsigned char *nm=snap_ent_name(data.p,off,&len);
+		uint32_t k=snap_hash(nm,len)&mask;
+		while(idx[k]) k=(k+1)&mask;
+		idx[k]=off+1;
+	}
+
+	memcpy(hdr.id,cachverid,sizeof(cachverid));
+	hdr.tsz=sizeof(time_t);
+	memset(hdr.pad,0,sizeof(hdr.pad));
+	hdr.nent=nent;
+	hdr.nidx=nidx;
+	hdr.dlen=data.len;
+	hdr.cksum=snap_cksum(snap_cksum(FNV_INIT,(unsigned char *)idx,nidx*sizeof(uint32_t)),data.p,data.len);
+
+	/* Write to a temporary file and rename it, so that the cache file is always complete. */
+	strcpy(ext,".tmp");
+	if ((fd=open(path,O_WRONLY|O_CREAT|O_TRUNC,0600))==-1) {
+		log_warn("Could not open disk cache file %s: %s",path,strerror(errno));
+		goto free_return;
+	}
+	if (write_all(fd,&hdr,sizeof(hdr))!=sizeof(hdr) ||
+	    write_all(fd,idx,nidx*sizeof(uint32_t))!=(ssize_t)(nidx*sizeof(uint32_t)) ||
+	    write_all(fd,data.p,data.len)!=(ssize_t)data.len ||
+	    fsync(fd))
+	{
+		log_error("Error while writing disk cache file %s: %s", path,strerror(errno));
+		close(fd);
+		unlink(path);
+		goto free_return;
+	}
+	if (close(fd)) {
 		log_error("Could not close cache file %s after writing cache: %s", path,strerror(errno));
+		unlink(path);
+		goto free_return;
 	}
-	softunlock_cache_r();
-	DEBUG_MSG("Finished writing cache to disk.\n");
-	return;
+	{
+		char npath[strlen(global.cache_dir)+sizeof("/pdnsd.cache")];
+		stpcpy(stpcpy(npath,global.cache_dir),"/pdnsd.cache");
+		if (rename(path,npath)) {
+			log_error("Could not rename %s to %s: %s", path,npath,strerror(errno));
+			unlink(path);
+			goto free_return;
+		}
+	}
+	rv=1;
+	DEBUG_MSG("Finished writing cache to disk (%lu entries).\n",(unsigned long)nent);
+
+ free_return:
+	free(idx);
+	free(offs.p);
+	free(data.p);
+	return rv;
+}
 
- fclose_unlock:
-	fclose(f);
- softunlock_return:
-	softunlock_cache_r();
+
+/*
+ * Write cache to disk on termination. The hash table is lost and needs to be regenerated
+ * on reload.
+ */
+void write_disk_cache()
+{
+	/* Entries of the old snapshot that have not been loaded yet would be lost, so
+	   if we exit before loading has finished, leave the old cache file alone. */
+	if (snap_map) {
+		log_info(2,"Disk cache has not been loaded completely; not overwriting it.");
+		return;
+	}
+
+	/* Wait for a periodic write in progress. */
+	pthread_mutex_lock(&snap_wlock);
+	if (!softlock_cache_rw()) {
+		goto lock_failed;
+	}
+	/* purge timed-out records and evict entries down to the allowed size */
+	purge_timedout();
+	while(evict_step((long)global.perm_cache*1024));
+	if (!softunlock_cache_rw()) {
+		goto lock_failed;
+	}
+	if (snap_write(1)<0)
+		goto lock_failed;
+	pthread_mutex_unlock(&snap_wlock);
 	return;
 
  lock_failed:
+	pthread_mutex_unlock(&snap_wlock);
 	crash_msg("Lock failed; could not write disk cache.");
 }
 
+/* Load the snapshot mapped by read_disk_cache() into the cache, evict entries whenever
+   the cache has grown too large and, if cache_sync is set, write the cache to disk
+   periodically whenever it has changed. */
+static void *cache_thread(void *p)
+{
+	struct timespec sync_ts={0,0};
+
+	THREAD_SIGINIT;
+
+	if (snap_map)
+		snap_load_all();
+	if (global.cache_sync>0)
+		sync_ts.tv_sec=time(NULL)+global.cache_sync;
+	for(;;) {
+		int evict;
+
+		pthread_mutex_lock(&evict_lock);
+		while (!evict_pending) {
+			if (!sync_ts.tv_sec)
+				pthread_cond_wait(&evict_cond,&evict_lock);
+			else if (pthread_cond_timedwait(&evict_cond,&evict_lock,&sync_ts)==ETIMEDOUT)
+				break;
+		}
+		evict=evict_pending;
+		evict_pending=0;
+		pthread_mutex_unlock(&evict_lock);
+
+		if (evict)
+			evict_run((long)global.perm_cache*1024);
+		if (sync_ts.tv_sec && time(NULL)>=sync_ts.tv_sec) {
+			if (cache_gen!=cache_gen_written) {
+				pthread_mutex_lock(&snap_wlock);
+				snap_write(0);
+				pthread_mutex_unlock(&snap_wlock);
+			}
+			sync_ts.tv_sec=time(NULL)+global.cache_sync;
+		}
+	}
+	return NULL;
+}
+
+/* Start the thread that loads the disk cache, evicts entries and writes the cache back
+   periodically, if needed. Call after the cache lock has been initialized.
+   If the thread cannot be started, the disk cache is loaded right away and eviction is done
+   inline (the cache is then only written on exit), so this is not treated as a failure. */
+void start_cache_thread()
+{
+	pthread_t ct;
+	int rv;
+
+	/* Set this before the thread starts adding entries from the disk cache. */
+	cache_thread_running=1;
+	rv=pthread_create(&ct,&attr_detached,cache_thread,NULL);
+	if (rv) {
+		log_warn("Failed to start cache thread: %s",strerror(rv));
+		cache_thread_running=0;
+		if (snap_map)
+			snap_load_all();
+	}
+	else
+		log_info(2,"Cache thread started.");
+}
+
 /*
  * Conflict Resolution.
  * The first function is the actual checker; the latter two are wrappers for the respective
@@ -1858,20 +2144,20 @@ inline static void adjust_dom_ttl(dns_cent_t *cent)
 }
 
 /*
- * Add a ready built dns_cent_t to the hashes, purge if necessary to not exceed cache size
- * limits, and add the entries to the hashes.
+ * Add a ready built dns_cent_t to the hashes, evict entries if necessary to not exceed
+ * cache size limits (see check_cache_size()), and add the entries to the hashes.
  * As memory is already reserved for the rrs, we only need to wrap up the dns_cent_t and
  * alloc memory for it.
- * New entries are appended, so we easiliy know the oldest for purging. For fast acces,
- * we use hashes instead of ordered storage.
  *
  * This does not free the argument, and it uses a copy of it, so the caller must do free_cent()
  * on it.
  *
  * The new entries rr sets replace the old ones, i.e. old rr sets with the same key are deleted
  * before the new ones are added.
+ * add_cache_int() with fill set only adds the rr sets the cache does not have yet; this is used
+ * for entries from the disk cache, which are older than anything cached since startup.
  */
-void add_cache(dns_cent_t *cent)
+static void add_cache_int(dns_cent_t *cent, int fill)
 {
 	dns_cent_t *ce;
 	dns_hash_loc_t loc;
@@ -1881,37 +2167,33 @@ void add_cache(dns_cent_t *cent)
  retry:
 	if (!(ce=dns_lookup(cent->qname,&loc))) {
 		/* if the new entry doesn't contain any information,
-		   don't try to add it to the cache because purge_cache() will not
+		   don't try to add it to the cache because evict_one() will not
 		   be able to get rid of it.
 		*/
 		if(cent->num_rrs==0 && !(cent->flags&DF_NEGATIVE))
-			goto purge_cache_return;
+			goto check_size_return;
 
 		if(!(ce=copy_cent(cent  DBG0)))
 			goto warn_unlock_cache_return;
 
 		if(!(ce->flags&DF_NEGATIVE)) {
 			ilim= RRARR_LEN(ce);
-			/* Add the rrs to the rr list */
 			for (i=0; i<ilim; ++i) {
 				rr_set_t *rrset= RRARR_INDEX(ce,i);
-				if (rrset) {
+				if (rrset)
 					adjust_ttl(rrset);
-					if (!insert_rrl(rrset,ce,i))
-						goto free_cent_unlock_cache_return;
-				}
 			}
 		}
-		else {
-			/* If this domain is negatively cached, add the cent to the rr_l list. */
+		else
 			adjust_dom_ttl(ce);
-			if (!insert_rrl(NULL,ce,-1))
-				goto free_cent_unlock_cache_return;
-		}
+		/* Entries from the disk cache count as used before anything else. */
+		ce->atime= fill?0:use_tick();
 		if (!add_dns_hash(ce,&loc))
 			goto free_cent_unlock_cache_return;
 		++ent_num;
 	} else {
+		if (fill && ((cent->flags|ce->flags)&DF_NEGATIVE))
+			goto unlock_cache_return;
 		if (cent->flags&DF_NEGATIVE) {
 			/* the new entry is negative. So, we need to delete the whole cent,
 			 * and then generate a new one. */
@@ -1939,7 +2221,7 @@ void add_cache(dns_cent_t *cent)
 				   Answers obtained from root servers have precedence over additional records
 				   from other servers. */
 				if (!(cerrs &&
-				      ((!(centrrs->flags&CF_LOCAL) && (cerrs->flags&CF_LOCAL)) ||
+				      (fill || (!(centrrs->flags&CF_LOCAL) && (cerrs->flags&CF_LOCAL)) ||
 				       ((centrrs->flags&CF_ADDITIONAL) && (!(cerrs->flags&CF_ADDITIONAL) ||
 									   (!(centrrs->flags&CF_ROOTSERV) &&
 									    (cerrs->flags&CF_ROOTSERV))) &&
@@ -1966,11 +2248,7 @@ void add_cache(dns_cent_t *cent)
 							goto cleanup_cent_unlock_cache_return;
 						}
 					}
-					cerrs= RRARR_INDEX(ce,i);
-					adjust_ttl(cerrs);
-					if (!insert_rrl(cerrs,ce,i)) {
-						goto cleanup_cent_unlock_cache_return;
-					}
+					adjust_ttl(RRARR_INDEX(ce,i));
 				}
 			}
 		}
@@ -1979,11 +2257,15 @@ void add_cache(dns_cent_t *cent)
 			ce->c_ns=cent->c_ns;
 		if(cent->c_soa!=cundef && (ce->c_soa==cundef || ce->c_soa<cent->c_soa))
 			ce->c_soa=cent->c_soa;
+		if(!fill)
+			ce->atime=use_tick();
 	}
 
 	cache_size += ce->cs;
- purge_cache_return:
-	purge_cache((long)global.perm_cache*1024+MCSZ, 1);
+	++cache_gen;
+	cache_touch(ce->qname);
+ check_size_return:
+	check_cache_size();
 	goto unlock_cache_return;
 
  cleanup_cent_unlock_cache_return:
@@ -2001,6 +2283,11 @@ void add_cache(dns_cent_t *cent)
 	unlock_cache_rw();
 }
 
+void add_cache(dns_cent_t *cent)
+{
+	add_cache_int(cent,0);
+}
+
 /*
   Convert A (and AAAA) records in a ready built cache entry to PTR records suitable for reverse resolving
   of numeric addresses and add them to the cache.
@@ -2061,6 +2348,7 @@ int add_reverse_cache(dns_cent_t * cent)
 void del_cent(dns_cent_t *cent)
 {
 	cache_size -= cent->cs;
+	cache_touch(cent->qname);
 
 	/* free the data referred by the cent and the cent itself */
 	free_cent(cent  DBG0);
@@ -2112,6 +2400,7 @@ void invalidate_record(const unsigned char *name)
 
 	lock_cache_rw();
 	if ((ce=dns_lookup(name,NULL))) {
+		cache_touch(name);
 		if(!(ce->flags&DF_NEGATIVE)) {
 			ilim= RRARR_LEN(ce);
 			for (i=0; i<ilim; ++i) {
@@ -2145,6 +2434,7 @@ int set_cent_flags(const unsigned char *name, unsigned flags)
 	ret=dns_lookup(name,NULL);
 	if (ret) {
 		ret->flags |= flags;
+		cache_touch(name);
 	}
 	unlock_cache_rw();
 	return ret!=NULL;
@@ -2175,6 +2465,29 @@ unsigned char *getlocalowner(unsigned char *name,int tp)
 }
 
 
+/* Count a lookup of a cache entry, saturating at the maximum, and note when it was used.
+   Only a read lock is held here, so the increment must be atomic. */
+inline static void count_hit(dns_cent_t *cent)
+{
+	if(cent->hits<0xffff)
+		__sync_fetch_and_add(&cent->hits,1);
+	cent->atime=use_tick();
+}
+
+/* Add n to the hit counter of the cache entry for name, for lookups that were answered
+   without calling lookup_cache(). */
+void cache_count_hits(const unsigned char *name, unsigned n)
+{
+	dns_cent_t *cent;
+
+	lock_cache_r();
+	if ((cent=dns_lookup(name,NULL))) {
+		for(; n; --n)
+			count_hit(cent);
+	}
+	unlock_cache_r();
+}
+
 /* Lookup an entry in the cache using name (in length byte -  string notation).
  * For thread safety, a copy must be returned, so delete it after use, by first doing
  * free_cent to remove the rrs and then by freeing the returned pointer.
@@ -2186,6 +2499,10 @@ dns_cent_t *lookup_cache(const unsigned char *name, int *wild)
 	int purge=0;
 	dns_cent_t *ret;
 
+	/* While the disk cache is being loaded, make sure its entry for name is in the cache. */
+	if (snap_map)
+		snap_load_name(name);
+
 	/* First try with only read access to the cache. */
 	lock_cache_r();
 	ret=dns_lookup(name,NULL);
@@ -2223,8 +2540,10 @@ dns_cent_t *lookup_cache(const unsigned char *name, int *wild)
 		}
 	}
 	if (ret) {
-		if(!(purge=purge_cent(ret, 1,1))) /* test only, don't remove anything yet! */
+		if(!(purge=purge_cent(ret, 1,1))) { /* test only, don't remove anything yet! */
+			count_hit(ret);
 			ret=copy_cent(ret  DBG1);
+		}
 	}
 	unlock_cache_r();
 
@@ -2264,8 +2583,10 @@ dns_cent_t *lookup_cache(const unsigned char *name, int *wild)
 		if (ret) {
 			if(purge_cent(ret, 1,0)<0)
 				ret=NULL;
-			else
+			else {
+				count_hit(ret);
 				ret=copy_cent(ret  DBG1);
+			}
 		}
 		unlock_cache_rw();
 	}
@@ -2366,6 +2687,15 @@ int add_cache_rr_add(const unsigned char *name, int tp, time_t ttl, time_t ts, u
 #endif
 
 /* Report the cache status to the file descriptor f, for the status fifo (see status.c) */
+/* Copy the cache counters for the metrics report. Like report_cache_stat(), this does not lock the cache. */
+void cache_metrics(long *bytes, long *maxbytes, long *entries, unsigned long *evicted)
+{
+	*bytes=cache_size;
+	*maxbytes=global.perm_cache*1024+MCSZ;
+	*entries=ent_num;
+	*evicted=evict_num;
+}
+
 int report_cache_stat(int f)
 {
 	/* Cache size and entry counters are volatile (and even the entries
@@ -2374,6 +2704,12 @@ int report_cache_stat(int f)
 	long csz= cache_size, en= ent_num;
 	long pc= global.perm_cache;
 	long mc= pc*1024+MCSZ;
+	unsigned long as= arena_slabs, au= arena_used;
+	unsigned long hs, hu;
+	unsigned long ev= evict_num, et= evict_timedout, es= evict_steps;
+	unsigned long epm= evict_pause_max, ept= evict_pause_tot;
+
+	dns_hash_stat(&hs,&hu);
 
 	fsprintf_or_return(f,"\nCache status:\n=============\n");
 	fsprintf_or_return(f,"%ld kB maximum disk cache size.\n",pc);
@@ -2381,6 +2717,12 @@ int report_cache_stat(int f)
 			   " (avg %.5g bytes/entry).\n",
 			   csz, mc, (((double)csz)/mc)*100, en,
 			   ((double)csz)/en);
+	fsprintf_or_return(f,"%lu kB allocated in %lu arena slabs, %lu kB in use.\n",
+			   as*(ARENA_SLABSZ/1024), as, au/1024);
+	fsprintf_or_return(f,"%lu of %lu hash table slots used.\n",hu,hs);
+	fsprintf_or_return(f,"%lu entries evicted, %lu timed-out entries removed in %lu steps"
+			   " (longest %lu us, avg %lu us).\n",
+			   ev, et, es, epm, es?ept/es:0);
 	return 0;
 }
 
@@ -31,8 +31,6 @@
 #include "dns.h"
 #include "conff.h"
 
-struct rr_lent_s;
-
 /*
  * These values are converted to host byte order. the data is _not_.
  */
@@ -47,7 +45,6 @@ typedef struct rr_b_s  {
 } rr_bucket_t;
 
 typedef struct {
-	struct rr_lent_s *lent;                   /* this points to the list entry */
 	time_t           ttl;
 	time_t           ts;
 	unsigned short   flags;
@@ -58,11 +55,16 @@ typedef struct {
 typedef struct {
 	unsigned char    *qname;                  /* Name of the domain in length byte - string notation. */
 	size_t           cs;                      /* Size of the cache entry, including RR sets. */
+	unsigned long    atime;                   /* Value of the use clock at the last lookup (or when cached),
+						     for eviction (see evict_one() in cache.c). */
 	unsigned short   num_rrs;                 /* The number of RR sets. When this decreases to 0, the cent is deleted. */
 	unsigned short   flags;                   /* Flags for the whole domain. */
+	unsigned short   hits;                    /* Number of lookups served from this entry (saturating). */
+	unsigned char    c_ns,c_soa;              /* Number of trailing name elements in qname to use to find NS or SOA
+						     records to add to the authority section of a response.
+						     Kept next to the other small members to avoid padding. */
 	union {
 		struct {                          /* Fields used only for negatively cached domains. */
-			struct rr_lent_s *lent;   /* list entry for the whole cent. */
 			time_t           ttl;     /* TTL for negative caching. */
 			time_t           ts;      /* Timestamp. */
 		} neg;
@@ -73,8 +75,6 @@ typedef struct {
 						     less frequently used records. */
 		} rr;
 	};
-	unsigned char    c_ns,c_soa;              /* Number of trailing name elements in qname to use to find NS or SOA
-						     records to add to the authority section of a response. */
 } dns_cent_t;
 
 /* This value is used to represent an undefined c_ns or c_soa field. */
@@ -132,9 +132,20 @@ char *flags2str(unsigned flags,char *buf,int nflags,const char *flgnames);
 /* This is used internally to check if a negatively cached domain has timed out.
    Only use if the DF_NEGATIVE bit is set! */
 #define timedout_nxdom(cent) ((cent)->neg.ts+CLAT_ADJ((cent)->neg.ttl)<time(NULL))
+/* These are like timedout() and timedout_nxdom(), but check whether a record may be removed from
+   the cache. Timed-out records are kept for another stale_ttl seconds, so that they may be served
+   while being refreshed (RFC 8767). */
+#define expired(rrset) ((rrset)->ts+CLAT_ADJ((rrset)->ttl)+global.stale_ttl<time(NULL))
+#define expired_nxdom(cent) ((cent)->neg.ts+CLAT_ADJ((cent)->neg.ttl)+global.stale_ttl<time(NULL))
 
 extern volatile short int use_cache_lock;
 
+/* Number of modification counters, see cache_gen_slot(). */
+#define CACHE_GEN_SLOTS 1024
+extern volatile unsigned long cache_gens[CACHE_GEN_SLOTS];
+unsigned cache_gen_slot(const unsigned char *name);
+void cache_note_use(unsigned slot);
+
 
 #ifdef ALLOC_DEBUG
 #define DBGPARAM ,int dbg
@@ -163,7 +174,9 @@ int empty_cache(slist_array sla);
 void destroy_cache(void);
 void read_disk_cache(void);
 void write_disk_cache(void);
+void start_cache_thread(void);
 
+void cache_metrics(long *bytes, long *maxbytes, long *entries, unsigned long *evicted);
 int report_cache_stat(int f);
 int dump_cache(int fd, const unsigned char *name, int exact);
 
@@ -177,6 +190,7 @@ void invalidate_record(const unsigned char *name);
 int set_cent_flags(const unsigned char *name, unsigned flags);
 unsigned char *getlocalowner(unsigned char *name,int tp);
 dns_cent_t *lookup_cache(const unsigned char *name, int *wild);
+void cache_count_hits(const unsigned char *name, unsigned n);
 rr_set_t *lookup_cache_local_rrset(const unsigned char *name, int type);
 #if 0
 int add_cache_rr_add(const unsigned char *name, int tp, time_t ttl, time_t ts, unsigned flags, unsigned dlen, void *data, unsigned long serial);
@@ -66,6 +66,9 @@ enum {
 	QUERY_PORT_END,
 	UDP_BUFSIZE,
 	DELEGATION_ONLY,
+	STALE_TTL,
+	PREFETCH_HITS,
+	CACHE_SYNC,
 
 	IP,
 	PORT,
@@ -126,6 +129,7 @@ static const namevalue_t section_headers[]= {
 /* Table for looking up global options. Order alphabetically! */
 static const namevalue_t global_options[]= {
 	{"cache_dir",         CACHE_DIR},
+	{"cache_sync",        CACHE_SYNC},
 	{"ctl_perms",         C_CTL_PERMS},
 	{"daemon",            DAEMON},
 	{"debug",             C_DEBUG},
@@ -145,6 +149,7 @@ static const namevalue_t global_options[]= {
 	{"paranoid",          PARANOID},
 	{"perm_cache",        PERM_CACHE},
 	{"pid_file",          PID_FILE},
+	{"prefetch_hits",     PREFETCH_HITS},
 	{"proc_limit",        C_PROC_LIMIT},
 	{"procq_limit",       C_PROCQ_LIMIT},
 	{"query_method",      C_QUERY_METHOD},
@@ -156,6 +161,7 @@ static const namevalue_t global_options[]= {
 	{"scheme_file",       SCHEME_FILE},
 	{"server_ip",         SERVER_IP},
 	{"server_port",       SERVER_PORT},
+	{"stale_ttl",         STALE_TTL},
 	{"status_ctl",        STATUS_CTL},
 	{"strict_setuid",     STRICT_SETUID},
 	{"tcp_qtimeout",      TCP_QTIMEOUT},
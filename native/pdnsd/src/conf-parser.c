@@ -857,6 +857,18 @@ int confparse(FILE* in, char *prestr, globparm_t *global, servparm_array *server
 	    SCAN_TIMESECS(global->neg_ttl, p,"neg_ttl option");
 	    break;
 
+	  case STALE_TTL:
+	    SCAN_TIMESECS(global->stale_ttl, p,"stale_ttl option");
+	    break;
+
+	  case PREFETCH_HITS:
+	    SCAN_UNSIGNED_NUM(global->prefetch_hits, p,"prefetch_hits option");
+	    break;
+
+	  case CACHE_SYNC:
+	    SCAN_TIMESECS(global->cache_sync, p,"cache_sync option");
+	    break;
+
 	  case NEG_RRS_POL: {
 	    int cnst;
 	    ASSIGN_CONST(cnst,p,cnst==C_ON || cnst==C_OFF || cnst==C_DEFAULT || cnst==C_AUTH,
@@ -50,6 +50,9 @@ globparm_t global={
   max_ttl:           604800,
   min_ttl:           30,
   neg_ttl:           60,
+  stale_ttl:         0,
+  prefetch_hits:     0,
+  cache_sync:        0,
   neg_rrs_pol:       C_DEFAULT,
   neg_domain_pol:    C_AUTH,
   verbosity:         VERBOSITY,
@@ -379,6 +382,9 @@ int report_conf_stat(int f)
 	fsprintf_or_return(f,"\tMaximum ttl: %li\n",(long)global.max_ttl);
 	fsprintf_or_return(f,"\tMinimum ttl: %li\n",(long)global.min_ttl);
 	fsprintf_or_return(f,"\tNegative ttl: %li\n",(long)global.neg_ttl);
+	fsprintf_or_return(f,"\tStale ttl: %li\n",(long)global.stale_ttl);
+	fsprintf_or_return(f,"\tPrefetch after hits: %i\n",global.prefetch_hits);
+	fsprintf_or_return(f,"\tCache sync interval: %li\n",(long)global.cache_sync);
 	fsprintf_or_return(f,"\tNegative RRS policy: %s\n",const_name(global.neg_rrs_pol));
 	fsprintf_or_return(f,"\tNegative domain policy: %s\n",const_name(global.neg_domain_pol));
 	fsprintf_or_return(f,"\tRun as: %s\n",global.run_as);
@@ -468,6 +474,12 @@ static int report_server_stat(int f,int i)
 		{char buf[ADDRSTR_MAXLEN];
 		 fsprintf_or_return(f,"\tip: %s\n",pdnsd_a2str(PDNSD_A2_TO_A(&at->a),buf,ADDRSTR_MAXLEN));}
 		fsprintf_or_return(f,"\tserver assumed available: %s\n",at->is_up?"yes":"no");
+		{long srtt,rttvar; unsigned fails;
+		 if(srv_rtt_get(PDNSD_A2_TO_A(&at->a),st->port,&srtt,&rttvar,&fails)) {
+			 if(srtt>=0)
+				 fsprintf_or_return(f,"\tround trip time: %li ms (deviation %li ms)\n",srtt,rttvar);
+			 fsprintf_or_return(f,"\tfailure score: %u\n",fails);
+		 }}
 	}
 	fsprintf_or_return(f,"\tport: %hu\n",st->port);
 	fsprintf_or_return(f,"\tuptest: %s\n",const_name(st->uptest));
@@ -130,6 +130,9 @@ typedef struct {
 	time_t        max_ttl;
 	time_t        min_ttl;
 	time_t        neg_ttl;
+	time_t        stale_ttl;
+	int           prefetch_hits;
+	time_t        cache_sync;
 	short         neg_rrs_pol;
 	short         neg_domain_pol;
 	short         verbosity;
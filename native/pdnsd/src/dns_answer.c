@@ -58,6 +58,7 @@
 #include "cache.h"
 #include "error.h"
 #include "debug.h"
+#include "status.h"
 
 
 /*
@@ -82,6 +83,8 @@ static volatile int qprocs=0;  /* queued query processes */
 static volatile unsigned long dropped=0,spawned=0;
 static volatile unsigned thrid_cnt=0;
 static pthread_mutex_t proc_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t proc_cond = PTHREAD_COND_INITIALIZER;  /* signaled when procs drops */
+static volatile unsigned long inline_answered=0;
 
 #ifdef SOCKET_LOCKING
 static pthread_mutex_t s_lock = PTHREAD_MUTEX_INITIALIZER;
@@ -116,6 +119,7 @@ typedef struct {
 	int                sock;
 	int                proto;
 	size_t             len;
+	unsigned long      rcv_us;  /* time of arrival, for the latency metrics */
 	unsigned char      buf[0];  /* Actual size determined by global.udpbufsize */
 } udp_buf_t;
 
@@ -162,6 +166,9 @@ static int sva_add(dlist *sva, const unsigned char *rhn, unsigned short tp, unsi
 	return 1;
 }
 
+/* The ttl given to records that are answered after they have timed out (RFC 8767). */
+#define STALE_ANS_TTL 30
+
 /* ans_ttl computes the ttl value to return to the client.
    This is the ttl value stored in the cache entry minus the time
    the cache entry has lived in the cache.
@@ -176,6 +183,8 @@ inline static time_t ans_ttl(rr_set_t *rrset, time_t queryts)
 		if(tpassed<0) tpassed=0;
 		ttl -= tpassed;
 		if(ttl<0) ttl=0;
+		if(global.stale_ttl && tpassed>CLAT_ADJ(rrset->ttl))
+			ttl=STALE_ANS_TTL;
 	}
 	return ttl;
 }
@@ -1010,6 +1019,259 @@ return_ans:
 	return ans;
 }
 
+/*
+ * The answer cache keeps the wire format of recently composed responses to single-question
+ * queries, so that repeated queries for popular names can be answered by copying the response,
+ * patching the ID and ageing the TTLs instead of running compose_answer() again.
+ * An entry is only used as long as none of the names whose records it contains have been
+ * changed in the cache (see cache_gens in cache.c), and not beyond the lifetime of the
+ * shortest-lived record in it.
+ */
+#define ANSCACHE_SIZE     256    /* Number of entries (direct mapped). */
+#define ANSCACHE_MAXTTLS  16     /* Responses with more records are not cached. */
+#define ANSCACHE_MAXDEPS  8      /* Responses with more owner names are not cached. */
+#define ANSCACHE_MAXLEN   1024   /* Larger responses are not cached. */
+
+typedef struct {
+	unsigned char  *msg;                      /* Composed response, starting with the header. NULL if unused. */
+	unsigned short len;
+	unsigned short qtype,qclass;
+	unsigned short udp;                       /* Size limit the response was composed for, 0 for TCP. */
+	unsigned char  rd,edns,age;               /* age is 0 if the TTLs must not be decreased (local records). */
+	unsigned char  nttl,ndeps;
+	unsigned char  rot_n;                     /* Number of records in the run to rotate if randomize_recs is on. */
+	unsigned short rot_off,rot_len;           /* Offset and length of a single record in this run. */
+	time_t         ts;                        /* Time the response was composed. */
+	time_t         expires;
+	unsigned       hits;
+	unsigned short ttloff[ANSCACHE_MAXTTLS];
+	uint32_t       ttl[ANSCACHE_MAXTTLS];
+	unsigned short dep[ANSCACHE_MAXDEPS];    /* cache_gens slots of the owner names ... */
+	unsigned long  depgen[ANSCACHE_MAXDEPS]; /* ... and their values at composition time. */
+} anscache_t;
+
+static anscache_t anscache[ANSCACHE_SIZE];
+static pthread_mutex_t anscache_lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned long anscache_hits=0, anscache_stored=0;  /* Protected by anscache_lock. */
+
+static unsigned anscache_idx(const unsigned char *name, unsigned short qtype)
+{
+	return (cache_gen_slot(name)*31+qtype)%ANSCACHE_SIZE;
+}
+
+inline static int anscache_match(anscache_t *e, dns_queryel_t *qe, dns_hdr_t *hdr, edns_info_t *ednsinfo, unsigned *udp)
+{
+	return e->msg && e->qtype==qe->qtype && e->qclass==qe->qclass &&
+		e->rd==hdr->rd && e->edns==(ednsinfo!=NULL) && e->udp==(udp?*udp:0) &&
+		e->len>=sizeof(dns_hdr_t)+rhnlen(qe->query) &&
+		!memcmp(e->msg+sizeof(dns_hdr_t),qe->query,rhnlen(qe->query));
+}
+
+/* Look up a response for the single question qe in the answer cache.
+   Returns a newly allocated copy with ID and TTLs adjusted, or NULL.
+   If peek is set, a stale entry is left for a later call without peek to dispose of,
+   so that this never has to touch the cache lock. */
+static dns_msg_t *anscache_lookup(dns_queryel_t *qe, dns_hdr_t *hdr, edns_info_t *ednsinfo, unsigned *udp, size_t *rlen,
+				  int peek)
+{
+	anscache_t *e=&anscache[anscache_idx(qe->query,qe->qtype)];
+	dns_msg_t *ans=NULL;
+	unsigned hits=0;
+	time_t now=time(NULL);
+	uint32_t elapsed=0;
+	unsigned char *p;
+	int i;
+
+	pthread_mutex_lock(&anscache_lock);
+	if (!anscache_match(e,qe,hdr,ednsinfo,udp))
+		goto unlock_return;
+	for (i=0; i<e->ndeps; ++i) {
+		if (cache_gens[e->dep[i]]!=e->depgen[i])
+			break;
+	}
+	if (i<e->ndeps || now>=e->expires || now<e->ts) {
+		if (peek)
+			goto unlock_return;
+		/* Stale. Pass on the hits, so that prefetching still works for names
+		   that are mostly answered from here. */
+		hits=e->hits;
+		free(e->msg);
+		e->msg=NULL;
+		goto unlock_return;
+	}
+	if ((ans=(dns_msg_t *)pdnsd_malloc(dnsmsghdroffset+e->len))) {
+		p=(unsigned char *)&ans->hdr;
+		memcpy(p,e->msg,e->len);
+		*rlen=e->len;
+		if (e->age)
+			elapsed=now-e->ts;
+		for (i=0; i<e->nttl; ++i) {
+			unsigned char *tp=p+e->ttloff[i];
+			PUTINT32(e->ttl[i]-elapsed,tp);
+		}
+		if (e->rot_n>1) {
+			/* Rotate the records like add_rrset() does for randomize_recs. */
+			unsigned k=random()%e->rot_n;
+			if (k) {
+				unsigned char tmp[ANSCACHE_MAXLEN];
+				unsigned char *run=p+e->rot_off;
+				size_t shift=k*e->rot_len, runlen=e->rot_n*e->rot_len;
+				memcpy(tmp,run,runlen);
+				memcpy(run,tmp+shift,runlen-shift);
+				memcpy(run+runlen-shift,tmp,shift);
+			}
+		}
+		/* Let the cache know these names are in use, so they are not evicted. */
+		for (i=0; i<e->ndeps; ++i)
+			cache_note_use(e->dep[i]);
+		++e->hits;
+		++anscache_hits;
+		metric_inc(M_CACHE_HITS);
+	}
+ unlock_return:
+	pthread_mutex_unlock(&anscache_lock);
+	if (ans)
+		ans->hdr.id=hdr->id;
+	if (hits)
+		cache_count_hits(qe->query,hits);
+	return ans;
+}
+
+/* Store the response ans of length rlen to the single question qe in the answer cache, if it
+   is suitable for that. queryts is the time the response was composed. */
+static void anscache_store(dns_queryel_t *qe, dns_hdr_t *hdr, edns_info_t *ednsinfo, unsigned *udp,
+			   dns_msg_t *ans, size_t rlen, time_t queryts)
+{
+	anscache_t n, *e;
+	unsigned char *msg=(unsigned char *)&ans->hdr, *ptr;
+	size_t sz;
+	unsigned nrr,j;
+	uint32_t minttl=0xffffffff;
+	unsigned char rot_nm[2]={0,0};
+	unsigned short rot_tp=0;
+	int rot_done=0;
+
+	if (ans->hdr.rcode!=RC_OK || ans->hdr.tc || !ans->hdr.ancount || rlen>ANSCACHE_MAXLEN)
+		return;
+
+	n.len=rlen; n.qtype=qe->qtype; n.qclass=qe->qclass;
+	n.udp=udp?*udp:0; n.rd=hdr->rd; n.edns=(ednsinfo!=NULL); n.age=!ans->hdr.aa;
+	n.nttl=0; n.ndeps=0; n.rot_n=0; n.rot_off=0; n.rot_len=0;
+	n.ts=queryts; n.hits=0;
+
+	/* Walk the response to find the TTL fields, the owner names and a run of records to rotate. */
+	ptr=msg+sizeof(dns_hdr_t);
+	sz=rlen-sizeof(dns_hdr_t);
+	{
+		unsigned char nbuf[DNSNAMEBUFSIZE];
+		if (decompress_name(msg,rlen,&ptr,&sz,nbuf,NULL)!=RC_OK || sz<4)
+			return;
+		ptr+=4; sz-=4;
+	}
+	nrr=ntohs(ans->hdr.ancount)+ntohs(ans->hdr.nscount)+ntohs(ans->hdr.arcount);
+	for (j=0; j<nrr; ++j) {
+		unsigned char nbuf[DNSNAMEBUFSIZE];
+		unsigned char *nm=ptr;
+		uint16_t type,rdlen;
+		uint32_t ttl;
+		unsigned short slot;
+		int i;
+
+		if (decompress_name(msg,rlen,&ptr,&sz,nbuf,NULL)!=RC_OK || sz<sizeof_rr_hdr_t)
+			return;
+		GETINT16(type,ptr);
+		ptr+=2;
+		if (type!=T_OPT) {
+			if (n.nttl>=ANSCACHE_MAXTTLS)
+				return;
+			n.ttloff[n.nttl]=ptr-msg;
+		}
+		GETINT32(ttl,ptr);
+		GETINT16(rdlen,ptr);
+		sz-=sizeof_rr_hdr_t;
+		if (sz<rdlen)
+			return;
+		ptr+=rdlen; sz-=rdlen;
+		if (type==T_OPT)
+			continue;
+		n.ttl[n.nttl++]=ttl;
+		if (ttl<minttl)
+			minttl=ttl;
+
+		slot=cache_gen_slot(nbuf);
+		for (i=0; i<n.ndeps && n.dep[i]!=slot; ++i) ;
+		if (i==n.ndeps) {
+			if (n.ndeps>=ANSCACHE_MAXDEPS)
+				return;
+			n.dep[n.ndeps]=slot;
+			n.depgen[n.ndeps++]=cache_gens[slot];
+		}
+
+		/* Address records whose owner name is a plain compression pointer contain no
+		   names that other names can point to, so they can be reordered freely. */
+		if (j<ntohs(ans->hdr.ancount) && !rot_done) {
+			if ((type==T_A || type==T_AAAA) && ptr-nm==2+sizeof_rr_hdr_t+rdlen && nm[0]>=0xc0) {
+				if (n.rot_n && rot_tp==type && nm[0]==rot_nm[0] && nm[1]==rot_nm[1] &&
+				    ptr-nm==n.rot_len && n.rot_n<255)
+					++n.rot_n;
+				else if (n.rot_n>=2)
+					rot_done=1;
+				else {
+					n.rot_n=1; n.rot_off=nm-msg; n.rot_len=ptr-nm;
+					rot_tp=type; rot_nm[0]=nm[0]; rot_nm[1]=nm[1];
+				}
+			}
+			else if (n.rot_n>=2)
+				rot_done=1;
+			else
+				n.rot_n=0;
+		}
+	}
+	if (!global.rnd_recs)
+		n.rot_n=0;
+	if (!n.nttl || !minttl)
+		return;
+	/* Let the last tenth of the lifetime go through compose_answer(), where the
+	   cached records may be prefetched (see PREFETCH_FRAC in dns_query.c). */
+	n.expires=queryts+minttl-(global.prefetch_hits?minttl/10:0);
+	if (n.expires<=queryts)
+		return;
+	if (!(n.msg=malloc(rlen)))
+		return;
+	memcpy(n.msg,msg,rlen);
+
+	e=&anscache[anscache_idx(qe->query,qe->qtype)];
+	pthread_mutex_lock(&anscache_lock);
+	free(e->msg);
+	*e=n;
+	++anscache_stored;
+	pthread_mutex_unlock(&anscache_lock);
+}
+
+/* compose_answer() with the answer cache in front of it.
+   If cached_only is set, only the answer cache is consulted, and NULL is returned on a miss. */
+static dns_msg_t *compose_answer_cached(llist *ql, dns_hdr_t *hdr, size_t *rlen, edns_info_t *ednsinfo, unsigned *udp, int *rcodep,
+					int cached_only)
+{
+	dns_queryel_t *qe=llist_first(ql);
+	dns_msg_t *ans;
+	time_t queryts;
+
+	if (llist_next(qe))
+		return cached_only? NULL: compose_answer(ql, hdr, rlen, ednsinfo, udp, rcodep);
+
+	if ((ans=anscache_lookup(qe, hdr, ednsinfo, udp, rlen, cached_only))) {
+		if(rcodep) *rcodep=RC_OK;
+		return ans;
+	}
+	if (cached_only)
+		return NULL;
+	queryts=time(NULL);
+	if ((ans=compose_answer(ql, hdr, rlen, ednsinfo, udp, rcodep)))
+		anscache_store(qe, hdr, ednsinfo, udp, ans, *rlen, queryts);
+	return ans;
+}
+
 /*
  * Decode the query (the query messgage is in data and rlen bytes long) into a dlist.
  * data needs to be aligned.
@@ -1173,7 +1435,7 @@ static void mk_error_reply(unsigned short id, unsigned short opcode,unsigned sho
  * Analyze and answer the query in data. The answer is returned. rlen is at call the query length and at
  * return the length of the answer. You have to free the answer after sending it.
  */
-static dns_msg_t *process_query(unsigned char *data, size_t *rlenp, unsigned *udp, int *rcodep)
+static dns_msg_t *process_query(unsigned char *data, size_t *rlenp, unsigned *udp, int *rcodep, int cached_only)
 {
 	size_t rlen= *rlenp;
 	int res;
@@ -1182,8 +1444,10 @@ static dns_msg_t *process_query(unsigned char *data, size_t *rlenp, unsigned *ud
 	dns_msg_t *ans;
 	edns_info_t ednsinfo= {0}, *ednsinfop= NULL;
 
-	DEBUG_MSG("Received query (msg len=%u).\n", (unsigned int)rlen);
-	DEBUG_DUMP_DNS_MSG(data, rlen);
+	if (!cached_only) {
+		DEBUG_MSG("Received query (msg len=%u).\n", (unsigned int)rlen);
+		DEBUG_DUMP_DNS_MSG(data, rlen);
+	}
 
 	/*
 	 * We will ignore all records that come with a query, except for the actual query records,
@@ -1330,7 +1594,7 @@ static dns_msg_t *process_query(unsigned char *data, size_t *rlenp, unsigned *ud
 		res=RC_FORMAT;
 		goto error_reply;
 	}
-	if (!(ans=compose_answer(&ql, hdr, rlenp, ednsinfop, udp, rcodep))) {
+	if (!(ans=compose_answer_cached(&ql, hdr, rlenp, ednsinfop, udp, rcodep, cached_only))) {
 		/* An out of memory condition or similar could cause NULL output. Send failure notification */
 		res=RC_SERVFAIL;
 		goto free_ql_error_reply;
@@ -1341,6 +1605,8 @@ static dns_msg_t *process_query(unsigned char *data, size_t *rlenp, unsigned *ud
  free_ql_error_reply:
 	llist_free(&ql);
  error_reply:
+	if (cached_only)
+		return NULL;
 	*rlenp=sizeof(dns_hdr_t);
 	{
 		size_t allocsz = sizeof(dns_msg_t);
@@ -1370,7 +1636,26 @@ inline static void decrease_procs()
 	pthread_mutex_lock(&proc_lock);
 	procs--;
 	qprocs--;
+	pthread_cond_signal(&proc_cond);
+	pthread_mutex_unlock(&proc_lock);
+}
+
+/*
+ * Wait until fewer than proc_limit queries are being processed, then count the calling thread
+ * as active. Queued threads sleep until a slot is freed rather than polling for one.
+ * Returns the thread number.
+ */
+static unsigned increase_procs()
+{
+	unsigned thrid;
+
+	pthread_mutex_lock(&proc_lock);
+	while (procs>=global.proc_limit)
+		pthread_cond_wait(&proc_cond,&proc_lock);
+	++procs;
+	thrid= ++thrid_cnt;
 	pthread_mutex_unlock(&proc_lock);
+	return thrid;
 }
 
 static void udp_answer_thread_cleanup(void *data)
@@ -1380,12 +1665,10 @@ static void udp_answer_thread_cleanup(void *data)
 }
 
 /*
- * A thread opened to answer a query transmitted via udp. Data is a pointer to the structure udp_buf_t that
- * contains the received data and various other parameters.
- * After the query is answered, the thread terminates
- * data must point to a correctly aligned buffer
+ * Send the response resp (rlen bytes long) to the UDP query in ub, truncating it to udpmaxrespsize bytes
+ * if necessary.
  */
-static void *udp_answer_thread(void *data)
+static void udp_send_reply(udp_buf_t *ub, dns_msg_t *resp, size_t rlen, unsigned udpmaxrespsize, int rcode)
 {
 	struct msghdr msg;
 	struct iovec v;
@@ -1393,51 +1676,7 @@ static void *udp_answer_thread(void *data)
 #if defined(SRC_ADDR_DISC)
 	char ctrl[CMSG_SPACE(sizeof(pkt_info_t))];
 #endif
-	size_t rlen=((udp_buf_t *)data)->len;
-	unsigned udpmaxrespsize = UDP_BUFSIZE;
-	/* process_query is assigned to this, this mallocs, so this points to aligned memory */
-	dns_msg_t *resp;
-	int rcode;
-	unsigned thrid;
-	pthread_cleanup_push(udp_answer_thread_cleanup, data);
-	THREAD_SIGINIT;
-
-	if (!global.strict_suid) {
-		if (!run_as(global.run_as)) {
-			pdnsd_exit();
-		}
-	}
 
-	for(;;) {
-		pthread_mutex_lock(&proc_lock);
-		if (procs<global.proc_limit)
-			break;
-		pthread_mutex_unlock(&proc_lock);
-		usleep_r(50000);
-	}
-	++procs;
-	thrid= ++thrid_cnt;
-	pthread_mutex_unlock(&proc_lock);
-
-#if DEBUG>0
-	if(debug_p) {
-		int err;
-		if ((err=pthread_setspecific(thrid_key, &thrid)) != 0) {
-			if(++da_misc_errs<=MISC_MAX_ERRS)
-				log_error("pthread_setspecific failed: %s",strerror(err));
-			/* pdnsd_exit(); */
-		}
-	}
-#endif
-
-	if (!(resp=process_query(((udp_buf_t *)data)->buf,&rlen,&udpmaxrespsize,&rcode))) {
-		/*
-		 * A return value of NULL is a fatal error that prohibits even the sending of an error message.
-		 * logging is already done. Just exit the thread now.
-		 */
-		pthread_exit(NULL); /* data freed by cleanup handler */
-	}
-	pthread_cleanup_push(free, resp);
 	if (rlen>udpmaxrespsize) {
 		rlen=udpmaxrespsize;
 		resp->hdr.tc=1; /*set truncated bit*/
@@ -1462,23 +1701,23 @@ static void *udp_answer_thread(void *data)
 #ifdef ENABLE_IPV4
 	if (run_ipv4) {
 
-		msg.msg_name=&((udp_buf_t *)data)->addr.sin4;
+		msg.msg_name=&ub->addr.sin4;
 		msg.msg_namelen=sizeof(struct sockaddr_in);
 # if defined(SRC_ADDR_DISC)
 #  if (TARGET==TARGET_LINUX)
-		((udp_buf_t *)data)->pi.pi4.ipi_spec_dst=((udp_buf_t *)data)->pi.pi4.ipi_addr;
+		ub->pi.pi4.ipi_spec_dst=ub->pi.pi4.ipi_addr;
 		cmsg=CMSG_FIRSTHDR(&msg);
 		cmsg->cmsg_len=CMSG_LEN(sizeof(struct in_pktinfo));
 		cmsg->cmsg_level=SOL_IP;
 		cmsg->cmsg_type=IP_PKTINFO;
-		memcpy(CMSG_DATA(cmsg),&((udp_buf_t *)data)->pi.pi4,sizeof(struct in_pktinfo));
+		memcpy(CMSG_DATA(cmsg),&ub->pi.pi4,sizeof(struct in_pktinfo));
 		msg.msg_controllen=CMSG_SPACE(sizeof(struct in_pktinfo));
 #  else
 		cmsg=CMSG_FIRSTHDR(&msg);
 		cmsg->cmsg_len=CMSG_LEN(sizeof(struct in_addr));
 		cmsg->cmsg_level=IPPROTO_IP;
 		cmsg->cmsg_type=IP_RECVDSTADDR;
-		memcpy(CMSG_DATA(cmsg),&((udp_buf_t *)data)->pi.ai4,sizeof(struct in_addr));
+		memcpy(CMSG_DATA(cmsg),&ub->pi.ai4,sizeof(struct in_addr));
 		msg.msg_controllen=CMSG_SPACE(sizeof(struct in_addr));
 #  endif
 # endif
@@ -1486,12 +1725,12 @@ static void *udp_answer_thread(void *data)
 		{
 			char buf[ADDRSTR_MAXLEN];
 
-			DEBUG_MSG("Answering to: %s", inet_ntop(AF_INET,&((udp_buf_t *)data)->addr.sin4.sin_addr,buf,ADDRSTR_MAXLEN));
+			DEBUG_MSG("Answering to: %s", inet_ntop(AF_INET,&ub->addr.sin4.sin_addr,buf,ADDRSTR_MAXLEN));
 #  if defined(SRC_ADDR_DISC)
 #   if (TARGET==TARGET_LINUX)
-			DEBUG_MSGC(", source address: %s\n", inet_ntop(AF_INET,&((udp_buf_t *)data)->pi.pi4.ipi_spec_dst,buf,ADDRSTR_MAXLEN));
+			DEBUG_MSGC(", source address: %s\n", inet_ntop(AF_INET,&ub->pi.pi4.ipi_spec_dst,buf,ADDRSTR_MAXLEN));
 #   else
-			DEBUG_MSGC(", source address: %s\n", inet_ntop(AF_INET,&((udp_buf_t *)data)->pi.ai4,buf,ADDRSTR_MAXLEN));
+			DEBUG_MSGC(", source address: %s\n", inet_ntop(AF_INET,&ub->pi.ai4,buf,ADDRSTR_MAXLEN));
 #   endif
 #  else
 			DEBUG_MSGC("\n");
@@ -1503,23 +1742,23 @@ static void *udp_answer_thread(void *data)
 #ifdef ENABLE_IPV6
 	ELSE_IPV6 {
 
-		msg.msg_name=&((udp_buf_t *)data)->addr.sin6;
+		msg.msg_name=&ub->addr.sin6;
 		msg.msg_namelen=sizeof(struct sockaddr_in6);
 # if defined(SRC_ADDR_DISC)
 		cmsg=CMSG_FIRSTHDR(&msg);
 		cmsg->cmsg_len=CMSG_LEN(sizeof(struct in6_pktinfo));
 		cmsg->cmsg_level=SOL_IPV6;
 		cmsg->cmsg_type=IPV6_PKTINFO;
-		memcpy(CMSG_DATA(cmsg),&((udp_buf_t *)data)->pi.pi6,sizeof(struct in6_pktinfo));
+		memcpy(CMSG_DATA(cmsg),&ub->pi.pi6,sizeof(struct in6_pktinfo));
 		msg.msg_controllen=CMSG_SPACE(sizeof(struct in6_pktinfo));
 # endif
 # if DEBUG>0
 		{
 			char buf[ADDRSTR_MAXLEN];
 
-			DEBUG_MSG("Answering to: %s", inet_ntop(AF_INET6,&((udp_buf_t *)data)->addr.sin6.sin6_addr,buf,ADDRSTR_MAXLEN));
+			DEBUG_MSG("Answering to: %s", inet_ntop(AF_INET6,&ub->addr.sin6.sin6_addr,buf,ADDRSTR_MAXLEN));
 #  if defined(SRC_ADDR_DISC)
-			DEBUG_MSGC(", source address: %s\n", inet_ntop(AF_INET6,&((udp_buf_t *)data)->pi.pi6.ipi6_addr,buf,ADDRSTR_MAXLEN));
+			DEBUG_MSGC(", source address: %s\n", inet_ntop(AF_INET6,&ub->pi.pi6.ipi6_addr,buf,ADDRSTR_MAXLEN));
 #  else
 			DEBUG_MSGC("\n");
 #  endif
@@ -1532,7 +1771,7 @@ static void *udp_answer_thread(void *data)
 #ifdef SOCKET_LOCKING
 	pthread_mutex_lock(&s_lock);
 #endif
-	if (sendmsg(((udp_buf_t *)data)->sock,&msg,0)<0) {
+	if (sendmsg(ub->sock,&msg,0)<0) {
 #ifdef SOCKET_LOCKING
 		pthread_mutex_unlock(&s_lock);
 #endif
@@ -1542,11 +1781,59 @@ static void *udp_answer_thread(void *data)
 	} else {
 		int tmp;
 		socklen_t sl=sizeof(tmp);
-		getsockopt(((udp_buf_t *)data)->sock, SOL_SOCKET, SO_ERROR, &tmp, &sl);
+		getsockopt(ub->sock, SOL_SOCKET, SO_ERROR, &tmp, &sl);
 #ifdef SOCKET_LOCKING
 		pthread_mutex_unlock(&s_lock);
 #endif
 	}
+}
+
+/*
+ * A thread opened to answer a query transmitted via udp. Data is a pointer to the structure udp_buf_t that
+ * contains the received data and various other parameters.
+ * After the query is answered, the thread terminates
+ * data must point to a correctly aligned buffer
+ */
+static void *udp_answer_thread(void *data)
+{
+	size_t rlen=((udp_buf_t *)data)->len;
+	unsigned udpmaxrespsize = UDP_BUFSIZE;
+	/* process_query is assigned to this, this mallocs, so this points to aligned memory */
+	dns_msg_t *resp;
+	int rcode;
+	unsigned thrid;
+	pthread_cleanup_push(udp_answer_thread_cleanup, data);
+	THREAD_SIGINIT;
+
+	if (!global.strict_suid) {
+		if (!run_as(global.run_as)) {
+			pdnsd_exit();
+		}
+	}
+
+	thrid=increase_procs();
+
+#if DEBUG>0
+	if(debug_p) {
+		int err;
+		if ((err=pthread_setspecific(thrid_key, &thrid)) != 0) {
+			if(++da_misc_errs<=MISC_MAX_ERRS)
+				log_error("pthread_setspecific failed: %s",strerror(err));
+			/* pdnsd_exit(); */
+		}
+	}
+#endif
+
+	if (!(resp=process_query(((udp_buf_t *)data)->buf,&rlen,&udpmaxrespsize,&rcode,0))) {
+		/*
+		 * A return value of NULL is a fatal error that prohibits even the sending of an error message.
+		 * logging is already done. Just exit the thread now.
+		 */
+		pthread_exit(NULL); /* data freed by cleanup handler */
+	}
+	pthread_cleanup_push(free, resp);
+	udp_send_reply((udp_buf_t *)data,resp,rlen,udpmaxrespsize,rcode);
+	metric_answer(0,rcode,metric_clock_us()-((udp_buf_t *)data)->rcv_us);
 
 	pthread_cleanup_pop(1);  /* free(resp) */
 	pthread_cleanup_pop(1);  /* free(data) */
@@ -1790,6 +2077,23 @@ void *udp_server_thread(void *dummy)
 #endif /* SRC_ADDR_DISC */
 
 		if (qlen>=0) {
+			/* Queries that can be answered from the answer cache are answered right here,
+			   which saves starting a thread (and the context switches) for them. */
+			{
+				size_t rlen=qlen;
+				unsigned udpmaxrespsize=UDP_BUFSIZE;
+				int rcode;
+				dns_msg_t *resp;
+				buf->rcv_us=metric_clock_us();
+				resp=process_query(buf->buf,&rlen,&udpmaxrespsize,&rcode,1);
+				if (resp) {
+					udp_send_reply(buf,resp,rlen,udpmaxrespsize,rcode);
+					pdnsd_free(resp);
+					metric_answer(0,rcode,metric_clock_us()-buf->rcv_us);
+					++inline_answered;
+					continue;
+				}
+			}
 			pthread_mutex_lock(&proc_lock);
 			if (qprocs<global.proc_limit+global.procq_limit) {
 				int err;
@@ -1856,16 +2160,7 @@ static void *tcp_answer_thread(void *csock)
 		}
 	}
 
-	for(;;) {
-		pthread_mutex_lock(&proc_lock);
-		if (procs<global.proc_limit)
-			break;
-		pthread_mutex_unlock(&proc_lock);
-		usleep_r(50000);
-	}
-	++procs;
-	thrid= ++thrid_cnt;
-	pthread_mutex_unlock(&proc_lock);
+	thrid=increase_procs();
 
 #if DEBUG>0
 	if(debug_p) {
@@ -1886,10 +2181,11 @@ static void *tcp_answer_thread(void *csock)
 	for(;;)
 #endif
 	{
-		int rlen,olen;
+		int rlen,olen,rcode;
 		size_t nlen;
 		unsigned char *buf;
 		dns_msg_t *resp;
+		unsigned long rcv_us;
 
 #ifdef NO_POLL
 		fd_set fds;
@@ -1971,7 +2267,8 @@ static void *tcp_answer_thread(void *csock)
 			olen += rv;
 		}
 		nlen=rlen;
-		if (!(resp=process_query(buf,&nlen,NULL,NULL))) {
+		rcv_us=metric_clock_us();
+		if (!(resp=process_query(buf,&nlen,NULL,&rcode,0))) {
 			/*
 			 * A return value of NULL is a fatal error that prohibits even the sending of an error message.
 			 * logging is already done. Just exit the thread now.
@@ -1989,6 +2286,7 @@ static void *tcp_answer_thread(void *csock)
 				pthread_exit(NULL); /* resp is freed and socket is closed by cleanup handlers */
 			}
 		}
+		metric_answer(1,rcode,metric_clock_us()-rcv_us);
 		pthread_cleanup_pop(1);  /* free(resp) */
 	}
 
@@ -2171,10 +2469,19 @@ void start_dns_servers()
 
 
 /* Report the thread status to the file descriptor f, for the status fifo (see status.c) */
+/* Copy the thread counters for the metrics report. */
+void thread_metrics(unsigned long *nspawned, unsigned long *ndropped, int *ncurrent, int *nactive)
+{
+	pthread_mutex_lock(&proc_lock);
+	*nspawned=spawned; *ndropped=dropped;
+	*ncurrent=qprocs; *nactive=procs;
+	pthread_mutex_unlock(&proc_lock);
+}
+
 int report_thread_stat(int f)
 {
-	unsigned long nspawned,ndropped;
-	int nactive,ncurrent,nqueued;
+	unsigned long nspawned,ndropped,nhits,nstored,njoined,nfallback;
+	int nactive,ncurrent,nqueued,nbusy;
 
 	/* The thread counters are volatile, so we will make copies
 	   under locked conditions to make sure we get consistent data.
@@ -2198,6 +2505,16 @@ int report_thread_stat(int f)
 			   nspawned,ndropped);
 	fsprintf_or_return(f,"%i running query threads (%i active, %i queued).\n",
 			   ncurrent,nactive,nqueued);
+	pthread_mutex_lock(&anscache_lock);
+	nhits=anscache_hits; nstored=anscache_stored;
+	pthread_mutex_unlock(&anscache_lock);
+	fsprintf_or_return(f,"%lu queries answered from the answer cache (%lu responses stored),\n"
+			   "%lu of them without starting a query thread.\n",
+			   nhits,nstored,(unsigned long)inline_answered);
+	inflight_stat(&njoined,&nfallback,&nbusy);
+	fsprintf_or_return(f,"%i distinct queries in flight, %lu queries waited for an identical one"
+			   " (%lu queried again).\n",
+			   nbusy,njoined,nfallback);
 	return 0;
 }
 
@@ -35,6 +35,7 @@ extern volatile int udp_socket;
 int init_udp_socket(void);
 int init_tcp_socket(void);
 void start_dns_servers(void);
+void thread_metrics(unsigned long *nspawned, unsigned long *ndropped, int *ncurrent, int *nactive);
 int report_thread_stat(int f);
 
 #endif
@@ -22,6 +22,7 @@
 
 #include <config.h>
 #include <sys/types.h>
+#include <sys/time.h>
 #ifdef HAVE_SYS_POLL_H
 #include <sys/poll.h>
 #endif
@@ -45,6 +46,8 @@
 #include "netdev.h"
 #include "error.h"
 #include "debug.h"
+#include "thread.h"
+#include "status.h"
 
 
 #if defined(NO_TCP_QUERIES) && M_PRESET!=UDP_ONLY
@@ -115,6 +118,11 @@ typedef struct {
 	dns_hdr_t           *recvbuf;
 	unsigned short      myrid;
 	int                 s_errno;
+	/* UDP (re)transmission timing, in ms */
+	unsigned char       nsent;
+	unsigned char       rtt_failed;  /* a failure has been charged to the server's RTT estimate */
+	unsigned long       sent_ms;
+	unsigned long       resend_ms;
 } query_stat_t;
 typedef DYNAMIC_ARRAY(query_stat_t) *query_stat_array;
 
@@ -160,6 +168,10 @@ typedef DYNAMIC_ARRAY(query_stat_t) *query_stat_array;
 static volatile unsigned long poll_errs=0;
 
 #define SOCK_ADDR(p) ((struct sockaddr *) &(p)->a)
+#define QS_PORT(p) ntohs(SEL_IPVER((p)->a.sin4.sin_port,(p)->a.sin6.sin6_port))
+
+/* A query sent by UDP is transmitted at most this many times to the same server. */
+#define QS_MAXSEND 3
 
 #ifdef SIN_LEN
 #undef SIN_LEN
@@ -172,6 +184,14 @@ static volatile unsigned long poll_errs=0;
 #define EWOULDBLOCK EAGAIN
 #endif
 
+/* Milliseconds on a monotonic clock. Only differences of these values are meaningful. */
+static unsigned long now_ms()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC,&ts);
+	return (unsigned long)ts.tv_sec*1000+ts.tv_nsec/1000000;
+}
+
 typedef DYNAMIC_ARRAY(dns_cent_t) *dns_cent_array;
 
 
@@ -822,6 +842,15 @@ inline static void switch_to_tcp(query_stat_t *st)
 }
 #endif
 
+/* Score the server of a query as having failed, at most once per query. */
+inline static void qs_rtt_failure(query_stat_t *st)
+{
+	if(!st->rtt_failed) {
+		st->rtt_failed=1;
+		srv_rtt_update(PDNSD_A(st),QS_PORT(st),-1);
+	}
+}
+
 
 /* ------ following is the parallel query code.
  * It has been observed that a whole lot of name servers are just damn lame, with response time
@@ -1054,6 +1083,9 @@ static int p_query_sm(query_stat_t *st)
 			close(st->sock);
 			break;
 		}
+		st->nsent=1;
+		st->sent_ms=now_ms();
+		st->resend_ms=st->sent_ms+srv_hedge_ms(PDNSD_A(st),QS_PORT(st),st->timeout);
 		st->state=QS_UDPRECEIVE;
 		/* st->event=QEV_READ; */
 		return -1;
@@ -1070,6 +1102,7 @@ static int p_query_sm(query_stat_t *st)
 			st->s_errno=errno;
 			DEBUG_PDNSDA_MSG("Error while receiving data from %s: %s\n", PDNSDA2STR(PDNSD_A(st)),strerror(errno));
 			close(st->sock);
+			qs_rtt_failure(st);
 			break;
 		}
 		st->recvl=rv;
@@ -1081,6 +1114,9 @@ static int p_query_sm(query_stat_t *st)
 			return -1;
 		}
 		close(st->sock);
+		/* If the query was sent more than once, we can't tell which copy was answered. */
+		if(st->nsent==1)
+			srv_rtt_update(PDNSD_A(st),QS_PORT(st),(long)(now_ms()-st->sent_ms));
 		st->state=QS_DONE;
 		return RC_OK;
 	}
@@ -2008,6 +2044,8 @@ static int add_qserv(query_stat_array *q, pdnsd_a2 *a, int port, time_t timeout,
 	qs->state=QS_INITIAL;
 	qs->qm=global.query_method;
 	qs->s_errno=0;
+	qs->nsent=0;
+	qs->rtt_failed=0;
 	return 1;
 }
 
@@ -2132,6 +2170,7 @@ static int p_recursive_query(query_stat_array q, const unsigned char *name, int
 
 	{
 		time_t ts0=time(NULL),global_timeout=global.timeout;
+		unsigned long ts0_ms=now_ms();
 		int dc=0,mc=0,nq=DA_NEL(q),parqueries=global.par_queries;
 
 		for (j=0; j<nq; j += parqueries) {
@@ -2193,8 +2232,10 @@ static int p_recursive_query(query_stat_array q, const unsigned char *name, int
 					dc++;
 			}
 			if (dc<mc) {
-				time_t ts,maxto,now;
-				int pc,nevents;
+				time_t maxto;
+				unsigned long ts_ms,now;
+				long wait_ms,hedge_ms=0;
+				int pc,nevents,hedging;
 #ifdef NO_POLL
 				int maxfd;
 				fd_set reads;
@@ -2206,7 +2247,18 @@ static int p_recursive_query(query_stat_array q, const unsigned char *name, int
 #endif
 				/* we do time keeping by hand, because poll/select might be interrupted and
 				 * the returned times are not always to be trusted upon */
-				ts=time(NULL);
+				ts_ms=now_ms();
+				/* If there are more servers to try, we don't wait for the full timeout
+				 * before asking the next ones as well, but only as long as a reply from
+				 * the present ones usually takes. The earlier queries are not canceled,
+				 * so whichever server answers first wins. */
+				if (mc<nq) {
+					for (i=j;i<mc;i++) {
+						query_stat_t *qs=&DA_INDEX(q,i);
+						long h=srv_hedge_ms(PDNSD_A(qs),QS_PORT(qs),qs->timeout);
+						if (h>hedge_ms) hedge_ms=h;
+					}
+				}
 				do {
 					/* build poll/select sets, maintain time.
 					 * If you do parallel queries, the highest timeout will be honored
@@ -2269,8 +2321,8 @@ static int p_recursive_query(query_stat_array q, const unsigned char *name, int
 						dc=mc;
 						break;
 					}
-					now=time(NULL);
-					maxto -= now-ts;
+					now=now_ms();
+					wait_ms=maxto*1000-(long)(now-ts_ms);
 					if (mc==nq) {
 #if !defined(NO_TCP_QUERIES) && !defined(NO_UDP_QUERIES)
 						/* Don't use the global timeout if there are TCP queries
@@ -2282,32 +2334,86 @@ static int p_recursive_query(query_stat_array q, const unsigned char *name, int
 						}
 #endif
 						{
-							time_t globto=global_timeout-(now-ts0);
-							if(globto>maxto) maxto=globto;
+							long globto=global_timeout*1000-(long)(now-ts0_ms);
+							if(globto>wait_ms) wait_ms=globto;
 						}
 #if !defined(NO_TCP_QUERIES) && !defined(NO_UDP_QUERIES)
 					skip_globto:;
 #endif
 					}
+					/* Wake up early if it is time to hedge to the next servers or, if there are
+					   none left, to send a UDP query that has not been answered yet once more.
+					   Queries that have already been hedged against are not sent again. */
+					hedging=0;
+					if (hedge_ms) {
+						long h=hedge_ms-(long)(now-ts_ms);
+						if (h<wait_ms) {
+							wait_ms=h;
+							hedging=1;
+						}
+					}
+					else if (mc==nq) {
+						for (i=j;i<mc;i++) {
+							query_stat_t *qs=&DA_INDEX(q,i);
+							if (qs->state==QS_UDPRECEIVE && qs->nsent<QS_MAXSEND) {
+								long h=(long)(qs->resend_ms-now);
+								if (h<wait_ms) {
+									wait_ms=h;
+									hedging=1;
+								}
+							}
+						}
+					}
+					if (wait_ms<0) wait_ms=0;
 #ifdef NO_POLL
-					tv.tv_sec=(maxto>0)?maxto:0;
-					tv.tv_usec=0;
+					tv.tv_sec=wait_ms/1000;
+					tv.tv_usec=(wait_ms%1000)*1000;
 					nevents=select(maxfd+1,&reads,&writes,NULL,&tv);
 #else
-					nevents=poll(polls,pc,(maxto>0)?(maxto*1000):0);
+					nevents=poll(polls,pc,wait_ms);
 #endif
 					if (nevents<0) {
-						/* if(errno==EINTR)
-							continue; */
+						/* Interrupted, e.g. by the set*id() broadcast of a thread starting up;
+						   the wait is recomputed from the clock, so simply poll again. */
+						if(errno==EINTR)
+							continue;
 						log_warn("poll/select failed: %s",strerror(errno));
 						goto done;
 					}
+					if (nevents==0 && hedging) {
+						if (hedge_ms)
+							break; /* Go on to the next servers, but keep listening to these. */
+						now=now_ms();
+						for (i=j;i<mc;i++) {
+							query_stat_t *qs=&DA_INDEX(q,i);
+							if (qs->state==QS_UDPRECEIVE && qs->nsent<QS_MAXSEND &&
+							    (long)(qs->resend_ms-now)<=0)
+							{
+								DEBUG_PDNSDA_MSG("No reply from %s yet, sending query again.\n",
+										 PDNSDA2STR(PDNSD_A(qs)));
+								if (send(qs->sock,&qs->msg->hdr,qs->transl,0)==-1) {
+									qs->s_errno=errno;
+									DEBUG_PDNSDA_MSG("Error while sending data to %s: %s\n",
+											 PDNSDA2STR(PDNSD_A(qs)),strerror(errno));
+									/* Stop resending, but keep waiting for a reply to the earlier copies. */
+									qs->nsent=QS_MAXSEND;
+								}
+								else {
+									++qs->nsent;
+									qs->resend_ms=now+(srv_hedge_ms(PDNSD_A(qs),QS_PORT(qs),qs->timeout)<<(qs->nsent-1));
+								}
+							}
+						}
+						continue;
+					}
 					if (nevents==0) {
 						/* We have timed out. Mark the unresponsive servers so that we can consider
 						   them for retesting later on. We will continue to listen for replies from
 						   these servers as long as we have additional servers to try. */
 						for (i=j;i<mc;i++) {
 							query_stat_t *qs=&DA_INDEX(q,i);
+							if (qs->state!=QS_DONE)
+								qs_rtt_failure(qs);
 							if (qs->state!=QS_DONE && qs->needs_testing)
 								qs->needs_testing=2;
 #if !defined(NO_TCP_QUERIES) && !defined(NO_UDP_QUERIES)
@@ -2461,9 +2567,17 @@ static int p_recursive_query(query_stat_array q, const unsigned char *name, int
 			dlist_free(nssave);
 		}
 	cancel_queries:
-		/* Cancel any remaining queries. */
-		for (i=dc;i<mc;i++)
-			p_cancel_query(&DA_INDEX(q,i));
+		/* Cancel any remaining queries. A server that has not replied by the time
+		   it would have been hedged against is scored as if it had failed. */
+		{
+			unsigned long now=now_ms();
+			for (i=dc;i<mc;i++) {
+				query_stat_t *qs=&DA_INDEX(q,i);
+				if (qs->state==QS_UDPRECEIVE && (long)(now-qs->resend_ms)>=0)
+					qs_rtt_failure(qs);
+				p_cancel_query(qs);
+			}
+		}
 
 		{
 			/* See if any servers need to be retested for availability.
@@ -3190,6 +3304,36 @@ addr2_array dns_rootserver_resolv(atup_array atup_a, int port, char edns_query,
 }
 
 
+/*
+ * Order the entries of q from index i0 on by their expected cost (see srv_rtt_cost()),
+ * so that the fastest and most reliable servers are asked first. This is a stable
+ * insertion sort, so servers with equal cost keep their configured (or random) order.
+ */
+static void sort_qserv_by_rtt(query_stat_array q, int i0)
+{
+	int i,k,n=DA_NEL(q)-i0;
+
+	if(n<2)
+		return;
+	{
+		long cost[n]; /* variable length array */
+		for(i=0;i<n;++i) {
+			query_stat_t *qs=&DA_INDEX(q,i0+i);
+			cost[i]=srv_rtt_cost(PDNSD_A(qs),QS_PORT(qs));
+		}
+		for(i=1;i<n;++i) {
+			long c=cost[i];
+			query_stat_t tmp=DA_INDEX(q,i0+i);
+			for(k=i; k>0 && cost[k-1]>c; --k) {
+				cost[k]=cost[k-1];
+				DA_INDEX(q,i0+k)=DA_INDEX(q,i0+k-1);
+			}
+			cost[k]=c;
+			DA_INDEX(q,i0+k)=tmp;
+		}
+	}
+}
+
 static int p_dns_resolve(const unsigned char *name, int thint, dns_cent_t **cachedp, int hops, qhintnode_t *qhlist,
 			 unsigned char *c_soa)
 {
@@ -3198,7 +3342,8 @@ static int p_dns_resolve(const unsigned char *name, int thint, dns_cent_t **cach
 	query_stat_array serv=NULL;
 	rejectlist_t *rejectlist=NULL;
 
-	/* try the servers in the order of their definition */
+	/* try the servers in the order of their definition,
+	   but within each server section, try the best performing servers first. */
 	lock_server_data();
 	n=DA_NEL(servers);
 	for (i=0;i<n;++i) {
@@ -3207,7 +3352,7 @@ static int p_dns_resolve(const unsigned char *name, int thint, dns_cent_t **cach
 			int m=DA_NEL(sp->atup_a);
 			if(m>0) {
 				rejectlist_t *rjl=NULL;
-				int j=0, jstart=0;
+				int j=0, jstart=0, sstart=DA_NEL(serv);
 				if(sp->rand_servers) j=jstart=random()%m;
 				do {
 					atup_t *at=&DA_INDEX(sp->atup_a,j);
@@ -3282,6 +3427,7 @@ static int p_dns_resolve(const unsigned char *name, int thint, dns_cent_t **cach
 					}
 					if(++j==m) j=0;
 				} while(j!=jstart);
+				sort_qserv_by_rtt(serv,sstart);
 			}
 		}
 	}
@@ -3359,14 +3505,17 @@ static void set_all_flags_ttl(unsigned short *flags, time_t *ttl, dns_cent_t *ca
     RC_CACHED:    name was found in the cache, requery not needed.
     RC_STALE:     name was found in the cache, but requery is needed.
     RC_NOTCACHED: name was not found in the cache.
+  If expiresp is not NULL, *expiresp is set to the time the records found time out, or 0 if a
+  requery is needed for some other reason than the records timing out.
 */
 static int lookup_cache_status(const unsigned char *name, int thint, dns_cent_t **cachedp, unsigned short *flagsp,
-			       time_t queryts, unsigned char *c_soa)
+			       time_t *expiresp, time_t queryts, unsigned char *c_soa)
 {
 	dns_cent_t *cached;
 	int rc=RC_NOTCACHED;
 	int wild=0;
 	unsigned short flags=0;
+	time_t expires=0;
 
 	if ((cached=lookup_cache(name,&wild))) {
 		short int neg=0,timed=0,need_req=0;
@@ -3450,16 +3599,230 @@ static int lookup_cache_status(const unsigned char *name, int thint, dns_cent_t
 		}
 #endif
 		rc = (!neg && (need_req || timed))? RC_STALE: RC_CACHED;
+		if(!need_req) expires=ttl;
 	return_rc_cent:
 		*cachedp=cached;
 	}
 
 return_rc:
 	if(flagsp) *flagsp=flags;
+	if(expiresp) *expiresp=expires;
 	return rc;
 }
 
 
+/*
+ * Background refreshes of cache entries, used for serving stale records (RFC 8767)
+ * and for prefetching popular records before they time out.
+ * The number of refreshes in progress is limited, and a name is refreshed only once at a time.
+ */
+#define MAX_REFRESHES 8
+
+/* Refresh a popular entry if it is in the last 1/PREFETCH_FRAC part of its lifetime. */
+#define PREFETCH_FRAC 10
+
+typedef struct {
+	char          busy;
+	int           thint;
+	unsigned char name[DNSNAMEBUFSIZE];
+} refresh_t;
+
+static refresh_t refreshes[MAX_REFRESHES];
+static pthread_mutex_t refresh_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void *refresh_thread(void *data)
+{
+	refresh_t *rf=data;
+	dns_cent_t *ent;
+	int rc;
+
+	THREAD_SIGINIT;
+
+	rc=p_dns_resolve(rf->name, rf->thint, &ent, MAX_HOPS, NULL, NULL);
+	if(rc==RC_OK || rc==RC_CACHED || rc==RC_STALE) {
+		free_cent(ent  DBG1);
+		pdnsd_free(ent);
+	}
+	DEBUG_RHN_MSG("Background refresh of %s, type %s done (rc: %s)\n",
+		      RHN2STR(rf->name),get_tname(rf->thint),get_ename(rc));
+
+	pthread_mutex_lock(&refresh_lock);
+	rf->busy=0;
+	pthread_mutex_unlock(&refresh_lock);
+	return NULL;
+}
+
+/* Start refreshing name in the background, unless that is already being done
+   or too many refreshes are in progress. */
+static void start_refresh(const unsigned char *name, int thint)
+{
+	refresh_t *rf=NULL;
+	pthread_t pt;
+	int i,err;
+
+	pthread_mutex_lock(&refresh_lock);
+	for(i=0;i<MAX_REFRESHES;++i) {
+		refresh_t *r=&refreshes[i];
+		if(r->busy) {
+			if(r->thint==thint && rhnicmp(r->name,name))
+				goto unlock_return;
+		}
+		else if(!rf)
+			rf=r;
+	}
+	if(!rf) {
+		DEBUG_MSG("Too many background refreshes in progress.\n");
+		goto unlock_return;
+	}
+	rf->busy=1;
+	rf->thint=thint;
+	rhncpy(rf->name,name);
+	if((err=pthread_create(&pt,&attr_detached,refresh_thread,rf))) {
+		log_warn("pthread_create failed: %s",strerror(err));
+		rf->busy=0;
+	}
+ unlock_return:
+	pthread_mutex_unlock(&refresh_lock);
+}
+
+/* Check whether a popular, still valid cache entry is about to time out. */
+static int want_prefetch(dns_cent_t *cached, int thint, time_t expires, time_t queryts)
+{
+	rr_set_t *rrset=NULL;
+
+	if(!global.prefetch_hits || cached->hits<global.prefetch_hits || (cached->flags&DF_NEGATIVE))
+		return 0;
+	if(thint>=T_MIN && thint<=T_MAX)
+		rrset=getrrset(cached,thint);
+	if(!rrset || !rrset->rrs)
+		rrset=getrrset_CNAME(cached);
+	if(!rrset)
+		return 0;
+	return (expires-queryts)*PREFETCH_FRAC <= CLAT_ADJ(rrset->ttl);
+}
+
+
+/*
+ * Coalescing of identical queries that are in flight at the same time.
+ * The first thread that needs to ask the servers for a (name, type) pair becomes the
+ * leader; threads that need the same pair while the leader is busy wait for it and then
+ * take the answer from the cache. A waiter gives up after the global timeout, and
+ * resolves the name on its own if the leader could not get an answer into the cache.
+ */
+#define MAX_INFLIGHT 32
+
+typedef struct {
+	char           busy;      /* the leader is still querying */
+	unsigned char  c_soa;
+	unsigned short waiters;
+	int            thint;
+	int            rc;
+	unsigned char  name[DNSNAMEBUFSIZE];
+} inflight_t;
+
+static inflight_t inflight[MAX_INFLIGHT];
+static pthread_mutex_t inflight_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  inflight_cond = PTHREAD_COND_INITIALIZER;
+static unsigned long inflight_joined=0, inflight_fallback=0;
+
+static int shared_dns_resolve(const unsigned char *name, int thint, dns_cent_t **cachedp, int hops,
+			      unsigned char *c_soa)
+{
+	inflight_t *fl=NULL;
+	int i,rc;
+
+	pthread_mutex_lock(&inflight_lock);
+	for(i=0;i<MAX_INFLIGHT;++i) {
+		inflight_t *f=&inflight[i];
+		if(f->busy) {
+			if(f->thint==thint && rhnicmp(f->name,name))
+				goto wait_leader;
+		}
+		else if(!fl && !f->waiters)
+			fl=f;
+	}
+	if(fl) {
+		fl->busy=1;
+		fl->thint=thint;
+		rhncpy(fl->name,name);
+	}
+	pthread_mutex_unlock(&inflight_lock);
+
+	/* We are the leader, or there is no room left to let others join us. */
+	rc=p_dns_resolve(name,thint,cachedp,hops,NULL,c_soa);
+	if(fl) {
+		pthread_mutex_lock(&inflight_lock);
+		fl->rc=rc;
+		fl->c_soa=c_soa?*c_soa:cundef;
+		fl->busy=0;
+		if(fl->waiters)
+			pthread_cond_broadcast(&inflight_cond);
+		pthread_mutex_unlock(&inflight_lock);
+	}
+	return rc;
+
+ wait_leader:
+	fl=&inflight[i];
+	++fl->waiters;
+	++inflight_joined;
+	DEBUG_RHN_MSG("Query for %s, type %s already in progress, waiting for it.\n",
+		      RHN2STR(name),get_tname(thint));
+	{
+		struct timeval now;
+		struct timespec timeout;
+		gettimeofday(&now,NULL);
+		timeout.tv_sec = now.tv_sec + global.timeout;
+		timeout.tv_nsec = now.tv_usec * 1000;
+		while(fl->busy) {
+			if(pthread_cond_timedwait(&inflight_cond,&inflight_lock,&timeout)==ETIMEDOUT)
+				break;
+		}
+	}
+	rc=fl->busy?RC_SERVFAIL:fl->rc;
+	if(rc==RC_NAMEERR && c_soa)
+		*c_soa=fl->c_soa;
+	--fl->waiters;
+	pthread_mutex_unlock(&inflight_lock);
+
+	if(rc==RC_OK || rc==RC_CACHED || rc==RC_STALE) {
+		dns_cent_t *cached=NULL;
+		int crc=lookup_cache_status(name,thint,&cached,NULL,NULL,time(NULL),c_soa);
+		if(crc==RC_OK || crc==RC_CACHED) {
+			*cachedp=cached;
+			return RC_CACHED;
+		}
+		if(cached) {
+			free_cent(cached  DBG1);
+			pdnsd_free(cached);
+		}
+	}
+	else if(rc==RC_NAMEERR)
+		return rc;
+
+	/* The leader failed, timed out, or did not cache its answer. */
+	DEBUG_RHN_MSG("Shared query for %s, type %s gave no usable answer, querying again.\n",
+		      RHN2STR(name),get_tname(thint));
+	pthread_mutex_lock(&inflight_lock);
+	++inflight_fallback;
+	pthread_mutex_unlock(&inflight_lock);
+	return p_dns_resolve(name,thint,cachedp,hops,NULL,c_soa);
+}
+
+/* Report how many queries were coalesced with an identical one in flight,
+   and how many distinct queries are in flight right now. */
+void inflight_stat(unsigned long *joined, unsigned long *fallback, int *busy)
+{
+	int i,n=0;
+	pthread_mutex_lock(&inflight_lock);
+	*joined=inflight_joined;
+	*fallback=inflight_fallback;
+	for(i=0;i<MAX_INFLIGHT;++i)
+		n+=inflight[i].busy;
+	pthread_mutex_unlock(&inflight_lock);
+	*busy=n;
+}
+
+
 /*
  * Resolve records for name into dns_cent_t, type thint.
  * q is the set of servers to query from. Set q to NULL if you want to ask the servers registered with pdnsd.
@@ -3476,9 +3839,10 @@ static int p_dns_cached_resolve(query_stat_array q, const unsigned char *name, i
 	dns_cent_t *cached=NULL;
 	int rc;
 	unsigned short flags=0;
+	time_t expires=0;
 
 	DEBUG_RHN_MSG("Starting cached resolve for: %s, query %s\n",RHN2STR(name),get_tname(thint));
-	rc= lookup_cache_status(name, thint, &cached, &flags,queryts,c_soa);
+	rc= lookup_cache_status(name, thint, &cached, &flags,&expires,queryts,c_soa);
 	if(rc==RC_OK) {
 		/* Locally defined record. */
 		*cachedp=cached;
@@ -3513,11 +3877,30 @@ static int p_dns_cached_resolve(query_stat_array q, const unsigned char *name, i
 			goto cleanup_return;
 		}
 	}
+	if (rc==RC_STALE && !q && expires && global.stale_ttl && expires+global.stale_ttl>=queryts) {
+		/* Timed out, but recently enough to answer with it while fetching a fresh copy. */
+		DEBUG_MSG("Using stale cached record, refreshing in background.\n");
+		start_refresh(name,thint);
+		if (!qhlist)
+			metric_inc(M_STALE);
+		rc=RC_CACHED;
+	}
+	else if (rc==RC_CACHED && !q && expires && want_prefetch(cached,thint,expires,queryts)) {
+		DEBUG_MSG("Prefetching popular cached record.\n");
+		start_refresh(name,thint);
+	}
+	if (!q && !qhlist)
+		metric_inc(rc==RC_CACHED?M_CACHE_HITS:M_CACHE_MISSES);
 	if (rc!=RC_CACHED) {
 		dns_cent_t *ent;
 		DEBUG_MSG("Trying name servers.\n");
 		if (q)
 			rc=p_recursive_query(q,name,thint, &ent,NULL,hops,qslist,qhlist,c_soa);
+		else if (!qhlist)
+			/* Top-level query: share the work with identical queries in flight.
+			   Lookups made on behalf of another query (qhlist set) are not shared,
+			   so that waiting can never close a cycle. */
+			rc=shared_dns_resolve(name,thint, &ent,hops,c_soa);
 		else
 			rc=p_dns_resolve(name,thint, &ent,hops,qhlist,c_soa);
 
@@ -3533,6 +3916,8 @@ static int p_dns_cached_resolve(query_stat_array q, const unsigned char *name, i
 			   with the nopurge flag set. This means that we shall use it even
 			   if timed out when no new one is available*/
 			DEBUG_MSG("Falling back to cached record.\n");
+			if (!q && !qhlist)
+				metric_inc(M_STALE);
 			rc=RC_STALE;
 		}
 		else
@@ -3586,7 +3971,7 @@ static int simple_dns_cached_resolve(atup_array atup_a, int port, char edns_quer
 	int rc;
 
 	DEBUG_RHN_MSG("Starting simple cached resolve for: %s, query %s\n",RHN2STR(name),get_tname(thint));
-	rc= lookup_cache_status(name, thint, &cached, NULL, time(NULL), NULL);
+	rc= lookup_cache_status(name, thint, &cached, NULL, NULL, time(NULL), NULL);
 	if(rc==RC_OK) {
 		/* Locally defined record. */
 		*cachedp=cached;
@@ -3691,6 +4076,7 @@ int query_uptest(pdnsd_a *addr, int port, const unsigned char *name, time_t time
 	qs.state=QS_INITIAL;
 	qs.qm=global.query_method;
 	qs.s_errno=0;
+	qs.rtt_failed=0;
 	rv=p_exec_query(NULL, name, T_A, &qs, NULL, NULL);
 	if(rv==-1) {
 		time_t ts, tpassed;
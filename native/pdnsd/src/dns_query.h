@@ -39,6 +39,7 @@ int r_dns_cached_resolve(unsigned char *name, int thint, dns_cent_t **cachedp,
 #define dns_cached_resolve(name,thint,cachedp,hops,queryts,c_soa) \
         r_dns_cached_resolve(name,thint,cachedp,hops,NULL,queryts,c_soa)
 
+void inflight_stat(unsigned long *joined, unsigned long *fallback, int *busy);
 addr2_array dns_rootserver_resolv(atup_array atup_a, int port, char edns_query, time_t timeout);
 int query_uptest(pdnsd_a *addr, int port, const unsigned char *name, time_t timeout, int rep);
 
@@ -25,6 +25,8 @@
 #include <stdio.h>
 #include <string.h>
 #include <ctype.h>
+#include <time.h>
+#include <unistd.h>
 #include "hash.h"
 #include "cache.h"
 #include "error.h"
@@ -32,70 +34,161 @@
 #include "consts.h"
 
 
-/* This is not a perfect hash, but I hope it holds. It is designed for 1024 hash
- * buckets, and hashes strings with case-insensitivity.
- * It is position-aware in a limited way.
- * It is exactly seen a two-way hash: because I do not want to exaggerate
- * the hash buckets (i do have 1024), but I hash strings and string-comparisons
- * are expensive, I save another 32 bit hash in each hash element that is checked
- * before the string. The 32 bit hash is also used to order the entries in a hash chain.
- * I hope not to have all too much collision concentration.
- *
- * The ip hash was removed. I don't think it concentrated the collisions too much.
- * If it does, the hash algorithm needs to be changed, rather than using another
- * hash.
- * Some measurements seem to indicate that the hash algorithm is doing reasonable well.
+/* The names are hashed eight bytes at a time. Each word is lowercased in-register
+ * (the length bytes of a name are always below 64, so they are left alone), mixed
+ * in with a multiply-rotate step and the result is passed through a final avalanche.
+ * The hash is seeded at startup, so that the distribution over the slots cannot be
+ * predicted from the outside.
+ * The hash value is kept in each slot and compared before the name is, and it is also
+ * used to rehash the table when it grows, so names never have to be hashed twice.
  */
 
-dns_hash_ent_t *hash_buckets[HASH_NUM_BUCKETS];
+static dns_hash_slot_t *hash_tab=NULL;
+static unsigned long hash_mask=0;	/* number of slots - 1, or 0 if there is no table */
+static unsigned long hash_used=0;	/* live entries */
+static unsigned long hash_fill=0;	/* live entries plus deleted slots */
+static int hash_held=0;
+static uint64_t hash_seed;
+static char hash_tomb;
+
+#define HASH_TOMB ((dns_cent_t *)&hash_tomb)
+#define HASH_SIZE (hash_tab?hash_mask+1:0)
 
+#define HASH_K1 0x9e3779b97f4a7c15ULL
+#define HASH_K2 0xc2b2ae3d27d4eb4fULL
+
+#define ONES8   0x0101010101010101ULL
+#define HIGH8   0x8080808080808080ULL
+
+/* Lowercase the ASCII letters in the eight bytes of w. */
+inline static uint64_t lower8(uint64_t w)
+{
+	uint64_t h7=w&~HIGH8;
+	uint64_t up= ((h7+ONES8*(0x80-'A')) ^ (h7+ONES8*(0x7f-'Z'))) & ~w & HIGH8;
+	return w|(up>>2);
+}
+
+inline static uint64_t rotl64(uint64_t x, int r)
+{
+	return (x<<r)|(x>>(64-r));
+}
+
+inline static uint64_t load_tail(const unsigned char *p, unsigned n)
+{
+	uint64_t w=0;
+	memcpy(&w,p,n);
+	return w;
+}
 
 /*
- * Hash a dns name (length-byte string format) to HASH_SZ bit.
- * *rhash is set to a long int hash.
+ * Hash a dns name (length-byte string format) of length len, ignoring case.
  */
-static unsigned dns_hash(const unsigned char *str, unsigned long *rhash)
+static uint32_t dns_hash(const unsigned char *str, unsigned len)
 {
-	unsigned s,i,lb,c;
-	unsigned long r;
-	s=0; r=0;
-	i=0;
-	while((lb=str[i])) {
-		s+=lb<<(i%(HASH_SZ-5));
-		r+=((unsigned long)lb)<<(i%(8*sizeof(unsigned long)-7));
-		++i;
-		do {
-			c=toupper(str[i]);
-			s+=c<<(i%(HASH_SZ-5));
-			r+=((unsigned long)c)<<(i%(8*sizeof(unsigned long)-7));
-			++i;
-		} while(--lb);
+	uint64_t h=hash_seed^((uint64_t)len*HASH_K1), w;
+	const unsigned char *p=str;
+	unsigned n=len;
+
+	for(;n>=8;n-=8,p+=8) {
+		memcpy(&w,p,8);
+		h=rotl64(h^(lower8(w)*HASH_K1),31)*HASH_K2;
 	}
-	s=(s&HASH_BITMASK)+((s&(~HASH_BITMASK))>>HASH_SZ);
-	s=(s&HASH_BITMASK)+((s&(~HASH_BITMASK))>>HASH_SZ);
-	s &= HASH_BITMASK;
-#ifdef DEBUG_HASH
-	{
-		unsigned char buf[DNSNAMEBUFSIZE];
-		printf("Diagnostic: hashes for %s: %03x,%04lx\n",rhn2str(str,buf,sizeof(buf)),s,r);
+	if(n)
+		h=rotl64(h^(lower8(load_tail(p,n))*HASH_K1),31)*HASH_K2;
+
+	h^=h>>33; h*=HASH_K2;
+	h^=h>>29; h*=HASH_K1;
+	h^=h>>32;
+	return (uint32_t)h;
+}
+
+/*
+ * Compare two names of the same length len, ignoring case.
+ * Names in the cache and in queries are usually spelled the same way,
+ * so try an exact compare first.
+ */
+inline static int name_eq(const unsigned char *a, const unsigned char *b, unsigned len)
+{
+	unsigned n=len;
+
+	if(!memcmp(a,b,len))
+		return 1;
+	for(;n>=8;n-=8,a+=8,b+=8) {
+		uint64_t wa,wb;
+		memcpy(&wa,a,8);
+		memcpy(&wb,b,8);
+		if(lower8(wa)!=lower8(wb))
+			return 0;
 	}
-#endif
-	if(rhash) *rhash=r;
-	return s;
+	return !n || lower8(load_tail(a,n))==lower8(load_tail(b,n));
 }
 
 /*
- * Initialize hash to hold a dns hash table
+ * Initialize the hash table. The slots are allocated when the first entry is added.
  */
-/* This is now defined as an inline function in hash.h */
-#if 0
 void mk_dns_hash()
 {
-	int i;
-	for(i=0;i<HASH_NUM_BUCKETS;i++)
-		hash_buckets[i]=NULL;
+	uint64_t s=(uint64_t)time(NULL)*HASH_K1;
+	s^=((uint64_t)getpid()<<32)^(uint64_t)(unsigned long)&s;
+	s^=s>>31; s*=HASH_K2; s^=s>>29;
+	hash_seed=s;
+	hash_tab=NULL;
+	hash_mask=hash_used=hash_fill=0;
+}
+
+/*
+ * Move all entries into a new table with nslots slots (a power of two).
+ * Returns 1 on success, or 0 if out of memory (the old table is left in place).
+ */
+static int rehash(unsigned long nslots)
+{
+	dns_hash_slot_t *nt=calloc(nslots,sizeof(dns_hash_slot_t));
+	unsigned long i,j,nmask=nslots-1,size=HASH_SIZE;
+
+	if(!nt)
+		return 0;
+	for(i=0;i<size;++i) {
+		dns_hash_slot_t *sl=&hash_tab[i];
+		if(sl->data && sl->data!=HASH_TOMB) {
+			for(j=sl->hash&nmask; nt[j].data; j=(j+1)&nmask) ;
+			nt[j]= *sl;
+		}
+	}
+	free(hash_tab);
+	hash_tab=nt;
+	hash_mask=nmask;
+	hash_fill=hash_used;
+	return 1;
+}
+
+/* The number of slots needed to hold n entries at no more than half load. */
+static unsigned long slots_for(unsigned long n)
+{
+	unsigned long sz=HASH_MIN_SLOTS;
+	while(sz<2*n)
+		sz<<=1;
+	return sz;
+}
+
+/*
+ * Make room for at least n entries, so that loading a large number of entries
+ * does not need to grow the table repeatedly.
+ */
+void dns_hash_reserve(unsigned long n)
+{
+	unsigned long sz=slots_for(n);
+	if(sz>HASH_SIZE && !rehash(sz))
+		log_warn("Out of memory in resizing the cache hash table.");
+}
+
+/*
+ * While on is set, the table is only resized when it is full, so that the parts processed
+ * by free_dns_hash_part() and free_dns_hash_selected() keep covering the same slots.
+ */
+void dns_hash_hold(int on)
+{
+	hash_held=on;
 }
-#endif
 
 /*
   Lookup in the hash table for key. If it is found, return the pointer to the cache entry.
@@ -105,23 +198,29 @@ void mk_dns_hash()
 */
 dns_cent_t *dns_lookup(const unsigned char *key, dns_hash_loc_t *loc)
 {
+	unsigned len=rhnlen(key);
+	uint32_t h=dns_hash(key,len);
+	unsigned long i,ins=~0UL;
 	dns_cent_t *retval=NULL;
-	unsigned idx;
-	unsigned long rh;
-	dns_hash_ent_t **hep,*he;
-
-	idx = dns_hash(key,&rh);
-	hep = &hash_buckets[idx];
-	while ((he= *hep) && he->rhash<=rh) {
-		if (he->rhash==rh && rhnicmp(key,he->data->qname)) {
-			retval = he->data;
-			break;
+
+	if(hash_tab) {
+		dns_hash_slot_t *sl;
+		for(i=h&hash_mask; (sl=&hash_tab[i])->data; i=(i+1)&hash_mask) {
+			if(sl->data==HASH_TOMB) {
+				if(ins==~0UL) ins=i;
+			}
+			else if(sl->hash==h && sl->len==len && name_eq(key,sl->data->qname,len)) {
+				retval=sl->data;
+				ins=i;
+				break;
+			}
 		}
-		hep = &he->next;
+		if(ins==~0UL) ins=i;
 	}
 	if(loc) {
-		loc->pos = hep;
-		loc->rhash = rh;
+		loc->pos=ins;
+		loc->hash=h;
+		loc->len=len;
 	}
 	return retval;
 }
@@ -136,30 +235,54 @@ dns_cent_t *dns_lookup(const unsigned char *key, dns_hash_loc_t *loc)
 */
 int add_dns_hash(dns_cent_t *data, dns_hash_loc_t *loc)
 {
-	dns_hash_ent_t *he = malloc(sizeof(dns_hash_ent_t));
-
-	if(!he)
-		return 0;
-
-	he->next = *(loc->pos);
-	he->rhash = loc->rhash;
-	he->data = data;
-	*(loc->pos) = he;
-
+	unsigned long i=loc->pos;
+
+	if(!hash_tab || (hash_tab[i].data!=HASH_TOMB && (hash_fill+1)*4>(hash_mask+1)*3)) {
+		/* Grow the table, or just clear out the deleted slots if it is mostly tombstones. */
+		unsigned long sz=slots_for(hash_used+1);
+		if(hash_held && hash_tab && hash_fill+1<=hash_mask)
+			;
+		else if(rehash(sz))
+			i=~0UL;
+		else if(!hash_tab || hash_fill+1>hash_mask)
+			return 0;
+	}
+	if(i==~0UL)
+		for(i=loc->hash&hash_mask; hash_tab[i].data && hash_tab[i].data!=HASH_TOMB; i=(i+1)&hash_mask) ;
+
+	if(!hash_tab[i].data)
+		++hash_fill;
+	++hash_used;
+	hash_tab[i].hash=loc->hash;
+	hash_tab[i].len=loc->len;
+	hash_tab[i].data=data;
+	loc->pos=i;
 	return 1;
 }
 
+/* Remove the entry in slot i. If the next slot is empty, no probe sequence can
+   pass through this one, so it and any deleted slots before it become empty. */
+static void clear_slot(unsigned long i)
+{
+	--hash_used;
+	if(!hash_tab[(i+1)&hash_mask].data) {
+		do {
+			hash_tab[i].data=NULL;
+			--hash_fill;
+			i=(i-1)&hash_mask;
+		} while(hash_tab[i].data==HASH_TOMB);
+	}
+	else
+		hash_tab[i].data=HASH_TOMB;
+}
+
 /*
   Delete the hash entry indentified by the location returned by dns_lookup().
 */
 dns_cent_t *del_dns_hash_ent(dns_hash_loc_t *loc)
 {
-	dns_hash_ent_t *he = *(loc->pos);
-	dns_cent_t *data;
-
-	*(loc->pos) = he->next;
-	data = he->data;
-	free(he);
+	dns_cent_t *data=hash_tab[loc->pos].data;
+	clear_slot(loc->pos);
 	return data;
 }
 
@@ -169,78 +292,67 @@ dns_cent_t *del_dns_hash_ent(dns_hash_loc_t *loc)
  */
 dns_cent_t *del_dns_hash(const unsigned char *key)
 {
-	unsigned idx;
-	unsigned long rh;
-	dns_hash_ent_t **hep,*he;
-	dns_cent_t *data;
-
-	idx = dns_hash(key,&rh);
-	hep = &hash_buckets[idx];
-	while ((he= *hep) && he->rhash<=rh) {
-		if (he->rhash==rh && rhnicmp(key,he->data->qname)) {
-			*hep = he->next;
-			data = he->data;
-			free(he);
-			return data;
-		}
-		hep = &he->next;
-	}
-	return NULL;   /* not found */
+	dns_hash_loc_t loc;
+	dns_cent_t *data=dns_lookup(key,&loc);
+
+	if(data)
+		clear_slot(loc.pos);
+	return data;
 }
 
 
 /*
- * Delete all entries in a hash bucket.
+ * Delete all entries in part i (0 <= i < HASH_NUM_PARTS) of the hash table.
+ * size is the table size when the first part was processed (see dns_hash_stat()); the caller
+ * must start over if it has changed since, so that all parts are taken from the same size.
  */
-void free_dns_hash_bucket(int i)
+void free_dns_hash_part(int i, unsigned long size)
 {
-	dns_hash_ent_t *he,*hen;
-
-	he=hash_buckets[i];
-	hash_buckets[i]=NULL;
-	while (he) {
-		hen=he->next;
-		del_cent(he->data);
-		free(he);
-		he=hen;
+	unsigned long j;
+	unsigned long jlim=size/HASH_NUM_PARTS*(i+1);
+
+	if(i==HASH_NUM_PARTS-1)
+		jlim=size;
+	for(j=size/HASH_NUM_PARTS*i; j<jlim; ++j) {
+		dns_cent_t *data=hash_tab[j].data;
+		if(data && data!=HASH_TOMB) {
+			hash_tab[j].data=HASH_TOMB;
+			--hash_used;
+			del_cent(data);
+		}
 	}
 }
 
 /*
- * Delete all entries in a hash bucket whose names match those in
- * an include/exclude list.
+ * Delete all entries in part i of the hash table whose names match those in
+ * an include/exclude list. size is as for free_dns_hash_part().
  */
-void free_dns_hash_selected(int i, slist_array sla)
+void free_dns_hash_selected(int i, unsigned long size, slist_array sla)
 {
-	dns_hash_ent_t **hep,*he,*hen;
-	int j,m=DA_NEL(sla);
-
-	hep= &hash_buckets[i];
-	he= *hep;
-
-	while (he) {
-		unsigned char *name=he->data->qname;
-		for(j=0;j<m;++j) {
-			slist_t *sl=&DA_INDEX(sla,j);
+	unsigned long j;
+	unsigned long jlim=size/HASH_NUM_PARTS*(i+1);
+	int k,m=DA_NEL(sla);
+
+	if(i==HASH_NUM_PARTS-1)
+		jlim=size;
+	for(j=size/HASH_NUM_PARTS*i; j<jlim; ++j) {
+		dns_cent_t *data=hash_tab[j].data;
+		if(!data || data==HASH_TOMB)
+			continue;
+		for(k=0;k<m;++k) {
+			slist_t *sl=&DA_INDEX(sla,k);
 			unsigned int nrem,lrem;
-			domain_match(name,sl->domain,&nrem,&lrem);
+			domain_match(data->qname,sl->domain,&nrem,&lrem);
 			if(!lrem && (!sl->exact || !nrem)) {
-				if(sl->rule==C_INCLUDED)
-					goto delete_entry;
-				else
-					break;
+				if(sl->rule==C_INCLUDED) {
+					hash_tab[j].data=HASH_TOMB;
+					--hash_used;
+					del_cent(data);
+				}
+				break;
 			}
 		}
 		/* default policy is not to delete */
-		hep= &he->next;
-		he= *hep;
-		continue;
-
-	delete_entry:
-		*hep=hen=he->next;;
-		del_cent(he->data);
-		free(he);
-		he=hen;
 	}
 }
 
@@ -249,18 +361,21 @@ void free_dns_hash_selected(int i, slist_array sla)
  */
 void free_dns_hash()
 {
-	int i;
-	dns_hash_ent_t *he,*hen;
-	for (i=0;i<HASH_NUM_BUCKETS;i++) {
-		he=hash_buckets[i];
-		hash_buckets[i]=NULL;
-		while (he) {
-			hen=he->next;
-			del_cent(he->data);
-			free(he);
-			he=hen;
-		}
+	unsigned long i,size=HASH_SIZE;
+	for (i=0;i<size;i++) {
+		dns_cent_t *data=hash_tab[i].data;
+		if(data && data!=HASH_TOMB)
+			del_cent(data);
 	}
+	free(hash_tab);
+	hash_tab=NULL;
+	hash_mask=hash_used=hash_fill=0;
+}
+
+void dns_hash_stat(unsigned long *slots, unsigned long *used)
+{
+	*slots=HASH_SIZE;
+	*used=hash_used;
 }
 
 /*
@@ -274,49 +389,144 @@ void free_dns_hash()
  */
 dns_cent_t *fetch_first(dns_hash_pos_t *pos)
 {
-	int i;
-	for (i=0;i<HASH_NUM_BUCKETS;i++) {
-		dns_hash_ent_t *he=hash_buckets[i];
-		if (he) {
-			pos->bucket=i;
-			pos->ent=he->next;
-			return he->data;
+	pos->slot=0;
+	return fetch_next(pos);
+}
+
+dns_cent_t *fetch_next(dns_hash_pos_t *pos)
+{
+	unsigned long i,size=HASH_SIZE;
+	for (i=pos->slot;i<size;i++) {
+		dns_cent_t *data=hash_tab[i].data;
+		if (data && data!=HASH_TOMB) {
+			pos->slot=i+1;
+			return data;
 		}
 	}
+	pos->slot=size;
 	return NULL;
 }
 
-dns_cent_t *fetch_next(dns_hash_pos_t *pos)
+/*
+ * Return the first entry at or after slot r (modulo the table size), looking at no more
+ * than HASH_SAMPLE_SCAN slots, or NULL if there is none. Used to sample entries for eviction.
+ */
+dns_cent_t *dns_hash_sample(unsigned long r)
 {
-	dns_hash_ent_t *he=pos->ent;
-	int i;
-	if (he) {
-		pos->ent=he->next;
-		return he->data;
-	}
+	unsigned long i,n;
 
-	for (i=pos->bucket+1;i<HASH_NUM_BUCKETS;i++) {
-		he=hash_buckets[i];
-		if (he) {
-			pos->bucket=i;
-			pos->ent=he->next;
-			return he->data;
-		}
+	if(!hash_used)
+		return NULL;
+	for (i=r&hash_mask,n=0; n<HASH_SAMPLE_SCAN; i=(i+1)&hash_mask,++n) {
+		dns_cent_t *data=hash_tab[i].data;
+		if (data && data!=HASH_TOMB)
+			return data;
 	}
 	return NULL;
 }
 
 #ifdef DEBUG_HASH
+/* The average number of slots looked at to find each entry. */
+static double avg_probe_len()
+{
+	unsigned long i,size=HASH_SIZE,tot=0;
+	for (i=0; i<size; i++) {
+		dns_cent_t *data=hash_tab[i].data;
+		if(data && data!=HASH_TOMB)
+			tot+=((i-(hash_tab[i].hash&hash_mask))&hash_mask)+1;
+	}
+	return hash_used?(double)tot/hash_used:0;
+}
+
 void dumphash()
 {
 	if(debug_p) {
-		int i, j;
-		dns_hash_ent_t *he;
+		DEBUG_MSG("hash table: %lu slots, %lu entries, %lu deleted, %.3g slots probed per entry\n",
+			  HASH_SIZE, hash_used, hash_fill-hash_used, avg_probe_len());
+	}
+}
+
+/*
+ * Replay a query name distribution against dns_lookup().
+ * file contains one domain name per line, as they were queried (e.g. extracted from
+ * a query log), so that popular names appear more often. The distinct names are put
+ * into the (otherwise empty) table, then all lines are looked up rounds times.
+ * Returns 0 on success, -1 on error.
+ */
+int dns_hash_bench(const char *file, int rounds)
+{
+	FILE *f;
+	char line[DNSNAMEBUFSIZE+2];
+	unsigned char *names=NULL;
+	unsigned long nnames=0,anames=0,i,found=0,nent=0;
+	dns_cent_t *cents=NULL;
+	struct timespec t0,t1;
+	double ns;
+	int r,rv=-1;
+
+	if(!(f=fopen(file,"r"))) {
+		fprintf(stderr,"Could not open %s.\n",file);
+		return -1;
+	}
+	while(fgets(line,sizeof(line),f)) {
+		line[strcspn(line," \t\r\n")]=0;
+		if(!line[0])
+			continue;
+		if(nnames==anames) {
+			unsigned char *nn=realloc(names,(anames=anames?2*anames:1024)*DNSNAMEBUFSIZE);
+			if(!nn) goto out_of_memory;
+			names=nn;
+		}
+		if(str2rhn(ucharp line,names+nnames*DNSNAMEBUFSIZE)) {
+			fprintf(stderr,"Skipping invalid name: %s\n",line);
+			continue;
+		}
+		++nnames;
+	}
+	fclose(f);
+	f=NULL;
+	if(!nnames) {
+		fprintf(stderr,"No names in %s.\n",file);
+		goto free_return;
+	}
 
-		for (i=0; i<HASH_NUM_BUCKETS; i++) {
-			for (j=0, he=hash_buckets[i]; he; he=he->next, j++) ;
-			DEBUG_MSG("bucket %d: %d entries\n", i, j);
+	if(!(cents=calloc(nnames,sizeof(dns_cent_t))))
+		goto out_of_memory;
+	clock_gettime(CLOCK_MONOTONIC,&t0);
+	for(i=0;i<nnames;++i) {
+		dns_hash_loc_t loc;
+		unsigned char *nm=names+i*DNSNAMEBUFSIZE;
+		if(!dns_lookup(nm,&loc)) {
+			cents[nent].qname=nm;
+			if(!add_dns_hash(&cents[nent],&loc))
+				goto out_of_memory;
+			++nent;
 		}
 	}
+	clock_gettime(CLOCK_MONOTONIC,&t1);
+	ns=(t1.tv_sec-t0.tv_sec)*1e9+(t1.tv_nsec-t0.tv_nsec);
+	printf("%lu names, %lu distinct, inserted in %.1f ns/name.\n",nnames,nent,ns/nnames);
+	printf("%lu slots, %.3g slots probed per entry.\n",HASH_SIZE,avg_probe_len());
+
+	clock_gettime(CLOCK_MONOTONIC,&t0);
+	for(r=0;r<rounds;++r)
+		for(i=0;i<nnames;++i)
+			found+= dns_lookup(names+i*DNSNAMEBUFSIZE,NULL)!=NULL;
+	clock_gettime(CLOCK_MONOTONIC,&t1);
+	ns=(t1.tv_sec-t0.tv_sec)*1e9+(t1.tv_nsec-t0.tv_nsec);
+	printf("%lu lookups (%lu hits) in %.1f ns/lookup.\n",(unsigned long)rounds*nnames,found,ns/((double)rounds*nnames));
+
+	for(i=0;i<nent;++i)
+		del_dns_hash(cents[i].qname);
+	rv=0;
+	goto free_return;
+
+ out_of_memory:
+	fprintf(stderr,"Out of memory.\n");
+ free_return:
+	if(f) fclose(f);
+	free(cents);
+	free(names);
+	return rv;
 }
 #endif
@@ -24,60 +24,61 @@
 #ifndef _HASH_H_
 #define _HASH_H_
 #include <config.h>
+#include <stdint.h>
 #include "cache.h"
 
-typedef struct dns_hash_ent_s {
-	struct dns_hash_ent_s	*next;
-	unsigned long		rhash; /* this is a better hash */
-	dns_cent_t		*data;
-} dns_hash_ent_t;
+/* The hash table is an open-addressed array of slots that is searched with linear probing.
+ * Every slot stores the hash value and the name length of its entry, so that most
+ * mismatches are rejected without looking at the name itself.
+ * The table starts out with HASH_MIN_SLOTS slots (computed from HASH_SZ, which is defined
+ * in config.h) and is doubled whenever it becomes three quarters full, so it grows along
+ * with the number of cache entries (and thus with perm_cache) instead of having a
+ * fixed number of buckets. */
+#define HASH_MIN_SLOTS   (1<<HASH_SZ)
 
-/* Redefine this if you want another hash size. Should work ;-).
- * The number of hash buckets is computed as power of two;
- * so, e.g. HASH_SZ set to 10 yields 1024 hash rows (2^10 or 1<<10).
- * Only powers of two are possible conveniently.
- * HASH_SZ may not be bigger than 32 (if you set it even close to that value,
- * you are nuts.) */
-/* #define HASH_SZ       10 */  /* Now defined in config.h */
-#define HASH_NUM_BUCKETS (1<<HASH_SZ)
+/* empty_cache() processes the table in this many parts, yielding the lock in between. */
+#define HASH_NUM_PARTS   64
 
-#define HASH_BITMASK     (HASH_NUM_BUCKETS-1)
+/* dns_hash_sample() gives up after looking at this many slots. */
+#define HASH_SAMPLE_SCAN 32
 
-extern dns_hash_ent_t *hash_buckets[];
+typedef struct {
+	uint32_t	hash;
+	uint32_t	len;       /* rhnlen() of the name */
+	dns_cent_t	*data;     /* NULL: empty slot, HASH_TOMB: deleted entry */
+} dns_hash_slot_t;
 
 /* A type for remembering the position in the hash table where a new entry can be inserted. */
 typedef struct {
-	dns_hash_ent_t **pos;      /* pointer to the location in the hash table */
-	unsigned long  rhash;      /* long hash */
+	unsigned long  pos;        /* slot index in the hash table */
+	uint32_t       hash;
+	uint32_t       len;
 } dns_hash_loc_t;
 
 /* A type for position specification for fetch_first and fetch_next */
 typedef struct {
-	int            bucket;     /* bucket chain we are in */
-	dns_hash_ent_t *ent;       /* entry */
+	unsigned long  slot;       /* next slot to look at */
 } dns_hash_pos_t;
 
-inline static void mk_dns_hash()  __attribute__((always_inline));
-inline static void mk_dns_hash()
-{
-	int i;
-	for(i=0;i<HASH_NUM_BUCKETS;i++)
-		hash_buckets[i]=NULL;
-}
-
+void mk_dns_hash();
+void dns_hash_reserve(unsigned long n);
+void dns_hash_hold(int on);
 dns_cent_t *dns_lookup(const unsigned char *key, dns_hash_loc_t *loc);
 int add_dns_hash(dns_cent_t *data, dns_hash_loc_t *loc);
 dns_cent_t *del_dns_hash_ent(dns_hash_loc_t *loc);
 dns_cent_t *del_dns_hash(const unsigned char *key);
-void free_dns_hash_bucket(int i);
-void free_dns_hash_selected(int i, slist_array sla);
+void free_dns_hash_part(int i, unsigned long size);
+void free_dns_hash_selected(int i, unsigned long size, slist_array sla);
 void free_dns_hash();
+void dns_hash_stat(unsigned long *slots, unsigned long *used);
 
 dns_cent_t *fetch_first(dns_hash_pos_t *pos);
 dns_cent_t *fetch_next(dns_hash_pos_t *pos);
+dns_cent_t *dns_hash_sample(unsigned long r);
 
 #ifdef DEBUG_HASH
 void dumphash();
+int dns_hash_bench(const char *file, int rounds);
 #endif
 
 #endif
@@ -68,6 +68,9 @@ volatile int tcp_socket=-1;
 volatile int udp_socket=-1;
 sigset_t sigs_msk;
 char *conf_file=CONFDIR"/pdnsd.conf";
+#ifdef DEBUG_HASH
+static char *hash_bench_file=NULL;
+#endif
 
 
 /* version and licensing information */
@@ -141,6 +144,11 @@ static const char help_message[] =
 	"-c\t\t--or--\n"
 	"--config-file\tspecifies the file the configuration is read from.\n"
 	"\t\tDefault is " CONFDIR "/pdnsd.conf\n"
+#ifdef DEBUG_HASH
+	"--hash-bench=file\n"
+	"\t\treplay the query names in file (one per line) against\n"
+	"\t\tthe cache hash table, print timings and exit.\n"
+#endif
 #ifdef ENABLE_IPV4
 	"-4\t\tswitches to IPv4 mode.\n"
 	"\t\t"
@@ -391,6 +399,11 @@ int main(int argc,char *argv[])
 				if(arg_isparam("--config-file")) {
 					conf_file=valstr;
 				}
+#ifdef DEBUG_HASH
+				else if(arg_isparam("--hash-bench")) {
+					hash_bench_file=valstr;
+				}
+#endif
 				else if(arg_isparam("--ipv4_6_prefix")) {
 #ifdef ENABLE_IPV6
 					if(inet_pton(AF_INET6,valstr,&global.ipv4_6_prefix)<=0) {
@@ -414,6 +427,10 @@ int main(int argc,char *argv[])
 	}
 
 	init_cache();
+#ifdef DEBUG_HASH
+	if(hash_bench_file)
+		exit(dns_hash_bench(hash_bench_file,100)?1:0);
+#endif
 	{
 		char *errmsg;
 		if(!read_config_file(conf_file,&global,&servers,0,&errmsg)) {
@@ -646,6 +663,7 @@ int main(int argc,char *argv[])
 #endif
 
 		if(start_servstat_thread()) thrdfail;
+		start_cache_thread();
 
 #if (TARGET==TARGET_LINUX)
 		if (!global.strict_suid) {
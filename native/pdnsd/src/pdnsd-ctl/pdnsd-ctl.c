@@ -69,7 +69,7 @@ static const cmd_s top_cmds[]={
 	{"status",CTL_STATS},{"server",CTL_SERVER},{"record",CTL_RECORD},
 	{"source",CTL_SOURCE},{"add",CTL_ADD},{"neg",CTL_NEG},
 	{"config",CTL_CONFIG},{"include",CTL_INCLUDE},{"eval",CTL_EVAL},
-	{"empty-cache",CTL_EMPTY}, {"dump",CTL_DUMP},
+	{"empty-cache",CTL_EMPTY}, {"dump",CTL_DUMP}, {"metrics",CTL_METRICS},
 	{NULL,0}
 };
 static const cmd_s server_cmds[]= {{"up",CTL_S_UP},{"down",CTL_S_DOWN},{"retest",CTL_S_RETEST},{NULL,0}};
@@ -216,6 +216,12 @@ static const char *const help_messages[] =
 	"\tthe leading dot) will be printed. If name is missing, information about\n"
 	"\tall the names in the cache will be printed.\n",
 
+	"metrics\t[no arguments]\n"
+	"\tPrint pdnsd's query counters, answer latency histogram and the round\n"
+	"\ttrip time estimates of the name servers, one value per line. pdnsd\n"
+	"\tsends these in a compact binary form, which is cheap enough to be\n"
+	"\tpolled frequently.\n",
+
 	"list-rrtypes\t[no arguments]\n"
 	"\tList available rr types for the neg command. Note that those are only\n"
 	"\tused for the neg command, not for add!\n"
@@ -340,6 +346,83 @@ static ssize_t copymsgtofile(int fd, FILE* out)
 	return ntot;
 }
 
+/* Names of the counters in a metrics reply, indexed by the M_* constants in status.h. */
+static const char *const metric_names[M_NUM]= {
+	"queries_udp","queries_tcp","cache_hits","cache_misses","stale_served",
+	"upstream_replies","upstream_failures","answers_servfail","answers_nxdomain",
+	"queries_dropped","threads_spawned","threads_running","threads_active",
+	"queries_in_flight","queries_coalesced","cache_bytes","cache_max_bytes",
+	"cache_entries","cache_evicted"
+};
+
+#define get_u16(p) (((unsigned)(p)[0]<<8)|(p)[1])
+#define get_u32(p) (((uint32_t)get_u16(p)<<16)|get_u16((p)+2))
+#define get_u64(p) (((uint64_t)get_u32(p)<<32)|get_u32((p)+4))
+
+/* Read a metrics reply (see report_metrics() in status.c) from fd and print it to out.
+   Returns 0 on success, -1 if the reply could not be read or is malformed. */
+static int print_metrics(int fd, FILE *out)
+{
+	unsigned char *buf=NULL,*p,*end;
+	size_t sz=0,len=0;
+	unsigned i,n;
+
+	for(;;) {
+		ssize_t m;
+		if(len==sz) {
+			unsigned char *nbuf=realloc(buf,sz+=1024);
+			if(!nbuf) goto bad;
+			buf=nbuf;
+		}
+		if((m=read(fd,buf+len,sz-len))<0) goto bad;
+		if(!m) break;
+		len+=m;
+	}
+	p=buf; end=buf+len;
+
+#define need(k) if(end-p<(ptrdiff_t)(k)) goto bad
+	need(4);
+	if(get_u16(p)!=METRICS_VERSION) goto bad;
+	n=get_u16(p+2); p+=4;
+	need(n*8);
+	for(i=0;i<n;++i,p+=8) {
+		if(i<M_NUM)
+			fprintf(out,"%s %llu\n",metric_names[i],(unsigned long long)get_u64(p));
+		else
+			fprintf(out,"metric_%u %llu\n",i,(unsigned long long)get_u64(p));
+	}
+	need(2);
+	n=get_u16(p); p+=2;
+	need(n*12);
+	for(i=0;i<n;++i,p+=12) {
+		uint32_t bound=get_u32(p);
+		if(bound==0xffffffff)
+			fprintf(out,"latency_us_le_inf %llu\n",(unsigned long long)get_u64(p+4));
+		else
+			fprintf(out,"latency_us_le_%lu %llu\n",(unsigned long)bound,(unsigned long long)get_u64(p+4));
+	}
+	need(2);
+	n=get_u16(p); p+=2;
+	need(n*(1+16+2+4+4+4+1));
+	for(i=0;i<n;++i,p+=1+16+2+4+4+4+1) {
+		char abuf[INET6_ADDRSTRLEN];
+		int fam=p[0]==6?AF_INET6:AF_INET;
+		if(!inet_ntop(fam,p+1,abuf,sizeof(abuf)))
+			strcpy(abuf,"?");
+		fprintf(out,fam==AF_INET6?"server [%s]:%u":"server %s:%u",abuf,get_u16(p+17));
+		fprintf(out," srtt_ms %ld rttvar_ms %ld fails %lu up %u\n",
+			(long)(int32_t)get_u32(p+19),(long)(int32_t)get_u32(p+23),
+			(unsigned long)get_u32(p+27),p[31]);
+	}
+#undef need
+	free(buf);
+	return 0;
+
+ bad:
+	free(buf);
+	return -1;
+}
+
 static int match_cmd(const char *cmd, const cmd_s cmds[])
 {
 	int i;
@@ -746,6 +829,21 @@ int main(int argc, char *argv[])
 		}
 			goto read_retval;
 
+		case CTL_METRICS:
+			if (argc!=1)
+				goto wrong_args;
+			pf=open_sock(cache_dir, cmd);
+			if((rv=read_short(pf)))
+				goto retval_failed;
+			errno=0;
+			if(print_metrics(pf,stdout)<0) {
+				fprintf(stderr,"Error: could not read metrics from socket: %s\n",
+					errno?strerror(errno):"malformed reply");
+				close(pf);
+				exit(2);
+			}
+			goto close_pf;
+
 		case CTL_DUMP:
 			if (argc>2)
 				goto wrong_args;
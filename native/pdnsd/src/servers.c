@@ -46,6 +46,7 @@
 #include "netdev.h"
 #include "helpers.h"
 #include "dns_query.h"
+#include "status.h"
 
 
 /*
@@ -847,6 +848,139 @@ int change_servers(int i, addr_array ar, int up)
 }
 
 
+/*
+ * Round trip time estimates and failure scores of the name servers we query.
+ * These are updated from the replies to (and time-outs of) real queries, independently of
+ * the uptests, and are used to order the servers within a section and to decide how long
+ * to wait for a reply before a query is also sent to the next server (or sent again).
+ * The table is small and direct-mapped; a server whose slot is taken over by another
+ * one simply starts out with a fresh estimate.
+ */
+typedef struct {
+	pdnsd_a        a;
+	unsigned short port;      /* 0: slot unused */
+	unsigned short fails;     /* failure score, decays with every reply */
+	unsigned long  nsamp;     /* number of RTT samples */
+	long           srtt;      /* smoothed RTT in ms, times 8 */
+	long           rttvar;    /* mean RTT deviation in ms, times 4 */
+} srv_rtt_t;
+
+#define SRV_RTT_SLOTS 64
+#define SRV_FAIL_MAX  16
+
+static srv_rtt_t srv_rtt[SRV_RTT_SLOTS];
+static pthread_mutex_t srv_rtt_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static srv_rtt_t *srv_rtt_slot(const pdnsd_a *a, int port)
+{
+	const unsigned char *p=(const unsigned char *)a;
+	unsigned i,n=SEL_IPVER(sizeof(struct in_addr),sizeof(struct in6_addr));
+	unsigned long h=port;
+	for(i=0;i<n;++i)
+		h=h*31+p[i];
+	return &srv_rtt[(h^(h>>7))%SRV_RTT_SLOTS];
+}
+
+#define srv_rtt_match(e,a,port) ((e)->port==(port) && ADDR_EQUIV(&(e)->a,(a)))
+
+/*
+ * Record the outcome of a query to the server at address a.
+ * ms is the round trip time in milliseconds, or negative if the query failed or timed out.
+ */
+void srv_rtt_update(const pdnsd_a *a, int port, long ms)
+{
+	srv_rtt_t *e=srv_rtt_slot(a,port);
+
+	metric_inc(ms<0?M_UP_FAILURES:M_UP_REPLIES);
+	pthread_mutex_lock(&srv_rtt_lock);
+	if(!srv_rtt_match(e,a,port)) {
+		memset(e,0,sizeof(*e));
+		e->a= *a;
+		e->port=port;
+	}
+	if(ms<0) {
+		if(e->fails<SRV_FAIL_MAX)
+			++e->fails;
+	}
+	else {
+		e->fails >>= 1;
+		if(!e->nsamp) {
+			e->srtt=ms<<3;
+			e->rttvar=ms<<1;
+		}
+		else {
+			/* The usual estimator (RFC 6298), with alpha=1/8 and beta=1/4. */
+			long d=ms-(e->srtt>>3);
+			e->srtt+=d;
+			if(d<0) d= -d;
+			e->rttvar+=d-(e->rttvar>>2);
+		}
+		++e->nsamp;
+	}
+	pthread_mutex_unlock(&srv_rtt_lock);
+}
+
+/*
+ * Get the estimates for the server at address a.
+ * *srtt and *rttvar are set to -1 if the server has not replied yet.
+ * Returns 0 if nothing is known about the server yet, 1 otherwise.
+ */
+int srv_rtt_get(const pdnsd_a *a, int port, long *srtt, long *rttvar, unsigned *fails)
+{
+	srv_rtt_t *e=srv_rtt_slot(a,port);
+	int rv=0;
+
+	pthread_mutex_lock(&srv_rtt_lock);
+	if(srv_rtt_match(e,a,port) && (e->nsamp || e->fails)) {
+		*srtt= e->nsamp? e->srtt>>3: -1;
+		*rttvar= e->nsamp? e->rttvar>>2: -1;
+		*fails=e->fails;
+		rv=1;
+	}
+	pthread_mutex_unlock(&srv_rtt_lock);
+	return rv;
+}
+
+/*
+ * The expected cost in milliseconds of sending a query to the server at address a.
+ * Every failure counts as one expected round trip wasted on waiting.
+ */
+long srv_rtt_cost(const pdnsd_a *a, int port)
+{
+	long srtt,rttvar;
+	unsigned fails;
+
+	if(!srv_rtt_get(a,port,&srtt,&rttvar,&fails))
+		return SRV_RTT_UNKNOWN;
+	if(srtt<0) {
+		srtt=SRV_RTT_UNKNOWN;
+		rttvar=0;
+	}
+	return (srtt+rttvar)*(fails+1);
+}
+
+/*
+ * How long to wait (in milliseconds) for a reply from the server at address a before
+ * the query is also sent elsewhere. This is srtt+2*rttvar, roughly the 90th percentile
+ * of the recent round trip times, but never more than the server timeout.
+ */
+long srv_hedge_ms(const pdnsd_a *a, int port, time_t timeout)
+{
+	long srtt,rttvar,ms;
+	unsigned fails;
+
+	if(srv_rtt_get(a,port,&srtt,&rttvar,&fails) && srtt>=0)
+		ms=srtt+2*rttvar;
+	else
+		ms=SRV_RTT_UNKNOWN;
+	if(ms<SRV_HEDGE_MIN)
+		ms=SRV_HEDGE_MIN;
+	if(ms>timeout*1000)
+		ms=timeout*1000;
+	return ms;
+}
+
+
 /*
   The signal handler for the signal to tell the server status thread to discontinue testing.
 */
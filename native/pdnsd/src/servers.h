@@ -44,6 +44,16 @@ int exclusive_lock_server_data(int tm);
 void exclusive_unlock_server_data(int retest);
 int change_servers(int i, addr_array ar, int up);
 
+/* The RTT (in ms) assumed for servers we have not had a reply from yet. */
+#define SRV_RTT_UNKNOWN 1000
+/* Never wait less than this many ms before hedging a query to another server. */
+#define SRV_HEDGE_MIN   30
+
+void srv_rtt_update(const pdnsd_a *a, int port, long ms);
+int srv_rtt_get(const pdnsd_a *a, int port, long *srtt, long *rttvar, unsigned *fails);
+long srv_rtt_cost(const pdnsd_a *a, int port);
+long srv_hedge_ms(const pdnsd_a *a, int port, time_t timeout);
+
 inline static int needs_testing(servparm_t *sp)
   __attribute__((always_inline));
 inline static int needs_testing(servparm_t *sp)
@@ -38,6 +38,7 @@
 #include <sys/socket.h>
 #include <sys/un.h>
 #include <stddef.h>	/* for offsetof */
+#include <time.h>
 #include "ipvers.h"
 #include "status.h"
 #include "thread.h"
@@ -45,6 +46,7 @@
 #include "error.h"
 #include "servers.h"
 #include "dns_answer.h"
+#include "dns_query.h"
 #include "helpers.h"
 #include "conf-parser.h"
 
@@ -169,6 +171,177 @@ static int read_domain(int fh, char *buf, unsigned int buflen)
 	return 1;
 }
 
+
+/*
+ * Query metrics.
+ * The counters are bumped by every query thread, so they must not be protected by a
+ * common lock. Query threads are short-lived, which rules out per-thread blocks that
+ * are summed up on reading. Instead, the counters are spread over a few stripes, each
+ * in a cache line of its own, and a thread uses the stripe picked by its thread id.
+ * Threads that happen to share a stripe still update it with atomic adds.
+ * Reading sums up the stripes without any locking; the result is a snapshot that may
+ * be a few counts off, which is good enough for monitoring.
+ */
+#define METRIC_STRIPE_BITS 4
+#define METRIC_STRIPES     (1<<METRIC_STRIPE_BITS)
+
+typedef struct {
+	unsigned long cnt[M_NUM_STRIPED];
+	unsigned long lat[METRICS_LAT_BUCKETS];
+} __attribute__((aligned(64))) metric_stripe_t;
+
+static metric_stripe_t metric_stripes[METRIC_STRIPES];
+static const unsigned long metric_lat_bounds[METRICS_LAT_BUCKETS-1]=METRICS_LAT_BOUNDS;
+
+static metric_stripe_t *metric_stripe()
+{
+	unsigned long h=(unsigned long)pthread_self();
+	/* Fibonacci hashing: thread ids are aligned, so only the high bits of the product are useful. */
+	h*=(unsigned long)0x9e3779b97f4a7c15ULL;
+	return &metric_stripes[h>>(sizeof(h)*8-METRIC_STRIPE_BITS)];
+}
+
+void metric_inc(int m)
+{
+	__sync_fetch_and_add(&metric_stripe()->cnt[m],1);
+}
+
+/* Account for an answer sent after us microseconds with the given rcode. */
+void metric_answer(int tcp, int rcode, unsigned long us)
+{
+	metric_stripe_t *st=metric_stripe();
+	int i;
+
+	__sync_fetch_and_add(&st->cnt[tcp?M_QUERIES_TCP:M_QUERIES_UDP],1);
+	if(rcode==RC_SERVFAIL)
+		__sync_fetch_and_add(&st->cnt[M_SERVFAIL],1);
+	else if(rcode==RC_NAMEERR)
+		__sync_fetch_and_add(&st->cnt[M_NXDOMAIN],1);
+	for(i=0;i<METRICS_LAT_BUCKETS-1 && us>metric_lat_bounds[i];++i) ;
+	__sync_fetch_and_add(&st->lat[i],1);
+}
+
+/* Microseconds on a monotonic clock. Only differences of these values are meaningful. */
+unsigned long metric_clock_us()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC,&ts);
+	return (unsigned long)ts.tv_sec*1000000+ts.tv_nsec/1000;
+}
+
+#define put_u8(p,v)  (*(p)++=(unsigned char)(v))
+#define put_u16(p,v) (put_u8(p,(v)>>8), put_u8(p,v))
+#define put_u32(p,v) (put_u16(p,(uint32_t)(v)>>16), put_u16(p,(uint32_t)(v)&0xffff))
+#define put_u64(p,v) (put_u32(p,(uint64_t)(v)>>32), put_u32(p,(uint64_t)(v)&0xffffffff))
+
+/* Size of a server record: family, address, port, srtt, rttvar, failure score, up flag. */
+#define METRICS_SRVSZ (1+16+2+4+4+4+1)
+
+/*
+ * Write the metrics to f in binary form. All numbers are big-endian:
+ *   u16 version, u16 n, n times u64 counter (indexed by the M_* constants),
+ *   u16 b, b times (u32 upper bound in us (0xffffffff for the last one), u64 count),
+ *   u16 s, s times (u8 address family 4 or 6, 16 bytes address (IPv4 in the first 4),
+ *                   u16 port, i32 srtt in ms, i32 rttvar in ms (both -1 if unknown),
+ *                   u32 failure score, u8 server assumed available).
+ * The server records are collected first, so that the server data is not locked
+ * while writing to a possibly slow reader.
+ * Returns 0 on success, -1 on error.
+ */
+static int report_metrics(int f)
+{
+	unsigned long val[M_NUM],lat[METRICS_LAT_BUCKETS];
+	unsigned char hdr[2+2+M_NUM*8+2+METRICS_LAT_BUCKETS*12+2],*p=hdr;
+	unsigned char *srv=NULL;
+	int i,j,nsrv=0,rv;
+
+	memset(val,0,sizeof(val));
+	memset(lat,0,sizeof(lat));
+	for(i=0;i<METRIC_STRIPES;++i) {
+		metric_stripe_t *st=&metric_stripes[i];
+		for(j=0;j<M_NUM_STRIPED;++j)
+			val[j]+=st->cnt[j];
+		for(j=0;j<METRICS_LAT_BUCKETS;++j)
+			lat[j]+=st->lat[j];
+	}
+	{
+		unsigned long spawned,dropped,joined,fallback;
+		int running,active,busy;
+		long bytes,maxbytes,entries;
+		thread_metrics(&spawned,&dropped,&running,&active);
+		val[M_DROPPED]=dropped;
+		val[M_THR_SPAWNED]=spawned;
+		val[M_THR_RUNNING]=running;
+		val[M_THR_ACTIVE]=active;
+		inflight_stat(&joined,&fallback,&busy);
+		val[M_INFLIGHT]=busy;
+		val[M_COALESCED]=joined;
+		cache_metrics(&bytes,&maxbytes,&entries,&val[M_EVICTED]);
+		val[M_CACHE_BYTES]=bytes;
+		val[M_CACHE_MAXBYTES]=maxbytes;
+		val[M_CACHE_ENTRIES]=entries;
+	}
+
+	put_u16(p,METRICS_VERSION);
+	put_u16(p,M_NUM);
+	for(i=0;i<M_NUM;++i)
+		put_u64(p,val[i]);
+	put_u16(p,METRICS_LAT_BUCKETS);
+	for(i=0;i<METRICS_LAT_BUCKETS;++i) {
+		put_u32(p,i<METRICS_LAT_BUCKETS-1?metric_lat_bounds[i]:0xffffffff);
+		put_u64(p,lat[i]);
+	}
+
+	lock_server_data();
+	{
+		int n=DA_NEL(servers),m=0;
+		for(i=0;i<n;++i)
+			m+=DA_NEL(DA_INDEX(servers,i).atup_a);
+		if(m>0xffff) m=0xffff;
+		if(m && (srv=malloc(m*METRICS_SRVSZ))) {
+			unsigned char *q=srv;
+			for(i=0;i<n && nsrv<m;++i) {
+				servparm_t *sp=&DA_INDEX(servers,i);
+				int k=DA_NEL(sp->atup_a);
+				for(j=0;j<k && nsrv<m;++j,++nsrv) {
+					atup_t *at=&DA_INDEX(sp->atup_a,j);
+					long srtt=-1,rttvar=-1; unsigned fails=0;
+					unsigned char abuf[16];
+					memset(abuf,0,sizeof(abuf));
+#ifdef ENABLE_IPV4
+					if(run_ipv4) {
+						put_u8(q,4);
+						memcpy(abuf,&at->a.ipv4,sizeof(struct in_addr));
+					}
+#endif
+#ifdef ENABLE_IPV6
+					ELSE_IPV6 {
+						put_u8(q,6);
+						memcpy(abuf,&at->a.ipv6,sizeof(struct in6_addr));
+					}
+#endif
+					memcpy(q,abuf,16); q+=16;
+					put_u16(q,sp->port);
+					srv_rtt_get(PDNSD_A2_TO_A(&at->a),sp->port,&srtt,&rttvar,&fails);
+					put_u32(q,(int32_t)srtt);
+					put_u32(q,(int32_t)rttvar);
+					put_u32(q,fails);
+					put_u8(q,at->is_up);
+				}
+			}
+		}
+	}
+	unlock_server_data();
+	put_u16(p,nsrv);
+
+	rv=0;
+	if(write_all(f,hdr,p-hdr)!=p-hdr ||
+	   (nsrv && write_all(f,srv,nsrv*METRICS_SRVSZ)!=nsrv*METRICS_SRVSZ))
+		rv=-1;
+	free(srv);
+	return rv;
+}
+
 static void *status_thread (void *p)
 {
 	THREAD_SIGINIT;
@@ -679,6 +852,15 @@ static void *status_thread (void *p)
 					free(names);
 				}
 					break;
+				case CTL_METRICS:
+					DEBUG_MSG("Received METRICS query.\n");
+					if(!print_succ(rs))
+						break;
+					if(report_metrics(rs)<0) {
+						DEBUG_MSG("Error writing to control socket: %s\n"
+							  "Failed to send metrics.\n",strerror(errno));
+					}
+					break;
 				case CTL_DUMP: {
 					int rv,exact=0;
 					unsigned char *nm=NULL;
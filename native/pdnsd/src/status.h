@@ -45,7 +45,8 @@ extern int stat_sock;
 #define CTL_EVAL     9 /* Parse string as if part of config file */
 #define CTL_EMPTY   10 /* Empty the cache */
 #define CTL_DUMP    11 /* Dump cache contents */
-#define CTL_MAX     11
+#define CTL_METRICS 12 /* Give out counters in binary form (see report_metrics() in status.c) */
+#define CTL_MAX     12
 
 #define CTL_S_UP     1
 #define CTL_S_DOWN   2
@@ -53,6 +54,43 @@ extern int stat_sock;
 #define CTL_R_DELETE 1
 #define CTL_R_INVAL  2
 
+/* Version of the CTL_METRICS reply layout. Counters are only ever appended, so a reader
+   that knows fewer of them than the reply carries can skip the rest. */
+#define METRICS_VERSION 1
+
+/* Counters kept by the query threads themselves. */
+#define M_QUERIES_UDP      0  /* queries received by UDP */
+#define M_QUERIES_TCP      1  /* queries received by TCP */
+#define M_CACHE_HITS       2  /* lookups answered from the cache or the answer cache */
+#define M_CACHE_MISSES     3  /* lookups that had to ask the name servers */
+#define M_STALE            4  /* timed-out records served (stale_ttl or purge_cache=off) */
+#define M_UP_REPLIES       5  /* replies received from name servers */
+#define M_UP_FAILURES      6  /* name server queries that failed or timed out */
+#define M_SERVFAIL         7  /* answers sent with rcode SERVFAIL */
+#define M_NXDOMAIN         8  /* answers sent with rcode NXDOMAIN */
+#define M_NUM_STRIPED      9
+/* Values sampled when the metrics are read. */
+#define M_DROPPED          9  /* UDP queries dropped because too many threads were running */
+#define M_THR_SPAWNED     10  /* query threads started in total */
+#define M_THR_RUNNING     11  /* query threads running (active and queued) */
+#define M_THR_ACTIVE      12  /* query threads allowed to query */
+#define M_INFLIGHT        13  /* distinct queries in flight */
+#define M_COALESCED       14  /* queries that waited for an identical one in flight */
+#define M_CACHE_BYTES     15  /* memory used by the cache */
+#define M_CACHE_MAXBYTES  16  /* memory the cache may use before eviction starts */
+#define M_CACHE_ENTRIES   17  /* names in the cache */
+#define M_EVICTED         18  /* cache entries evicted */
+#define M_NUM             19
+
+/* Upper bounds (in microseconds) of the answer latency histogram buckets.
+   A last bucket without bound catches everything slower. */
+#define METRICS_LAT_BOUNDS {100,250,500,1000,2500,5000,10000,25000,50000,100000,250000,500000,1000000,2500000}
+#define METRICS_LAT_BUCKETS 15
+
+void metric_inc(int m);
+void metric_answer(int tcp, int rcode, unsigned long us);
+unsigned long metric_clock_us(void);
+
 void init_stat_sock(void);
 int start_stat_sock(void);
 